@@ -0,0 +1,676 @@
+/*
+ * admin.c -- status page served by the proxy itself.
+ *
+ * The admin thread takes one queued request at a time, renders the answer
+ * into an arena of its own and sends it with a send timeout, so a client
+ * that stops reading only delays other admin requests, never a worker.
+ */
+
+#include "admin.h"
+
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "log.h"
+#include "metrics.h"
+#include "net.h"
+#include "origin.h"
+#include "parent.h"
+
+#define TOP_KEYS 20           // Keys listed by hit count
+#define LIST_ENTRIES 100      // Newest entries listed
+#define KEY_SHOWN 256         // Longer keys are cut on the page
+#define SEND_TIMEOUT 5        // Seconds a send to an admin client may block
+
+struct admin_job {
+    int fd;
+    struct sockaddr_in peer;
+    char method[8];
+    char target[1024];
+    char form[1024];          // Form body of a POST, NUL terminated
+    size_t form_len;          // Bytes of it read so far
+    long long form_want;      // Its Content-Length, 0 if it has none
+    uint64_t accepted;
+};
+
+// What a worker is doing, written by that worker only
+struct worker_status {
+    unsigned seq;             // Odd while the worker is updating the slot
+    int busy;
+    int tunnel;
+    uint64_t since;           // now_usec() when the request started
+    char client[INET_ADDRSTRLEN];
+    char method[8];
+    char target[200];
+} __attribute__((aligned(64)));
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    struct admin_job jobs[ADMIN_QUEUE];
+    int head, count;
+} queue = {.lock = PTHREAD_MUTEX_INITIALIZER, .not_empty = PTHREAD_COND_INITIALIZER};
+
+// Networks allowed to purge besides loopback, in host byte order
+static struct {
+    uint32_t addr, mask;
+} purge_allow[MAX_PURGE_ALLOW];
+static int npurge_allow;
+
+static struct cache *cache;
+static struct cache *negative;
+static struct worker_status *board;
+static int nworkers;
+static time_t started;
+static __thread struct worker_status *my_status;
+
+// Output page, grown in the admin thread's arena
+struct page {
+    struct arena *arena;
+    char *buf;
+    size_t len, cap;
+    int failed;
+};
+
+static void page_printf(struct page *p, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void page_printf(struct page *p, const char *fmt, ...) {
+    va_list ap;
+    while (!p->failed) {
+        va_start(ap, fmt);
+        int n = vsnprintf(p->buf + p->len, p->cap - p->len, fmt, ap);
+        va_end(ap);
+        if (n < 0) {
+            p->failed = 1;
+        } else if ((size_t)n < p->cap - p->len) {
+            p->len += n;
+            return;
+        } else {
+            size_t cap = p->cap * 2 > p->len + n + 1 ? p->cap * 2 : p->len + n + 1;
+            char *buf = arena_realloc(p->arena, p->buf, p->cap, cap);
+            if (buf == NULL) {
+                p->failed = 1;
+            } else {
+                p->buf = buf;
+                p->cap = cap;
+            }
+        }
+    }
+}
+
+// Append text with the characters HTML gives a meaning to escaped
+static void page_escape(struct page *p, const char *s) {
+    const char *run = s;
+    for (; *s; s++) {
+        const char *rep = NULL;
+        switch (*s) {
+            case '<': rep = "&lt;"; break;
+            case '>': rep = "&gt;"; break;
+            case '&': rep = "&amp;"; break;
+            case '"': rep = "&quot;"; break;
+            case '\'': rep = "&#39;"; break;
+        }
+        if (rep != NULL) {
+            page_printf(p, "%.*s%s", (int)(s - run), run, rep);
+            run = s + 1;
+        }
+    }
+    page_printf(p, "%s", run);
+}
+
+static int hexval(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/*
+ * Find a parameter in a query string and decode it into out. Returns the
+ * decoded length, or -1 if the parameter is missing or does not fit.
+ */
+static int query_param(const char *query, const char *name, char *out, size_t outlen) {
+    size_t namelen = strlen(name);
+    while (query != NULL && *query) {
+        const char *end = strchr(query, '&');
+        size_t len = end ? (size_t)(end - query) : strlen(query);
+        if (len > namelen && strncmp(query, name, namelen) == 0 && query[namelen] == '=') {
+            size_t n = 0;
+            for (size_t i = namelen + 1; i < len; i++) {
+                char c = query[i];
+                if (c == '+') {
+                    c = ' ';
+                } else if (c == '%' && i + 2 < len && hexval(query[i + 1]) >= 0 &&
+                           hexval(query[i + 2]) >= 0) {
+                    c = (char)(hexval(query[i + 1]) * 16 + hexval(query[i + 2]));
+                    i += 2;
+                }
+                if (n + 1 >= outlen) {
+                    return -1;
+                }
+                out[n++] = c;
+            }
+            out[n] = '\0';
+            return (int)n;
+        }
+        query = end ? end + 1 : NULL;
+    }
+    return -1;
+}
+
+struct key_stat {
+    char key[KEY_SHOWN];
+    size_t len;
+    unsigned long hits;
+};
+
+struct cache_view {
+    size_t entries, bytes;
+    int nlisted, ntop;
+    struct key_stat listed[LIST_ENTRIES];
+    struct key_stat top[TOP_KEYS];    // Min-heap on hits
+};
+
+static void key_stat_set(struct key_stat *k, const struct cache_entry *e, unsigned long hits) {
+    snprintf(k->key, sizeof(k->key), "%s", e->key);
+    k->len = e->len;
+    k->hits = hits;
+}
+
+static void heap_sift_down(struct key_stat *h, int n, int i) {
+    while (1) {
+        int m = i, l = 2 * i + 1, r = l + 1;
+        if (l < n && h[l].hits < h[m].hits) m = l;
+        if (r < n && h[r].hits < h[m].hits) m = r;
+        if (m == i) {
+            return;
+        }
+        struct key_stat t = h[i];
+        h[i] = h[m];
+        h[m] = t;
+        i = m;
+    }
+}
+
+static void heap_sift_up(struct key_stat *h, int i) {
+    while (i > 0 && h[(i - 1) / 2].hits > h[i].hits) {
+        struct key_stat t = h[i];
+        h[i] = h[(i - 1) / 2];
+        h[(i - 1) / 2] = t;
+        i = (i - 1) / 2;
+    }
+}
+
+// Runs under the cache's read lock: copy what is shown and nothing else
+static int view_entry(void *arg, const struct cache_entry *e) {
+    struct cache_view *v = arg;
+    unsigned long hits = __atomic_load_n(&e->hits, __ATOMIC_RELAXED);
+
+    v->entries++;
+    v->bytes += e->len;
+    if (v->nlisted < LIST_ENTRIES) {
+        key_stat_set(&v->listed[v->nlisted++], e, hits);
+    }
+    if (hits == 0) {
+        return 0;
+    }
+    if (v->ntop < TOP_KEYS) {
+        key_stat_set(&v->top[v->ntop], e, hits);
+        heap_sift_up(v->top, v->ntop++);
+    } else if (hits > v->top[0].hits) {
+        key_stat_set(&v->top[0], e, hits);
+        heap_sift_down(v->top, v->ntop, 0);
+    }
+    return 0;
+}
+
+static int by_hits_desc(const void *a, const void *b) {
+    unsigned long ha = ((const struct key_stat *)a)->hits, hb = ((const struct key_stat *)b)->hits;
+    return ha < hb ? 1 : ha > hb ? -1 : 0;
+}
+
+static void render_keys(struct page *p, const struct key_stat *keys, int n, int purge) {
+    page_printf(p, "<table><tr><th>Key</th><th>Bytes</th><th>Hits</th>%s</tr>\n",
+                purge ? "<th></th>" : "");
+    for (int i = 0; i < n; i++) {
+        page_printf(p, "<tr><td>");
+        page_escape(p, keys[i].key);
+        page_printf(p, "</td><td>%zu</td><td>%lu</td>", keys[i].len, keys[i].hits);
+        if (purge && strlen(keys[i].key) < KEY_SHOWN - 1) {
+            page_printf(p, "<td><form action=\"/admin/purge\" method=\"post\">"
+                           "<input type=\"hidden\" name=\"url\" value=\"");
+            page_escape(p, keys[i].key);
+            page_printf(p, "\"><button>purge</button></form></td>");
+        } else if (purge) {
+            page_printf(p, "<td></td>");
+        }
+        page_printf(p, "</tr>\n");
+    }
+    page_printf(p, "</table>\n");
+}
+
+// Copy a worker's slot, retrying while the worker is writing it
+static int read_status(const struct worker_status *s, struct worker_status *out) {
+    for (int tries = 0; tries < 8; tries++) {
+        unsigned seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            continue;
+        }
+        memcpy(out, s, sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) == seq) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static void render_workers(struct page *p, uint64_t now) {
+    struct worker_status s;
+    int busy = 0, tunnels = 0, shown = 0;
+
+    page_printf(p, "<h2>Busy workers</h2>\n<table><tr><th>Worker</th><th>Client</th>"
+                   "<th>Method</th><th>Target</th><th>Seconds</th></tr>\n");
+    for (int i = 0; i < nworkers; i++) {
+        if (read_status(&board[i], &s) < 0 || !s.busy) {
+            continue;
+        }
+        busy++;
+        tunnels += s.tunnel;
+        if (shown++ >= LIST_ENTRIES) {
+            continue;
+        }
+        page_printf(p, "<tr><td>%d</td><td>%s</td><td>", i, s.client);
+        page_escape(p, s.method);
+        page_printf(p, "</td><td>");
+        page_escape(p, s.target);
+        page_printf(p, "</td><td>%.1f</td></tr>\n", (now - s.since) / 1e6);
+    }
+    page_printf(p, "</table>\n<p>%d of %d workers busy, %d in CONNECT tunnels.</p>\n",
+                busy, nworkers, tunnels);
+}
+
+static void render_parent(void *arg, struct parent *p) {
+    struct page *page = arg;
+
+    page_printf(page, "<tr><td>");
+    page_escape(page, p->name);
+    page_printf(page, "</td><td>%s</td><td>%llu</td><td>%llu</td></tr>\n",
+                __atomic_load_n(&p->up, __ATOMIC_RELAXED) ? "up" : "down",
+                __atomic_load_n(&p->requests, __ATOMIC_RELAXED),
+                __atomic_load_n(&p->failures, __ATOMIC_RELAXED));
+}
+
+static const char *const breaker_names[] = {"closed", "open", "half open"};
+
+static void render_origin(void *arg, struct origin *o) {
+    struct page *p = arg;
+    unsigned long long requests = __atomic_load_n(&o->requests, __ATOMIC_RELAXED);
+    unsigned long long failures = __atomic_load_n(&o->failures, __ATOMIC_RELAXED);
+    unsigned long long connects = __atomic_load_n(&o->connect.total, __ATOMIC_RELAXED);
+    unsigned long long connect_sum = __atomic_load_n(&o->connect.sum, __ATOMIC_RELAXED);
+
+    page_printf(p, "<tr><td>");
+    page_escape(p, o->name);
+    page_printf(p, "</td><td>%llu</td><td>%llu</td><td>%.2f</td><td>%.2f</td><td>%.2f</td>"
+                   "<td>%d</td><td>%llu</td><td>%s%s</td></tr>\n",
+                requests, failures, connects ? connect_sum / 1e3 / connects : 0.0,
+                histogram_quantile(&o->ttfb, 0.5) / 1e3, histogram_quantile(&o->ttfb, 0.99) / 1e3,
+                __atomic_load_n(&o->inflight, __ATOMIC_RELAXED),
+                __atomic_load_n(&o->rejected, __ATOMIC_RELAXED),
+                breaker_names[__atomic_load_n(&o->breaker, __ATOMIC_RELAXED)],
+                now_usec() < __atomic_load_n(&o->unreachable_until, __ATOMIC_RELAXED) ? ", unreachable" : "");
+}
+
+static void render_status(struct page *p) {
+    struct cache_view *v = arena_alloc(p->arena, sizeof(*v));
+    if (v == NULL) {
+        p->failed = 1;
+        return;
+    }
+    memset(v, 0, sizeof(*v));
+    cache_walk(cache, view_entry, v);
+    qsort(v->top, v->ntop, sizeof(v->top[0]), by_hits_desc);
+
+    unsigned long long hits = metric_total(M_CACHE_HITS), misses = metric_total(M_CACHE_MISSES);
+    uint64_t now = now_usec();
+
+    page_printf(p, "<!DOCTYPE html>\n<html><head><title>Proxy status</title>\n"
+                   "<style>body{font-family:sans-serif}table{border-collapse:collapse}"
+                   "td,th{border:1px solid #ccc;padding:2px 6px;text-align:left}</style>\n"
+                   "</head><body>\n<h1>Proxy status</h1>\n");
+    page_printf(p, "<p>Up %lds. <a href=\"/metrics\">Metrics</a></p>\n", (long)(time(NULL) - started));
+
+    page_printf(p, "<h2>Cache</h2>\n<table>"
+                   "<tr><td>Policy</td><td>%s</td></tr>"
+                   "<tr><td>Entries</td><td>%zu</td></tr>"
+                   "<tr><td>Bytes</td><td>%zu of %zu</td></tr>"
+                   "<tr><td>Hits / misses</td><td>%llu / %llu (%.1f%%)</td></tr>"
+                   "<tr><td>Evictions</td><td>%llu</td></tr></table>\n",
+                cache->shared != NULL ? "fifo, shared between processes" :
+                cache_policy_names[__atomic_load_n(&cache->policy, __ATOMIC_RELAXED)], v->entries, v->bytes,
+                __atomic_load_n(&cache->max_bytes, __ATOMIC_RELAXED),
+                hits, misses, hits + misses ? 100.0 * hits / (hits + misses) : 0.0,
+                metric_total(M_CACHE_EVICTIONS));
+
+    page_printf(p, "<form action=\"/admin/purge\" method=\"post\">"
+                   "<input name=\"url\" size=\"80\" placeholder=\"http://host/path\"> "
+                   "<button>Purge URL</button></form>\n"
+                   "<form action=\"/admin/purge\" method=\"post\">"
+                   "<input name=\"prefix\" size=\"80\" placeholder=\"http://host/path/\"> "
+                   "<button>Purge prefix</button></form>\n"
+                   "<form action=\"/admin/purge\" method=\"post\">"
+                   "<input name=\"host\" size=\"80\" placeholder=\"host[:port]\"> "
+                   "<button>Purge host</button></form>\n");
+
+    page_printf(p, "<h2>Top keys by hits</h2>\n");
+    render_keys(p, v->top, v->ntop, 1);
+    page_printf(p, "<h2>Newest entries</h2>\n");
+    render_keys(p, v->listed, v->nlisted, 1);
+    if (v->entries > (size_t)v->nlisted) {
+        page_printf(p, "<p>%zu more not shown.</p>\n", v->entries - v->nlisted);
+    }
+
+    render_workers(p, now);
+
+    page_printf(p, "<h2>Origins</h2>\n<table><tr><th>Origin</th><th>Connects</th><th>Failures</th>"
+                   "<th>Avg connect ms</th><th>TTFB p50 ms</th><th>TTFB p99 ms</th>"
+                   "<th>In flight</th><th>Turned away</th><th>Breaker</th></tr>\n");
+    origin_walk(render_origin, p);
+    page_printf(p, "</table>\n");
+
+    page_printf(p, "<h2>Parents</h2>\n<table><tr><th>Parent</th><th>State</th><th>Connects</th>"
+                   "<th>Failures</th></tr>\n");
+    parent_walk(render_parent, p);
+    page_printf(p, "</table>\n</body></html>\n");
+}
+
+// Send a response; the body is left out for HEAD
+static size_t reply(int fd, int status, const char *reason, const char *type, const char *body,
+                    size_t len, int head_only) {
+    char head[256];
+    int headlen = snprintf(head, sizeof(head),
+                           "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\n"
+                           "Cache-Control: no-store\r\nConnection: close\r\n\r\n",
+                           status, reason, type, len);
+    size_t sent = send_all(fd, head, headlen);
+    if (sent == (size_t)headlen && !head_only) {
+        sent += send_all(fd, body, len);
+    }
+    return sent;
+}
+
+/*
+ * Drop entries by exact url=, by host= or by URL prefix=. Returns the status:
+ * 404 if an exact URL was not cached; host and prefix purges report how many
+ * entries went, none included.
+ */
+static int purge(struct page *p, const char *query, const char **reason) {
+    char arg[1024];
+    int removed;
+
+    // Both caches: a URL that answered 404 or 301 is held in the negative one
+    if (query_param(query, "url", arg, sizeof(arg)) > 0) {
+        removed = (cache_remove(cache, arg) == 0) + (cache_remove(negative, arg) == 0);
+        if (removed == 0) {
+            *reason = "Not Found";
+            page_printf(p, "Not cached: %s\n", arg);
+            return 404;
+        }
+    } else if (query_param(query, "host", arg, sizeof(arg)) > 0) {
+        removed = cache_purge_host(cache, arg) + cache_purge_host(negative, arg);
+    } else if (query_param(query, "prefix", arg, sizeof(arg)) > 0) {
+        removed = cache_purge_prefix(cache, arg) + cache_purge_prefix(negative, arg);
+    } else {
+        *reason = "Bad Request";
+        page_printf(p, "Expected a url, host or prefix parameter\n");
+        return 400;
+    }
+    metric_add(M_CACHE_PURGED, removed);
+    log_info("Purged %d entries for %s", removed, query);
+    page_printf(p, "Purged %d entries\n", removed);
+    return 200;
+}
+
+// Read the rest of a POSTed form; -1 if it is too large or does not arrive
+static int read_form(struct admin_job *job) {
+    if (job->form_want >= (long long)sizeof(job->form)) {
+        return -1;
+    }
+    struct timeval timeout = {SEND_TIMEOUT, 0};
+    setsockopt(job->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    while ((long long)job->form_len < job->form_want) {
+        ssize_t n = recv(job->fd, job->form + job->form_len, job->form_want - job->form_len, 0);
+        if (n <= 0) {
+            return -1;
+        }
+        metric_add(M_CLIENT_BYTES_IN, n);
+        job->form_len += n;
+    }
+    job->form[job->form_len] = '\0';
+    return 0;
+}
+
+static void serve(struct admin_job *job, struct arena *arena) {
+    struct page p = {arena, NULL, 0, 16 * 1024, 0};
+    int status = 200;
+    const char *reason = "OK", *type = "text/html; charset=utf-8";
+
+    p.buf = arena_alloc(arena, p.cap);
+    if (p.buf == NULL) {
+        p.failed = 1;
+    }
+
+    char *query = strchr(job->target, '?');
+    size_t pathlen = query ? (size_t)(query - job->target) : strlen(job->target);
+    int get = strcmp(job->method, "GET") == 0;
+
+    if (pathlen == 13 && strncmp(job->target, "/admin/purge", 12) == 0 && job->target[12] == '/') {
+        pathlen = 12;       // Tolerate a trailing slash
+    }
+    if ((pathlen == 1 || (pathlen == 6 && strncmp(job->target, "/admin", 6) == 0)) &&
+        (get || strcmp(job->method, "HEAD") == 0)) {
+        render_status(&p);
+    } else if (pathlen == 12 && strncmp(job->target, "/admin/purge", 12) == 0) {
+        // Purges change state, so a link followed or prefetched must not
+        // trigger one; the parameters come in the form or the query
+        type = "text/plain; charset=utf-8";
+        if (strcmp(job->method, "POST") != 0) {
+            status = 405, reason = "Method Not Allowed";
+            page_printf(&p, "Purges must be POSTed\n");
+        } else if (!admin_may_purge(&job->peer)) {
+            status = 403, reason = "Forbidden";
+            page_printf(&p, "Not allowed to purge from this address\n");
+        } else if (read_form(job) < 0) {
+            status = 400, reason = "Bad Request";
+            page_printf(&p, "Form too large or incomplete\n");
+        } else {
+            status = purge(&p, job->form_len > 0 ? job->form : query != NULL ? query + 1 : "", &reason);
+        }
+    } else {
+        status = 404, reason = "Not Found";
+        type = "text/plain; charset=utf-8";
+        page_printf(&p, "Not found\n");
+    }
+
+    size_t sent;
+    int head_only = strcmp(job->method, "HEAD") == 0;
+    if (p.failed) {
+        status = 500;
+        sent = reply(job->fd, 500, "Internal Server Error", "text/plain", "Out of memory\n", 14, head_only);
+    } else {
+        sent = reply(job->fd, status, reason, type, p.buf, p.len, head_only);
+    }
+    metric_add(M_CLIENT_BYTES_OUT, sent);
+
+    char client[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &job->peer.sin_addr, client, sizeof(client));
+    log_access("client=%s method=%s status=%d bytes=%zu class=admin ms=%.3f url=%s",
+               client, job->method, status, sent, (now_usec() - job->accepted) / 1000.0, job->target);
+}
+
+static void *admin_thread(void *arg) {
+    (void)arg;
+    struct timeval timeout = {SEND_TIMEOUT, 0};
+
+    while (1) {
+        pthread_mutex_lock(&queue.lock);
+        while (queue.count == 0) {
+            pthread_cond_wait(&queue.not_empty, &queue.lock);
+        }
+        struct admin_job job = queue.jobs[queue.head];
+        queue.head = (queue.head + 1) % ADMIN_QUEUE;
+        queue.count--;
+        pthread_mutex_unlock(&queue.lock);
+
+        setsockopt(job.fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        struct arena *arena = arena_get();
+        if (arena == NULL) {
+            log_error("Memory allocation failed");
+        } else {
+            serve(&job, arena);
+            arena_put(arena);
+        }
+        shutdown(job.fd, SHUT_RDWR);
+        close(job.fd);
+    }
+    return NULL;
+}
+
+int admin_init(struct cache *c, struct cache *neg, int workers) {
+    pthread_t tid;
+
+    board = aligned_alloc(64, workers * sizeof(*board));
+    if (board == NULL) {
+        return -1;
+    }
+    memset(board, 0, workers * sizeof(*board));
+    nworkers = workers;
+    cache = c;
+    negative = neg;
+    started = time(NULL);
+
+    if (pthread_create(&tid, NULL, admin_thread, NULL) != 0) {
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+int admin_purge_allow(const char *list) {
+    for (const char *s = list; *s != '\0'; ) {
+        size_t n = strcspn(s, ", \t");
+        if (n > 0) {
+            char entry[INET_ADDRSTRLEN + 3];
+            struct in_addr addr;
+            long bits = 32;
+            char *slash, *end;
+            if (n >= sizeof(entry) || npurge_allow == MAX_PURGE_ALLOW) {
+                log_error("Bad purge_allow entry %.*s", (int)n, s);
+                return -1;
+            }
+            memcpy(entry, s, n);
+            entry[n] = '\0';
+            if ((slash = strchr(entry, '/')) != NULL) {
+                *slash = '\0';
+                bits = strtol(slash + 1, &end, 10);
+                if (slash[1] == '\0' || *end != '\0' || bits < 0 || bits > 32) {
+                    bits = -1;
+                }
+            }
+            if (bits < 0 || inet_pton(AF_INET, entry, &addr) != 1) {
+                log_error("Bad purge_allow entry %.*s, expected an IPv4 address or network", (int)n, s);
+                return -1;
+            }
+            uint32_t mask = bits == 0 ? 0 : 0xffffffffu << (32 - bits);
+            purge_allow[npurge_allow].addr = ntohl(addr.s_addr) & mask;
+            purge_allow[npurge_allow++].mask = mask;
+        }
+        s += n;
+        s += strspn(s, ", \t");
+    }
+    return npurge_allow;
+}
+
+int admin_may_purge(const struct sockaddr_in *peer) {
+    uint32_t addr = ntohl(peer->sin_addr.s_addr);
+    if ((addr >> 24) == 127) {
+        return 1;
+    }
+    for (int i = 0; i < npurge_allow; i++) {
+        if ((addr & purge_allow[i].mask) == purge_allow[i].addr) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int admin_submit(int fd, const struct sockaddr_in *peer, const char *method, const char *target,
+                 const char *body, size_t body_len, long long content_length, uint64_t accepted) {
+    pthread_mutex_lock(&queue.lock);
+    if (queue.count == ADMIN_QUEUE) {
+        pthread_mutex_unlock(&queue.lock);
+        return -1;
+    }
+    struct admin_job *job = &queue.jobs[(queue.head + queue.count) % ADMIN_QUEUE];
+    job->fd = fd;
+    job->peer = *peer;
+    snprintf(job->method, sizeof(job->method), "%s", method);
+    snprintf(job->target, sizeof(job->target), "%s", target);
+    // Whatever of the form came with the head; the admin thread reads the rest
+    job->form_want = content_length > 0 ? content_length : 0;
+    job->form_len = body_len < (size_t)job->form_want ? body_len : (size_t)job->form_want;
+    if (job->form_len >= sizeof(job->form)) {
+        job->form_len = sizeof(job->form) - 1;
+    }
+    memcpy(job->form, body, job->form_len);
+    job->form[job->form_len] = '\0';
+    job->accepted = accepted;
+    queue.count++;
+    pthread_cond_signal(&queue.not_empty);
+    pthread_mutex_unlock(&queue.lock);
+    return 0;
+}
+
+void admin_bind(int slot) {
+    if (board != NULL && slot >= 0 && slot < nworkers) {
+        my_status = &board[slot];
+    }
+}
+
+void admin_busy(const struct sockaddr_in *peer, const char *method, const char *target, int tunnel) {
+    struct worker_status *s = my_status;
+    if (s == NULL) {
+        return;
+    }
+    unsigned seq = s->seq;
+    __atomic_store_n(&s->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    s->busy = 1;
+    s->tunnel = tunnel;
+    s->since = now_usec();
+    inet_ntop(AF_INET, &peer->sin_addr, s->client, sizeof(s->client));
+    snprintf(s->method, sizeof(s->method), "%s", method);
+    snprintf(s->target, sizeof(s->target), "%s", target);
+    __atomic_store_n(&s->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+void admin_idle(void) {
+    struct worker_status *s = my_status;
+    if (s == NULL || !s->busy) {
+        return;
+    }
+    unsigned seq = s->seq;
+    __atomic_store_n(&s->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    s->busy = 0;
+    __atomic_store_n(&s->seq, seq + 2, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,97 @@
+/*
+ * admin.h -- status page served by the proxy itself.
+ *
+ * Requests addressed to the proxy (other than /metrics) are handed to one
+ * admin thread, so rendering the page or walking the cache never holds up
+ * a worker: the worker queues the socket and goes back to serving clients.
+ * The page shows the cache contents, the busiest keys, what every worker is
+ * doing and the latency of each origin, and has forms to purge cached
+ * entries by URL, by host or by URL prefix (/admin/purge). Purges must be
+ * POSTed, from loopback or from an address on the purge allow-list.
+ *
+ * Workers publish what they are serving on a status board of one cache
+ * line aligned slot each, written only by its worker under a sequence
+ * counter, so the admin thread reads a consistent slot without a lock.
+ */
+
+#ifndef ADMIN_H
+#define ADMIN_H
+
+#include <netinet/in.h>
+#include <stdint.h>
+
+#include "cache.h"
+
+#define ADMIN_QUEUE 16        // Admin requests waiting; more get a 503
+#define MAX_PURGE_ALLOW 32    // Entries accepted on the purge allow-list
+
+/**
+ * Allocate the status board and start the admin thread.
+ *
+ * @param c Cache shown and purged by the page
+ * @param neg Negative cache, purged along with c
+ * @param workers Number of worker slots on the status board
+ * @return 0 on success, -1 on failure
+ */
+int admin_init(struct cache *c, struct cache *neg, int workers);
+
+/**
+ * Set the clients that may purge cached entries besides loopback. Call
+ * once, before any request is served.
+ *
+ * @param list Comma separated IPv4 addresses, each with an optional
+ *        /prefix length; may be empty
+ * @return Number of entries, or -1 if one is bad
+ */
+int admin_purge_allow(const char *list);
+
+/**
+ * Check whether a client may purge cached entries, through the PURGE
+ * method or the status page.
+ *
+ * @param peer Client address
+ * @return Nonzero if it is on loopback or on the allow-list
+ */
+int admin_may_purge(const struct sockaddr_in *peer);
+
+/**
+ * Hand a request for the proxy itself to the admin thread, which answers
+ * it and closes the socket.
+ *
+ * @param fd Client socket
+ * @param peer Client address
+ * @param method Request method
+ * @param target Request path, with the query
+ * @param body Request body bytes already read along with the head
+ * @param body_len Number of bytes in body
+ * @param content_length Content-Length of the request, -1 if it has none
+ * @param accepted When the connection was accepted (now_usec())
+ * @return 0 if queued, -1 if the queue is full; the socket is the
+ *         caller's again then
+ */
+int admin_submit(int fd, const struct sockaddr_in *peer, const char *method, const char *target,
+                 const char *body, size_t body_len, long long content_length, uint64_t accepted);
+
+/**
+ * Make the calling worker publish its state in a slot of the board.
+ *
+ * @param slot Slot number, 0 to workers - 1
+ */
+void admin_bind(int slot);
+
+/**
+ * Show the calling worker as serving a request.
+ *
+ * @param peer Client address
+ * @param method Request method
+ * @param target URL, or host:port of a tunnel
+ * @param tunnel Nonzero for a CONNECT tunnel
+ */
+void admin_busy(const struct sockaddr_in *peer, const char *method, const char *target, int tunnel);
+
+/**
+ * Show the calling worker as idle.
+ */
+void admin_idle(void);
+
+#endif
@@ -0,0 +1,201 @@
+/*
+ * arena.c -- bump allocator for objects that live as long as a connection.
+ *
+ * An arena is a list of chunks from malloc(). Allocations bump a pointer in
+ * the current chunk and move on to the next chunk when it is full. Resetting
+ * just rewinds every chunk, keeping up to ARENA_RETAIN bytes for the next
+ * connection. The counters are only touched when a chunk comes from or goes
+ * back to libc and once per reset, never per allocation, and each thread
+ * has its own copy so counting never writes to a shared cache line.
+ */
+
+#include "arena.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_ALIGN 16
+#define ALIGN_UP(n) (((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;                   // Usable bytes after the header
+    size_t used;                   // Bytes handed out
+};
+
+#define CHUNK_HEADER ALIGN_UP(sizeof(struct arena_chunk))
+#define CHUNK_DATA(c) ((char *)(c) + CHUNK_HEADER)
+
+// Counters of one thread, linked into a list for arena_stats()
+struct thread_stats {
+    struct arena_stats s;
+    struct thread_stats *next;
+} __attribute__((aligned(64)));
+
+static struct thread_stats *all_stats;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct thread_stats unlisted;      // Used if registering fails
+static __thread struct thread_stats *stats;
+static __thread struct arena *free_list;
+
+static struct arena_stats *local_stats(void) {
+    if (stats == NULL) {
+        struct thread_stats *ts = aligned_alloc(sizeof(*ts), sizeof(*ts));
+        if (ts == NULL) {
+            stats = &unlisted;
+        } else {
+            memset(ts, 0, sizeof(*ts));
+            pthread_mutex_lock(&stats_lock);
+            ts->next = all_stats;
+            all_stats = ts;
+            pthread_mutex_unlock(&stats_lock);
+            stats = ts;
+        }
+    }
+    return &stats->s;
+}
+
+// Only the owning thread writes its counters; the atomics keep readers from
+// seeing torn values. Subtracting wraps, which the sums undo.
+static void count(unsigned long long *counter, unsigned long long n) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static struct arena_chunk *chunk_new(struct arena *a, size_t size) {
+    if (size < ARENA_CHUNK - CHUNK_HEADER) {
+        size = ARENA_CHUNK - CHUNK_HEADER;
+    }
+    struct arena_chunk *c = malloc(CHUNK_HEADER + size);
+    if (c == NULL) {
+        return NULL;
+    }
+    c->next = NULL;
+    c->size = size;
+    c->used = 0;
+    a->retained += CHUNK_HEADER + size;
+    count(&local_stats()->mallocs, 1);
+    count(&local_stats()->bytes, CHUNK_HEADER + size);
+    return c;
+}
+
+static void chunk_free(struct arena *a, struct arena_chunk *c) {
+    a->retained -= CHUNK_HEADER + c->size;
+    count(&local_stats()->bytes, -(unsigned long long)(CHUNK_HEADER + c->size));
+    count(&local_stats()->frees, 1);
+    free(c);
+}
+
+struct arena *arena_get(void) {
+    struct arena *a = free_list;
+    if (a != NULL) {
+        free_list = a->next_free;
+        a->next_free = NULL;
+        return a;
+    }
+    a = calloc(1, sizeof(*a));
+    if (a != NULL) {
+        count(&local_stats()->mallocs, 1);
+    }
+    return a;
+}
+
+void arena_put(struct arena *a) {
+    struct arena_chunk **link = &a->first;
+    size_t kept = 0;
+
+    // Keep the oldest chunks up to the retention limit, rewound
+    while (*link != NULL) {
+        struct arena_chunk *c = *link;
+        if (kept + CHUNK_HEADER + c->size <= ARENA_RETAIN) {
+            kept += CHUNK_HEADER + c->size;
+            c->used = 0;
+            link = &c->next;
+        } else {
+            *link = c->next;
+            chunk_free(a, c);
+        }
+    }
+    a->cur = a->first;
+
+    count(&local_stats()->allocs, a->allocs);
+    count(&local_stats()->resets, 1);
+    a->allocs = 0;
+
+    a->next_free = free_list;
+    free_list = a;
+}
+
+void *arena_alloc(struct arena *a, size_t size) {
+    struct arena_chunk *c = a->cur;
+    struct arena_chunk *last = NULL;
+
+    size = ALIGN_UP(size ? size : 1);
+
+    // Chunks after the current one are empty leftovers of earlier use
+    for (; c != NULL; c = c->next) {
+        if (c->size - c->used >= size) {
+            break;
+        }
+        last = c;
+    }
+    if (c == NULL) {
+        c = chunk_new(a, size);
+        if (c == NULL) {
+            return NULL;
+        }
+        if (last != NULL) {
+            last->next = c;
+        } else {
+            a->first = c;
+        }
+    }
+
+    a->cur = c;
+    a->allocs++;
+    void *p = CHUNK_DATA(c) + c->used;
+    c->used += size;
+    return p;
+}
+
+void *arena_realloc(struct arena *a, void *p, size_t old_size, size_t size) {
+    struct arena_chunk *c = a->cur;
+
+    if (p == NULL) {
+        return arena_alloc(a, size);
+    }
+    if (size <= old_size) {
+        return p;
+    }
+
+    // The last allocation of the current chunk can simply be extended
+    if (c != NULL && (char *)p + ALIGN_UP(old_size) == CHUNK_DATA(c) + c->used &&
+        (char *)p - CHUNK_DATA(c) + ALIGN_UP(size) <= c->size) {
+        c->used = (size_t)((char *)p - CHUNK_DATA(c)) + ALIGN_UP(size);
+        return p;
+    }
+
+    void *q = arena_alloc(a, size);
+    if (q != NULL) {
+        memcpy(q, p, old_size);
+    }
+    return q;
+}
+
+static void add_stats(struct arena_stats *out, struct arena_stats *s) {
+    out->mallocs += __atomic_load_n(&s->mallocs, __ATOMIC_RELAXED);
+    out->frees += __atomic_load_n(&s->frees, __ATOMIC_RELAXED);
+    out->allocs += __atomic_load_n(&s->allocs, __ATOMIC_RELAXED);
+    out->resets += __atomic_load_n(&s->resets, __ATOMIC_RELAXED);
+    out->bytes += __atomic_load_n(&s->bytes, __ATOMIC_RELAXED);
+}
+
+void arena_stats(struct arena_stats *out) {
+    memset(out, 0, sizeof(*out));
+    add_stats(out, &unlisted.s);
+    pthread_mutex_lock(&stats_lock);
+    for (struct thread_stats *ts = all_stats; ts != NULL; ts = ts->next) {
+        add_stats(out, &ts->s);
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
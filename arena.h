@@ -0,0 +1,86 @@
+/*
+ * arena.h -- bump allocator for objects that live as long as a connection.
+ *
+ * Everything a connection needs (receive buffer, parsed request, rewritten
+ * headers, the upstream request, the response copy for the cache) is taken
+ * from one arena and released all at once when the connection ends. Arenas
+ * keep their memory when reset and are recycled through a per-thread free
+ * list, so once a worker has seen its largest request it handles further
+ * ones without calling malloc() or free().
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+// Size of the blocks an arena gets from malloc; bigger requests get a block
+// of their own
+#define ARENA_CHUNK (64 * 1024)
+// Memory an arena keeps across resets; anything above is returned to libc
+#define ARENA_RETAIN (256 * 1024)
+
+struct arena_chunk;
+
+struct arena {
+    struct arena_chunk *first;     // Chunks, oldest first
+    struct arena_chunk *cur;       // Chunk allocations are taken from
+    size_t retained;               // Bytes held in chunks
+    unsigned long long allocs;     // Allocations since the last reset
+    struct arena *next_free;       // Link in the per-thread free list
+};
+
+// Allocator counters, kept per thread and summed by arena_stats()
+struct arena_stats {
+    unsigned long long mallocs;    // Chunks taken from libc
+    unsigned long long frees;      // Chunks given back to libc
+    unsigned long long allocs;     // Allocations served from arenas
+    unsigned long long resets;     // Connections whose arena was recycled
+    unsigned long long bytes;      // Bytes currently held by arenas
+};
+
+/**
+ * Take an empty arena from the calling thread's free list, or create one.
+ *
+ * @return The arena, or NULL if memory ran out
+ */
+struct arena *arena_get(void);
+
+/**
+ * Release everything allocated from an arena and put it back on the calling
+ * thread's free list.
+ *
+ * @param a Arena from arena_get()
+ */
+void arena_put(struct arena *a);
+
+/**
+ * Allocate from an arena. Memory is aligned for any type and stays valid
+ * until the arena is put back.
+ *
+ * @param a Arena
+ * @param size Bytes needed
+ * @return The memory, or NULL if memory ran out
+ */
+void *arena_alloc(struct arena *a, size_t size);
+
+/**
+ * Resize an allocation. The most recent allocation grows in place when its
+ * chunk has room; otherwise the contents are copied to a new allocation.
+ *
+ * @param a Arena
+ * @param p Allocation to resize, or NULL
+ * @param old_size Current size of p
+ * @param size New size
+ * @return The memory, or NULL if memory ran out (p is left untouched)
+ */
+void *arena_realloc(struct arena *a, void *p, size_t old_size, size_t size);
+
+/**
+ * Read the allocator counters.
+ *
+ * @param out Filled with the current values
+ */
+void arena_stats(struct arena_stats *out);
+
+#endif
@@ -0,0 +1,335 @@
+/*
+ * cache_sim.c -- replay request traces against the cache module.
+ *
+ * For every eviction policy and cache size, replays a trace of (key, size)
+ * requests: a hit is a lookup that finds the key, a miss stores the object.
+ * Reports the hit ratio, the byte hit ratio and the time per request.
+ * Then runs lookups and stores from several threads at once to show how the
+ * policies scale under contention.
+ *
+ * The trace is either read from a file or generated with a Zipf
+ * distribution. A file holds one request per line, either
+ *
+ *   <timestamp> <key> <size>
+ *
+ * or a line of the proxy's access log, of which the url= and bytes= fields
+ * are used (lines that are not successful GETs are skipped).
+ *
+ * Usage: ./cache_sim [-f trace] [-n keys] [-s zipf_s] [-r requests]
+ *                    [-m sizes] [-e max_entry] [-t threads] [-o ops]
+ *
+ *   -f trace     trace file, - for stdin (default: generated)
+ *   -n keys      distinct keys of the generated trace (default 100000)
+ *   -s zipf_s    Zipf exponent of the generated trace (default 0.99)
+ *   -r requests  length of the generated trace (default 2000000)
+ *   -m sizes     comma separated cache sizes, suffixes k/m/g (default 16m,64m,256m)
+ *   -e bytes     largest object stored (default 10m, as in the proxy)
+ *   -t threads   most threads for the contention run (default: CPUs, up to 16)
+ *   -o ops       operations per thread in the contention run (default 1000000)
+ */
+
+#include "cache.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+struct request {
+    char *key;
+    size_t size;
+};
+
+static struct request *trace;
+static size_t trace_len, trace_cap;
+static size_t max_object;
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t next_rand(uint64_t *s) {
+    *s ^= *s >> 12;
+    *s ^= *s << 25;
+    *s ^= *s >> 27;
+    return *s * 2685821657736338717ULL;
+}
+
+static double rand_unit(uint64_t *s) {
+    return (next_rand(s) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static size_t parse_size(const char *s, char **end) {
+    double v = strtod(s, end);
+    switch (**end) {
+        case 'k': case 'K': v *= 1024; (*end)++; break;
+        case 'm': case 'M': v *= 1024 * 1024; (*end)++; break;
+        case 'g': case 'G': v *= 1024.0 * 1024 * 1024; (*end)++; break;
+    }
+    return (size_t)v;
+}
+
+static void trace_add(const char *key, size_t keylen, size_t size) {
+    if (trace_len == trace_cap) {
+        trace_cap = trace_cap ? trace_cap * 2 : 65536;
+        trace = realloc(trace, trace_cap * sizeof(*trace));
+        if (trace == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    trace[trace_len].key = strndup(key, keylen);
+    trace[trace_len].size = size;
+    trace_len++;
+    if (size > max_object) {
+        max_object = size;
+    }
+}
+
+static int load_trace(const char *path) {
+    FILE *f = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    char line[8192];
+
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char *url = strstr(line, " url=");
+        char *bytes = strstr(line, " bytes=");
+        if (url != NULL && bytes != NULL) {
+            // Access log line of the proxy
+            if (strstr(line, " method=GET ") == NULL || strstr(line, " status=200 ") == NULL) {
+                continue;
+            }
+            // A URL cut off with the log line is not the real key
+            url += 5;
+            size_t len = strcspn(url, " \n");
+            if (len >= 3 && strncmp(url + len - 3, "...", 3) == 0) {
+                continue;
+            }
+            trace_add(url, len, strtoull(bytes + 7, NULL, 10));
+            continue;
+        }
+
+        char *save;
+        char *ts = strtok_r(line, " \t\n", &save);
+        char *key = strtok_r(NULL, " \t\n", &save);
+        char *size = strtok_r(NULL, " \t\n", &save);
+        if (ts != NULL && key != NULL && size != NULL) {
+            trace_add(key, strlen(key), strtoull(size, NULL, 10));
+        }
+    }
+    if (f != stdin) {
+        fclose(f);
+    }
+    return 0;
+}
+
+// Object sizes log-uniform from 1KB to 256KB, fixed per key
+static size_t key_size(int rank) {
+    uint64_t s = 0x9e3779b97f4a7c15ULL * (rank + 1);
+    double u = rand_unit(&s);
+    return (size_t)(1024 * pow(256, u));
+}
+
+static double *zipf_cdf(int n, double zs) {
+    double *cdf = malloc(n * sizeof(double));
+    double sum = 0;
+    for (int i = 0; i < n; i++) {
+        sum += 1.0 / pow(i + 1, zs);
+        cdf[i] = sum;
+    }
+    for (int i = 0; i < n; i++) {
+        cdf[i] /= sum;
+    }
+    return cdf;
+}
+
+static int zipf_pick(const double *cdf, int n, uint64_t *s) {
+    double u = rand_unit(s);
+    int lo = 0, hi = n - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (cdf[mid] < u) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static void generate_trace(int nkeys, double zs, size_t requests) {
+    double *cdf = zipf_cdf(nkeys, zs);
+    uint64_t s = 88172645463325252ULL;
+    char key[64];
+
+    for (size_t i = 0; i < requests; i++) {
+        int rank = zipf_pick(cdf, nkeys, &s);
+        int n = snprintf(key, sizeof(key), "http://origin.test/obj/%d", rank);
+        trace_add(key, n, key_size(rank));
+    }
+    free(cdf);
+}
+
+static void replay(enum cache_policy policy, size_t capacity, size_t max_entry, const char *filler) {
+    struct cache c;
+    unsigned long long hits = 0, hit_bytes = 0, total_bytes = 0;
+
+    if (cache_init(&c, capacity, max_entry, policy) < 0) {
+        perror("cache_init");
+        exit(1);
+    }
+    double t0 = now_sec();
+    for (size_t i = 0; i < trace_len; i++) {
+        struct cache_entry *e = cache_get(&c, trace[i].key);
+        total_bytes += trace[i].size;
+        if (e != NULL) {
+            hits++;
+            hit_bytes += trace[i].size;
+            cache_release(e);
+        } else {
+            cache_put(&c, trace[i].key, filler, trace[i].size);
+        }
+    }
+    double elapsed = now_sec() - t0;
+
+    printf("%-6s %10zuK %9.2f%% %9.2f%% %10llu %9.0f\n", cache_policy_names[policy],
+           capacity / 1024, 100.0 * hits / trace_len,
+           total_bytes ? 100.0 * hit_bytes / total_bytes : 0.0, c.evictions,
+           elapsed * 1e9 / trace_len);
+    cache_destroy(&c);
+}
+
+struct worker {
+    pthread_t tid;
+    struct cache *c;
+    const double *cdf;
+    int nkeys;
+    long ops;
+    uint64_t rng;
+};
+
+static char small_object[1024];
+
+static void *contend(void *arg) {
+    struct worker *w = arg;
+    char key[64];
+
+    for (long i = 0; i < w->ops; i++) {
+        int rank = zipf_pick(w->cdf, w->nkeys, &w->rng);
+        snprintf(key, sizeof(key), "http://origin.test/obj/%d", rank);
+        struct cache_entry *e = cache_get(w->c, key);
+        if (e != NULL) {
+            cache_release(e);
+        } else {
+            cache_put(w->c, key, small_object, sizeof(small_object));
+        }
+    }
+    return NULL;
+}
+
+static void contention(int max_threads, long ops, int nkeys, double zs) {
+    double *cdf = zipf_cdf(nkeys, zs);
+    struct worker *w = calloc(max_threads, sizeof(*w));
+
+    printf("\n%-6s %8s %12s   (1KB objects, cache holds half the keys)\n", "policy", "threads", "Mops/s");
+    for (int policy = 0; policy < CACHE_POLICY_COUNT; policy++) {
+        for (int threads = 1; threads <= max_threads; threads *= 2) {
+            struct cache c;
+            cache_init(&c, (size_t)nkeys / 2 * sizeof(small_object), sizeof(small_object), policy);
+            double t0 = now_sec();
+            for (int i = 0; i < threads; i++) {
+                w[i] = (struct worker){0, &c, cdf, nkeys, ops, 0x9e3779b97f4a7c15ULL * (i + 1)};
+                pthread_create(&w[i].tid, NULL, contend, &w[i]);
+            }
+            for (int i = 0; i < threads; i++) {
+                pthread_join(w[i].tid, NULL);
+            }
+            double elapsed = now_sec() - t0;
+            printf("%-6s %8d %12.2f\n", cache_policy_names[policy], threads,
+                   threads * ops / elapsed / 1e6);
+            cache_destroy(&c);
+            if (threads < max_threads && threads * 2 > max_threads) {
+                threads = max_threads / 2;    // Always finish with max_threads
+            }
+        }
+    }
+    free(w);
+    free(cdf);
+}
+
+int main(int argc, char *argv[]) {
+    const char *trace_file = NULL;
+    const char *sizes = "16m,64m,256m";
+    int nkeys = 100000;
+    double zs = 0.99;
+    size_t requests = 2000000;
+    size_t max_entry = 10 * 1024 * 1024;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = cpus > 16 ? 16 : cpus > 0 ? (int)cpus : 1;
+    long ops = 1000000;
+    char *end;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:n:s:r:m:e:t:o:")) != -1) {
+        switch (opt) {
+            case 'f': trace_file = optarg; break;
+            case 'n': nkeys = atoi(optarg); break;
+            case 's': zs = atof(optarg); break;
+            case 'r': requests = strtoull(optarg, NULL, 10); break;
+            case 'm': sizes = optarg; break;
+            case 'e': max_entry = parse_size(optarg, &end); break;
+            case 't': threads = atoi(optarg); break;
+            case 'o': ops = atol(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-f trace] [-n keys] [-s zipf_s] [-r requests] "
+                                "[-m sizes] [-e max_entry] [-t threads] [-o ops]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (nkeys < 1 || threads < 1) {
+        fprintf(stderr, "Bad arguments\n");
+        return 1;
+    }
+
+    if (trace_file != NULL) {
+        if (load_trace(trace_file) < 0) {
+            return 1;
+        }
+        printf("trace %s: %zu requests\n", trace_file, trace_len);
+    } else {
+        generate_trace(nkeys, zs, requests);
+        printf("generated trace: %zu requests, %d keys, zipf %.2f, 1KB-256KB objects\n",
+               trace_len, nkeys, zs);
+    }
+    if (trace_len == 0) {
+        return 1;
+    }
+
+    char *filler = malloc(max_object + 1);
+    memset(filler, 'x', max_object + 1);
+
+    printf("%-6s %11s %10s %10s %10s %9s\n", "policy", "size", "hits", "byte hits", "evictions", "ns/req");
+    for (const char *p = sizes; *p != '\0';) {
+        size_t capacity = parse_size(p, &end);
+        if (end == p) {
+            fprintf(stderr, "Bad size list: %s\n", sizes);
+            return 1;
+        }
+        for (int policy = 0; policy < CACHE_POLICY_COUNT; policy++) {
+            replay(policy, capacity, max_entry, filler);
+        }
+        p = *end == ',' ? end + 1 : end;
+    }
+
+    contention(threads, ops, nkeys, zs);
+    return 0;
+}
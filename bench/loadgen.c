@@ -0,0 +1,517 @@
+/*
+ * loadgen.c -- closed-loop load generator for the proxy.
+ *
+ * Each thread plays one client: it picks a URL on the origin with a Zipf
+ * distribution over -n objects, sends it through the proxy, reads the whole
+ * response and starts over. A fraction of the requests can instead open a
+ * CONNECT tunnel to the origin and send the GET through it. With -k the
+ * client asks for keep-alive and reuses the connection as long as the
+ * proxy leaves it open.
+ *
+ * At the end it prints throughput, the cache hit ratio (from the proxy's
+ * /metrics, before and after) and latency percentiles per request type.
+ *
+ * Usage: ./loadgen [-x proxy] [-o origin] [-c clients] [-d seconds]
+ *                  [-n objects] [-s zipf_s] [-t tunnel_fraction] [-k]
+ *
+ *   -x host:port  proxy (default 127.0.0.1:8080)
+ *   -o host:port  origin, as the proxy should reach it (default 127.0.0.1:9090)
+ *   -c clients    concurrent clients, one thread each (default 32)
+ *   -d seconds    run time (default 10)
+ *   -n objects    distinct URLs (default 10000)
+ *   -s zipf_s     Zipf exponent, 0 for uniform (default 0.99)
+ *   -t fraction   share of requests sent through a CONNECT tunnel (default 0)
+ *   -k            ask for keep-alive and reuse connections
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RBUF 65536
+
+enum { T_GET, T_TUNNEL, T_COUNT };
+static const char *type_names[T_COUNT] = {"GET", "CONNECT"};
+
+struct reader {
+    int fd;
+    size_t pos, len;
+    char buf[RBUF];
+};
+
+struct samples {
+    uint32_t *usec;
+    size_t n, cap;
+};
+
+struct client {
+    pthread_t tid;
+    int id;
+    uint64_t rng;
+    struct samples lat[T_COUNT];
+    unsigned long long errors;
+    unsigned long long bytes;
+    unsigned long long connects;
+    struct reader rd;
+};
+
+static struct sockaddr_in proxy_addr;
+static char origin[256] = "127.0.0.1:9090";
+static int nclients = 32;
+static double duration = 10;
+static int nobjects = 10000;
+static double zipf_s = 0.99;
+static double tunnel_share;
+static int keepalive;
+
+static double *zipf_cdf;
+static volatile int stop;
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// xorshift64*, one state per client
+static uint64_t next_rand(uint64_t *s) {
+    *s ^= *s >> 12;
+    *s ^= *s << 25;
+    *s ^= *s >> 27;
+    return *s * 2685821657736338717ULL;
+}
+
+static double rand_unit(uint64_t *s) {
+    return (next_rand(s) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void zipf_init(void) {
+    zipf_cdf = malloc(nobjects * sizeof(double));
+    double sum = 0;
+    for (int i = 0; i < nobjects; i++) {
+        sum += 1.0 / pow(i + 1, zipf_s);
+        zipf_cdf[i] = sum;
+    }
+    for (int i = 0; i < nobjects; i++) {
+        zipf_cdf[i] /= sum;
+    }
+}
+
+// Rank of an object, 0 being the most popular
+static int zipf_pick(uint64_t *s) {
+    double u = rand_unit(s);
+    int lo = 0, hi = nobjects - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (zipf_cdf[mid] < u) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static void sample_add(struct samples *s, double sec) {
+    if (s->n == s->cap) {
+        s->cap = s->cap ? s->cap * 2 : 4096;
+        s->usec = realloc(s->usec, s->cap * sizeof(*s->usec));
+    }
+    double us = sec * 1e6;
+    s->usec[s->n++] = us > UINT32_MAX ? UINT32_MAX : (uint32_t)us;
+}
+
+static int connect_proxy(void) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    if (fd < 0) {
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, (struct sockaddr *)&proxy_addr, sizeof(proxy_addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int send_all(int fd, const char *p, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int rd_fill(struct reader *r) {
+    if (r->pos == r->len) {
+        r->pos = r->len = 0;
+    } else if (r->pos > 0) {
+        memmove(r->buf, r->buf + r->pos, r->len - r->pos);
+        r->len -= r->pos;
+        r->pos = 0;
+    }
+    if (r->len == sizeof(r->buf)) {
+        return -1;
+    }
+    ssize_t n = recv(r->fd, r->buf + r->len, sizeof(r->buf) - r->len, 0);
+    if (n <= 0) {
+        return -1;
+    }
+    r->len += n;
+    return 0;
+}
+
+// Find the end of the line or head starting at r->pos, reading as needed
+static char *rd_until(struct reader *r, const char *delim, size_t dlen) {
+    while (1) {
+        char *p = memmem(r->buf + r->pos, r->len - r->pos, delim, dlen);
+        if (p != NULL) {
+            return p;
+        }
+        if (rd_fill(r) < 0) {
+            return NULL;
+        }
+    }
+}
+
+static int rd_skip(struct reader *r, unsigned long long n, unsigned long long *bytes) {
+    while (n > 0) {
+        if (r->pos == r->len && rd_fill(r) < 0) {
+            return -1;
+        }
+        size_t take = r->len - r->pos < n ? r->len - r->pos : n;
+        r->pos += take;
+        n -= take;
+        *bytes += take;
+    }
+    return 0;
+}
+
+static int has_token(const char *p, size_t len, const char *token) {
+    size_t tlen = strlen(token);
+    for (size_t i = 0; i + tlen <= len; i++) {
+        if (strncasecmp(p + i, token, tlen) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Read one response. Sets *reusable if the connection can carry another
+ * request. Returns the status code, or -1 on a broken response.
+ */
+static int read_response(struct reader *r, int head_only, unsigned long long *bytes, int *reusable) {
+    char *end = rd_until(r, "\r\n\r\n", 4);
+    if (end == NULL) {
+        return -1;
+    }
+    char *head = r->buf + r->pos;
+    *end = '\0';
+    size_t head_len = end + 4 - head;
+
+    int status = strncmp(head, "HTTP/1.", 7) == 0 ? atoi(head + 9) : -1;
+    long long length = -1;
+    int is_chunked = 0;
+    int is_close = strncmp(head, "HTTP/1.0", 8) == 0;
+    for (char *line = strstr(head, "\r\n"); line != NULL; line = strstr(line, "\r\n")) {
+        line += 2;
+        size_t line_len = strcspn(line, "\r");
+        if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            length = atoll(line + 15);
+        } else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0) {
+            is_chunked = has_token(line, line_len, "chunked");
+        } else if (strncasecmp(line, "Connection:", 11) == 0) {
+            is_close = has_token(line, line_len, "close");
+        }
+    }
+    r->pos += head_len;
+
+    if (head_only || status == 204 || status == 304 || (status >= 100 && status < 200)) {
+        *reusable = !is_close;
+        return status;
+    }
+    if (is_chunked) {
+        while (1) {
+            char *eol = rd_until(r, "\r\n", 2);
+            if (eol == NULL) {
+                return -1;
+            }
+            unsigned long long size = strtoull(r->buf + r->pos, NULL, 16);
+            r->pos = eol + 2 - r->buf;
+            if (size == 0) {
+                // Trailer fields up to the empty line
+                while ((eol = rd_until(r, "\r\n", 2)) != NULL && eol != r->buf + r->pos) {
+                    r->pos = eol + 2 - r->buf;
+                }
+                if (eol == NULL) {
+                    return -1;
+                }
+                r->pos += 2;
+                break;
+            }
+            if (rd_skip(r, size + 2, bytes) < 0) {
+                return -1;
+            }
+            *bytes -= 2;
+        }
+        *reusable = !is_close;
+    } else if (length >= 0) {
+        if (rd_skip(r, length, bytes) < 0) {
+            return -1;
+        }
+        *reusable = !is_close;
+    } else {
+        // Delimited by the end of the connection
+        while (rd_fill(r) == 0) {
+            *bytes += r->len - r->pos;
+            r->pos = r->len;
+        }
+        *bytes += r->len - r->pos;
+        r->pos = r->len;
+        *reusable = 0;
+    }
+    return status;
+}
+
+static void *client_main(void *arg) {
+    struct client *c = arg;
+    char req[1024];
+    int fd = -1;
+
+    while (!stop) {
+        int type = tunnel_share > 0 && rand_unit(&c->rng) < tunnel_share ? T_TUNNEL : T_GET;
+        int rank = zipf_pick(&c->rng);
+        int reusable = 0;
+        double t0 = now_sec();
+
+    retry:;
+        int reused = fd >= 0 && type == T_GET;
+        if (fd < 0 || type == T_TUNNEL) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            fd = connect_proxy();
+            if (fd < 0) {
+                c->errors++;
+                continue;
+            }
+            c->connects++;
+            c->rd.fd = fd;
+            c->rd.pos = c->rd.len = 0;
+        }
+
+        int status;
+        if (type == T_TUNNEL) {
+            int n = snprintf(req, sizeof(req), "CONNECT %s HTTP/1.1\r\nHost: %s\r\n\r\n", origin, origin);
+            unsigned long long ignored = 0;
+            if (send_all(fd, req, n) < 0 || read_response(&c->rd, 1, &ignored, &reusable) != 200) {
+                status = -1;
+            } else {
+                n = snprintf(req, sizeof(req),
+                             "GET /obj/%d HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n",
+                             rank, origin);
+                status = send_all(fd, req, n) < 0 ? -1
+                         : read_response(&c->rd, 0, &c->bytes, &reusable);
+            }
+            reusable = 0;
+        } else {
+            int n = snprintf(req, sizeof(req),
+                             "GET http://%s/obj/%d HTTP/1.1\r\nHost: %s\r\nConnection: %s\r\n\r\n",
+                             origin, rank, origin, keepalive ? "keep-alive" : "close");
+            status = send_all(fd, req, n) < 0 ? -1 : read_response(&c->rd, 0, &c->bytes, &reusable);
+            if (status < 0 && reused) {
+                // The proxy closed the idle connection; not an error
+                close(fd);
+                fd = -1;
+                goto retry;
+            }
+        }
+
+        if (status == 200) {
+            sample_add(&c->lat[type], now_sec() - t0);
+        } else {
+            c->errors++;
+        }
+        if (!keepalive || !reusable || status != 200) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    return NULL;
+}
+
+// Sum a counter from the proxy's /metrics, or -1 if it cannot be read
+static double scrape(const char *name) {
+    struct client *c = calloc(1, sizeof(*c));
+    double value = -1;
+    char req[256];
+
+    int fd = connect_proxy();
+    if (c == NULL || fd < 0) {
+        free(c);
+        return -1;
+    }
+    c->rd.fd = fd;
+    int n = snprintf(req, sizeof(req), "GET /metrics HTTP/1.1\r\nHost: %s:%d\r\nConnection: close\r\n\r\n",
+                     inet_ntoa(proxy_addr.sin_addr), ntohs(proxy_addr.sin_port));
+    if (send_all(fd, req, n) == 0 && rd_until(&c->rd, "\r\n\r\n", 4) != NULL) {
+        // Read the whole body, it ends with the connection
+        while (rd_fill(&c->rd) == 0) {
+        }
+        c->rd.buf[c->rd.len < RBUF ? c->rd.len : RBUF - 1] = '\0';
+        size_t nlen = strlen(name);
+        for (char *p = c->rd.buf; (p = strstr(p, name)) != NULL; p += nlen) {
+            if ((p == c->rd.buf || p[-1] == '\n') && p[nlen] == ' ') {
+                value = atof(p + nlen + 1);
+                break;
+            }
+        }
+    }
+    close(fd);
+    free(c);
+    return value;
+}
+
+static int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(struct samples *s, double q) {
+    size_t i = (size_t)(q * s->n);
+    return s->usec[i < s->n ? i : s->n - 1] / 1000.0;
+}
+
+static int parse_hostport(const char *s, struct sockaddr_in *addr) {
+    char host[256];
+    const char *colon = strrchr(s, ':');
+    if (colon == NULL || (size_t)(colon - s) >= sizeof(host)) {
+        return -1;
+    }
+    memcpy(host, s, colon - s);
+    host[colon - s] = '\0';
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(atoi(colon + 1));
+    return inet_pton(AF_INET, host, &addr->sin_addr) == 1 ? 0 : -1;
+}
+
+int main(int argc, char *argv[]) {
+    const char *proxy = "127.0.0.1:8080";
+    int opt;
+
+    while ((opt = getopt(argc, argv, "x:o:c:d:n:s:t:k")) != -1) {
+        switch (opt) {
+            case 'x': proxy = optarg; break;
+            case 'o': snprintf(origin, sizeof(origin), "%s", optarg); break;
+            case 'c': nclients = atoi(optarg); break;
+            case 'd': duration = atof(optarg); break;
+            case 'n': nobjects = atoi(optarg); break;
+            case 's': zipf_s = atof(optarg); break;
+            case 't': tunnel_share = atof(optarg); break;
+            case 'k': keepalive = 1; break;
+            default:
+                fprintf(stderr, "Usage: %s [-x proxy] [-o origin] [-c clients] [-d seconds] "
+                                "[-n objects] [-s zipf_s] [-t tunnel_fraction] [-k]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (parse_hostport(proxy, &proxy_addr) < 0 || nclients < 1 || nobjects < 1) {
+        fprintf(stderr, "Bad arguments\n");
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    zipf_init();
+
+    double hits0 = scrape("proxy_cache_hits_total");
+    double misses0 = scrape("proxy_cache_misses_total");
+
+    struct client *clients = calloc(nclients, sizeof(*clients));
+    if (clients == NULL) {
+        perror("calloc");
+        return 1;
+    }
+    double start = now_sec();
+    for (int i = 0; i < nclients; i++) {
+        clients[i].id = i;
+        clients[i].rng = 0x9e3779b97f4a7c15ULL * (i + 1);
+        if (pthread_create(&clients[i].tid, NULL, client_main, &clients[i]) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+    struct timespec ts = {(time_t)duration, (long)((duration - (time_t)duration) * 1e9)};
+    nanosleep(&ts, NULL);
+    stop = 1;
+    for (int i = 0; i < nclients; i++) {
+        pthread_join(clients[i].tid, NULL);
+    }
+    double elapsed = now_sec() - start;
+
+    double hits = scrape("proxy_cache_hits_total") - hits0;
+    double misses = scrape("proxy_cache_misses_total") - misses0;
+
+    // Merge the samples of all clients
+    unsigned long long total = 0, errors = 0, bytes = 0, connects = 0;
+    struct samples all[T_COUNT] = {{0}};
+    for (int i = 0; i < nclients; i++) {
+        errors += clients[i].errors;
+        bytes += clients[i].bytes;
+        connects += clients[i].connects;
+        for (int t = 0; t < T_COUNT; t++) {
+            for (size_t j = 0; j < clients[i].lat[t].n; j++) {
+                sample_add(&all[t], clients[i].lat[t].usec[j] / 1e6);
+            }
+        }
+    }
+
+    printf("clients %d, %.1f s, %d objects, zipf %.2f, tunnels %.0f%%, keep-alive %s\n",
+           nclients, elapsed, nobjects, zipf_s, tunnel_share * 100, keepalive ? "on" : "off");
+    for (int t = 0; t < T_COUNT; t++) {
+        total += all[t].n;
+    }
+    printf("requests %llu (%.0f/s), errors %llu, connections %llu, %.1f MB/s\n", total,
+           total / elapsed, errors, connects, bytes / elapsed / (1024 * 1024));
+    if (hits0 >= 0 && hits + misses > 0) {
+        printf("cache hit ratio %.1f%% (%.0f hits, %.0f misses)\n", 100 * hits / (hits + misses),
+               hits, misses);
+    } else {
+        printf("cache hit ratio unknown (no /metrics)\n");
+    }
+
+    printf("%-8s %10s %9s %9s %9s %9s %9s  (ms)\n", "type", "count", "p50", "p90", "p99", "p99.9", "max");
+    for (int t = 0; t < T_COUNT; t++) {
+        struct samples *s = &all[t];
+        if (s->n == 0) {
+            continue;
+        }
+        qsort(s->usec, s->n, sizeof(*s->usec), cmp_u32);
+        printf("%-8s %10zu %9.3f %9.3f %9.3f %9.3f %9.3f\n", type_names[t], s->n,
+               percentile(s, 0.5), percentile(s, 0.9), percentile(s, 0.99), percentile(s, 0.999),
+               s->usec[s->n - 1] / 1000.0);
+    }
+    return 0;
+}
@@ -0,0 +1,321 @@
+/*
+ * origin_stub.c -- local origin server for benchmarking the proxy.
+ *
+ * Answers every GET with a body of filler bytes. The size of each object
+ * is fixed by its path, so repeated requests for a URL get the same object
+ * and the proxy can cache it:
+ *
+ *   /size/<n>...  exactly n bytes
+ *   anything else a size drawn from the -s distribution, seeded by a hash
+ *                 of the path
+ *
+ * Connections are kept alive unless the client asks otherwise, and a
+ * CONNECT tunnel to the stub is just another connection carrying requests.
+ *
+ * Usage: ./origin_stub [-p port] [-s size] [-c] [-d ms]
+ *
+ *   -p port   port to listen on, 127.0.0.1 only (default 9090)
+ *   -s size   object sizes: "n" for all the same, "min-max" for sizes spread
+ *             evenly over the log scale, "min-max@alpha" for a Pareto tail
+ *             cut at max; suffixes k and m (default 1k-256k)
+ *   -c        send bodies with chunked encoding instead of Content-Length
+ *   -d ms     wait this long before answering each request
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define HEAD_MAX (16 * 1024)
+#define CHUNK (16 * 1024)
+#define FILL_SIZE (64 * 1024)
+
+static size_t size_min = 1024;
+static size_t size_max = 256 * 1024;
+static double pareto_alpha;        // 0 for log-uniform sizes
+static int chunked;
+static int delay_ms;
+static char fill[FILL_SIZE];
+
+static size_t parse_size(const char *s, char **end) {
+    double v = strtod(s, end);
+    if (**end == 'k' || **end == 'K') {
+        v *= 1024;
+        (*end)++;
+    } else if (**end == 'm' || **end == 'M') {
+        v *= 1024 * 1024;
+        (*end)++;
+    }
+    return (size_t)v;
+}
+
+static int parse_dist(const char *s) {
+    char *end;
+    size_min = size_max = parse_size(s, &end);
+    if (*end == '-') {
+        size_max = parse_size(end + 1, &end);
+    }
+    if (*end == '@') {
+        pareto_alpha = strtod(end + 1, &end);
+    }
+    return *end == '\0' && size_min <= size_max ? 0 : -1;
+}
+
+static uint64_t hash_path(const char *p, size_t len) {
+    uint64_t h = 1469598103934665603ULL;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)p[i]) * 1099511628211ULL;
+    }
+    // FNV alone leaves the low bits poorly mixed for similar paths
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static size_t object_size(const char *path, size_t len) {
+    if (len > 6 && strncmp(path, "/size/", 6) == 0) {
+        return strtoul(path + 6, NULL, 10);
+    }
+    if (size_min == size_max) {
+        return size_min;
+    }
+
+    double u = (hash_path(path, len) >> 11) * (1.0 / 9007199254740992.0);
+    double size;
+    if (pareto_alpha > 0) {
+        size = size_min / pow(1 - u, 1 / pareto_alpha);
+        if (size > size_max) {
+            size = size_max;
+        }
+    } else {
+        size = size_min * pow((double)size_max / size_min, u);
+    }
+    return (size_t)size;
+}
+
+static int send_all(int fd, const char *p, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int send_body(int fd, size_t size) {
+    char line[32];
+
+    while (size > 0) {
+        size_t n = size < CHUNK ? size : CHUNK;
+        if (chunked) {
+            int hl = snprintf(line, sizeof(line), "%zx\r\n", n);
+            if (send_all(fd, line, hl) < 0) {
+                return -1;
+            }
+        }
+        if (send_all(fd, fill, n) < 0 || (chunked && send_all(fd, "\r\n", 2) < 0)) {
+            return -1;
+        }
+        size -= n;
+    }
+    return chunked ? send_all(fd, "0\r\n\r\n", 5) : 0;
+}
+
+// Value of a header in a NUL terminated head, or NULL
+static const char *find_header(const char *head, const char *name, size_t *len) {
+    size_t nlen = strlen(name);
+    const char *p = strstr(head, "\r\n");
+    while (p != NULL && p[2] != '\r') {
+        p += 2;
+        if (strncasecmp(p, name, nlen) == 0 && p[nlen] == ':') {
+            const char *v = p + nlen + 1;
+            while (*v == ' ' || *v == '\t') {
+                v++;
+            }
+            *len = strcspn(v, "\r");
+            return v;
+        }
+        p = strstr(p, "\r\n");
+    }
+    return NULL;
+}
+
+static void *serve(void *arg) {
+    int fd = (int)(intptr_t)arg;
+    char *buf = malloc(HEAD_MAX + 1);
+    size_t have = 0;
+
+    if (buf != NULL) {
+        buf[0] = '\0';
+    }
+    while (buf != NULL) {
+        // Read one request head
+        char *end = NULL;
+        while ((end = strstr(buf, "\r\n\r\n")) == NULL) {
+            if (have == HEAD_MAX) {
+                goto done;
+            }
+            ssize_t n = recv(fd, buf + have, HEAD_MAX - have, 0);
+            if (n <= 0) {
+                goto done;
+            }
+            have += n;
+            buf[have] = '\0';
+        }
+        size_t head_len = end + 4 - buf;
+
+        // Skip a request body, which only has to be framed by Content-Length
+        size_t vlen;
+        const char *cl = find_header(buf, "Content-Length", &vlen);
+        size_t body = cl != NULL ? strtoul(cl, NULL, 10) : 0;
+
+        // HTTP/1.0 or Connection: close ends the connection after this one
+        int close_after = 0;
+        const char *eol = strstr(buf, "\r\n");
+        const char *conn = find_header(buf, "Connection", &vlen);
+        if ((conn != NULL && vlen == 5 && strncasecmp(conn, "close", 5) == 0) ||
+            (eol - buf >= 8 && strncmp(eol - 8, "HTTP/1.0", 8) == 0)) {
+            close_after = 1;
+        }
+
+        const char *path = strchr(buf, ' ');
+        size_t plen = 0;
+        if (path != NULL) {
+            path++;
+            // The proxy sends origin-form, but be lenient with absolute URLs
+            if (strncmp(path, "http://", 7) == 0) {
+                const char *slash = strchr(path + 7, '/');
+                path = slash != NULL ? slash : "/";
+            }
+            plen = strcspn(path, " \r");
+        } else {
+            path = "/";
+            plen = 1;
+        }
+        size_t size = object_size(path, plen);
+        int head_only = strncmp(buf, "HEAD ", 5) == 0;
+
+        if (delay_ms > 0) {
+            struct timespec ts = {delay_ms / 1000, (delay_ms % 1000) * 1000000L};
+            nanosleep(&ts, NULL);
+        }
+
+        char head[256];
+        int hl;
+        if (chunked) {
+            hl = snprintf(head, sizeof(head),
+                          "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\n"
+                          "Transfer-Encoding: chunked\r\n%s\r\n",
+                          close_after ? "Connection: close\r\n" : "");
+        } else {
+            hl = snprintf(head, sizeof(head),
+                          "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\n"
+                          "Content-Length: %zu\r\n%s\r\n",
+                          size, close_after ? "Connection: close\r\n" : "");
+        }
+        if (send_all(fd, head, hl) < 0 || (!head_only && send_body(fd, size) < 0)) {
+            break;
+        }
+        if (close_after) {
+            break;
+        }
+
+        // Keep whatever followed the head and its body
+        size_t used = head_len + body;
+        while (used > have) {
+            char skip[4096];
+            size_t want = used - have < sizeof(skip) ? used - have : sizeof(skip);
+            ssize_t n = recv(fd, skip, want, 0);
+            if (n <= 0) {
+                goto done;
+            }
+            used -= n;
+        }
+        memmove(buf, buf + used, have - used);
+        have -= used;
+        buf[have] = '\0';
+    }
+
+done:
+    free(buf);
+    close(fd);
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    int port = 9090;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:s:cd:")) != -1) {
+        switch (opt) {
+            case 'p': port = atoi(optarg); break;
+            case 's':
+                if (parse_dist(optarg) < 0) {
+                    fprintf(stderr, "Bad size distribution: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'c': chunked = 1; break;
+            case 'd': delay_ms = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-p port] [-s size|min-max[@alpha]] [-c] [-d ms]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    memset(fill, 'x', sizeof(fill));
+    signal(SIGPIPE, SIG_IGN);
+
+    int lfd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(lfd, 1024) < 0) {
+        perror("origin_stub");
+        return 1;
+    }
+    printf("origin_stub on 127.0.0.1:%d, sizes %zu-%zu%s%s, delay %d ms\n", port, size_min,
+           size_max, pareto_alpha > 0 ? " (pareto)" : "", chunked ? ", chunked" : "", delay_ms);
+    fflush(stdout);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attr, 256 * 1024);
+
+    while (1) {
+        int fd = accept(lfd, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EINTR) {
+                perror("accept");
+            }
+            continue;
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        pthread_t tid;
+        if (pthread_create(&tid, &attr, serve, (void *)(intptr_t)fd) != 0) {
+            close(fd);
+        }
+    }
+}
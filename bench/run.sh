@@ -0,0 +1,19 @@
+#!/bin/sh
+# Run the proxy against the origin stub on this machine and drive it with
+# the load generator. Arguments go to loadgen; ORIGIN_ARGS to origin_stub.
+#
+#   make bench && bench/run.sh -c 64 -d 20 -t 0.1
+set -e
+cd "$(dirname "$0")/.."
+
+PROXY_PORT=${PROXY_PORT:-8080}
+ORIGIN_PORT=${ORIGIN_PORT:-9090}
+
+./origin_stub -p "$ORIGIN_PORT" $ORIGIN_ARGS >/dev/null &
+origin=$!
+PROXY_LOG_LEVEL=${PROXY_LOG_LEVEL:-warn} ./proxy_server "$PROXY_PORT" >/dev/null &
+proxy=$!
+trap 'kill $proxy $origin 2>/dev/null' EXIT
+sleep 1
+
+./loadgen -x "127.0.0.1:$PROXY_PORT" -o "127.0.0.1:$ORIGIN_PORT" "$@"
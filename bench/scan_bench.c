@@ -0,0 +1,161 @@
+/*
+ * scan_bench.c -- compare request head scanning strategies.
+ *
+ * Builds browser-like request heads of 1-8KB (the size is made up mostly
+ * by the Cookie header, as in real traffic) and measures:
+ *
+ *   strstr     the old approach: NUL terminated copy, strstr for the end
+ *              of the head, then strstr/index per header line
+ *   head_end   http_scan_head_end() at each http_scan implementation
+ *              level (the scalar one is memchr driven)
+ *   parse      a full ParsedRequest_create/parse/destroy at each level
+ *
+ * Usage: ./scan_bench [seconds per measurement]
+ */
+
+#include "proxy_parse.h"
+#include "http_scan.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+static const char *level_names[] = {"scalar", "sse4.2", "avx2"};
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Build a request head of roughly target bytes */
+static size_t build_request(char *buf, size_t cap, size_t target) {
+    size_t n = snprintf(buf, cap,
+        "GET http://www.example.com/assets/app/main.bundle.js?v=20231018 HTTP/1.1\r\n"
+        "Host: www.example.com\r\n"
+        "Connection: keep-alive\r\n"
+        "sec-ch-ua: \"Chromium\";v=\"118\", \"Google Chrome\";v=\"118\", \"Not=A?Brand\";v=\"99\"\r\n"
+        "sec-ch-ua-mobile: ?0\r\n"
+        "User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 "
+        "(KHTML, like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+        "sec-ch-ua-platform: \"Windows\"\r\n"
+        "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,"
+        "image/webp,image/apng,*/*;q=0.8,application/signed-exchange;v=b3;q=0.7\r\n"
+        "Sec-Fetch-Site: same-origin\r\n"
+        "Sec-Fetch-Mode: no-cors\r\n"
+        "Sec-Fetch-Dest: script\r\n"
+        "Referer: https://www.example.com/products/category/item?id=1234567&ref=home\r\n"
+        "Accept-Encoding: gzip, deflate, br\r\n"
+        "Accept-Language: en-US,en;q=0.9,de;q=0.8\r\n"
+        "If-None-Match: \"5f1b2c3d4e5f6a7b8c9d0e1f\"\r\n"
+        "If-Modified-Since: Wed, 18 Oct 2023 07:28:00 GMT\r\n"
+        "Cookie: ");
+
+    /* name=value pairs until the head reaches the target size */
+    unsigned seed = 12345;
+    int pair = 0;
+    while (n + 64 < target && n + 64 < cap) {
+        n += snprintf(buf + n, cap - n, "%sc%d=", pair ? "; " : "", pair);
+        for (int i = 0; i < 24; i++) {
+            seed = seed * 1103515245 + 12345;
+            buf[n++] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789"[(seed >> 16) % 62];
+        }
+        pair++;
+    }
+    n += snprintf(buf + n, cap - n, "\r\n\r\n");
+    return n;
+}
+
+/* The scanning done by the original parser and read loop */
+static size_t legacy_scan(const char *buf, size_t len, char *tmp) {
+    size_t sum = 0;
+    memcpy(tmp, buf, len);
+    tmp[len] = '\0';
+
+    char *end = strstr(tmp, "\r\n\r\n");
+    if (end == NULL) {
+        return 0;
+    }
+    sum += end - tmp;
+
+    char *line = strstr(tmp, "\r\n") + 2;
+    while (line[0] != '\0' && !(line[0] == '\r' && line[1] == '\n')) {
+        char *colon = index(line, ':');
+        char *eol = strstr(line, "\r\n");
+        if (colon == NULL || eol == NULL) {
+            break;
+        }
+        sum += (colon - line) + (eol - colon);
+        line = eol + 2;
+    }
+    return sum;
+}
+
+static void report(const char *what, size_t size, long iters, double secs) {
+    double ns = secs * 1e9 / iters;
+    printf("%-18s %6zu B %10.1f ns/op %8.2f GB/s\n", what, size, ns, size / ns);
+}
+
+int main(int argc, char *argv[]) {
+    double budget = argc > 1 ? atof(argv[1]) : 0.3;
+    static const size_t sizes[] = {1024, 2048, 4096, 8192};
+    char *buf = malloc(16384);
+    char *tmp = malloc(16384);
+    volatile size_t sink = 0;
+    int best = http_scan_select(HTTP_SCAN_AVX2);
+
+    printf("best supported level: %s\n\n", level_names[best]);
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        size_t len = build_request(buf, 16384, sizes[s]);
+        long iters;
+        double start;
+
+        // Calibrate on the slowest variant
+        iters = 1000;
+        start = now_sec();
+        for (long i = 0; i < iters; i++) {
+            sink += legacy_scan(buf, len, tmp);
+        }
+        iters = (long)(iters * budget / (now_sec() - start + 1e-9));
+        if (iters < 1000) {
+            iters = 1000;
+        }
+
+        start = now_sec();
+        for (long i = 0; i < iters; i++) {
+            sink += legacy_scan(buf, len, tmp);
+        }
+        report("strstr", len, iters, now_sec() - start);
+
+        for (int level = HTTP_SCAN_SCALAR; level <= best; level++) {
+            char name[32];
+            http_scan_select(level);
+
+            start = now_sec();
+            for (long i = 0; i < iters; i++) {
+                sink += http_scan_head_end(buf, len);
+            }
+            snprintf(name, sizeof(name), "head_end/%s", level_names[level]);
+            report(name, len, iters, now_sec() - start);
+
+            start = now_sec();
+            for (long i = 0; i < iters; i++) {
+                struct ParsedRequest *req = ParsedRequest_create();
+                if (ParsedRequest_parse(req, buf, len) == 0) {
+                    sink += req->headersused;
+                }
+                ParsedRequest_destroy(req);
+            }
+            snprintf(name, sizeof(name), "parse/%s", level_names[level]);
+            report(name, len, iters, now_sec() - start);
+        }
+        printf("\n");
+    }
+
+    free(buf);
+    free(tmp);
+    return sink == 0;
+}
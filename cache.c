@@ -0,0 +1,780 @@
+/*
+ * cache.c -- in-memory response cache.
+ *
+ * The index and the policy list are guarded by one reader-writer lock.
+ * Lookups only need it shared when the policy does not reorder the list on
+ * a hit (FIFO, and CLOCK, which just sets a bit); LRU lookups move the entry
+ * to the front and take it exclusively. Reference counts are atomic since
+ * shared lookups take references concurrently.
+ *
+ * The origin index and its tries change only under the exclusive lock,
+ * with the hash index, so lookups never see them. Purging takes the
+ * entries out like an eviction: a request that is sending one of them
+ * keeps its reference and finishes.
+ *
+ * With a shared region attached (cache_share()) every call goes to
+ * shmcache.c instead, and the local index stays empty.
+ */
+
+#include "cache.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+
+#include "shmcache.h"
+
+#define CACHE_MIN_BUCKETS 1024
+
+// Node of a radix trie over the paths of one origin
+struct tnode {
+    const char *label;        // Edge from the parent; points into the node's own block
+    size_t len;
+    struct cache_entry *entry;                // Entry whose path ends here, if any
+    struct tnode **kids;
+    int nkids, capkids;
+};
+
+struct cache_host {
+    char *name;               // Scheme and authority, "http://example.com:8080"
+    size_t namelen;
+    uint64_t hash;            // Of the lowercased name, so names differing in case share a chain
+    struct tnode root;        // Empty label
+    struct cache_host *next;
+};
+
+const char *const cache_policy_names[CACHE_POLICY_COUNT] = {"lru", "fifo", "clock"};
+
+static uint64_t hash_key(const char *key) {
+    uint64_t h = 1469598103934665603ULL;
+    for (; *key; key++) {
+        h = (h ^ (unsigned char)*key) * 1099511628211ULL;
+    }
+    return h;
+}
+
+int cache_init(struct cache *c, size_t max_bytes, size_t max_entry, enum cache_policy policy) {
+    memset(c, 0, sizeof(*c));
+    c->buckets = calloc(CACHE_MIN_BUCKETS, sizeof(*c->buckets));
+    c->hosts = calloc(CACHE_HOST_BUCKETS, sizeof(*c->hosts));
+    if (c->buckets == NULL || c->hosts == NULL) {
+        free(c->buckets);
+        free(c->hosts);
+        return -1;
+    }
+    c->nbuckets = CACHE_MIN_BUCKETS;
+    c->max_bytes = max_bytes;
+    c->max_entry = max_entry;
+    c->policy = policy;
+    pthread_rwlock_init(&c->lock, NULL);
+    return 0;
+}
+
+void cache_release(struct cache_entry *e) {
+    if (__atomic_sub_fetch(&e->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        struct cache_map *map = e->map;
+        free(e);            // Key (and data, unless mapped) live in the same block
+        if (map != NULL && __atomic_sub_fetch(&map->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+            munmap(map->base, map->len);
+            free(map);
+        }
+    }
+}
+
+static void list_unlink(struct cache *c, struct cache_entry *e) {
+    if (c->hand == e) {
+        c->hand = e->prev;
+    }
+    if (e->prev != NULL) {
+        e->prev->next = e->next;
+    } else {
+        c->head = e->next;
+    }
+    if (e->next != NULL) {
+        e->next->prev = e->prev;
+    } else {
+        c->tail = e->prev;
+    }
+    e->prev = e->next = NULL;
+}
+
+static void list_push_front(struct cache *c, struct cache_entry *e) {
+    e->prev = NULL;
+    e->next = c->head;
+    if (c->head != NULL) {
+        c->head->prev = e;
+    } else {
+        c->tail = e;
+    }
+    c->head = e;
+}
+
+// Insert e on the tail side of pos
+static void list_insert_after(struct cache *c, struct cache_entry *pos, struct cache_entry *e) {
+    e->prev = pos;
+    e->next = pos->next;
+    if (pos->next != NULL) {
+        pos->next->prev = e;
+    } else {
+        c->tail = e;
+    }
+    pos->next = e;
+}
+
+static struct cache_entry **bucket_link(struct cache *c, const char *key, uint64_t hash) {
+    struct cache_entry **link = &c->buckets[hash & (c->nbuckets - 1)];
+    while (*link != NULL && ((*link)->hash != hash || strcmp((*link)->key, key) != 0)) {
+        link = &(*link)->hnext;
+    }
+    return link;
+}
+
+/*
+ * Split a key into its origin ("http://host:port") and path. Keys without a
+ * scheme are taken to start with the host.
+ */
+static size_t key_origin_len(const char *key) {
+    const char *auth = strstr(key, "://");
+    auth = auth != NULL ? auth + 3 : key;
+    return (size_t)(auth - key) + strcspn(auth, "/");
+}
+
+static uint64_t hash_lower(const char *s, size_t len) {
+    uint64_t h = 1469598103934665603ULL;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)tolower((unsigned char)s[i])) * 1099511628211ULL;
+    }
+    return h;
+}
+
+// Keys are case sensitive, so is the index; purges match either case
+static struct cache_host **host_link(struct cache *c, const char *name, size_t len) {
+    uint64_t hash = hash_lower(name, len);
+    struct cache_host **link = &c->hosts[hash % CACHE_HOST_BUCKETS];
+    while (*link != NULL && ((*link)->hash != hash || (*link)->namelen != len ||
+                             strncmp((*link)->name, name, len) != 0)) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+static struct tnode *tnode_new(const char *label, size_t len) {
+    struct tnode *n = malloc(sizeof(*n) + len);
+    if (n == NULL) {
+        return NULL;
+    }
+    memset(n, 0, sizeof(*n));
+    memcpy(n + 1, label, len);
+    n->label = (const char *)(n + 1);
+    n->len = len;
+    return n;
+}
+
+static void tnode_free(struct tnode *n) {
+    for (int i = 0; i < n->nkids; i++) {
+        tnode_free(n->kids[i]);
+    }
+    free(n->kids);
+    free(n);
+}
+
+static int tnode_add_kid(struct tnode *n, struct tnode *kid) {
+    if (n->nkids == n->capkids) {
+        int cap = n->capkids ? n->capkids * 2 : 2;
+        struct tnode **kids = realloc(n->kids, cap * sizeof(*kids));
+        if (kids == NULL) {
+            return -1;
+        }
+        n->kids = kids;
+        n->capkids = cap;
+    }
+    n->kids[n->nkids++] = kid;
+    return 0;
+}
+
+// Children differ in their first byte
+static int tnode_find_kid(const struct tnode *n, char first) {
+    for (int i = 0; i < n->nkids; i++) {
+        if (n->kids[i]->label[0] == first) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static size_t common_prefix(const char *a, size_t alen, const char *b, size_t blen) {
+    size_t i = 0;
+    while (i < alen && i < blen && a[i] == b[i]) {
+        i++;
+    }
+    return i;
+}
+
+static int trie_insert(struct tnode *n, const char *path, struct cache_entry *e) {
+    size_t rem = strlen(path);
+
+    while (rem > 0) {
+        int i = tnode_find_kid(n, path[0]);
+        if (i < 0) {
+            struct tnode *leaf = tnode_new(path, rem);
+            if (leaf == NULL || tnode_add_kid(n, leaf) < 0) {
+                free(leaf);
+                return -1;
+            }
+            n = leaf;
+            break;
+        }
+        struct tnode *kid = n->kids[i];
+        size_t common = common_prefix(kid->label, kid->len, path, rem);
+        if (common < kid->len) {
+            // The path leaves the edge part way: split it
+            struct tnode *mid = tnode_new(path, common);
+            if (mid == NULL || tnode_add_kid(mid, kid) < 0) {
+                free(mid);
+                return -1;
+            }
+            kid->label += common;
+            kid->len -= common;
+            n->kids[i] = mid;
+            kid = mid;
+        }
+        n = kid;
+        path += common;
+        rem -= common;
+    }
+    n->entry = e;
+    return 0;
+}
+
+// Fold a node without an entry into its only child
+static struct tnode *tnode_merge(struct tnode *n) {
+    struct tnode *kid = n->kids[0];
+    struct tnode *m = malloc(sizeof(*m) + n->len + kid->len);
+    if (m == NULL) {
+        return n;           // Stays unmerged, which is still correct
+    }
+    memcpy(m + 1, n->label, n->len);
+    memcpy((char *)(m + 1) + n->len, kid->label, kid->len);
+    m->label = (const char *)(m + 1);
+    m->len = n->len + kid->len;
+    m->entry = kid->entry;
+    m->kids = kid->kids;
+    m->nkids = kid->nkids;
+    m->capkids = kid->capkids;
+    free(n->kids);
+    free(n);
+    free(kid);
+    return m;
+}
+
+static void trie_remove(struct tnode *n, const char *path, size_t rem) {
+    if (rem == 0) {
+        n->entry = NULL;
+        return;
+    }
+    int i = tnode_find_kid(n, path[0]);
+    if (i < 0) {
+        return;
+    }
+    struct tnode *kid = n->kids[i];
+    if (rem < kid->len || memcmp(kid->label, path, kid->len) != 0) {
+        return;
+    }
+    trie_remove(kid, path + kid->len, rem - kid->len);
+    if (kid->entry == NULL && kid->nkids == 0) {
+        free(kid->kids);
+        free(kid);
+        n->kids[i] = n->kids[--n->nkids];
+    } else if (kid->entry == NULL && kid->nkids == 1) {
+        n->kids[i] = tnode_merge(kid);
+    }
+}
+
+static int origin_index_add(struct cache *c, struct cache_entry *e) {
+    size_t len = key_origin_len(e->key);
+    struct cache_host **link = host_link(c, e->key, len);
+    struct cache_host *h = *link;
+
+    if (h == NULL) {
+        h = calloc(1, sizeof(*h) + len + 1);
+        if (h == NULL) {
+            return -1;
+        }
+        h->name = (char *)(h + 1);
+        memcpy(h->name, e->key, len);
+        h->namelen = len;
+        h->hash = hash_lower(e->key, len);
+        *link = h;
+    }
+    return trie_insert(&h->root, e->key + len, e);
+}
+
+static void host_free(struct cache_host *h) {
+    for (int i = 0; i < h->root.nkids; i++) {
+        tnode_free(h->root.kids[i]);
+    }
+    free(h->root.kids);
+    free(h);
+}
+
+static void origin_index_remove(struct cache *c, struct cache_entry *e) {
+    size_t len = key_origin_len(e->key);
+    struct cache_host **link = host_link(c, e->key, len);
+    struct cache_host *h = *link;
+
+    if (h == NULL) {
+        return;
+    }
+    trie_remove(&h->root, e->key + len, strlen(e->key + len));
+    if (h->root.entry == NULL && h->root.nkids == 0) {
+        *link = h->next;
+        host_free(h);
+    }
+}
+
+// Take an entry out of the index and the list; the caller holds the lock
+static void unindex(struct cache *c, struct cache_entry **link) {
+    struct cache_entry *e = *link;
+    *link = e->hnext;
+    origin_index_remove(c, e);
+    list_unlink(c, e);
+    c->count--;
+    c->bytes -= e->len;
+    cache_release(e);
+}
+
+static struct cache_entry *pick_victim(struct cache *c) {
+    if (c->policy != CACHE_CLOCK) {
+        return c->tail;
+    }
+    // Give every referenced entry a second chance; two sweeps at most
+    while (1) {
+        if (c->hand == NULL) {
+            c->hand = c->tail;
+        }
+        struct cache_entry *e = c->hand;
+        if (!__atomic_load_n(&e->referenced, __ATOMIC_RELAXED)) {
+            return e;
+        }
+        __atomic_store_n(&e->referenced, 0, __ATOMIC_RELAXED);
+        c->hand = e->prev;
+    }
+}
+
+static void grow_index(struct cache *c) {
+    size_t n = c->nbuckets * 2;
+    struct cache_entry **b = calloc(n, sizeof(*b));
+    if (b == NULL) {
+        return;             // Longer chains, still correct
+    }
+    for (size_t i = 0; i < c->nbuckets; i++) {
+        struct cache_entry *e = c->buckets[i];
+        while (e != NULL) {
+            struct cache_entry *next = e->hnext;
+            e->hnext = b[e->hash & (n - 1)];
+            b[e->hash & (n - 1)] = e;
+            e = next;
+        }
+    }
+    free(c->buckets);
+    c->buckets = b;
+    c->nbuckets = n;
+}
+
+struct cache_entry *cache_get(struct cache *c, const char *key) {
+    uint64_t hash = hash_key(key);
+    if (c->shared != NULL) {
+        return shm_cache_get(c->shared, key, hash);
+    }
+    // The policy may change meanwhile; act on the one the lock was taken for
+    enum cache_policy policy = __atomic_load_n(&c->policy, __ATOMIC_RELAXED);
+    int exclusive = policy == CACHE_LRU;
+
+    if (exclusive) {
+        pthread_rwlock_wrlock(&c->lock);
+    } else {
+        pthread_rwlock_rdlock(&c->lock);
+    }
+
+    struct cache_entry *e = *bucket_link(c, key, hash);
+    if (e != NULL) {
+        __atomic_add_fetch(&e->refs, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&e->hits, 1, __ATOMIC_RELAXED);
+        if (policy == CACHE_LRU && c->head != e) {
+            list_unlink(c, e);
+            list_push_front(c, e);
+        } else if (policy == CACHE_CLOCK && !__atomic_load_n(&e->referenced, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&e->referenced, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    pthread_rwlock_unlock(&c->lock);
+    return e;
+}
+
+int cache_put(struct cache *c, const char *key, const char *data, size_t len) {
+    // Checked again under the lock, the limits can change meanwhile
+    if (len > __atomic_load_n(&c->max_entry, __ATOMIC_RELAXED) ||
+        len > __atomic_load_n(&c->max_bytes, __ATOMIC_RELAXED)) {
+        return -1;
+    }
+    if (c->shared != NULL) {
+        return shm_cache_put(c->shared, key, hash_key(key), data, len);
+    }
+
+    // Build the entry before taking the lock; one block holds it all
+    size_t keylen = strlen(key);
+    struct cache_entry *e = malloc(sizeof(*e) + keylen + 1 + len + 1);
+    if (e == NULL) {
+        return -1;
+    }
+    e->key = (char *)(e + 1);
+    e->data = e->key + keylen + 1;
+    memcpy(e->key, key, keylen + 1);
+    memcpy(e->data, data, len);
+    e->data[len] = '\0';
+    e->len = len;
+    e->hash = hash_key(key);
+    e->refs = 1;
+    e->referenced = 0;
+    e->hits = 0;
+    e->stored = time(NULL);
+    e->map = NULL;
+
+    int evicted = 0;
+    pthread_rwlock_wrlock(&c->lock);
+    if (len > c->max_entry || len > c->max_bytes) {
+        pthread_rwlock_unlock(&c->lock);
+        free(e);
+        return -1;
+    }
+
+    struct cache_entry **link = bucket_link(c, key, e->hash);
+    if (*link != NULL) {
+        unindex(c, link);
+    }
+    while (c->bytes + len > c->max_bytes && c->tail != NULL) {
+        struct cache_entry *victim = pick_victim(c);
+        unindex(c, bucket_link(c, victim->key, victim->hash));
+        evicted++;
+    }
+    c->evictions += evicted;
+
+    if (origin_index_add(c, e) < 0) {
+        pthread_rwlock_unlock(&c->lock);
+        free(e);
+        return -1;
+    }
+    if (c->count >= c->nbuckets) {
+        grow_index(c);
+    }
+    link = &c->buckets[e->hash & (c->nbuckets - 1)];
+    e->hnext = *link;
+    *link = e;
+    if (c->policy == CACHE_CLOCK && c->hand != NULL) {
+        // Just behind the hand, so it is looked at last
+        list_insert_after(c, c->hand, e);
+    } else {
+        list_push_front(c, e);
+    }
+    c->count++;
+    c->bytes += len;
+
+    pthread_rwlock_unlock(&c->lock);
+    return evicted;
+}
+
+int cache_insert_oldest(struct cache *c, struct cache_entry *e) {
+    if (c->shared != NULL) {
+        return -1;
+    }
+    e->hash = hash_key(e->key);
+    e->refs = 1;
+
+    pthread_rwlock_wrlock(&c->lock);
+    struct cache_entry **link = bucket_link(c, e->key, e->hash);
+    if (*link != NULL || e->len > c->max_entry || c->bytes + e->len > c->max_bytes ||
+        origin_index_add(c, e) < 0) {
+        pthread_rwlock_unlock(&c->lock);
+        return -1;
+    }
+    if (c->count >= c->nbuckets) {
+        grow_index(c);
+        link = &c->buckets[e->hash & (c->nbuckets - 1)];
+    }
+    e->hnext = *link;
+    *link = e;
+
+    // Onto the tail of the list
+    e->next = NULL;
+    e->prev = c->tail;
+    if (c->tail != NULL) {
+        c->tail->next = e;
+    } else {
+        c->head = e;
+    }
+    c->tail = e;
+    c->count++;
+    c->bytes += e->len;
+    pthread_rwlock_unlock(&c->lock);
+    return 0;
+}
+
+int cache_resize(struct cache *c, size_t max_bytes, size_t max_entry) {
+    int evicted = 0;
+
+    if (c->shared != NULL) {
+        // The region keeps the size it was created with
+        __atomic_store_n(&c->max_entry, max_entry, __ATOMIC_RELAXED);
+        return 0;
+    }
+    pthread_rwlock_wrlock(&c->lock);
+    __atomic_store_n(&c->max_bytes, max_bytes, __ATOMIC_RELAXED);
+    __atomic_store_n(&c->max_entry, max_entry, __ATOMIC_RELAXED);
+    while (c->bytes > c->max_bytes && c->tail != NULL) {
+        struct cache_entry *victim = pick_victim(c);
+        unindex(c, bucket_link(c, victim->key, victim->hash));
+        evicted++;
+    }
+    c->evictions += evicted;
+    pthread_rwlock_unlock(&c->lock);
+    return evicted;
+}
+
+void cache_set_policy(struct cache *c, enum cache_policy policy) {
+    if (c->shared != NULL) {
+        return;
+    }
+    pthread_rwlock_wrlock(&c->lock);
+    // The list is shared by all policies; only the CLOCK hand starts over
+    __atomic_store_n(&c->policy, policy, __ATOMIC_RELAXED);
+    c->hand = NULL;
+    pthread_rwlock_unlock(&c->lock);
+}
+
+long cache_collect(struct cache *c, struct cache_entry ***out) {
+    pthread_rwlock_rdlock(&c->lock);
+    struct cache_entry **v = malloc((c->count ? c->count : 1) * sizeof(*v));
+    long n = 0;
+    if (v != NULL) {
+        for (struct cache_entry *e = c->head; e != NULL; e = e->next) {
+            __atomic_add_fetch(&e->refs, 1, __ATOMIC_RELAXED);
+            v[n++] = e;
+        }
+    }
+    pthread_rwlock_unlock(&c->lock);
+    *out = v;
+    return v != NULL ? n : -1;
+}
+
+int cache_remove(struct cache *c, const char *key) {
+    uint64_t hash = hash_key(key);
+    int found = -1;
+
+    if (c->shared != NULL) {
+        return shm_cache_remove(c->shared, key, hash, NULL, NULL) > 0 ? 0 : -1;
+    }
+    pthread_rwlock_wrlock(&c->lock);
+    struct cache_entry **link = bucket_link(c, key, hash);
+    if (*link != NULL) {
+        unindex(c, link);
+        found = 0;
+    }
+    pthread_rwlock_unlock(&c->lock);
+    return found;
+}
+
+struct entry_list {
+    struct cache_entry **v;
+    size_t n, cap;
+};
+
+static void collect(const struct tnode *n, struct entry_list *out) {
+    if (n->entry != NULL && out->n < out->cap) {
+        out->v[out->n++] = n->entry;
+    }
+    for (int i = 0; i < n->nkids; i++) {
+        collect(n->kids[i], out);
+    }
+}
+
+// Remove every entry under a trie node; the caller holds the lock
+static int purge_subtree(struct cache *c, const struct tnode *n) {
+    // Unindexing reshapes the trie, so gather the entries first
+    struct entry_list list = {malloc(c->count * sizeof(struct cache_entry *)), 0, c->count};
+    if (list.v == NULL) {
+        return 0;
+    }
+    collect(n, &list);
+    for (size_t i = 0; i < list.n; i++) {
+        struct cache_entry *e = list.v[i];
+        unindex(c, bucket_link(c, e->key, e->hash));
+    }
+    free(list.v);
+    return (int)list.n;
+}
+
+// Matchers for purging a shared region, which has no origin index
+static int key_has_host(const char *key, const void *arg) {
+    const char *host = arg;
+    const char *auth = strstr(key, "://");
+    auth = auth != NULL ? auth + 3 : key;
+    size_t len = strcspn(auth, "/");
+    return len == strlen(host) && strncasecmp(auth, host, len) == 0;
+}
+
+static int key_has_prefix(const char *key, const void *arg) {
+    const char *prefix = arg;
+    size_t len = key_origin_len(prefix);
+    return key_origin_len(key) == len && strncasecmp(key, prefix, len) == 0 &&
+           strncmp(key + len, prefix + len, strlen(prefix + len)) == 0;
+}
+
+int cache_purge_host(struct cache *c, const char *host) {
+    int removed = 0;
+    size_t len = strlen(host);
+
+    if (c->shared != NULL) {
+        return shm_cache_remove(c->shared, NULL, 0, key_has_host, host);
+    }
+    pthread_rwlock_wrlock(&c->lock);
+    for (size_t b = 0; b < CACHE_HOST_BUCKETS; b++) {
+        struct cache_host *h = c->hosts[b];
+        while (h != NULL) {
+            // Hosts are few next to entries; match the authority of each
+            struct cache_host *next = h->next;
+            const char *auth = strstr(h->name, "://");
+            auth = auth != NULL ? auth + 3 : h->name;
+            if (h->namelen - (size_t)(auth - h->name) == len && strncasecmp(auth, host, len) == 0) {
+                // The last unindex frees h
+                removed += purge_subtree(c, &h->root);
+            }
+            h = next;
+        }
+    }
+    pthread_rwlock_unlock(&c->lock);
+    return removed;
+}
+
+// Find the node whose subtree holds every path starting with a prefix
+static const struct tnode *trie_find_prefix(const struct tnode *n, const char *path) {
+    size_t rem = strlen(path);
+
+    while (n != NULL && rem > 0) {
+        int i = tnode_find_kid(n, path[0]);
+        if (i < 0) {
+            n = NULL;
+            break;
+        }
+        const struct tnode *kid = n->kids[i];
+        size_t common = common_prefix(kid->label, kid->len, path, rem);
+        if (common < rem && common < kid->len) {
+            n = NULL;
+            break;
+        }
+        n = kid;
+        path += common;
+        rem -= common;
+    }
+    return n;
+}
+
+int cache_purge_prefix(struct cache *c, const char *prefix) {
+    int removed = 0;
+    size_t len = key_origin_len(prefix);
+    uint64_t hash = hash_lower(prefix, len);
+
+    if (c->shared != NULL) {
+        return shm_cache_remove(c->shared, NULL, 0, key_has_prefix, prefix);
+    }
+    pthread_rwlock_wrlock(&c->lock);
+    struct cache_host *h = c->hosts[hash % CACHE_HOST_BUCKETS];
+    while (h != NULL) {
+        struct cache_host *next = h->next;
+        if (h->hash == hash && h->namelen == len && strncasecmp(h->name, prefix, len) == 0) {
+            const struct tnode *n = trie_find_prefix(&h->root, prefix + len);
+            if (n != NULL) {
+                removed += purge_subtree(c, n);
+            }
+        }
+        h = next;
+    }
+    pthread_rwlock_unlock(&c->lock);
+    return removed;
+}
+
+size_t cache_bytes(struct cache *c) {
+    if (c->shared != NULL) {
+        return shm_cache_bytes(c->shared);
+    }
+    pthread_rwlock_rdlock(&c->lock);
+    size_t bytes = c->bytes;
+    pthread_rwlock_unlock(&c->lock);
+    return bytes;
+}
+
+void cache_walk(struct cache *c, int (*fn)(void *arg, const struct cache_entry *e), void *arg) {
+    if (c->shared != NULL) {
+        shm_cache_walk(c->shared, fn, arg);
+        return;
+    }
+    pthread_rwlock_rdlock(&c->lock);
+    for (struct cache_entry *e = c->head; e != NULL; e = e->next) {
+        if (fn(arg, e)) {
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&c->lock);
+}
+
+int cache_share(struct cache *c, const char *path) {
+    struct shm_cache *s = shm_cache_open(path, c->max_bytes);
+    if (s == NULL) {
+        return -1;
+    }
+    pthread_rwlock_wrlock(&c->lock);
+    c->shared = s;
+    __atomic_store_n(&c->max_bytes, shm_cache_capacity(s), __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&c->lock);
+    return 0;
+}
+
+void cache_destroy(struct cache *c) {
+    if (c->shared != NULL) {
+        shm_cache_close(c->shared);
+        c->shared = NULL;
+    }
+    pthread_rwlock_wrlock(&c->lock);
+    while (c->head != NULL) {
+        struct cache_entry *e = c->head;
+        list_unlink(c, e);
+        cache_release(e);
+    }
+    for (size_t b = 0; b < CACHE_HOST_BUCKETS; b++) {
+        while (c->hosts[b] != NULL) {
+            struct cache_host *h = c->hosts[b];
+            c->hosts[b] = h->next;
+            host_free(h);
+        }
+    }
+    free(c->hosts);
+    c->hosts = NULL;
+    free(c->buckets);
+    c->buckets = NULL;
+    c->nbuckets = 0;
+    c->count = 0;
+    c->bytes = 0;
+    pthread_rwlock_unlock(&c->lock);
+    pthread_rwlock_destroy(&c->lock);
+}
+
+int cache_policy_parse(const char *name) {
+    for (int p = 0; p < CACHE_POLICY_COUNT; p++) {
+        if (strcasecmp(name, cache_policy_names[p]) == 0) {
+            return p;
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,234 @@
+/*
+ * cache.h -- in-memory response cache.
+ *
+ * Entries are found through a hash index and kept on one list that the
+ * eviction policy works on. A lookup returns the entry with a reference
+ * held, so it stays valid while the caller sends it even if another thread
+ * evicts or replaces it meanwhile; the memory goes when the last reference
+ * is dropped.
+ *
+ * A second index groups the entries by origin (scheme and authority) and
+ * keeps each origin's paths in a radix trie, so everything under a host or
+ * a URL prefix can be purged without looking at the rest of the cache.
+ */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+enum cache_policy {
+    CACHE_LRU,                // Evict the least recently used entry
+    CACHE_FIFO,               // Evict the oldest entry
+    CACHE_CLOCK,              // Second chance: evict the oldest entry not used since the hand last passed
+    CACHE_POLICY_COUNT
+};
+
+#define CACHE_HOST_BUCKETS 256
+
+struct cache_host;            // Origin and its path trie, private to cache.c
+struct shm_cache;             // Shared memory region, see shmcache.h
+
+// File mapping that entries loaded from a snapshot point into; unmapped
+// when the last of them is freed
+struct cache_map {
+    void *base;
+    size_t len;
+    unsigned refs;            // One per entry
+};
+
+struct cache_entry {
+    char *key;                // NUL terminated
+    char *data;               // len bytes plus a NUL
+    size_t len;
+    uint64_t hash;
+    time_t stored;            // When the response was stored (wall clock)
+    struct cache_map *map;    // Mapping data lives in, NULL if in this block
+    unsigned refs;            // One for the cache while indexed, one per reader
+    unsigned char referenced; // CLOCK bit
+    unsigned long hits;       // Lookups that found the entry
+    struct cache_entry *hnext;                // Next in the hash bucket
+    struct cache_entry *prev, *next;          // Policy list, newest first
+};
+
+struct cache {
+    pthread_rwlock_t lock;
+    enum cache_policy policy;
+    struct cache_entry **buckets;
+    size_t nbuckets;          // Power of two
+    size_t count;             // Entries indexed
+    struct cache_entry *head; // Newest (or most recently used, for LRU)
+    struct cache_entry *tail;
+    struct cache_entry *hand; // CLOCK hand, moves from tail to head
+    size_t bytes;             // Sum of the lengths of indexed entries
+    size_t max_bytes;
+    size_t max_entry;         // Largest entry accepted
+    unsigned long long evictions;
+    struct cache_host **hosts;                // CACHE_HOST_BUCKETS chains
+    struct shm_cache *shared; // Region used instead of the local index, or NULL
+};
+
+/**
+ * Set up an empty cache.
+ *
+ * @param c Cache
+ * @param max_bytes Capacity, counted in response bytes
+ * @param max_entry Largest response that is stored
+ * @param policy Eviction policy
+ * @return 0 on success, -1 if memory ran out
+ */
+int cache_init(struct cache *c, size_t max_bytes, size_t max_entry, enum cache_policy policy);
+
+/**
+ * Keep the entries in a shared memory region instead, so several proxy
+ * processes share one cache. Lookups return private copies, eviction is
+ * FIFO whatever the policy, the capacity is the region's, and entries are
+ * neither collected for snapshots nor inserted from them. Call before the
+ * cache is used.
+ *
+ * @param c Cache, empty
+ * @param path File of the region, normally under /dev/shm; created with
+ *        the cache's capacity if it does not exist
+ * @return 0 on success, -1 if the region cannot be used
+ */
+int cache_share(struct cache *c, const char *path);
+
+/**
+ * Drop every entry and free the index. Entries still referenced are freed
+ * when released.
+ *
+ * @param c Cache
+ */
+void cache_destroy(struct cache *c);
+
+/**
+ * Look a key up. A hit counts as a use for the policy.
+ *
+ * @param c Cache
+ * @param key Key
+ * @return The entry with a reference held, to be given back with
+ *         cache_release(), or NULL on a miss
+ */
+struct cache_entry *cache_get(struct cache *c, const char *key);
+
+/**
+ * Drop a reference taken by cache_get().
+ *
+ * @param e Entry
+ */
+void cache_release(struct cache_entry *e);
+
+/**
+ * Store a copy of a response, replacing any entry for the key and evicting
+ * entries as needed to stay within the capacity.
+ *
+ * @param c Cache
+ * @param key Key
+ * @param data Response
+ * @param len Length of data
+ * @return Number of entries evicted, or -1 if the response was not stored
+ *         (too large, or memory ran out)
+ */
+int cache_put(struct cache *c, const char *key, const char *data, size_t len);
+
+/**
+ * Index an entry built by the caller as the oldest one, for loading a
+ * snapshot newest first. The entry is one malloc block with its key; data
+ * may point into e->map.
+ *
+ * @param c Cache
+ * @param e Entry with key, data, len, stored, hits and map set; the cache
+ *        owns it on success
+ * @return 0 on success, -1 if the key is cached already or the entry does
+ *         not fit in the space left
+ */
+int cache_insert_oldest(struct cache *c, struct cache_entry *e);
+
+/**
+ * Change the capacity and the largest entry accepted, evicting as needed
+ * to fit the new capacity. Entries over the new entry limit stay.
+ *
+ * @param c Cache
+ * @param max_bytes Capacity, counted in response bytes
+ * @param max_entry Largest response that is stored
+ * @return Number of entries evicted
+ */
+int cache_resize(struct cache *c, size_t max_bytes, size_t max_entry);
+
+/**
+ * Switch the eviction policy. Entries keep their place in the list.
+ *
+ * @param c Cache
+ * @param policy Eviction policy
+ */
+void cache_set_policy(struct cache *c, enum cache_policy policy);
+
+/**
+ * Take a reference to every indexed entry, newest first, so they can be
+ * read without the lock held.
+ *
+ * @param c Cache
+ * @param out Set to a malloc()ed array, to be freed by the caller after
+ *        releasing every entry in it
+ * @return Number of entries, or -1 if memory ran out
+ */
+long cache_collect(struct cache *c, struct cache_entry ***out);
+
+/**
+ * Drop the entry for a key, if there is one.
+ *
+ * @param c Cache
+ * @param key Key
+ * @return 0 if an entry was removed, -1 otherwise
+ */
+int cache_remove(struct cache *c, const char *key);
+
+/**
+ * Drop every entry of one origin.
+ *
+ * @param c Cache
+ * @param host Host as it appears in the keys, with the port if the URL
+ *        had one ("example.com", "example.com:8080"); case is ignored
+ * @return Number of entries removed
+ */
+int cache_purge_host(struct cache *c, const char *host);
+
+/**
+ * Drop every entry whose key starts with a prefix.
+ *
+ * @param c Cache
+ * @param prefix Absolute URL prefix, scheme and host complete
+ *        ("http://example.com/static/")
+ * @return Number of entries removed
+ */
+int cache_purge_prefix(struct cache *c, const char *prefix);
+
+/**
+ * @param c Cache
+ * @return Bytes held by indexed entries
+ */
+size_t cache_bytes(struct cache *c);
+
+/**
+ * Call fn for every indexed entry, newest (or most recently used) first,
+ * under the read lock; a shared region is walked shard by shard instead. fn must not call back into the cache and should be
+ * quick, since writers wait meanwhile; it returns nonzero to stop the walk.
+ *
+ * @param c Cache
+ * @param fn Callback
+ * @param arg Passed to fn
+ */
+void cache_walk(struct cache *c, int (*fn)(void *arg, const struct cache_entry *e), void *arg);
+
+/**
+ * @param name "lru", "fifo" or "clock"
+ * @return The policy, or -1 if the name is not known
+ */
+int cache_policy_parse(const char *name);
+
+extern const char *const cache_policy_names[CACHE_POLICY_COUNT];
+
+#endif
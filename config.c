@@ -0,0 +1,226 @@
+/*
+ * config.c -- runtime configuration.
+ */
+
+#include "config.h"
+
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "log.h"
+
+// Parse a whole number with an optional k/m/g suffix; -1 on junk
+static long long parse_size(const char *s) {
+    char *end;
+    errno = 0;
+    long long v = strtoll(s, &end, 10);
+    if (end == s || errno != 0 || v < 0) {
+        return -1;
+    }
+    switch (*end) {
+        case 'k': case 'K': v <<= 10; end++; break;
+        case 'm': case 'M': v <<= 20; end++; break;
+        case 'g': case 'G': v <<= 30; end++; break;
+    }
+    return *end == '\0' ? v : -1;
+}
+
+static char *trim(char *s) {
+    while (isspace((unsigned char)*s)) {
+        s++;
+    }
+    char *end = s + strlen(s);
+    while (end > s && isspace((unsigned char)end[-1])) {
+        *--end = '\0';
+    }
+    return s;
+}
+
+// Set a numeric field if v lies in [lo, hi]
+#define SET_IN_RANGE(field, v, lo, hi) \
+    ((v) >= (lo) && (v) <= (hi) ? ((field) = (v), 0) : -1)
+
+static int set_option(struct config *cfg, const char *key, const char *value) {
+    long long v = parse_size(value);
+
+    if (strcmp(key, "listen") == 0) {
+        struct in_addr addr;
+        if (inet_pton(AF_INET, value, &addr) != 1 || strlen(value) >= sizeof(cfg->listen)) {
+            return -1;
+        }
+        strcpy(cfg->listen, value);
+        return 0;
+    }
+    if (strcmp(key, "port") == 0) return SET_IN_RANGE(cfg->port, v, 1, 65535);
+    if (strcmp(key, "workers") == 0) return SET_IN_RANGE(cfg->workers, v, 1, 10000);
+    if (strcmp(key, "queue_size") == 0) return SET_IN_RANGE(cfg->queue_size, v, 0, 1000000);
+    if (strcmp(key, "queue_timeout_ms") == 0) return SET_IN_RANGE(cfg->queue_timeout_ms, v, 0, 3600000);
+    if (strcmp(key, "shed_serve_hits") == 0) return SET_IN_RANGE(cfg->shed_serve_hits, v, 0, 1);
+    if (strcmp(key, "cache_size") == 0) return SET_IN_RANGE(cfg->cache_size, v, 0, 1LL << 40);
+    if (strcmp(key, "cache_max_entry") == 0) return SET_IN_RANGE(cfg->cache_max_entry, v, 0, 1LL << 32);
+    if (strcmp(key, "cache_ttl") == 0) return SET_IN_RANGE(cfg->cache_ttl, v, 0, 1LL << 30);
+    if (strcmp(key, "stale_while_revalidate") == 0) return SET_IN_RANGE(cfg->stale_while_revalidate, v, 0, 1LL << 30);
+    if (strcmp(key, "stale_if_error") == 0) return SET_IN_RANGE(cfg->stale_if_error, v, 0, 1LL << 30);
+    if (strcmp(key, "negative_cache_size") == 0) return SET_IN_RANGE(cfg->negative_cache_size, v, 0, 1LL << 40);
+    if (strcmp(key, "negative_status_ttl") == 0) return SET_IN_RANGE(cfg->negative_status_ttl, v, 0, 86400);
+    if (strcmp(key, "negative_dns_ttl") == 0) return SET_IN_RANGE(cfg->negative_dns_ttl, v, 0, 86400);
+    if (strcmp(key, "negative_refused_ttl") == 0) return SET_IN_RANGE(cfg->negative_refused_ttl, v, 0, 86400);
+    if (strcmp(key, "refresh_rate") == 0) return SET_IN_RANGE(cfg->refresh_rate, v, 0, 1000000);
+    if (strcmp(key, "buffer_size") == 0) return SET_IN_RANGE(cfg->buffer_size, v, 512, 1 << 20);
+    if (strcmp(key, "max_header") == 0) return SET_IN_RANGE(cfg->max_header, v, 1024, 16 << 20);
+    if (strcmp(key, "tunnel_timeout") == 0) return SET_IN_RANGE(cfg->tunnel_timeout, v, 1, 86400);
+    if (strcmp(key, "drain_timeout") == 0) return SET_IN_RANGE(cfg->drain_timeout, v, 0, 3600);
+    if (strcmp(key, "connect_timeout") == 0) return SET_IN_RANGE(cfg->connect_timeout, v, 1, 3600);
+    if (strcmp(key, "origin_timeout") == 0) return SET_IN_RANGE(cfg->origin_timeout, v, 1, 86400);
+    if (strcmp(key, "origin_max_conns") == 0) return SET_IN_RANGE(cfg->origin_max_conns, v, 0, 1000000);
+    if (strcmp(key, "origin_wait_ms") == 0) return SET_IN_RANGE(cfg->origin_wait_ms, v, 0, 3600000);
+    if (strcmp(key, "breaker_failures") == 0) return SET_IN_RANGE(cfg->breaker_failures, v, 0, 1000000);
+    if (strcmp(key, "breaker_cooldown") == 0) return SET_IN_RANGE(cfg->breaker_cooldown, v, 1, 86400);
+    if (strcmp(key, "client_max_conns") == 0) return SET_IN_RANGE(cfg->client_max_conns, v, 0, 1000000);
+    if (strcmp(key, "client_rate") == 0) return SET_IN_RANGE(cfg->client_rate, v, 0, 1000000);
+    if (strcmp(key, "client_burst") == 0) return SET_IN_RANGE(cfg->client_burst, v, 0, 1000000);
+    if (strcmp(key, "client_byte_rate") == 0) return SET_IN_RANGE(cfg->client_byte_rate, v, 0, 1LL << 40);
+    if (strcmp(key, "parent_check_interval") == 0) return SET_IN_RANGE(cfg->parent_check_interval, v, 1, 3600);
+    if (strcmp(key, "parent_direct") == 0) return SET_IN_RANGE(cfg->parent_direct, v, 0, 1);
+    if (strcmp(key, "snapshot_interval") == 0) return SET_IN_RANGE(cfg->snapshot_interval, v, 0, 86400);
+    if (strcmp(key, "cache_policy") == 0) {
+        int p = cache_policy_parse(value);
+        return p < 0 ? -1 : (cfg->cache_policy = p, 0);
+    }
+    if (strcmp(key, "log_level") == 0) {
+        int lv = log_level_parse(value);
+        return lv < 0 ? -1 : (cfg->log_level = lv, 0);
+    }
+    if (strcmp(key, "shared_cache") == 0) {
+        if (strlen(value) >= sizeof(cfg->shared_cache)) {
+            return -1;
+        }
+        strcpy(cfg->shared_cache, value);
+        return 0;
+    }
+    if (strcmp(key, "snapshot_dir") == 0) {
+        if (strlen(value) >= sizeof(cfg->snapshot_dir)) {
+            return -1;
+        }
+        strcpy(cfg->snapshot_dir, value);
+        return 0;
+    }
+    if (strcmp(key, "self_host") == 0) {
+        // May be given more than once, the names add up
+        size_t len = strlen(cfg->self_hosts);
+        if (len + strlen(value) + 2 > sizeof(cfg->self_hosts)) {
+            return -1;
+        }
+        snprintf(cfg->self_hosts + len, sizeof(cfg->self_hosts) - len, "%s%s", len ? "," : "", value);
+        return 0;
+    }
+    if (strcmp(key, "parent") == 0) {
+        // Like self_host, repeated entries add up
+        size_t len = strlen(cfg->parents);
+        if (len + strlen(value) + 2 > sizeof(cfg->parents)) {
+            return -1;
+        }
+        snprintf(cfg->parents + len, sizeof(cfg->parents) - len, "%s%s", len ? "," : "", value);
+        return 0;
+    }
+    if (strcmp(key, "purge_allow") == 0) {
+        size_t len = strlen(cfg->purge_allow);
+        if (len + strlen(value) + 2 > sizeof(cfg->purge_allow)) {
+            return -1;
+        }
+        snprintf(cfg->purge_allow + len, sizeof(cfg->purge_allow) - len, "%s%s", len ? "," : "", value);
+        return 0;
+    }
+    return -2;
+}
+
+void config_defaults(struct config *cfg) {
+    const char *env;
+
+    memset(cfg, 0, sizeof(*cfg));
+    strcpy(cfg->listen, "0.0.0.0");
+    cfg->port = DEFAULT_PORT;
+    cfg->workers = DEFAULT_WORKERS;
+    cfg->cache_size = DEFAULT_CACHE_SIZE;
+    cfg->cache_max_entry = DEFAULT_MAX_ENTRY;
+    cfg->cache_policy = CACHE_LRU;
+    cfg->buffer_size = DEFAULT_BUFFER_SIZE;
+    cfg->max_header = DEFAULT_MAX_HEADER;
+    cfg->tunnel_timeout = DEFAULT_TUNNEL_TIMEOUT;
+    cfg->drain_timeout = DEFAULT_DRAIN_TIMEOUT;
+    cfg->connect_timeout = DEFAULT_CONNECT_TIMEOUT;
+    cfg->origin_timeout = DEFAULT_ORIGIN_TIMEOUT;
+    cfg->origin_wait_ms = DEFAULT_ORIGIN_WAIT_MS;
+    cfg->breaker_failures = DEFAULT_BREAKER_FAILURES;
+    cfg->breaker_cooldown = DEFAULT_BREAKER_COOLDOWN;
+    cfg->shed_serve_hits = 1;
+    cfg->refresh_rate = DEFAULT_REFRESH_RATE;
+    cfg->negative_cache_size = DEFAULT_NEGATIVE_SIZE;
+    cfg->negative_status_ttl = DEFAULT_NEGATIVE_STATUS_TTL;
+    cfg->negative_dns_ttl = DEFAULT_NEGATIVE_DNS_TTL;
+    cfg->negative_refused_ttl = DEFAULT_NEGATIVE_REFUSED_TTL;
+    cfg->log_level = LV_INFO;
+    cfg->snapshot_interval = DEFAULT_SNAPSHOT_INTERVAL;
+    cfg->parent_check_interval = DEFAULT_PARENT_CHECK;
+    cfg->parent_direct = 1;
+
+    if ((env = getenv("PROXY_LOG_LEVEL")) != NULL && set_option(cfg, "log_level", env) < 0) {
+        log_warn("Unknown log level %s, using info", env);
+    }
+    if ((env = getenv("PROXY_CACHE_POLICY")) != NULL && set_option(cfg, "cache_policy", env) < 0) {
+        log_warn("Unknown cache policy %s, using lru", env);
+    }
+    if ((env = getenv("PROXY_SNAPSHOT_DIR")) != NULL && set_option(cfg, "snapshot_dir", env) < 0) {
+        log_warn("Snapshot directory name too long: %s", env);
+    }
+    if ((env = getenv("PROXY_SNAPSHOT_INTERVAL")) != NULL && set_option(cfg, "snapshot_interval", env) < 0) {
+        log_warn("Bad snapshot interval %s, using %d", env, DEFAULT_SNAPSHOT_INTERVAL);
+    }
+}
+
+int config_load(struct config *cfg, const char *path) {
+    FILE *f = fopen(path, "r");
+    char line[1024];
+    int lineno = 0, err = 0;
+
+    if (f == NULL) {
+        log_error("Cannot read config file %s: %s", path, strerror(errno));
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f) != NULL) {
+        lineno++;
+        char *hash = strchr(line, '#');
+        if (hash != NULL) {
+            *hash = '\0';
+        }
+        char *key = trim(line);
+        if (*key == '\0') {
+            continue;
+        }
+        char *eq = strchr(key, '=');
+        if (eq == NULL) {
+            log_error("%s:%d: expected key = value", path, lineno);
+            err = -1;
+            continue;
+        }
+        *eq = '\0';
+        char *value = trim(eq + 1);
+        key = trim(key);
+
+        int r = set_option(cfg, key, value);
+        if (r == -2) {
+            log_error("%s:%d: unknown setting %s", path, lineno, key);
+            err = -1;
+        } else if (r < 0) {
+            log_error("%s:%d: bad value for %s: %s", path, lineno, key, value);
+            err = -1;
+        }
+    }
+    fclose(f);
+    return err;
+}
@@ -0,0 +1,145 @@
+/*
+ * config.h -- runtime configuration.
+ *
+ * Settings come from the compiled-in defaults below, then the PROXY_*
+ * environment variables, then the config file given with -c. The file has
+ * one "key = value" per line; '#' starts a comment. Sizes take a k, m or g
+ * suffix, timeouts are in seconds:
+ *
+ *   listen = 0.0.0.0
+ *   port = 8080
+ *   workers = 400
+ *   queue_size = 400
+ *   queue_timeout_ms = 500
+ *   shed_serve_hits = 1
+ *   cache_size = 200m
+ *   cache_max_entry = 10m
+ *   cache_policy = lru
+ *   cache_ttl = 0
+ *   stale_while_revalidate = 30
+ *   stale_if_error = 300
+ *   refresh_rate = 10
+ *   negative_cache_size = 1m
+ *   negative_status_ttl = 10
+ *   negative_dns_ttl = 10
+ *   negative_refused_ttl = 2
+ *   shared_cache = /dev/shm/proxy-cache
+ *   buffer_size = 4k
+ *   max_header = 64k
+ *   tunnel_timeout = 30
+ *   drain_timeout = 30
+ *   connect_timeout = 10
+ *   origin_timeout = 60
+ *   origin_max_conns = 50
+ *   origin_wait_ms = 1000
+ *   breaker_failures = 5
+ *   breaker_cooldown = 10
+ *   client_max_conns = 20
+ *   client_rate = 50
+ *   client_burst = 100
+ *   client_byte_rate = 10m
+ *   log_level = info
+ *   snapshot_dir = /var/cache/proxy
+ *   snapshot_interval = 300
+ *   self_host = proxy.example.com, proxy
+ *   parent = regional1:8080, regional2:8080
+ *   parent_check_interval = 5
+ *   parent_direct = 1
+ *   purge_allow = 10.0.0.5, 192.168.1.0/24
+ *
+ * On SIGHUP the file is read again. Cache size, entry limit and policy,
+ * freshness defaults, negative caching, buffer and header sizes, the timeouts, load shedding, the client and
+ * origin limits, the parent checks and the log level change at once; the
+ * listener, the worker count and queue size, the shared cache, snapshot
+ * settings, self hosts, parents and the purge allow-list need a restart.
+ */
+
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <limits.h>
+#include <stddef.h>
+
+#define DEFAULT_PORT 8080
+#define DEFAULT_WORKERS 400              // One client connection per worker at a time
+#define DEFAULT_CACHE_SIZE (200 << 20)   // 200MB of responses
+#define DEFAULT_MAX_ENTRY (10 << 20)     // Largest response cached, 10MB
+#define DEFAULT_BUFFER_SIZE 4096         // Receive buffers for origin responses and tunnels
+#define DEFAULT_MAX_HEADER (64 * 1024)   // Largest request head accepted
+#define DEFAULT_TUNNEL_TIMEOUT 30        // Seconds a CONNECT tunnel may sit idle
+#define DEFAULT_DRAIN_TIMEOUT 30         // Seconds in-flight requests get at shutdown
+#define DEFAULT_CONNECT_TIMEOUT 10       // Seconds a connect to an origin may take
+#define DEFAULT_ORIGIN_TIMEOUT 60        // Seconds an origin may take to start answering
+#define DEFAULT_ORIGIN_WAIT_MS 1000      // Wait for a place at an origin at its cap
+#define DEFAULT_BREAKER_FAILURES 5       // Failed requests in a row that open a breaker
+#define DEFAULT_BREAKER_COOLDOWN 10      // Seconds before an open breaker lets a probe through
+#define DEFAULT_NEGATIVE_SIZE (1 << 20) // Budget of the negative cache, 1MB
+#define DEFAULT_NEGATIVE_STATUS_TTL 10  // Seconds a 301, 404 or 410 is kept without a lifetime of its own
+#define DEFAULT_NEGATIVE_DNS_TTL 10     // Seconds a name that did not resolve is not looked up
+#define DEFAULT_NEGATIVE_REFUSED_TTL 2  // Seconds an origin that refused is not tried
+#define DEFAULT_REFRESH_RATE 10         // Background refreshes per origin per second
+#define DEFAULT_PARENT_CHECK 5          // Seconds between checks of the parent proxies
+#define DEFAULT_SNAPSHOT_INTERVAL 300    // Seconds between cache snapshots
+
+struct config {
+    char listen[64];          // IPv4 address to listen on
+    int port;
+    int workers;
+    int queue_size;           // Connections waiting for a worker, 0 for one per worker
+    int queue_timeout_ms;     // Longest wait for a worker before shedding, 0 for no limit
+    int shed_serve_hits;      // Serve cache hits to shed connections
+    size_t cache_size;
+    size_t cache_max_entry;
+    int cache_policy;         // enum cache_policy
+    int cache_ttl;            // Lifetime of responses that give none, 0 for no expiry
+    int stale_while_revalidate;       // Defaults for responses that do not say
+    int stale_if_error;
+    int refresh_rate;         // Background refreshes per origin per second, 0 for no limit
+    size_t negative_cache_size;       // Bytes of 301, 404 and 410 responses kept
+    int negative_status_ttl;  // 0 turns each kind of negative caching off
+    int negative_dns_ttl;
+    int negative_refused_ttl;
+    char shared_cache[PATH_MAX];      // Shared memory file of the cache, empty for a private one
+    size_t buffer_size;
+    size_t max_header;
+    int tunnel_timeout;
+    int drain_timeout;
+    int connect_timeout;
+    int origin_timeout;
+    int origin_max_conns;     // Requests in flight per origin, 0 for no cap
+    int origin_wait_ms;       // Wait for a place at an origin at its cap
+    int breaker_failures;     // Failed requests in a row that open a breaker, 0 for none
+    int breaker_cooldown;
+    int client_max_conns;     // Connections per client address, 0 for no cap
+    int client_rate;          // Requests per second per client, 0 for no limit
+    int client_burst;         // Requests a client may make at once, 0 for client_rate
+    long long client_byte_rate;       // Bytes per second per client, 0 for no limit
+    int log_level;            // enum log_level
+    char snapshot_dir[PATH_MAX];      // Empty if snapshots are off
+    int snapshot_interval;
+    char self_hosts[512];     // Extra names for the proxy itself, comma separated
+    char parents[1024];       // Parent proxies as host:port, comma separated
+    int parent_check_interval;
+    int parent_direct;        // Go to the origin when no parent is up
+    char purge_allow[512];    // Addresses besides loopback that may purge, comma separated
+};
+
+/**
+ * Fill in the compiled-in defaults, overridden by the PROXY_LOG_LEVEL,
+ * PROXY_CACHE_POLICY, PROXY_SNAPSHOT_DIR and PROXY_SNAPSHOT_INTERVAL
+ * environment variables.
+ *
+ * @param cfg Configuration
+ */
+void config_defaults(struct config *cfg);
+
+/**
+ * Read a config file over cfg. Errors are logged with their line number.
+ *
+ * @param cfg Configuration, partly updated on failure
+ * @param path File
+ * @return 0 on success, -1 if the file is unreadable or has a bad line
+ */
+int config_load(struct config *cfg, const char *path);
+
+#endif
@@ -0,0 +1,367 @@
+/*
+ * http_scan.c -- vectorised byte scanning for the request parser.
+ *
+ * Each kernel has a scalar version and, on x86, SSE4.2 and AVX2 versions
+ * compiled with function level target attributes, so the rest of the build
+ * needs no special flags. The vector loops only read whole blocks inside
+ * the buffer; the remaining tail is finished by the scalar code.
+ */
+
+#include "http_scan.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HTTP_SCAN_X86 1
+#endif
+
+typedef size_t (*scan_fn)(const char *p, size_t len);
+
+/*
+ * Header name characters (RFC 9110 tchar), as a byte table for the scalar
+ * kernel and as two nibble tables for the vector ones: byte c is a tchar
+ * when name_lo[c & 15] & name_hi[c >> 4] is nonzero. Filled in before
+ * main(), by http_scan_init().
+ */
+static uint8_t name_table[256];
+static uint8_t name_lo[16] __attribute__((aligned(16)));
+static uint8_t name_hi[16] __attribute__((aligned(16)));
+
+static void name_tables_init(void) {
+    for (int c = 0x21; c < 0x7f; c++) {
+        if (strchr("\"(),/:;<=>?@[\\]{}", c) == NULL) {
+            name_table[c] = 1;
+            name_lo[c & 15] |= 1u << (c >> 4);
+        }
+    }
+    for (int h = 0; h < 8; h++) {
+        name_hi[h] = 1u << h;
+    }
+}
+
+/*
+ * Scalar kernels
+ */
+
+static size_t value_scalar(const char *p, size_t len) {
+    size_t i;
+    for (i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)p[i];
+        if (c == '\r' || c == '\n' || c == '\0') {
+            break;
+        }
+    }
+    return i;
+}
+
+static size_t target_scalar(const char *p, size_t len) {
+    size_t i;
+    for (i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)p[i];
+        if (c <= ' ' || c == 0x7f) {
+            break;
+        }
+    }
+    return i;
+}
+
+static size_t name_scalar(const char *p, size_t len) {
+    size_t i;
+    for (i = 0; i < len; i++) {
+        if (!name_table[(unsigned char)p[i]]) {
+            break;
+        }
+    }
+    return i;
+}
+
+// A single byte search is what libc's memchr is already vectorised for
+static size_t head_end_scalar(const char *p, size_t len) {
+    size_t i = 0;
+
+    while (i + 4 <= len) {
+        const char *cr = memchr(p + i, '\r', len - i);
+        if (cr == NULL) {
+            break;
+        }
+        i = cr - p;
+        if (i + 4 > len) {
+            break;
+        }
+        if (p[i + 1] == '\n' && p[i + 2] == '\r' && p[i + 3] == '\n') {
+            return i + 4;
+        }
+        i++;
+    }
+    return 0;
+}
+
+// Finish a vector search for the end of the head from offset i
+static size_t head_end_tail(const char *p, size_t len, size_t i) {
+    size_t end = head_end_scalar(p + i, len - i);
+    return end ? i + end : 0;
+}
+
+#ifdef HTTP_SCAN_X86
+
+/*
+ * SSE4.2 kernels: PCMPESTRI matches every byte of a 16 byte block against
+ * a small set of characters or ranges in one instruction.
+ */
+
+#define SSE42_ANY (_SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT)
+#define SSE42_RANGES (_SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT)
+
+__attribute__((target("sse4.2")))
+static size_t value_sse42(const char *p, size_t len) {
+    const __m128i set = _mm_setr_epi8('\r', '\n', '\0', 0, 0, 0, 0, 0,
+                                      0, 0, 0, 0, 0, 0, 0, 0);
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(p + i));
+        int idx = _mm_cmpestri(set, 3, block, 16, SSE42_ANY);
+        if (idx < 16) {
+            return i + idx;
+        }
+    }
+    return i + value_scalar(p + i, len - i);
+}
+
+__attribute__((target("sse4.2")))
+static size_t target_sse42(const char *p, size_t len) {
+    // Ranges [0x00, 0x20] and [0x7f, 0x7f]
+    const __m128i ranges = _mm_setr_epi8(0x00, 0x20, 0x7f, 0x7f, 0, 0, 0, 0,
+                                         0, 0, 0, 0, 0, 0, 0, 0);
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(p + i));
+        int idx = _mm_cmpestri(ranges, 4, block, 16, SSE42_RANGES);
+        if (idx < 16) {
+            return i + idx;
+        }
+    }
+    return i + target_scalar(p + i, len - i);
+}
+
+// PSHUFB looks both nibbles of every byte up in the tchar tables
+__attribute__((target("sse4.2")))
+static size_t name_sse42(const char *p, size_t len) {
+    const __m128i lo = _mm_load_si128((const __m128i *)name_lo);
+    const __m128i hi = _mm_load_si128((const __m128i *)name_hi);
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i bits = _mm_and_si128(
+            _mm_shuffle_epi8(lo, _mm_and_si128(block, nibble)),
+            _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi16(block, 4), nibble)));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(bits, _mm_setzero_si128()));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + name_scalar(p + i, len - i);
+}
+
+// Most blocks hold no '\r' at all (long cookie or user agent values), so
+// only '\r' is searched for, and the bytes after each one are checked
+static size_t head_end_at(const char *p, size_t len, size_t i, uint64_t mask) {
+    for (; mask; mask &= mask - 1) {
+        size_t j = i + __builtin_ctzll(mask);
+        if (j + 4 <= len && p[j + 1] == '\n' && p[j + 2] == '\r' && p[j + 3] == '\n') {
+            return j + 4;
+        }
+    }
+    return 0;
+}
+
+__attribute__((target("sse4.2")))
+static size_t head_end_sse42(const char *p, size_t len) {
+    const __m128i cr = _mm_set1_epi8('\r');
+    size_t i = 0, end;
+
+    for (; i + 64 <= len; i += 64) {
+        __m128i a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i)), cr);
+        __m128i b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i + 16)), cr);
+        __m128i c = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i + 32)), cr);
+        __m128i d = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i + 48)), cr);
+        if (!_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d)))) {
+            continue;
+        }
+        uint64_t mask = (uint64_t)_mm_movemask_epi8(a) | (uint64_t)_mm_movemask_epi8(b) << 16 |
+                        (uint64_t)_mm_movemask_epi8(c) << 32 | (uint64_t)_mm_movemask_epi8(d) << 48;
+        if ((end = head_end_at(p, len, i, mask)) != 0) {
+            return end;
+        }
+    }
+    return head_end_tail(p, len, i);
+}
+
+/*
+ * AVX2 kernels: byte compares on 32 byte blocks folded into a bit mask.
+ */
+
+__attribute__((target("avx2")))
+static size_t value_avx2(const char *p, size_t len) {
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    const __m256i nul = _mm256_setzero_si256();
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(p + i));
+        __m256i hit = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(block, cr), _mm256_cmpeq_epi8(block, lf)),
+            _mm256_cmpeq_epi8(block, nul));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(hit);
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + value_scalar(p + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t target_avx2(const char *p, size_t len) {
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i del = _mm256_set1_epi8(0x7f);
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(p + i));
+        // Unsigned c <= ' ' is min(c, ' ') == c
+        __m256i ctl = _mm256_cmpeq_epi8(_mm256_min_epu8(block, space), block);
+        __m256i hit = _mm256_or_si256(ctl, _mm256_cmpeq_epi8(block, del));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(hit);
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + target_scalar(p + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t name_avx2(const char *p, size_t len) {
+    // VPSHUFB looks up within each 128 bit lane, so both lanes get a table
+    const __m256i lo = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)name_lo));
+    const __m256i hi = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)name_hi));
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(p + i));
+        __m256i bits = _mm256_and_si256(
+            _mm256_shuffle_epi8(lo, _mm256_and_si256(block, nibble)),
+            _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi16(block, 4), nibble)));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(bits, _mm256_setzero_si256()));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + name_scalar(p + i, len - i);
+}
+
+// As head_end_sse42(), in two 32 byte blocks
+__attribute__((target("avx2")))
+static size_t head_end_avx2(const char *p, size_t len) {
+    const __m256i cr = _mm256_set1_epi8('\r');
+    size_t i = 0, end;
+
+    for (; i + 64 <= len; i += 64) {
+        __m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i)), cr);
+        __m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i + 32)), cr);
+        if (_mm256_testz_si256(_mm256_or_si256(a, b), _mm256_or_si256(a, b))) {
+            continue;
+        }
+        uint64_t mask = (uint32_t)_mm256_movemask_epi8(a) |
+                        (uint64_t)(uint32_t)_mm256_movemask_epi8(b) << 32;
+        if ((end = head_end_at(p, len, i, mask)) != 0) {
+            return end;
+        }
+    }
+    return head_end_tail(p, len, i);
+}
+
+#endif
+
+/*
+ * Dispatch
+ */
+
+static scan_fn value_impl = value_scalar;
+static scan_fn target_impl = target_scalar;
+static scan_fn name_impl = name_scalar;
+static scan_fn head_end_impl = head_end_scalar;
+static int scan_level = HTTP_SCAN_SCALAR;
+
+static int best_level(void) {
+#ifdef HTTP_SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return HTTP_SCAN_AVX2;
+    }
+    if (__builtin_cpu_supports("sse4.2")) {
+        return HTTP_SCAN_SSE42;
+    }
+#endif
+    return HTTP_SCAN_SCALAR;
+}
+
+int http_scan_select(int level) {
+    int best = best_level();
+    if (level > best) {
+        level = best;
+    }
+
+    value_impl = value_scalar;
+    target_impl = target_scalar;
+    name_impl = name_scalar;
+    head_end_impl = head_end_scalar;
+#ifdef HTTP_SCAN_X86
+    if (level == HTTP_SCAN_SSE42) {
+        value_impl = value_sse42;
+        target_impl = target_sse42;
+        name_impl = name_sse42;
+        head_end_impl = head_end_sse42;
+    } else if (level == HTTP_SCAN_AVX2) {
+        value_impl = value_avx2;
+        target_impl = target_avx2;
+        name_impl = name_avx2;
+        head_end_impl = head_end_avx2;
+    }
+#endif
+    scan_level = level;
+    return level;
+}
+
+int http_scan_level(void) {
+    return scan_level;
+}
+
+// Runs before main(), so the pointers never change while threads use them
+__attribute__((constructor))
+static void http_scan_init(void) {
+    name_tables_init();
+    http_scan_select(HTTP_SCAN_AVX2);
+}
+
+size_t http_scan_value(const char *p, size_t len) {
+    return value_impl(p, len);
+}
+
+size_t http_scan_target(const char *p, size_t len) {
+    return target_impl(p, len);
+}
+
+size_t http_scan_name(const char *p, size_t len) {
+    return name_impl(p, len);
+}
+
+size_t http_scan_head_end(const char *p, size_t len) {
+    return head_end_impl(p, len);
+}
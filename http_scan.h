@@ -0,0 +1,66 @@
+/*
+ * http_scan.h -- vectorised byte scanning for the request parser.
+ *
+ * The parser spends most of its time walking over long runs of bytes that
+ * need no individual attention: header names and values (cookies, user
+ * agents) and request targets. These helpers find the next interesting
+ * byte in such a run, or the blank line ending the head, 16 or 32 bytes
+ * at a time. The implementation is picked once at
+ * startup from the CPU features (AVX2, then SSE4.2, then plain C).
+ */
+
+#ifndef HTTP_SCAN_H
+#define HTTP_SCAN_H
+
+#include <stddef.h>
+
+// Implementation levels, in order of preference
+#define HTTP_SCAN_SCALAR 0
+#define HTTP_SCAN_SSE42  1
+#define HTTP_SCAN_AVX2   2
+
+/**
+ * Find the end of a header value.
+ *
+ * @return Offset of the first '\r', '\n' or NUL in p, or len if there is none
+ */
+size_t http_scan_value(const char *p, size_t len);
+
+/**
+ * Find the end of a request target.
+ *
+ * @return Offset of the first control character, space or DEL in p, or len
+ */
+size_t http_scan_target(const char *p, size_t len);
+
+/**
+ * Find the end of a header name.
+ *
+ * @return Offset of the first byte in p that is not a token character
+ *         (normally the colon), or len if there is none
+ */
+size_t http_scan_name(const char *p, size_t len);
+
+/**
+ * Find the end of a request head.
+ *
+ * @return Offset just past the first "\r\n\r\n" in p, or 0 if there is none
+ */
+size_t http_scan_head_end(const char *p, size_t len);
+
+/**
+ * Select the implementation. Levels the CPU does not support are lowered
+ * to the best supported one. Used by the benchmark; normal callers rely on
+ * the automatic selection.
+ *
+ * @param level One of the HTTP_SCAN_* levels
+ * @return The level now in use
+ */
+int http_scan_select(int level);
+
+/**
+ * @return The level currently in use
+ */
+int http_scan_level(void);
+
+#endif
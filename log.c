@@ -0,0 +1,274 @@
+/*
+ * log.c -- leveled logging through per-thread rings.
+ *
+ * Each ring has a single producer, the thread that owns it, and a single
+ * consumer, whoever holds drain_lock (the flusher thread, or log_flush()).
+ * The producer only writes head and the consumer only writes tail, so a
+ * line is handed over with one release store each way.
+ */
+
+#include "log.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOG_SLOTS 128              // Lines per ring
+#define LOG_LINE 256               // Bytes per slot, header included
+#define LOG_BATCH (64 * 1024)      // Bytes written per write()
+#define LOG_IDLE_NSEC 10000000     // Flusher sleep when all rings are empty
+
+// Not a level: marks access log lines
+#define LV_ACCESS LV_COUNT
+
+struct log_slot {
+    uint64_t time;                 // Wall clock, microseconds
+    uint16_t len;
+    uint8_t level;
+    char text[LOG_LINE - 11];
+};
+
+struct log_ring {
+    struct log_slot slots[LOG_SLOTS];
+    unsigned head __attribute__((aligned(64)));   // Next slot to fill, owner only
+    unsigned long long dropped;                   // Lines lost to a full ring, owner only
+    unsigned tail __attribute__((aligned(64)));   // Next slot to drain, consumer only
+    unsigned long long reported;                  // Drops already reported, consumer only
+    struct log_ring *next;
+};
+
+// Output buffer of one stream
+struct log_out {
+    int fd;
+    size_t len;
+    char data[LOG_BATCH];
+};
+
+int log_level = LV_INFO;
+
+static const char *level_names[LV_COUNT] = {"error", "warn", "info", "debug"};
+
+static struct log_ring *rings;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct log_ring *ring;
+static __thread int no_ring;               // Allocating the ring failed
+static unsigned long long unringed;        // Lines lost that way
+static unsigned long long unringed_reported;
+
+static struct log_out err_out = {2, 0, {0}};
+static struct log_out access_out = {1, 0, {0}};
+
+static struct log_ring *local_ring(void) {
+    if (ring == NULL && !no_ring) {
+        struct log_ring *r = aligned_alloc(64, sizeof(*r));
+        if (r == NULL) {
+            no_ring = 1;
+            return NULL;
+        }
+        memset(r, 0, sizeof(*r));
+        pthread_mutex_lock(&rings_lock);
+        r->next = rings;
+        rings = r;
+        pthread_mutex_unlock(&rings_lock);
+        ring = r;
+    }
+    return ring;
+}
+
+static uint64_t wall_usec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void queue_line(int level, const char *format, va_list args) {
+    struct log_ring *r = local_ring();
+    if (r == NULL) {
+        __atomic_fetch_add(&unringed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    unsigned head = r->head;
+    if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == LOG_SLOTS) {
+        __atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    struct log_slot *s = &r->slots[head % LOG_SLOTS];
+    s->time = wall_usec();
+
+    // Long lines are cut to the slot and end in "..." to show it
+    int n = vsnprintf(s->text, sizeof(s->text), format, args);
+    if (n < 0) {
+        n = 0;
+    } else if ((size_t)n >= sizeof(s->text)) {
+        n = sizeof(s->text) - 1;
+        memcpy(s->text + n - 3, "...", 3);
+    }
+    while (n > 0 && s->text[n - 1] == '\n') {
+        n--;
+    }
+    s->len = (uint16_t)n;
+    s->level = (uint8_t)level;
+
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void log_vwrite(int level, const char *format, va_list args) {
+    queue_line(level, format, args);
+}
+
+void log_write(int level, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    queue_line(level, format, args);
+    va_end(args);
+}
+
+void log_access(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    queue_line(LV_ACCESS, format, args);
+    va_end(args);
+}
+
+int log_level_parse(const char *name) {
+    for (int lv = 0; lv < LV_COUNT; lv++) {
+        if (strcasecmp(name, level_names[lv]) == 0) {
+            return lv;
+        }
+    }
+    return -1;
+}
+
+static void out_flush(struct log_out *out) {
+    size_t off = 0;
+    while (off < out->len) {
+        ssize_t n = write(out->fd, out->data + off, out->len - off);
+        if (n <= 0) {
+            break;             // Nowhere to log the failure to log
+        }
+        off += n;
+    }
+    out->len = 0;
+}
+
+// Append "<time> <level> <text>\n", flushing first if it does not fit
+static void out_line(struct log_out *out, uint64_t usec, int level, const char *text, size_t len) {
+    static time_t last_sec = -1;
+    static char stamp[32];         // "2026-01-02T03:04:05" of last_sec
+
+    if (out->len + len + 64 > sizeof(out->data)) {
+        out_flush(out);
+    }
+
+    time_t sec = (time_t)(usec / 1000000);
+    if (sec != last_sec) {
+        struct tm tm;
+        gmtime_r(&sec, &tm);
+        strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+        last_sec = sec;
+    }
+
+    int n;
+    if (level == LV_ACCESS) {
+        n = snprintf(out->data + out->len, sizeof(out->data) - out->len, "%s.%03uZ ",
+                     stamp, (unsigned)(usec % 1000000 / 1000));
+    } else {
+        n = snprintf(out->data + out->len, sizeof(out->data) - out->len, "%s.%03uZ %-5s ",
+                     stamp, (unsigned)(usec % 1000000 / 1000), level_names[level]);
+    }
+    out->len += n;
+    memcpy(out->data + out->len, text, len);
+    out->len += len;
+    out->data[out->len++] = '\n';
+}
+
+// Write out every queued line; returns the number of lines written
+static int drain(void) {
+    int lines = 0;
+    char note[64];
+
+    pthread_mutex_lock(&drain_lock);
+
+    // Rings are only ever added at the front, so the list can be walked
+    // without the lock once its head is read
+    pthread_mutex_lock(&rings_lock);
+    struct log_ring *r = rings;
+    pthread_mutex_unlock(&rings_lock);
+
+    for (; r != NULL; r = r->next) {
+        unsigned tail = r->tail;
+        unsigned head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+
+        for (; tail != head; tail++) {
+            struct log_slot *s = &r->slots[tail % LOG_SLOTS];
+            out_line(s->level == LV_ACCESS ? &access_out : &err_out, s->time, s->level,
+                     s->text, s->len);
+            lines++;
+        }
+        __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+
+        unsigned long long dropped = __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+        if (dropped != r->reported) {
+            int n = snprintf(note, sizeof(note), "log ring full, dropped %llu lines",
+                             dropped - r->reported);
+            out_line(&err_out, wall_usec(), LV_WARN, note, n);
+            r->reported = dropped;
+        }
+    }
+
+    unsigned long long lost = __atomic_load_n(&unringed, __ATOMIC_RELAXED);
+    if (lost != unringed_reported) {
+        int n = snprintf(note, sizeof(note), "no memory for a log ring, dropped %llu lines",
+                         lost - unringed_reported);
+        out_line(&err_out, wall_usec(), LV_WARN, note, n);
+        unringed_reported = lost;
+    }
+
+    out_flush(&access_out);
+    out_flush(&err_out);
+    pthread_mutex_unlock(&drain_lock);
+    return lines;
+}
+
+static void *flusher(void *arg) {
+    (void)arg;
+    struct timespec idle = {0, LOG_IDLE_NSEC};
+
+    while (1) {
+        if (drain() == 0) {
+            nanosleep(&idle, NULL);
+        }
+    }
+    return NULL;
+}
+
+void log_flush(void) {
+    drain();
+}
+
+int log_init(void) {
+    pthread_t tid;
+    sigset_t all, old;
+
+    // Signal handlers may exit() and so flush; they must not run on the
+    // flusher while it holds drain_lock
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int err = pthread_create(&tid, NULL, flusher, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err != 0) {
+        return -1;
+    }
+    pthread_detach(tid);
+    atexit(log_flush);
+    return 0;
+}
@@ -0,0 +1,219 @@
+/*
+ * metrics.c -- per-worker counters, summed when they are read.
+ */
+
+#include "metrics.h"
+#include "arena.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const struct {
+    const char *name;
+    const char *help;
+} metric_info[M_COUNT] = {
+    [M_REQUESTS] = {"proxy_requests_total", "Request heads parsed"},
+    [M_CACHE_HITS] = {"proxy_cache_hits_total", "GET requests answered from the cache"},
+    [M_CACHE_MISSES] = {"proxy_cache_misses_total", "GET requests sent to the origin"},
+    [M_CLIENT_BYTES_IN] = {"proxy_client_received_bytes_total", "Bytes received from clients"},
+    [M_CLIENT_BYTES_OUT] = {"proxy_client_sent_bytes_total", "Bytes sent to clients"},
+    [M_ORIGIN_BYTES_OUT] = {"proxy_origin_sent_bytes_total", "Bytes sent to origin servers"},
+    [M_ORIGIN_BYTES_IN] = {"proxy_origin_received_bytes_total", "Bytes received from origin servers"},
+    [M_CACHE_EVICTIONS] = {"proxy_cache_evictions_total", "Cache entries evicted to make room"},
+    [M_CACHE_PURGED] = {"proxy_cache_purged_total", "Cache entries dropped by PURGE or the admin page"},
+    [M_CACHE_STALE] = {"proxy_cache_stale_total", "Stale responses served, while revalidating or on an origin error"},
+    [M_CACHE_REFRESHES] = {"proxy_cache_refreshes_total", "Background refreshes that stored a new copy"},
+    [M_NEGATIVE_HITS] = {"proxy_negative_hits_total", "Requests answered from a cached error, failed lookup or refused connect"},
+    [M_CONNECT_FAILURES] = {"proxy_upstream_connect_failures_total", "Failed lookups or connects to an origin"},
+    [M_CONNECTIONS_OPENED] = {"proxy_connections_opened_total", "Client connections taken by a worker"},
+    [M_CONNECTIONS_CLOSED] = {"proxy_connections_closed_total", "Client connections finished"},
+    [M_TUNNELS_OPENED] = {"proxy_tunnels_opened_total", "CONNECT tunnels established"},
+    [M_TUNNELS_CLOSED] = {"proxy_tunnels_closed_total", "CONNECT tunnels closed"},
+    [M_CLIENTS_REJECTED] = {"proxy_clients_rejected_total", "Connections refused by a per-client limit"},
+    [M_CONNECTIONS_SHED] = {"proxy_connections_shed_total", "Connections answered 503 because the queue was full or too slow"},
+};
+
+const char *const request_class_names[RC_COUNT] = {"hit", "miss", "tunnel"};
+static const char *phase_names[PH_COUNT] = {"queue", "dns", "connect", "ttfb", "transfer"};
+
+struct metrics_slot metrics_shared;
+static struct metrics_slot *slots;
+static int slot_count;
+
+__thread struct metrics_slot *metrics_local = &metrics_shared;
+
+int metrics_init(int nslots) {
+    slots = aligned_alloc(sizeof(struct metrics_slot), nslots * sizeof(struct metrics_slot));
+    if (slots == NULL) {
+        return -1;
+    }
+    memset(slots, 0, nslots * sizeof(struct metrics_slot));
+
+    // One block for all histograms; calloc leaves the pages of idle workers
+    // untouched
+    struct histogram *hist = calloc((size_t)nslots * RC_COUNT * PH_COUNT, sizeof(struct histogram));
+    if (hist == NULL) {
+        free(slots);
+        slots = NULL;
+        return -1;
+    }
+    for (int i = 0; i < nslots; i++) {
+        slots[i].hist = hist + (size_t)i * RC_COUNT * PH_COUNT;
+    }
+    slot_count = nslots;
+    return 0;
+}
+
+void metrics_bind(int slot) {
+    if (slot >= 0 && slot < slot_count) {
+        metrics_local = &slots[slot];
+    }
+}
+
+unsigned long long metric_total(enum metric_id id) {
+    unsigned long long sum = __atomic_load_n(&metrics_shared.v[id], __ATOMIC_RELAXED);
+    for (int i = 0; i < slot_count; i++) {
+        sum += __atomic_load_n(&slots[i].v[id], __ATOMIC_RELAXED);
+    }
+    return sum;
+}
+
+static int hist_index(uint64_t v) {
+    if (v < (1u << HIST_SUB_BITS)) {
+        return (int)v;
+    }
+    int e = 63 - __builtin_clzll(v);
+    int idx = (e - HIST_SUB_BITS + 1) << HIST_SUB_BITS |
+              (int)((v >> (e - HIST_SUB_BITS)) & ((1u << HIST_SUB_BITS) - 1));
+    return idx < HIST_BUCKETS ? idx : HIST_BUCKETS - 1;
+}
+
+// Middle of the range of values that land in bucket idx
+static uint64_t hist_value(int idx) {
+    if (idx < (1 << HIST_SUB_BITS)) {
+        return (uint64_t)idx;
+    }
+    int shift = (idx >> HIST_SUB_BITS) - 1;
+    uint64_t low = (uint64_t)((1 << HIST_SUB_BITS) + (idx & ((1 << HIST_SUB_BITS) - 1))) << shift;
+    return low + (((uint64_t)1 << shift) >> 1);
+}
+
+static void store_add(unsigned long long *p, unsigned long long n) {
+    __atomic_store_n(p, __atomic_load_n(p, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+void metrics_record(const struct request_timing *t) {
+    if (t->cls < 0 || metrics_local->hist == NULL) {
+        return;
+    }
+    for (int ph = 0; ph < PH_COUNT; ph++) {
+        if (!(t->set & (1u << ph))) {
+            continue;
+        }
+        struct histogram *h = &metrics_local->hist[t->cls * PH_COUNT + ph];
+        uint32_t *c = &h->counts[hist_index(t->usec[ph])];
+        __atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+        store_add(&h->total, 1);
+        store_add(&h->sum, t->usec[ph]);
+    }
+}
+
+void histogram_add(struct histogram *h, uint64_t v) {
+    __atomic_fetch_add(&h->counts[hist_index(v)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->total, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, v, __ATOMIC_RELAXED);
+}
+
+void metrics_histogram(int cls, int phase, struct histogram *out) {
+    memset(out, 0, sizeof(*out));
+    for (int i = 0; i < slot_count; i++) {
+        struct histogram *h = &slots[i].hist[cls * PH_COUNT + phase];
+        if (__atomic_load_n(&h->total, __ATOMIC_RELAXED) == 0) {
+            continue;
+        }
+        for (int b = 0; b < HIST_BUCKETS; b++) {
+            out->counts[b] += __atomic_load_n(&h->counts[b], __ATOMIC_RELAXED);
+        }
+        out->total += __atomic_load_n(&h->total, __ATOMIC_RELAXED);
+        out->sum += __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+    }
+}
+
+uint64_t histogram_quantile(const struct histogram *h, double q) {
+    unsigned long long seen = 0;
+    unsigned long long total = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        total += h->counts[b];
+    }
+    if (total == 0) {
+        return 0;
+    }
+    unsigned long long rank = (unsigned long long)(q * total + 0.999999);
+    if (rank == 0) {
+        rank = 1;
+    }
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        seen += h->counts[b];
+        if (seen >= rank) {
+            return hist_value(b);
+        }
+    }
+    return hist_value(HIST_BUCKETS - 1);
+}
+
+size_t metrics_render(char *buf, size_t len) {
+    size_t off = 0;
+    int n;
+
+#define EMIT(...) \
+    do { \
+        n = snprintf(buf + off, len - off, __VA_ARGS__); \
+        if (n < 0 || (size_t)n >= len - off) { \
+            return off; \
+        } \
+        off += n; \
+    } while (0)
+
+    for (int id = 0; id < M_COUNT; id++) {
+        EMIT("# HELP %s %s\n# TYPE %s counter\n%s %llu\n", metric_info[id].name,
+             metric_info[id].help, metric_info[id].name, metric_info[id].name,
+             metric_total(id));
+    }
+
+    struct arena_stats st;
+    arena_stats(&st);
+    EMIT("# HELP proxy_arena_mallocs_total Chunks the arenas took from malloc\n"
+         "# TYPE proxy_arena_mallocs_total counter\nproxy_arena_mallocs_total %llu\n", st.mallocs);
+    EMIT("# HELP proxy_arena_frees_total Chunks the arenas gave back to free\n"
+         "# TYPE proxy_arena_frees_total counter\nproxy_arena_frees_total %llu\n", st.frees);
+    EMIT("# HELP proxy_arena_allocations_total Allocations served from arenas\n"
+         "# TYPE proxy_arena_allocations_total counter\nproxy_arena_allocations_total %llu\n", st.allocs);
+    EMIT("# HELP proxy_arena_bytes Memory held by arenas\n"
+         "# TYPE proxy_arena_bytes gauge\nproxy_arena_bytes %llu\n", st.bytes);
+
+    static const double quantiles[] = {0.5, 0.99, 0.999};
+    struct histogram h;
+    EMIT("# HELP proxy_phase_seconds Time spent in each phase of a request\n"
+         "# TYPE proxy_phase_seconds summary\n");
+    for (int cls = 0; cls < RC_COUNT; cls++) {
+        for (int ph = 0; ph < PH_COUNT; ph++) {
+            metrics_histogram(cls, ph, &h);
+            if (h.total == 0) {
+                continue;
+            }
+            for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+                EMIT("proxy_phase_seconds{class=\"%s\",phase=\"%s\",quantile=\"%g\"} %.6f\n",
+                     request_class_names[cls], phase_names[ph], quantiles[q],
+                     histogram_quantile(&h, quantiles[q]) / 1e6);
+            }
+            EMIT("proxy_phase_seconds_sum{class=\"%s\",phase=\"%s\"} %.6f\n",
+                 request_class_names[cls], phase_names[ph], h.sum / 1e6);
+            EMIT("proxy_phase_seconds_count{class=\"%s\",phase=\"%s\"} %llu\n",
+                 request_class_names[cls], phase_names[ph], h.total);
+        }
+    }
+
+#undef EMIT
+    return off;
+}
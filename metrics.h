@@ -0,0 +1,213 @@
+/*
+ * metrics.h -- per-worker counters, summed when they are read.
+ *
+ * Every thread that counts gets its own cache line aligned slot and only
+ * ever writes to that slot, so counting costs a load and a store to a line
+ * no other core is writing. Readers add up all slots; a total may be a few
+ * increments behind but never torn.
+ *
+ * Latency histograms work the same way: each slot has one per request class
+ * and phase, and they are merged when read.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+enum metric_id {
+    M_REQUESTS,               // Request heads parsed
+    M_CACHE_HITS,             // GETs answered from the cache
+    M_CACHE_MISSES,           // GETs sent to the origin
+    M_CLIENT_BYTES_IN,        // Bytes received from clients
+    M_CLIENT_BYTES_OUT,       // Bytes sent to clients
+    M_ORIGIN_BYTES_OUT,       // Bytes sent to origins
+    M_ORIGIN_BYTES_IN,        // Bytes received from origins
+    M_CACHE_EVICTIONS,        // Entries evicted to make room
+    M_CACHE_PURGED,           // Entries dropped by PURGE or the admin page
+    M_CACHE_STALE,            // Stale responses served
+    M_CACHE_REFRESHES,        // Background refreshes that stored a new copy
+    M_NEGATIVE_HITS,          // Requests answered from a remembered failure
+    M_CONNECT_FAILURES,       // Failed DNS lookups or connects to an origin
+    M_CONNECTIONS_OPENED,     // Client connections taken by a worker
+    M_CONNECTIONS_CLOSED,     // Client connections finished
+    M_TUNNELS_OPENED,         // CONNECT tunnels established
+    M_TUNNELS_CLOSED,         // CONNECT tunnels torn down
+    M_CLIENTS_REJECTED,       // Connections refused by a per-client limit
+    M_CONNECTIONS_SHED,       // Connections answered 503 under load
+    M_COUNT
+};
+
+// Phases of a request, timed separately
+enum phase_id {
+    PH_QUEUE,                 // Accepted until a worker picks it up
+    PH_DNS,                   // Resolving the origin
+    PH_CONNECT,               // TCP connect to the origin
+    PH_TTFB,                  // Request sent until the first response byte
+    PH_TRANSFER,              // Response (or tunnel) until the client has it all
+    PH_COUNT
+};
+
+// How the request was served
+enum request_class {
+    RC_HIT,                   // From the cache
+    RC_MISS,                  // By the origin
+    RC_TUNNEL,                // CONNECT tunnel
+    RC_COUNT
+};
+
+/*
+ * Log-linear histogram of microseconds, in the style of HdrHistogram: 16
+ * linear buckets per power of two, so every value is within about 6% of
+ * its bucket. Values past about 4.7 hours land in the last bucket.
+ */
+#define HIST_SUB_BITS 4
+#define HIST_BUCKETS 512
+
+struct histogram {
+    uint32_t counts[HIST_BUCKETS];
+    unsigned long long total;     // Number of values
+    unsigned long long sum;       // Sum of the values
+};
+
+struct metrics_slot {
+    unsigned long long v[M_COUNT];
+    struct histogram *hist;       // RC_COUNT * PH_COUNT histograms
+} __attribute__((aligned(64)));
+
+// Phase durations of one request, recorded together once it is served
+struct request_timing {
+    uint64_t start;               // Start of the phase being timed
+    uint64_t usec[PH_COUNT];
+    unsigned set;                 // Bit per phase that was timed
+    int cls;                      // request_class, or -1 if not recorded
+    int status;                   // Status sent to the client, 0 if none
+};
+
+// "hit", "miss", "tunnel"
+extern const char *const request_class_names[RC_COUNT];
+
+/**
+ * @return Microseconds on the monotonic clock
+ */
+static inline uint64_t now_usec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Start timing a phase.
+ *
+ * @param t Timing of the request, may be NULL
+ */
+static inline void timing_start(struct request_timing *t) {
+    if (t != NULL) {
+        t->start = now_usec();
+    }
+}
+
+/**
+ * End the phase started by timing_start() and start the next one.
+ *
+ * @param t Timing of the request, may be NULL
+ * @param phase Phase that ended
+ */
+static inline void timing_end(struct request_timing *t, enum phase_id phase) {
+    if (t != NULL) {
+        uint64_t now = now_usec();
+        t->usec[phase] += now - t->start;
+        t->set |= 1u << phase;
+        t->start = now;
+    }
+}
+
+extern __thread struct metrics_slot *metrics_local;
+extern struct metrics_slot metrics_shared;
+
+/**
+ * Allocate the per-worker slots. Threads that never call metrics_bind()
+ * (accept loop, refresh, admin and check threads) share one extra slot,
+ * which they add to atomically; that is fine off the hot path.
+ *
+ * @param nslots Number of slots
+ * @return 0 on success, -1 if memory ran out
+ */
+int metrics_init(int nslots);
+
+/**
+ * Make the calling thread count into a slot of its own.
+ *
+ * @param slot Slot number, 0 to nslots - 1
+ */
+void metrics_bind(int slot);
+
+/**
+ * Add to a counter of the calling thread.
+ *
+ * @param id Counter
+ * @param n Amount to add
+ */
+static inline void metric_add(enum metric_id id, unsigned long long n) {
+    unsigned long long *p = &metrics_local->v[id];
+    if (metrics_local == &metrics_shared) {
+        // Several unbound threads write the shared slot
+        __atomic_fetch_add(p, n, __ATOMIC_RELAXED);
+        return;
+    }
+    // A worker's slot has a single writer: a plain load and store, atomic
+    // only so that readers never see a torn value
+    __atomic_store_n(p, __atomic_load_n(p, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+/**
+ * @param id Counter
+ * @return The counter summed over all slots
+ */
+unsigned long long metric_total(enum metric_id id);
+
+/**
+ * Record the timed phases of a request in the calling thread's histograms.
+ * Nothing is recorded if t->cls is -1.
+ *
+ * @param t Timing of the request
+ */
+void metrics_record(const struct request_timing *t);
+
+/**
+ * Merge a histogram over all slots.
+ *
+ * @param cls request_class
+ * @param phase phase_id
+ * @param out Merged histogram
+ */
+void metrics_histogram(int cls, int phase, struct histogram *out);
+
+/**
+ * Add a value to a histogram that several threads write to.
+ *
+ * @param h Histogram
+ * @param v Value, microseconds
+ */
+void histogram_add(struct histogram *h, uint64_t v);
+
+/**
+ * @param h Histogram
+ * @param q Quantile, 0 to 1
+ * @return Value (microseconds) below which a fraction q of the values lie
+ */
+uint64_t histogram_quantile(const struct histogram *h, double q);
+
+/**
+ * Write all counters, the allocator counters and the p50/p99/p999 of each
+ * phase histogram in the Prometheus text exposition format.
+ *
+ * @param buf Output buffer
+ * @param len Size of buf
+ * @return Number of bytes written (output is cut short if buf is too small)
+ */
+size_t metrics_render(char *buf, size_t len);
+
+#endif
@@ -0,0 +1,25 @@
+/*
+ * net.c -- socket helpers shared by the workers and the admin thread.
+ */
+
+#include "net.h"
+
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+size_t send_all(int socket, const char *data, size_t len) {
+    size_t sent = 0;
+
+    while (sent < len) {
+        ssize_t n = send(socket, data + sent, len - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        sent += n;
+    }
+    return sent;
+}
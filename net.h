@@ -0,0 +1,22 @@
+/*
+ * net.h -- socket helpers shared by the workers and the admin thread.
+ */
+
+#ifndef NET_H
+#define NET_H
+
+#include <stddef.h>
+
+/**
+ * Send all of data, carrying on after partial sends and interrupted calls.
+ * SIGPIPE is not raised if the peer is gone.
+ *
+ * @param socket Socket to send on
+ * @param data Bytes to send
+ * @param len Number of bytes
+ * @return Bytes sent; less than len if the peer is gone or the send timed
+ *         out
+ */
+size_t send_all(int socket, const char *data, size_t len);
+
+#endif
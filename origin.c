@@ -0,0 +1,255 @@
+/*
+ * origin.c -- per-origin statistics, concurrency caps and circuit breakers.
+ *
+ * The table is open addressed on a hash of the name. Lookups read the hash
+ * of each probed slot with acquire and only then its name; adding takes a
+ * mutex, fills the name and publishes the hash last with release.
+ */
+
+#include "origin.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+
+static struct origin origins[ORIGIN_SLOTS];
+static pthread_mutex_t add_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Set by origin_configure() and origin_configure_negative(); workers read
+// them in origin_acquire(), origin_release() and origin_connected(), and
+// refresh_rate when they queue a background refresh
+static int max_inflight;
+static int wait_ms;
+static int trip_failures;
+static int cooldown_sec;
+static int refresh_rate;
+static int no_host_sec;
+static int refused_sec;
+
+void origin_configure(int inflight, int wait, int failures, int cooldown, int refreshes) {
+    __atomic_store_n(&max_inflight, inflight, __ATOMIC_RELAXED);
+    __atomic_store_n(&wait_ms, wait, __ATOMIC_RELAXED);
+    __atomic_store_n(&trip_failures, failures, __ATOMIC_RELAXED);
+    __atomic_store_n(&cooldown_sec, cooldown, __ATOMIC_RELAXED);
+    __atomic_store_n(&refresh_rate, refreshes, __ATOMIC_RELAXED);
+}
+
+void origin_configure_negative(int no_host_ttl, int refused_ttl) {
+    __atomic_store_n(&no_host_sec, no_host_ttl, __ATOMIC_RELAXED);
+    __atomic_store_n(&refused_sec, refused_ttl, __ATOMIC_RELAXED);
+}
+
+static uint64_t hash_name(const char *name) {
+    uint64_t h = 1469598103934665603ULL;
+    for (; *name; name++) {
+        h = (h ^ (unsigned char)*name) * 1099511628211ULL;
+    }
+    return h ? h : 1;       // 0 marks a free slot
+}
+
+struct origin *origin_get(const char *host, int port) {
+    char name[ORIGIN_NAME_MAX];
+    int n = snprintf(name, sizeof(name), "%s:%d", host, port);
+    if (n < 0 || (size_t)n >= sizeof(name)) {
+        return NULL;
+    }
+    uint64_t hash = hash_name(name);
+
+    size_t i = hash % ORIGIN_SLOTS;
+    for (size_t probes = 0; probes < ORIGIN_SLOTS; probes++, i = (i + 1) % ORIGIN_SLOTS) {
+        uint64_t h = __atomic_load_n(&origins[i].hash, __ATOMIC_ACQUIRE);
+        if (h == 0) {
+            break;
+        }
+        if (h == hash && strcmp(origins[i].name, name) == 0) {
+            return &origins[i];
+        }
+    }
+
+    // Not there: probe again under the lock, another thread may be adding it
+    struct origin *found = NULL;
+    pthread_mutex_lock(&add_lock);
+    i = hash % ORIGIN_SLOTS;
+    for (size_t probes = 0; probes < ORIGIN_SLOTS; probes++, i = (i + 1) % ORIGIN_SLOTS) {
+        uint64_t h = origins[i].hash;
+        if (h == hash && strcmp(origins[i].name, name) == 0) {
+            found = &origins[i];
+            break;
+        }
+        if (h == 0) {
+            memcpy(origins[i].name, name, n + 1);
+            // Waits for a place are timed on the monotonic clock, so a
+            // wall clock step cannot stretch or cut them
+            pthread_condattr_t attr;
+            pthread_condattr_init(&attr);
+            pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+            pthread_mutex_init(&origins[i].lock, NULL);
+            pthread_cond_init(&origins[i].freed, &attr);
+            pthread_condattr_destroy(&attr);
+            __atomic_store_n(&origins[i].hash, hash, __ATOMIC_RELEASE);
+            found = &origins[i];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&add_lock);
+    return found;
+}
+
+void origin_connected(struct origin *o, uint64_t connect_usec, int result) {
+    if (o == NULL) {
+        return;
+    }
+    __atomic_fetch_add(&o->requests, 1, __ATOMIC_RELAXED);
+    if (result >= 0) {
+        histogram_add(&o->connect, connect_usec);
+        return;
+    }
+    __atomic_fetch_add(&o->failures, 1, __ATOMIC_RELAXED);
+
+    // A timeout may be load on the way; those are the breaker's business
+    int ttl = result == CONNECT_NO_HOST ? __atomic_load_n(&no_host_sec, __ATOMIC_RELAXED) :
+              result == CONNECT_REFUSED ? __atomic_load_n(&refused_sec, __ATOMIC_RELAXED) : 0;
+    if (ttl > 0) {
+        __atomic_store_n(&o->unreachable_until, now_usec() + (uint64_t)ttl * 1000000, __ATOMIC_RELAXED);
+        log_debug("Origin %s %s, not trying again for %d s", o->name,
+                  result == CONNECT_NO_HOST ? "does not resolve" : "refused", ttl);
+    }
+}
+
+enum origin_verdict origin_acquire(struct origin *o) {
+    if (o == NULL) {
+        return ORIGIN_OK;
+    }
+    int cap = __atomic_load_n(&max_inflight, __ATOMIC_RELAXED);
+    uint64_t now = now_usec();
+    enum origin_verdict v = ORIGIN_OK;
+
+    if (now < __atomic_load_n(&o->unreachable_until, __ATOMIC_RELAXED)) {
+        __atomic_fetch_add(&o->rejected, 1, __ATOMIC_RELAXED);
+        metric_add(M_NEGATIVE_HITS, 1);
+        return ORIGIN_UNREACHABLE;
+    }
+
+    pthread_mutex_lock(&o->lock);
+    if (o->breaker == BREAKER_OPEN &&
+        now - o->opened >= (uint64_t)__atomic_load_n(&cooldown_sec, __ATOMIC_RELAXED) * 1000000) {
+        // This request is the probe; the others keep failing until it is done
+        __atomic_store_n(&o->breaker, BREAKER_HALF_OPEN, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&o->inflight, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&o->lock);
+        return ORIGIN_OK;
+    }
+    if (o->breaker != BREAKER_CLOSED) {
+        v = ORIGIN_DOWN;
+    } else if (cap > 0 && o->inflight >= cap) {
+        // Wait for a place, for a bounded time: a worker blocked here is a
+        // worker not serving anyone else
+        struct timespec deadline;
+        int ms = __atomic_load_n(&wait_ms, __ATOMIC_RELAXED);
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += ms / 1000;
+        deadline.tv_nsec += (long)(ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        o->waiting++;
+        while (o->inflight >= cap && o->breaker == BREAKER_CLOSED) {
+            if (pthread_cond_timedwait(&o->freed, &o->lock, &deadline) == ETIMEDOUT) {
+                break;
+            }
+        }
+        o->waiting--;
+        if (o->breaker != BREAKER_CLOSED) {
+            v = ORIGIN_DOWN;
+        } else if (o->inflight >= cap) {
+            v = ORIGIN_BUSY;
+        }
+    }
+    if (v == ORIGIN_OK) {
+        __atomic_add_fetch(&o->inflight, 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_add(&o->rejected, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&o->lock);
+    return v;
+}
+
+void origin_release(struct origin *o, int ok) {
+    if (o == NULL) {
+        return;
+    }
+    int trip = __atomic_load_n(&trip_failures, __ATOMIC_RELAXED);
+    int opened = 0;
+
+    pthread_mutex_lock(&o->lock);
+    __atomic_sub_fetch(&o->inflight, 1, __ATOMIC_RELAXED);
+    if (ok) {
+        o->failed_in_row = 0;
+        if (o->breaker == BREAKER_HALF_OPEN) {
+            __atomic_store_n(&o->breaker, BREAKER_CLOSED, __ATOMIC_RELAXED);
+            log_info("Origin %s is back, closing its breaker", o->name);
+        }
+    } else {
+        o->failed_in_row++;
+        if (o->breaker == BREAKER_HALF_OPEN ||
+            (o->breaker == BREAKER_CLOSED && trip > 0 && o->failed_in_row >= trip)) {
+            if (o->breaker == BREAKER_CLOSED) {
+                log_warn("Origin %s failed %d times in a row, opening its breaker", o->name, o->failed_in_row);
+            }
+            __atomic_store_n(&o->breaker, BREAKER_OPEN, __ATOMIC_RELAXED);
+            o->opened = now_usec();
+            opened = 1;
+        }
+    }
+    // All waiters have to hear that the breaker opened, one that a place is free
+    if (opened) {
+        pthread_cond_broadcast(&o->freed);
+    } else {
+        pthread_cond_signal(&o->freed);
+    }
+    pthread_mutex_unlock(&o->lock);
+}
+
+int origin_refresh_permit(struct origin *o) {
+    int rate = __atomic_load_n(&refresh_rate, __ATOMIC_RELAXED);
+    if (o == NULL || rate == 0) {
+        return 1;
+    }
+    uint64_t now = now_usec();
+    int ok = 0;
+
+    pthread_mutex_lock(&o->lock);
+    if (o->refreshed == 0) {
+        o->refresh_tokens = rate;
+    } else {
+        o->refresh_tokens += (now - o->refreshed) / 1e6 * rate;
+        if (o->refresh_tokens > rate) {
+            o->refresh_tokens = rate;
+        }
+    }
+    o->refreshed = now;
+    if (o->refresh_tokens >= 1) {
+        o->refresh_tokens -= 1;
+        ok = 1;
+    }
+    pthread_mutex_unlock(&o->lock);
+    return ok;
+}
+
+void origin_ttfb(struct origin *o, uint64_t usec) {
+    if (o != NULL) {
+        histogram_add(&o->ttfb, usec);
+    }
+}
+
+void origin_walk(void (*fn)(void *arg, struct origin *o), void *arg) {
+    for (size_t i = 0; i < ORIGIN_SLOTS; i++) {
+        if (__atomic_load_n(&origins[i].hash, __ATOMIC_ACQUIRE) != 0) {
+            fn(arg, &origins[i]);
+        }
+    }
+}
@@ -0,0 +1,163 @@
+/*
+ * origin.h -- per-origin statistics, concurrency caps and circuit breakers.
+ *
+ * Every origin server the proxy talks to (host and port) gets a slot in a
+ * fixed table the first time it is seen. Slots are never removed, so the
+ * pointer to one stays valid for the life of the process and workers update
+ * its statistics with atomic adds, without a lock.
+ *
+ * A worker also takes one of the origin's in-flight places before it
+ * connects and gives it back when done, under the slot's own mutex. When
+ * an origin is at its cap, workers wait for a place for a bounded time
+ * and then give up, so a slow origin can hold at most its cap of workers
+ * and never the whole pool.
+ *
+ * The circuit breaker counts requests in a row that failed to connect or
+ * got no response in time. Past the threshold it opens: requests to the
+ * origin fail at once instead of holding a worker through a connect
+ * timeout. After the cooldown one request is let through as a probe; it
+ * closes the breaker if it works and opens it again if not.
+ *
+ * A name that does not resolve or a connect that is refused is remembered
+ * for a short time, so requests for a dead host are turned away without
+ * a lookup or a connect until it runs out.
+ */
+
+#ifndef ORIGIN_H
+#define ORIGIN_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "metrics.h"
+
+#define ORIGIN_SLOTS 512          // Origins tracked; later ones are not
+#define ORIGIN_NAME_MAX 128       // "host:port", longer names are not tracked
+
+enum breaker_state {
+    BREAKER_CLOSED,               // Requests go through
+    BREAKER_OPEN,                 // Requests fail at once until the cooldown ends
+    BREAKER_HALF_OPEN             // One probe request is in flight
+};
+
+// What origin_acquire() decided
+enum origin_verdict {
+    ORIGIN_OK,
+    ORIGIN_BUSY,                  // Still at the in-flight cap after the wait
+    ORIGIN_DOWN,                  // Breaker open
+    ORIGIN_UNREACHABLE            // Lookup failed or connect refused a moment ago
+};
+
+// Why a connect to an origin failed, as returned in place of a socket
+enum connect_error {
+    CONNECT_FAILED = -1,          // Timed out or another error
+    CONNECT_NO_HOST = -2,         // The name did not resolve
+    CONNECT_REFUSED = -3          // Every address refused
+};
+
+struct origin {
+    uint64_t hash;                // 0 while the slot is free
+    char name[ORIGIN_NAME_MAX];
+    unsigned long long requests;  // Connections attempted
+    unsigned long long failures;  // Lookups or connects that failed
+    unsigned long long rejected;  // Requests turned away, busy or breaker open
+    struct histogram connect;     // DNS plus connect, microseconds
+    struct histogram ttfb;        // Request sent until the first response byte
+
+    pthread_mutex_t lock;         // Guards the fields below
+    pthread_cond_t freed;         // Signalled when an in-flight place is given back
+    int inflight;                 // Requests holding a place
+    int waiting;                  // Workers waiting for a place
+    int failed_in_row;            // Consecutive failed requests
+    int breaker;                  // enum breaker_state
+    uint64_t opened;              // now_usec() when the breaker last opened
+    double refresh_tokens;        // Background refreshes the origin may take now
+    uint64_t refreshed;           // now_usec() when refresh_tokens was topped up
+    uint64_t unreachable_until;   // now_usec() until which connects are not tried
+};
+
+/**
+ * Set the caps and breaker settings. 0 turns a cap or the breaker off.
+ * Safe to call while requests are in flight.
+ *
+ * @param max_inflight Requests one origin may have in flight
+ * @param wait_ms Longest wait for an in-flight place
+ * @param failures Failed requests in a row that open the breaker
+ * @param cooldown Seconds the breaker stays open before a probe
+ * @param refresh_rate Background refreshes per second per origin
+ */
+void origin_configure(int max_inflight, int wait_ms, int failures, int cooldown, int refresh_rate);
+
+/**
+ * Set how long failed lookups and refused connects are remembered. 0
+ * forgets them at once. Safe to call while requests are in flight.
+ *
+ * @param no_host_ttl Seconds after a name did not resolve
+ * @param refused_ttl Seconds after a connect was refused
+ */
+void origin_configure_negative(int no_host_ttl, int refused_ttl);
+
+/**
+ * Find the slot of an origin, adding it if it is new.
+ *
+ * @param host Host name or address
+ * @param port Port
+ * @return The slot, or NULL if the table is full or the name too long
+ */
+struct origin *origin_get(const char *host, int port);
+
+/**
+ * Count a connection attempt, and remember an origin that does not
+ * resolve or refuses connections.
+ *
+ * @param o Origin, may be NULL
+ * @param connect_usec Time to resolve and connect
+ * @param result Socket connected, or the connect_error it failed with
+ */
+void origin_connected(struct origin *o, uint64_t connect_usec, int result);
+
+/**
+ * Take an in-flight place before connecting to an origin. Waits up to the
+ * configured time while the origin is at its cap.
+ *
+ * @param o Origin, may be NULL, which is never limited
+ * @return ORIGIN_OK with a place to give back with origin_release(), else
+ *         why the request may not go ahead; ORIGIN_UNREACHABLE is decided
+ *         without waiting or taking the lock
+ */
+enum origin_verdict origin_acquire(struct origin *o);
+
+/**
+ * Give back an in-flight place and feed the breaker.
+ *
+ * @param o Origin, may be NULL
+ * @param ok 0 if the connect failed or the origin did not answer in time
+ */
+void origin_release(struct origin *o, int ok);
+
+/**
+ * Take one of the origin's background refreshes for this second, from a
+ * token bucket as deep as the rate.
+ *
+ * @param o Origin, may be NULL, which is never limited
+ * @return 1 if the refresh may go ahead, 0 if the origin is over its rate
+ */
+int origin_refresh_permit(struct origin *o);
+
+/**
+ * Count the time to first byte of a response.
+ *
+ * @param o Origin, may be NULL
+ * @param usec Microseconds
+ */
+void origin_ttfb(struct origin *o, uint64_t usec);
+
+/**
+ * Call fn for every origin seen so far.
+ *
+ * @param fn Callback
+ * @param arg Passed to fn
+ */
+void origin_walk(void (*fn)(void *arg, struct origin *o), void *arg);
+
+#endif
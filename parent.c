@@ -0,0 +1,191 @@
+/*
+ * parent.c -- parent proxies and the choice between them.
+ *
+ * The ring is a sorted array of points, built once at start-up and only
+ * read afterwards; a lookup is a binary search. Whether a parent is up is
+ * a flag read and written with atomics, so routing takes no lock.
+ */
+
+#include "parent.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log.h"
+
+struct point {
+    uint64_t hash;
+    int parent;
+};
+
+static struct parent parents[MAX_PARENTS];
+static int nparents;
+static struct point ring[MAX_PARENTS * PARENT_POINTS];
+static int npoints;
+static int (*probe_parent)(struct parent *p);
+
+// Set by parent_configure(); the check thread sleeps by check_interval,
+// and workers read go_direct when routing
+static int check_interval = 1;
+static int go_direct;
+
+void parent_configure(int interval, int direct) {
+    __atomic_store_n(&check_interval, interval > 0 ? interval : 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&go_direct, direct, __ATOMIC_RELAXED);
+}
+
+// FNV-1a, then a finalizer so that similar keys land far apart on the ring
+static uint64_t hash_ring(const char *s) {
+    uint64_t h = 1469598103934665603ULL;
+    for (; *s; s++) {
+        h = (h ^ (unsigned char)*s) * 1099511628211ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    return h ^ (h >> 33);
+}
+
+static int point_cmp(const void *a, const void *b) {
+    const struct point *x = a, *y = b;
+    return x->hash < y->hash ? -1 : x->hash > y->hash;
+}
+
+// Parse one "host:port" entry into the next free parent
+static int parent_add(const char *entry, size_t len) {
+    const char *colon = NULL;
+    for (size_t i = 0; i < len; i++) {
+        if (entry[i] == ':') {
+            colon = entry + i;
+        }
+    }
+    if (nparents == MAX_PARENTS || colon == NULL || colon == entry ||
+        (size_t)(colon - entry) >= sizeof(parents[0].host)) {
+        return -1;
+    }
+    int port = 0;
+    for (const char *d = colon + 1; d < entry + len; d++) {
+        if (*d < '0' || *d > '9' || (port = port * 10 + (*d - '0')) > 65535) {
+            return -1;
+        }
+    }
+    if (port == 0) {
+        return -1;
+    }
+    struct parent *p = &parents[nparents++];
+    memcpy(p->host, entry, colon - entry);
+    p->host[colon - entry] = '\0';
+    p->port = port;
+    snprintf(p->name, sizeof(p->name), "%.*s:%d", (int)(colon - entry), entry, port);
+    p->up = 1;
+    return 0;
+}
+
+static void *check_thread(void *arg) {
+    (void)arg;
+
+    while (1) {
+        sleep(__atomic_load_n(&check_interval, __ATOMIC_RELAXED));
+        for (int i = 0; i < nparents; i++) {
+            parent_result(&parents[i], probe_parent(&parents[i]) == 0);
+        }
+    }
+    return NULL;
+}
+
+int parent_init(const char *list, int (*probe)(struct parent *p)) {
+    for (const char *s = list; *s != '\0'; ) {
+        size_t n = strcspn(s, ", \t");
+        if (n > 0 && parent_add(s, n) < 0) {
+            log_error("Bad parent %.*s, expected host:port", (int)n, s);
+            return -1;
+        }
+        s += n;
+        s += strspn(s, ", \t");
+    }
+    if (nparents == 0) {
+        return 0;
+    }
+
+    for (int i = 0; i < nparents; i++) {
+        for (int j = 0; j < PARENT_POINTS; j++) {
+            char point[300];
+            snprintf(point, sizeof(point), "%s#%d", parents[i].name, j);
+            ring[npoints].hash = hash_ring(point);
+            ring[npoints++].parent = i;
+        }
+    }
+    qsort(ring, npoints, sizeof(ring[0]), point_cmp);
+
+    probe_parent = probe;
+    pthread_t t;
+    if (pthread_create(&t, NULL, check_thread, NULL) != 0) {
+        return -1;
+    }
+    pthread_detach(t);
+    return nparents;
+}
+
+int parent_route(const char *key, struct parent **order, int max) {
+    if (nparents == 0) {
+        return 0;
+    }
+    uint64_t h = hash_ring(key);
+
+    // First point at or after the hash, wrapping around
+    int lo = 0, hi = npoints;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (ring[mid].hash < h) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    // Walk the ring for the up parents in order, or every parent if none
+    // is up and the origin is off limits
+    int all = 0, n = 0;
+    for (int pass = 0; pass < 2 && n == 0; pass++) {
+        unsigned seen = 0;
+        for (int k = 0; k < npoints && n < max && n < nparents; k++) {
+            int i = ring[(lo + k) % npoints].parent;
+            if (!(seen & (1u << i)) && (all || __atomic_load_n(&parents[i].up, __ATOMIC_RELAXED))) {
+                seen |= 1u << i;
+                order[n++] = &parents[i];
+            }
+        }
+        all = !__atomic_load_n(&go_direct, __ATOMIC_RELAXED);
+    }
+    return n;
+}
+
+void parent_result(struct parent *p, int ok) {
+    ok = ok != 0;
+    __atomic_fetch_add(&p->requests, 1, __ATOMIC_RELAXED);
+    if (!ok) {
+        __atomic_fetch_add(&p->failures, 1, __ATOMIC_RELAXED);
+    }
+    if (__atomic_exchange_n(&p->up, ok, __ATOMIC_RELAXED) != ok) {
+        if (ok) {
+            log_info("Parent %s is back", p->name);
+        } else {
+            log_warn("Parent %s failed, sending its requests to the next parent", p->name);
+        }
+    }
+}
+
+int parent_direct(void) {
+    return __atomic_load_n(&go_direct, __ATOMIC_RELAXED);
+}
+
+void parent_walk(void (*fn)(void *arg, struct parent *p), void *arg) {
+    for (int i = 0; i < nparents; i++) {
+        fn(arg, &parents[i]);
+    }
+}
@@ -0,0 +1,90 @@
+/*
+ * parent.h -- parent proxies and the choice between them.
+ *
+ * In a tiered setup the proxy sends misses and tunnels to parent proxies
+ * instead of the origins. Each parent owns PARENT_POINTS points on a hash
+ * ring, and a request goes to the parent owning the first point at or
+ * after the hash of its cache key. Every object thus lands in one parent's
+ * cache, and adding or removing a parent only moves the objects next to
+ * its points.
+ *
+ * A parent is taken out of the ring when a connect to it fails, and the
+ * requests it owned fail over to the next parent along the ring. A check
+ * thread connects to every parent at a fixed interval and puts parents
+ * that answer back. When no parent is up, requests go straight to the
+ * origin if that is allowed, else every parent is tried anyway.
+ */
+
+#ifndef PARENT_H
+#define PARENT_H
+
+#define MAX_PARENTS 16            // Parents accepted from the config
+#define PARENT_POINTS 100         // Points of each parent on the ring
+
+struct parent {
+    char host[256];               // Name or address, IPv6 bracketed
+    int port;
+    char name[272];               // "host:port"
+    int up;                       // 0 while taken out of the ring
+    unsigned long long requests;  // Connects tried, checks included
+    unsigned long long failures;  // Connects that failed
+};
+
+/**
+ * Set the check interval and whether to go direct with no parent up.
+ * Safe to call while requests are being routed.
+ *
+ * @param check_interval Seconds between checks of every parent
+ * @param direct Nonzero to go to the origin when no parent is up
+ */
+void parent_configure(int check_interval, int direct);
+
+/**
+ * Add the parents, build the ring and start the check thread. Call once,
+ * before any request is routed.
+ *
+ * @param list Comma separated host:port entries; may be empty
+ * @param probe Connects to a parent and hangs up, returns 0 if it could;
+ *        called on the check thread
+ * @return Number of parents, or -1 if an entry is bad or the thread could
+ *         not be started
+ */
+int parent_init(const char *list, int (*probe)(struct parent *p));
+
+/**
+ * List the parents to try for a key, in order along the ring from its
+ * hash: the parents that are up, or all of them if none is up and going
+ * direct is not allowed.
+ *
+ * @param key Cache key of the request, or host:port of a tunnel
+ * @param order Gets the parents
+ * @param max Room in order
+ * @return Number of parents listed; 0 means go to the origin
+ */
+int parent_route(const char *key, struct parent **order, int max);
+
+/**
+ * Report how a connect to a parent went. A failure takes the parent out
+ * of the ring until a check finds it answering again.
+ *
+ * @param p Parent
+ * @param ok 0 if the connect failed
+ */
+void parent_result(struct parent *p, int ok);
+
+/**
+ * Check whether a request may go to its origin once every parent failed.
+ *
+ * @return Nonzero if it may
+ */
+int parent_direct(void);
+
+/**
+ * Call fn for every parent.
+ *
+ * @param fn Callback
+ * @param arg Passed to fn
+ */
+void parent_walk(void (*fn)(void *arg, struct parent *p), void *arg);
+
+#endif
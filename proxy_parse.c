@@ -4,6 +4,10 @@
 */
 
 #include "proxy_parse.h"
+#include "http_scan.h"
+#include "log.h"
+
+#include <strings.h>
 
 #define DEFAULT_NHDRS 8
 #define MAX_REQ_LEN 65535
@@ -11,120 +15,305 @@
 
 static const char *root_abs_path = "/";
 
+/* parser states, see ParsedRequest_feed() */
+enum {
+     PS_METHOD = 0,
+     PS_TARGET,
+     PS_VERSION,
+     PS_REQLINE_LF,
+     PS_LINE_START,
+     PS_NAME,
+     PS_VALUE_START,
+     PS_VALUE,
+     PS_VALUE_LF,
+     PS_END_LF,
+     PS_DONE,
+     PS_ERROR
+};
+
 /* private function declartions */
 int ParsedRequest_printRequestLine(struct ParsedRequest *pr, 
 				   char * buf, size_t buflen,
 				   size_t *tmp);
 size_t ParsedRequest_requestLineLen(struct ParsedRequest *pr);
+int ParsedRequest_finish(struct ParsedRequest *pr);
 
 /*
- * debug() prints out debugging info if DEBUG is set to 1
+ * debug() queues debugging info on the debug log level if DEBUG is set
+ * to 1; when that level is off it costs a compare
  *
  * parameter format: same as printf 
  *
  */
 void debug(const char * format, ...) {
      va_list args;
-     if (DEBUG) {
+     if (DEBUG && log_enabled(LV_DEBUG)) {
 	  va_start(args, format);
-	  vfprintf(stderr, format, args);
+	  log_vwrite(LV_DEBUG, format, args);
 	  va_end(args);
      }
 }
 
+/* RFC 9110 tchar, as a table since it is checked for every byte of a
+   method and header name */
+static const unsigned char tchar_table[256] = {
+     0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+     0,1,0,1,1,1,1,1,0,0,1,1,0,1,1,0,1,1,1,1,1,1,1,1,1,1,0,0,0,0,0,0,
+     0,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,0,0,0,1,1,
+     1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,0,1,0,1,0,
+};
+
+static int is_tchar(unsigned char c)
+{
+     return tchar_table[c];
+}
+
 
 /*
- *  ParsedHeader Public Methods
+ * Header names
  */
 
-/* Set a header with key and value */
-int ParsedHeader_set(struct ParsedRequest *pr, 
-		     const char * key, const char * value)
+#define FNV_OFFSET 2166136261u
+#define FNV_PRIME 16777619u
+
+static const struct {
+     const char *name;
+     size_t len;
+} known_headers[HDR_COUNT] = {
+#define KNOWN(s) { s, sizeof(s) - 1 }
+     KNOWN("Host"), KNOWN("Connection"), KNOWN("Proxy-Connection"),
+     KNOWN("Keep-Alive"), KNOWN("Content-Length"),
+     KNOWN("Transfer-Encoding"), KNOWN("TE"), KNOWN("Trailer"),
+     KNOWN("Upgrade"), KNOWN("Expect"), KNOWN("Cache-Control"),
+     KNOWN("Pragma"), KNOWN("Proxy-Authorization"),
+     KNOWN("Proxy-Authenticate"), KNOWN("Authorization"), KNOWN("Cookie"),
+     KNOWN("Content-Type"), KNOWN("If-Modified-Since"),
+     KNOWN("If-None-Match"), KNOWN("Range"), KNOWN("Accept"),
+     KNOWN("Accept-Encoding"), KNOWN("User-Agent"), KNOWN("Referer"),
+     KNOWN("Via"), KNOWN("X-Forwarded-For"),
+#undef KNOWN
+};
+
+/* Perfect hash of the names above: KNOWN_SLOT() of each lowercased name is
+   distinct, so a name can only be the one in its slot. The table was
+   searched for offline; rerun the search when adding a name. */
+#define KNOWN_SLOT(first, last, len) \
+     (((unsigned)(first) + 37u * (unsigned)(last) + 3u * (unsigned)(len)) & 63)
+
+static const signed char known_slots[64] = {
+     -1, 23, -1,  7, 24, -1,  2, 11, -1, -1,  5, -1, -1, -1, 15, 12,
+     -1, -1, -1,  6, -1,  4, -1, 22, 18, -1, 19, -1, -1, -1, -1, 25,
+     16, -1,  3,  8, -1, -1, 10,  1, -1, -1, -1, -1, -1, -1, 14, -1,
+     -1, 21, -1, -1, -1, 17, -1, 20,  0, -1, -1,  9, -1, -1, -1, 13,
+};
+
+static unsigned char fold(unsigned char c)
 {
-     struct ParsedHeader *ph;
-     ParsedHeader_remove (pr, key);
+     return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+static unsigned hash_step(unsigned h, unsigned char c)
+{
+     return (h ^ fold(c)) * FNV_PRIME;
+}
+
+static unsigned hash_name(const char *key, size_t len)
+{
+     unsigned h = FNV_OFFSET;
+     size_t i;
+     for (i = 0; i < len; i++)
+	  h = hash_step(h, (unsigned char)key[i]);
+     return h;
+}
+
+int ParsedHeader_id(const char *key, size_t len)
+{
+     int id;
+
+     if (len == 0)
+	  return HDR_UNKNOWN;
+     id = known_slots[KNOWN_SLOT(fold((unsigned char)key[0]),
+				 fold((unsigned char)key[len-1]), len)];
+     if (id < 0 || known_headers[id].len != len ||
+	 strncasecmp(key, known_headers[id].name, len) != 0)
+	  return HDR_UNKNOWN;
+     return id;
+}
+
+/* Memory of a request made with ParsedRequest_createIn() comes from its
+   arena and is only released with the arena, so pr_free() is a no-op */
+static void *pr_alloc(struct ParsedRequest *pr, size_t size)
+{
+     return pr->arena ? arena_alloc(pr->arena, size) : malloc(size);
+}
 
+static void *pr_realloc(struct ParsedRequest *pr, void *p, size_t oldsize,
+			size_t size)
+{
+     return pr->arena ? arena_realloc(pr->arena, p, oldsize, size)
+	  : realloc(p, size);
+}
+
+static void pr_free(struct ParsedRequest *pr, void *p)
+{
+     if (!pr->arena)
+	  free(p);
+}
+
+static int ParsedHeader_matches(struct ParsedHeader *ph, const char *key,
+				size_t klen, unsigned hash)
+{
+     return ph->key && ph->hash == hash && ph->keylen == klen &&
+	  strncasecmp(ph->key, key, klen) == 0;
+}
+
+/* Make room for one more header, return it or NULL */
+static struct ParsedHeader *ParsedHeader_grow(struct ParsedRequest *pr)
+{
      if (pr->headerslen <= pr->headersused+1) {
+	  struct ParsedHeader *grown = (struct ParsedHeader *)pr_realloc(
+	       pr, pr->headers, pr->headerslen * sizeof(struct ParsedHeader),
+	       pr->headerslen * 2 * sizeof(struct ParsedHeader));
+	  if (!grown)
+	       return NULL;
+	  pr->headers = grown;
 	  pr->headerslen = pr->headerslen * 2;
-	  pr->headers = 
-	       (struct ParsedHeader *)realloc(pr->headers, 
-		pr->headerslen * sizeof(struct ParsedHeader));
-	  if (!pr->headers)
-	       return -1;
      }
+     return pr->headers + pr->headersused;
+}
 
-     ph = pr->headers + pr->headersused;
+/* Record a new header at the end of the array in the id slots */
+static void ParsedHeader_index(struct ParsedRequest *pr,
+			       struct ParsedHeader *ph)
+{
      pr->headersused += 1;
-     
-     ph->key = (char *)malloc(strlen(key)+1);
-     memcpy(ph->key, key, strlen(key));
-     ph->key[strlen(key)] = '\0';
+     if (ph->id == HDR_UNKNOWN)
+	  return;
+     if (pr->known[ph->id] == 0)
+	  pr->known[ph->id] = (unsigned)pr->headersused;
+     else
+	  pr->multi |= 1UL << ph->id;
+}
+
+static void ParsedHeader_clear(struct ParsedRequest *pr,
+			       struct ParsedHeader *ph)
+{
+     if (ph->owned)
+	  pr_free(pr, ph->key);
+     ph->key = NULL;
+     ph->value = NULL;
+     ph->owned = 0;
+}
 
-     ph->value = (char *)malloc(strlen(value)+1);
-     memcpy(ph->value, value, strlen(value));
-     ph->value[strlen(value)] = '\0';
+/*
+ *  ParsedHeader Public Methods
+ */
+
+/* Set a header with key and value, replacing any previous value */
+int ParsedHeader_set(struct ParsedRequest *pr, 
+		     const char * key, const char * value)
+{
+     struct ParsedHeader *ph;
+     size_t klen = strlen(key);
+     size_t vlen = strlen(value);
+     int id = ParsedHeader_id(key, klen);
+     char *copy;
+
+     /* the copy is the whole header line, so it can be sent as it is */
+     copy = (char *)pr_alloc(pr, klen + vlen + 4);
+     if (!copy)
+	  return -1;
+     memcpy(copy, key, klen);
+     memcpy(copy + klen, ": ", 2);
+     memcpy(copy + klen + 2, value, vlen);
+     memcpy(copy + klen + 2 + vlen, "\r\n", 2);
+
+     /* a header that occurs once is replaced in place */
+     if (id != HDR_UNKNOWN && pr->known[id] && !(pr->multi & (1UL << id))) {
+	  ph = pr->headers + pr->known[id] - 1;
+	  ParsedHeader_clear(pr, ph);
+     } else {
+	  ParsedHeader_remove(pr, key);
+	  ph = ParsedHeader_grow(pr);
+	  if (!ph) {
+	       pr_free(pr, copy);
+	       return -1;
+	  }
+	  ph->id = id;
+	  ph->hash = hash_name(key, klen);
+	  ParsedHeader_index(pr, ph);
+     }
 
-     ph->keylen = strlen(key)+1;
-     ph->valuelen = strlen(value)+1;
+     ph->key = copy;
+     ph->keylen = klen;
+     ph->value = copy + klen + 2;
+     ph->valuelen = vlen;
+     ph->linelen = klen + vlen + 4;
+     ph->owned = 1;
      return 0;
 }
 
+struct ParsedHeader* ParsedHeader_getId(struct ParsedRequest *pr, int id)
+{
+     if (id < 0 || id >= HDR_COUNT || pr->known[id] == 0)
+	  return NULL;
+     return pr->headers + pr->known[id] - 1;
+}
 
 /* get the parsedHeader with the specified key or NULL */
 struct ParsedHeader* ParsedHeader_get(struct ParsedRequest *pr, 
 				      const char * key)
 {
-     size_t i = 0;
-     struct ParsedHeader * tmp;
-     while(pr->headersused > i)
-     {
-	  tmp = pr->headers + i;
-	  if(tmp->key && key && strcmp(tmp->key, key) == 0)
-	  {
-	       return tmp;
-	  }
-	  i++;
+     size_t i;
+     size_t klen;
+     unsigned hash;
+     int id;
+
+     if (!key)
+	  return NULL;
+     klen = strlen(key);
+     id = ParsedHeader_id(key, klen);
+     if (id != HDR_UNKNOWN)
+	  return ParsedHeader_getId(pr, id);
+
+     hash = hash_name(key, klen);
+     for (i = 0; i < pr->headersused; i++) {
+	  if (ParsedHeader_matches(pr->headers + i, key, klen, hash))
+	       return pr->headers + i;
      }
      return NULL;
 }
 
-/* remove the specified key from parsedHeader */
+/* remove every header with the specified key */
 int ParsedHeader_remove(struct ParsedRequest *pr, const char *key)
 {
-     struct ParsedHeader *tmp;
-     tmp = ParsedHeader_get(pr, key);
-     if(tmp == NULL)
-	  return -1;
-
-     free(tmp->key);
-     free(tmp->value);
-     tmp->key = NULL;
-     return 0;
-}
-
+     size_t i;
+     size_t klen = strlen(key);
+     unsigned hash;
+     int id = ParsedHeader_id(key, klen);
+     int found = 0;
+
+     if (id != HDR_UNKNOWN) {
+	  if (pr->known[id] == 0)
+	       return -1;
+	  if (!(pr->multi & (1UL << id))) {
+	       ParsedHeader_clear(pr, pr->headers + pr->known[id] - 1);
+	       pr->known[id] = 0;
+	       return 0;
+	  }
+	  pr->known[id] = 0;
+	  pr->multi &= ~(1UL << id);
+     }
 
-/* modify the header with given key, giving it a new value
- * return 1 on success and 0 if no such header found
- * 
-int ParsedHeader_modify(struct ParsedRequest *pr, const char * key, 
-			const char *newValue)
-{
-     struct ParsedHeader *tmp;
-     tmp = ParsedHeader_get(pr, key);
-     if(tmp != NULL)
-     {
-	  if(tmp->valuelen < strlen(newValue)+1)
-	  {
-	       tmp->valuelen = strlen(newValue)+1;
-	       tmp->value = (char *) realloc(tmp->value, 
-					     tmp->valuelen * sizeof(char));
-	  } 
-	  strcpy(tmp->value, newValue);
-	  return 1;
+     hash = hash_name(key, klen);
+     for (i = 0; i < pr->headersused; i++) {
+	  if (ParsedHeader_matches(pr->headers + i, key, klen, hash)) {
+	       ParsedHeader_clear(pr, pr->headers + i);
+	       found = 1;
+	  }
      }
-     return 0;
+     return found ? 0 : -1;
 }
-*/
 
 /*
   ParsedHeader Private Methods
@@ -133,8 +322,8 @@ int ParsedHeader_modify(struct ParsedRequest *pr, const char * key,
 void ParsedHeader_create(struct ParsedRequest *pr)
 {
      pr->headers = 
-     (struct ParsedHeader *)malloc(sizeof(struct ParsedHeader)*DEFAULT_NHDRS);
-     pr->headerslen = DEFAULT_NHDRS;
+     (struct ParsedHeader *)pr_alloc(pr, sizeof(struct ParsedHeader)*DEFAULT_NHDRS);
+     pr->headerslen = pr->headers ? DEFAULT_NHDRS : 0;
      pr->headersused = 0;
 } 
 
@@ -143,7 +332,7 @@ size_t ParsedHeader_lineLen(struct ParsedHeader * ph)
 {
      if(ph->key != NULL)
      {
-	  return strlen(ph->key)+strlen(ph->value)+4;
+	  return ph->keylen+ph->valuelen+4;
      }
      return 0; 
 }
@@ -154,7 +343,7 @@ size_t ParsedHeader_headersLen(struct ParsedRequest *pr)
 	  return 0;
 
      size_t i = 0;
-     int len = 0;
+     size_t len = 0;
      while(pr->headersused > i)
      {
 	  len += ParsedHeader_lineLen(pr->headers + i);
@@ -181,13 +370,11 @@ int ParsedHeader_printHeaders(struct ParsedRequest * pr, char * buf,
      {
 	  ph = pr->headers+i;
 	  if (ph->key) {
-	       memcpy(current, ph->key, strlen(ph->key));
-	       memcpy(current+strlen(ph->key), ": ", 2);
-	       memcpy(current+strlen(ph->key) +2 , ph->value, 
-		      strlen(ph->value));
-	       memcpy(current+strlen(ph->key) +2+strlen(ph->value) , 
-		      "\r\n", 2);
-	       current += strlen(ph->key)+strlen(ph->value)+4;
+	       memcpy(current, ph->key, ph->keylen);
+	       memcpy(current+ph->keylen, ": ", 2);
+	       memcpy(current+ph->keylen+2, ph->value, ph->valuelen);
+	       memcpy(current+ph->keylen+2+ph->valuelen, "\r\n", 2);
+	       current += ph->keylen+ph->valuelen+4;
 	  }
 	  i++;
      }
@@ -196,16 +383,18 @@ int ParsedHeader_printHeaders(struct ParsedRequest * pr, char * buf,
 }
 
 
-void ParsedHeader_destroyOne(struct ParsedHeader * ph)
+void ParsedHeader_destroyOne(struct ParsedRequest *pr,
+			     struct ParsedHeader * ph)
 {
      if(ph->key != NULL)
      {
-	  free(ph->key);
+	  if (ph->owned)
+	       pr_free(pr, ph->key);
 	  ph->key = NULL;
-	  free(ph->value);
 	  ph->value = NULL;
 	  ph->keylen = 0;
 	  ph->valuelen = 0;
+	  ph->owned = 0;
      }
 }
 
@@ -214,42 +403,43 @@ void ParsedHeader_destroy(struct ParsedRequest * pr)
      size_t i = 0;
      while(pr->headersused > i)
      {
-	  ParsedHeader_destroyOne(pr->headers + i);
+	  ParsedHeader_destroyOne(pr, pr->headers + i);
 	  i++;
      }
      pr->headersused = 0;
 
-     free(pr->headers);
+     pr_free(pr, pr->headers);
      pr->headerslen = 0;
 }
 
-
-int ParsedHeader_parse(struct ParsedRequest * pr, char * line)
+/* Append a header whose key and value point into the request buffer. hash
+   is the hash of the name, computed while it was scanned. */
+int ParsedHeader_append(struct ParsedRequest *pr, const char *key,
+			size_t keylen, const char *value, size_t valuelen,
+			unsigned hash)
 {
-     char * key;
-     char * value;
-     char * index1;
-     char * index2;
+     struct ParsedHeader *ph;
+     int id = ParsedHeader_id(key, keylen);
 
-     index1 = index(line, ':');
-     if(index1 == NULL)
-     {
-	  debug("No colon found\n");
+     /* a second Host or Content-Length makes the request ambiguous
+	(RFC 9112 sections 3.2 and 6.3) */
+     if ((id == HDR_HOST || id == HDR_CONTENT_LENGTH) && pr->known[id]) {
+	  debug("duplicate %s header\n", known_headers[id].name);
 	  return -1;
      }
-     key = (char *)malloc((index1-line+1)*sizeof(char));
-     memcpy(key, line, index1-line);
-     key[index1-line]='\0';
-
-     index1 += 2;
-     index2 = strstr(index1, "\r\n");
-     value = (char *) malloc((index2-index1+1)*sizeof(char));
-     memcpy(value, index1, (index2-index1));
-     value[index2-index1] = '\0';
 
-     ParsedHeader_set(pr, key, value);
-     free(key);
-     free(value);
+     ph = ParsedHeader_grow(pr);
+     if (!ph)
+	  return -1;
+     ph->key = (char *)key;
+     ph->keylen = keylen;
+     ph->value = (char *)value;
+     ph->valuelen = valuelen;
+     ph->linelen = 0;
+     ph->owned = 0;
+     ph->hash = hash;
+     ph->id = id;
+     ParsedHeader_index(pr, ph);
      return 0;
 }
 
@@ -257,15 +447,30 @@ int ParsedHeader_parse(struct ParsedRequest * pr, char * line)
   ParsedRequest Public Methods
 */
 
+/*
+   Check that s is an RFC 9110 token (the grammar of a request method).
+   Which methods are actually forwarded is left to the caller.
+*/
+int ParsedRequest_isToken(const char *s)
+{
+     if (s == NULL || *s == '\0')
+	  return 0;
+     for (; *s; s++) {
+	  if (!is_tchar((unsigned char)*s))
+	       return 0;
+     }
+     return 1;
+}
+
 void ParsedRequest_destroy(struct ParsedRequest *pr)
 {
+     /* everything goes away with the arena */
+     if (pr->arena)
+	  return;
      if(pr->buf != NULL)
      {
 	  free(pr->buf);
      }
-     if (pr->path != NULL) {
-	  free(pr->path);
-     }
      if(pr->headerslen > 0)
      {
 	  ParsedHeader_destroy(pr);
@@ -274,20 +479,25 @@ void ParsedRequest_destroy(struct ParsedRequest *pr)
 }
 
 struct ParsedRequest* ParsedRequest_create()
+{
+     return ParsedRequest_createIn(NULL);
+}
+
+struct ParsedRequest* ParsedRequest_createIn(struct arena *arena)
 {
      struct ParsedRequest *pr;
-     pr = (struct ParsedRequest *)malloc(sizeof(struct ParsedRequest));
+     if (arena) {
+	  pr = (struct ParsedRequest *)arena_alloc(arena, sizeof(*pr));
+	  if (pr != NULL)
+	       memset(pr, 0, sizeof(*pr));
+     } else {
+	  pr = (struct ParsedRequest *)calloc(1, sizeof(struct ParsedRequest));
+     }
      if (pr != NULL)
      {
+	  pr->arena = arena;
 	  ParsedHeader_create(pr);
-	  pr->buf = NULL;
-	  pr->method = NULL;
-	  pr->protocol = NULL;
-	  pr->host = NULL;
-	  pr->path = NULL;
-	  pr->version = NULL;
-	  pr->buf = NULL;
-	  pr->buflen = 0;
+	  pr->state = PS_METHOD;
      }
      return pr;
 }
@@ -326,6 +536,58 @@ int ParsedRequest_unparse_headers(struct ParsedRequest *pr, char *buf,
 }
 
 
+/* Upper bound on the iovecs ParsedRequest_unparse_iov() needs */
+int ParsedRequest_iovCount(struct ParsedRequest *pr)
+{
+     return (int)pr->headersused + 4;
+}
+
+/*
+   Describe the request, with an origin-form request line, as a list of
+   buffers. Runs of headers that are still the lines received from the
+   client become a single entry pointing into the request buffer; headers
+   added with ParsedHeader_set() are entries of their own and removed ones
+   are left out. Nothing is copied.
+*/
+int ParsedRequest_unparse_iov(struct ParsedRequest *pr, struct iovec *iov,
+			      int iovcnt)
+{
+     static const char crlf[] = "\r\n";
+     const char *base;
+     struct ParsedHeader *ph;
+     size_t i;
+     int n = 0;
+
+     if (!pr || !pr->buf || !pr->path ||
+	 iovcnt < ParsedRequest_iovCount(pr))
+	  return -1;
+     base = pr->base;
+
+     /* "METHOD " and " HTTP/x.y\r\n" are taken from the original line */
+     iov[n].iov_base = (char *)base + pr->rl_method.off;
+     iov[n++].iov_len = pr->rl_method.len + 1;
+     iov[n].iov_base = pr->path;
+     iov[n++].iov_len = strlen(pr->path);
+     iov[n].iov_base = (char *)base + pr->rl_version.off - 1;
+     iov[n++].iov_len = pr->rl_version.len + 3;
+
+     for (i = 0; i < pr->headersused; i++) {
+	  ph = pr->headers + i;
+	  if (!ph->key)
+	       continue;
+	  if (n > 3 && (char *)iov[n-1].iov_base + iov[n-1].iov_len == ph->key) {
+	       iov[n-1].iov_len += ph->linelen;
+	  } else {
+	       iov[n].iov_base = ph->key;
+	       iov[n++].iov_len = ph->linelen;
+	  }
+     }
+
+     iov[n].iov_base = (char *)crlf;
+     iov[n++].iov_len = 2;
+     return n;
+}
+
 /* Size of the headers if unparsed into a string */
 size_t ParsedRequest_totalLen(struct ParsedRequest *pr)
 {
@@ -341,7 +603,7 @@ size_t ParsedRequest_totalLen(struct ParsedRequest *pr)
    Parameters: 
    parse: ptr to a newly created ParsedRequest object
    buf: ptr to the buffer containing the request (need not be NUL terminated)
-   and the trailing \r\n\r\n
+   and the trailing \r\n\r\n. The headers keep pointing into buf.
    buflen: length of the buffer including the trailing \r\n\r\n
    
    Return values:
@@ -352,12 +614,7 @@ int
 ParsedRequest_parse(struct ParsedRequest * parse, const char *buf, 
 		    int buflen)
 {
-     char *full_addr;
-     char *saveptr;
-     char *index;
-     char *currentHeader;
-
-     if (parse->buf != NULL) {
+     if (parse->buf != NULL || parse->scan != 0) {
 	  debug("parse object already assigned to a request\n");
 	  return -1;
      }
@@ -366,195 +623,363 @@ ParsedRequest_parse(struct ParsedRequest * parse, const char *buf,
 	  debug("invalid buflen %d", buflen);
 	  return -1;
      }
-   
-     /* Create NUL terminated tmp buffer */
-     char *tmp_buf = (char *)malloc(buflen + 1); /* including NUL */
-     memcpy(tmp_buf, buf, buflen);
-     tmp_buf[buflen] = '\0';
-   
-     index = strstr(tmp_buf, "\r\n\r\n");
-     if (index == NULL) {
-	  debug("invalid request line, no end of header\n");
-	  free(tmp_buf);
-	  return -1;
-     }
-   
-     /* Copy request line into parse->buf */
-     index = strstr(tmp_buf, "\r\n");
-     if (parse->buf == NULL) {
-	  parse->buf = (char *) malloc((index-tmp_buf)+1);
-	  parse->buflen = (index-tmp_buf)+1;
-     }
-     memcpy(parse->buf, tmp_buf, index-tmp_buf);
-     parse->buf[index-tmp_buf] = '\0';
-
-     /* Parse request line */
-     parse->method = strtok_r(parse->buf, " ", &saveptr);
-     if (parse->method == NULL) {
-	  debug( "invalid request line, no whitespace\n");
-	  free(tmp_buf);
-	  free(parse->buf);
-	  parse->buf = NULL;
-	  return -1;
-     }
-     if (strcmp (parse->method, "GET")) {
-	  debug( "invalid request line, method not 'GET': %s\n", 
-		 parse->method);
-	  free(tmp_buf);
-	  free(parse->buf);
-	  parse->buf = NULL;
-	  return -1;
-     }
 
-     full_addr = strtok_r(NULL, " ", &saveptr);
-
-     if (full_addr == NULL) {
-	  debug( "invalid request line, no full address\n");
-	  free(tmp_buf);
-	  free(parse->buf);
-	  parse->buf = NULL;
+     if (ParsedRequest_feed(parse, buf, buflen) <= 0) {
+	  debug("invalid request, incomplete or malformed head\n");
 	  return -1;
      }
+     return 0;
+}
 
-     parse->version = full_addr + strlen(full_addr) + 1;
+/* 
+   Incremental parser. This is a byte-at-a-time state machine over the
+   request head, except that request targets, header names and header
+   values are skipped with the vector kernels from http_scan.c. All positions are kept as
+   offsets into the caller's buffer (or as pointers that are moved along
+   with it), so nothing is copied until the head is complete and the
+   request line fields are materialised.
+*/
+int ParsedRequest_feed(struct ParsedRequest *pr, const char *buf, size_t len)
+{
+     size_t i, skip;
 
-     if (parse->version == NULL) {
-	  debug( "invalid request line, missing version\n");
-	  free(tmp_buf);
-	  free(parse->buf);
-	  parse->buf = NULL;
+     if (pr->state == PS_ERROR)
 	  return -1;
+     if (pr->state == PS_DONE)
+	  return (int)pr->scan;
+
+     /* The caller moved its buffer, move the header views along */
+     if (pr->base != NULL && pr->base != buf) {
+	  size_t h;
+	  for (h = 0; h < pr->headersused; h++) {
+	       struct ParsedHeader *ph = pr->headers + h;
+	       if (ph->key && !ph->owned) {
+		    ph->key = (char *)buf + (ph->key - pr->base);
+		    ph->value = (char *)buf + (ph->value - pr->base);
+	       }
+	  }
      }
-     if (strncmp (parse->version, "HTTP/", 5)) {
-	  debug( "invalid request line, unsupported version %s\n", 
-		 parse->version);
-	  free(tmp_buf);
-	  free(parse->buf);
-	  parse->buf = NULL;
-	  return -1;
+     pr->base = buf;
+
+     for (i = pr->scan; i < len; i++) {
+	  unsigned char c = (unsigned char)buf[i];
+
+	  switch (pr->state) {
+	  case PS_METHOD:
+	       if (c == ' ' && i > 0) {
+		    pr->rl_method.off = 0;
+		    pr->rl_method.len = i;
+		    pr->mark = i + 1;
+		    pr->state = PS_TARGET;
+	       } else if (!is_tchar(c)) {
+		    debug("invalid request line, bad method\n");
+		    goto fail;
+	       }
+	       break;
+	  case PS_TARGET:
+	       /* jump over the target in blocks; stopping at the end of the
+		  data leaves i past len, which ends the loop */
+	       i += http_scan_target(buf + i, len - i);
+	       if (i == len)
+		    break;
+	       c = (unsigned char)buf[i];
+	       if (c == ' ') {
+		    if (i == pr->mark) {
+			 debug("invalid request line, no full address\n");
+			 goto fail;
+		    }
+		    pr->rl_target.off = pr->mark;
+		    pr->rl_target.len = i - pr->mark;
+		    pr->mark = i + 1;
+		    pr->state = PS_VERSION;
+	       } else if (c <= ' ' || c == 0x7f) {
+		    debug("invalid request line, bad target\n");
+		    goto fail;
+	       }
+	       break;
+	  case PS_VERSION:
+	       if (c == '\r') {
+		    pr->rl_version.off = pr->mark;
+		    pr->rl_version.len = i - pr->mark;
+		    pr->state = PS_REQLINE_LF;
+	       } else if (c <= ' ') {
+		    debug("invalid request line, bad version\n");
+		    goto fail;
+	       }
+	       break;
+	  case PS_REQLINE_LF:
+	       if (c != '\n')
+		    goto fail;
+	       if (pr->rl_version.len < 5 ||
+		   strncmp(buf + pr->rl_version.off, "HTTP/", 5)) {
+		    debug("invalid request line, unsupported version\n");
+		    goto fail;
+	       }
+	       pr->state = PS_LINE_START;
+	       break;
+	  case PS_LINE_START:
+	       if (c == '\r') {
+		    pr->state = PS_END_LF;
+	       } else if (is_tchar(c)) {
+		    pr->mark = i;
+		    pr->namehash = hash_step(FNV_OFFSET, c);
+		    pr->state = PS_NAME;
+	       } else {
+		    /* obsolete line folding and garbage are both refused */
+		    debug("invalid header line\n");
+		    goto fail;
+	       }
+	       break;
+	  case PS_NAME:
+	       /* find the colon in blocks, then hash the name up to it */
+	       skip = http_scan_name(buf + i, len - i);
+	       for (; skip > 0; skip--, i++)
+		    pr->namehash = hash_step(pr->namehash, (unsigned char)buf[i]);
+	       if (i == len)
+		    break;
+	       c = (unsigned char)buf[i];
+	       if (c == ':') {
+		    pr->valueend = i;  /* end of the name until the value starts */
+		    pr->state = PS_VALUE_START;
+	       } else {
+		    debug("No colon found\n");
+		    goto fail;
+	       }
+	       break;
+	  case PS_VALUE_START:
+	       if (c == ' ' || c == '\t')
+		    break;
+	       /* name is [mark, valueend), remember it as a header now */
+	       if (ParsedHeader_append(pr, buf + pr->mark, pr->valueend - pr->mark,
+				       buf + i, 0, pr->namehash) < 0)
+		    goto fail;
+	       pr->valueend = i;
+	       pr->state = PS_VALUE;
+	       /* fall through */
+	  case PS_VALUE:
+	       skip = http_scan_value(buf + i, len - i);
+	       if (skip > 0) {
+		    /* trailing whitespace is not part of the value */
+		    size_t e = i + skip;
+		    while (e > i && (buf[e-1] == ' ' || buf[e-1] == '\t'))
+			 e--;
+		    if (e > i)
+			 pr->valueend = e;
+		    i += skip;
+		    if (i == len)
+			 break;
+		    c = (unsigned char)buf[i];
+	       }
+	       if (c == '\r') {
+		    struct ParsedHeader *ph = pr->headers + pr->headersused - 1;
+		    ph->valuelen = pr->valueend - (size_t)(ph->value - buf);
+		    pr->state = PS_VALUE_LF;
+	       } else {
+		    goto fail;
+	       }
+	       break;
+	  case PS_VALUE_LF:
+	       if (c != '\n')
+		    goto fail;
+	       {
+		    struct ParsedHeader *ph = pr->headers + pr->headersused - 1;
+		    ph->linelen = i + 1 - (size_t)(ph->key - buf);
+	       }
+	       pr->state = PS_LINE_START;
+	       break;
+	  case PS_END_LF:
+	       if (c != '\n')
+		    goto fail;
+	       pr->scan = i + 1;
+	       if (ParsedRequest_finish(pr) < 0)
+		    goto fail;
+	       pr->state = PS_DONE;
+	       return (int)pr->scan;
+	  default:
+	       goto fail;
+	  }
      }
 
+     /* the caller bounds the size of the head */
+     pr->scan = len;
+     return 0;
+
+fail:
+     pr->state = PS_ERROR;
+     return -1;
+}
+
+/* 
+   ParsedRequest Private Methods
+*/
+
+/* Split "host[:port]" into its parts. IPv6 literals keep their brackets. */
+static int ParsedRequest_splitAuthority(const char *auth, size_t len,
+					const char **host, size_t *hostlen,
+					const char **port, size_t *portlen)
+{
+     const char *colon = NULL;
+     size_t i;
 
-     parse->protocol = strtok_r(full_addr, "://", &saveptr);
-     if (parse->protocol == NULL) {
-	  debug( "invalid request line, missing host\n");
-	  free(tmp_buf);
-	  free(parse->buf);
-	  parse->buf = NULL;
+     if (len == 0)
 	  return -1;
+     if (auth[0] == '[') {
+	  const char *close = memchr(auth, ']', len);
+	  if (close == NULL)
+	       return -1;
+	  if ((size_t)(close - auth) + 1 < len) {
+	       if (close[1] != ':')
+		    return -1;
+	       colon = close + 1;
+	  }
+     } else {
+	  colon = memchr(auth, ':', len);
      }
-     
-     const char *rem = full_addr + strlen(parse->protocol) + strlen("://");
-     size_t abs_uri_len = strlen(rem);
 
-     parse->host = strtok_r(NULL, "/", &saveptr);
-     if (parse->host == NULL) {
-	  debug( "invalid request line, missing host\n");
-	  free(tmp_buf);
-	  free(parse->buf);
-	  parse->buf = NULL;
-	  return -1;
+     *host = auth;
+     *hostlen = colon ? (size_t)(colon - auth) : len;
+     *port = NULL;
+     *portlen = 0;
+     if (colon) {
+	  *port = colon + 1;
+	  *portlen = len - (size_t)(colon + 1 - auth);
+	  if (*portlen == 0 || *portlen > 5)
+	       return -1;
+	  for (i = 0; i < *portlen; i++)
+	       if (!isdigit((unsigned char)(*port)[i]))
+		    return -1;
+	  if (atoi(*port) == 0 || atoi(*port) > 65535)
+	       return -1;
      }
-     
-     if (strlen(parse->host) == abs_uri_len) {
-	  debug("invalid request line, missing absolute path\n");
-	  free(tmp_buf);
-	  free(parse->buf);
-	  parse->buf = NULL;
+     if (*hostlen == 0)
 	  return -1;
-     }
+     return 0;
+}
 
-     parse->path = strtok_r(NULL, " ", &saveptr);
-     if (parse->path == NULL) {          // replace empty abs_path with "/"
-	  int rlen = strlen(root_abs_path);
-	  parse->path = (char *)malloc(rlen + 1);
-	  strncpy(parse->path, root_abs_path, rlen + 1);
-     } else if (strncmp(parse->path, root_abs_path, strlen(root_abs_path)) == 0) {
-	  debug("invalid request line, path cannot begin "
-		"with two slash characters\n");
-	  free(tmp_buf);
-	  free(parse->buf);
-	  parse->buf = NULL;
-	  parse->path = NULL;
-	  return -1;
-     } else {
-	  // copy parse->path, prefix with a slash
-	  char *tmp_path = parse->path;
-	  int rlen = strlen(root_abs_path);
-	  int plen = strlen(parse->path);
-	  parse->path = (char *)malloc(rlen + plen + 1);
-	  strncpy(parse->path, root_abs_path, rlen);
-	  strncpy(parse->path + rlen, tmp_path, plen + 1);
-     }
-
-     parse->host = strtok_r(parse->host, ":", &saveptr);
-     parse->port = strtok_r(NULL, "/", &saveptr);
-
-     if (parse->host == NULL) {
-	  debug( "invalid request line, missing host\n");
-	  free(tmp_buf);
-	  free(parse->buf);
-	  free(parse->path);
-	  parse->buf = NULL;
-	  parse->path = NULL;
-	  return -1;
-     }
+/* Append a NUL terminated copy of s to the request line store */
+static char *ParsedRequest_store(char **cursor, const char *s, size_t len)
+{
+     char *start = *cursor;
+     memcpy(start, s, len);
+     start[len] = '\0';
+     *cursor = start + len + 1;
+     return start;
+}
 
-     if (parse->port != NULL) {
-	  int port = strtol (parse->port, (char **)NULL, 10);
-	  if (port == 0 && errno == EINVAL) {
-	       debug("invalid request line, bad port: %s\n", parse->port);
-	       free(tmp_buf);
-	       free(parse->buf);
-	       free(parse->path);
-	       parse->buf = NULL;
-	       parse->path = NULL;
+/* 
+   Called once the head is complete: split the request target into its
+   parts and copy the request line fields into a single allocation.
+   Targets in absolute form (http://host[:port]/path), origin form (/path,
+   with the authority taken from the Host header) and, for CONNECT,
+   authority form (host:port; protocol and path are left NULL) are
+   accepted.
+*/
+int ParsedRequest_finish(struct ParsedRequest *pr)
+{
+     const char *base = pr->base;
+     const char *target = base + pr->rl_target.off;
+     size_t tlen = pr->rl_target.len;
+     const char *proto = "http";
+     size_t protolen = 4;
+     const char *auth, *path, *host, *port;
+     size_t authlen, pathlen, hostlen, portlen;
+     char *cursor;
+
+     if (pr->rl_method.len == 7 && memcmp(base, "CONNECT", 7) == 0) {
+	  /* authority form, there is no scheme or path */
+	  proto = NULL;
+	  protolen = 0;
+	  auth = target;
+	  authlen = tlen;
+	  path = NULL;
+	  pathlen = 0;
+     } else if (target[0] == '/') {
+	  struct ParsedHeader *hh = ParsedHeader_getId(pr, HDR_HOST);
+	  if (hh == NULL) {
+	       debug("invalid request line, missing host\n");
+	       return -1;
+	  }
+	  auth = hh->value;
+	  authlen = hh->valuelen;
+	  path = target;
+	  pathlen = tlen;
+     } else {
+	  const char *sep = NULL;
+	  size_t i;
+	  for (i = 0; i + 3 <= tlen; i++) {
+	       if (memcmp(target + i, "://", 3) == 0) {
+		    sep = target + i;
+		    break;
+	       }
+	  }
+	  if (sep == NULL || sep == target) {
+	       debug("invalid request line, missing host\n");
+	       return -1;
+	  }
+	  proto = target;
+	  protolen = (size_t)(sep - target);
+	  auth = sep + 3;
+	  path = memchr(auth, '/', tlen - (size_t)(auth - target));
+	  if (path == NULL) {          // replace empty abs_path with "/"
+	       authlen = tlen - (size_t)(auth - target);
+	       path = root_abs_path;
+	       pathlen = 1;
+	  } else {
+	       authlen = (size_t)(path - auth);
+	       pathlen = tlen - (size_t)(path - target);
+	  }
+	  if (pathlen > 1 && path[1] == '/') {
+	       debug("invalid request line, path cannot begin "
+		     "with two slash characters\n");
 	       return -1;
 	  }
      }
 
-   
-     /* Parse headers */
-     int ret = 0;
-     currentHeader = strstr(tmp_buf, "\r\n")+2;
-     while (currentHeader[0] != '\0' && 
-	    !(currentHeader[0] == '\r' && currentHeader[1] == '\n')) {
-	  
-	  //debug("line %s %s", parse->version, currentHeader);
-
-	  if (ParsedHeader_parse(parse, currentHeader)) {
-	       ret = -1;
-	       break;
-	  }
+     if (ParsedRequest_splitAuthority(auth, authlen, &host, &hostlen,
+				      &port, &portlen) < 0) {
+	  debug("invalid request line, bad host or port\n");
+	  return -1;
+     }
+     if (path == NULL && port == NULL) {
+	  debug("invalid request line, CONNECT needs a port\n");
+	  return -1;
+     }
 
-	  currentHeader = strstr(currentHeader, "\r\n");
-	  if (currentHeader == NULL || strlen (currentHeader) < 2)
-	       break;
+     pr->buflen = pr->rl_method.len + protolen + hostlen + portlen +
+	  pathlen + pr->rl_version.len + 6;
+     pr->buf = (char *)pr_alloc(pr, pr->buflen);
+     if (pr->buf == NULL)
+	  return -1;
 
-	  currentHeader += 2;
-     }
-     free(tmp_buf);
-     return ret;
+     cursor = pr->buf;
+     pr->method = ParsedRequest_store(&cursor, base + pr->rl_method.off,
+				      pr->rl_method.len);
+     pr->protocol = proto ? ParsedRequest_store(&cursor, proto, protolen) : NULL;
+     pr->host = ParsedRequest_store(&cursor, host, hostlen);
+     pr->port = port ? ParsedRequest_store(&cursor, port, portlen) : NULL;
+     pr->path = path ? ParsedRequest_store(&cursor, path, pathlen) : NULL;
+     pr->version = ParsedRequest_store(&cursor, base + pr->rl_version.off,
+				       pr->rl_version.len);
+     return 0;
 }
 
-/* 
-   ParsedRequest Private Methods
-*/
-
 size_t ParsedRequest_requestLineLen(struct ParsedRequest *pr)
 {
      if (!pr || !pr->buf)
 	  return 0;
 
      size_t len =  
-	  strlen(pr->method) + 1 + strlen(pr->protocol) + 3 + 
+	  strlen(pr->method) + 1 + 
 	  strlen(pr->host) + 1 + strlen(pr->version) + 2;
      if(pr->port != NULL)
      {
 	  len += strlen(pr->port)+1;
      }
-     /* path is at least a slash */
-     len += strlen(pr->path);
+     /* path is at least a slash, except for CONNECT (authority form) */
+     if(pr->path != NULL)
+     {
+	  len += strlen(pr->protocol) + 3 + strlen(pr->path);
+     }
      return len;
 }
 
@@ -574,10 +999,13 @@ int ParsedRequest_printRequestLine(struct ParsedRequest *pr,
      current[0]  = ' ';
      current += 1;
 
-     memcpy(current, pr->protocol, strlen(pr->protocol));
-     current += strlen(pr->protocol);
-     memcpy(current, "://", 3);
-     current += 3;
+     if(pr->path != NULL)
+     {
+	  memcpy(current, pr->protocol, strlen(pr->protocol));
+	  current += strlen(pr->protocol);
+	  memcpy(current, "://", 3);
+	  current += 3;
+     }
      memcpy(current, pr->host, strlen(pr->host));
      current += strlen(pr->host);
      if(pr->port != NULL)
@@ -587,9 +1015,11 @@ int ParsedRequest_printRequestLine(struct ParsedRequest *pr,
 	  memcpy(current, pr->port, strlen(pr->port));
 	  current += strlen(pr->port);
      }
-     /* path is at least a slash */
-     memcpy(current, pr->path, strlen(pr->path));
-     current += strlen(pr->path);
+     if(pr->path != NULL)
+     {
+	  memcpy(current, pr->path, strlen(pr->path));
+	  current += strlen(pr->path);
+     }
 
      current[0] = ' ';
      current += 1;
@@ -13,6 +13,9 @@
 #include <errno.h>
 
 #include <ctype.h>
+#include <sys/uio.h>
+
+#include "arena.h"
 
 #ifndef PROXY_PARSE
 #define PROXY_PARSE
@@ -24,12 +27,59 @@
    request. The request buffer consists of a request line followed by a number
    of headers. Request line fields such as method, protocol etc. are stored
    explicitly. Headers such as 'Content-Length' and their values are maintained
-   in a linked list. Each node in this list is a ParsedHeader and contains a
+   in an array. Each entry in this array is a ParsedHeader and contains a
    key-value pair.
 
-   The buf and buflen fields are used internally to maintain the parsed request
-   line.
+   The request line fields are NUL terminated copies kept together in buf;
+   buflen is its size. Everything else refers to the request buffer the
+   caller passed in, which therefore has to outlive the ParsedRequest.
+
+   The remaining fields hold the state of the incremental parser, see
+   ParsedRequest_feed().
  */
+
+/*
+   Ids of the well-known headers. Their names are recognised with a perfect
+   hash while parsing and each request keeps a slot per id pointing at the
+   first occurrence, so looking one of them up never scans the headers.
+ */
+enum ParsedHeaderId {
+     HDR_HOST = 0,
+     HDR_CONNECTION,
+     HDR_PROXY_CONNECTION,
+     HDR_KEEP_ALIVE,
+     HDR_CONTENT_LENGTH,
+     HDR_TRANSFER_ENCODING,
+     HDR_TE,
+     HDR_TRAILER,
+     HDR_UPGRADE,
+     HDR_EXPECT,
+     HDR_CACHE_CONTROL,
+     HDR_PRAGMA,
+     HDR_PROXY_AUTHORIZATION,
+     HDR_PROXY_AUTHENTICATE,
+     HDR_AUTHORIZATION,
+     HDR_COOKIE,
+     HDR_CONTENT_TYPE,
+     HDR_IF_MODIFIED_SINCE,
+     HDR_IF_NONE_MATCH,
+     HDR_RANGE,
+     HDR_ACCEPT,
+     HDR_ACCEPT_ENCODING,
+     HDR_USER_AGENT,
+     HDR_REFERER,
+     HDR_VIA,
+     HDR_X_FORWARDED_FOR,
+     HDR_COUNT
+};
+
+#define HDR_UNKNOWN (-1)
+
+struct ParsedSlice {
+     size_t off;
+     size_t len;
+};
+
 struct ParsedRequest {
      char *method; 
      char *protocol; 
@@ -42,29 +92,80 @@ struct ParsedRequest {
      struct ParsedHeader *headers;
      size_t headersused;
      size_t headerslen;
+
+     const char *base;
+     size_t scan;
+     size_t mark;
+     size_t valueend;
+     int state;
+     struct ParsedSlice rl_method;
+     struct ParsedSlice rl_target;
+     struct ParsedSlice rl_version;
+     unsigned namehash;
+
+     /* index + 1 of the first header with each id, 0 if absent */
+     unsigned known[HDR_COUNT];
+     /* bit per id that occurs more than once */
+     unsigned long multi;
+
+     /* where the request's memory comes from, NULL for malloc() */
+     struct arena *arena;
 };
 
 /* 
    ParsedHeader: any header after the request line is a key-value pair with the
-   format "key:value\r\n" and is maintained in the ParsedHeader linked list
-   within ParsedRequest
+   format "key:value\r\n" and is maintained in the ParsedHeader array
+   within ParsedRequest. key and value point straight into the request buffer
+   and are NOT NUL terminated, use keylen and valuelen. Headers added with
+   ParsedHeader_set() own a private copy instead (owned is set). Either way
+   key starts a complete "key: value\r\n" line of linelen bytes.
+
+   Names are case-insensitive (RFC 9110 section 5.1): hash is a FNV-1a hash
+   of the lowercased name and id its HDR_* id or HDR_UNKNOWN.
 */
 struct ParsedHeader {
      char * key;
      size_t keylen;
      char * value;
      size_t valuelen;
+     size_t linelen;
+     int owned;
+     unsigned hash;
+     int id;
 };
 
-
 /* Create an empty parsing object to be used exactly once for parsing a single
  * request buffer */
 struct ParsedRequest* ParsedRequest_create();
 
-/* Parse the request buffer in buf given that buf is of length buflen */
+/* Same, but take the object and everything the parser allocates for it from
+ * arena; ParsedRequest_destroy() then releases nothing and the memory goes
+ * away with the arena */
+struct ParsedRequest* ParsedRequest_createIn(struct arena *arena);
+
+/* Parse the request buffer in buf given that buf is of length buflen and
+ * holds the complete request head */
 int ParsedRequest_parse(struct ParsedRequest * parse, const char *buf,
 			int buflen);
 
+/* 
+   Incrementally parse a request head. buf holds everything received so far
+   for this request and len is its length; only bytes past the previous call
+   are examined, so the caller can simply feed its receive buffer after every
+   read. The buffer may be moved between calls (e.g. by realloc), as long as
+   the bytes already fed are unchanged.
+
+   Returns the number of bytes consumed by the head (request line, headers
+   and the empty line) once it is complete, 0 if more data is needed and -1
+   if the request is malformed. Anything after the consumed bytes belongs to
+   the request body.
+ */
+int ParsedRequest_feed(struct ParsedRequest *parse, const char *buf,
+		       size_t len);
+
+/* Return 1 if s is a valid HTTP token (e.g. a request method), 0 otherwise */
+int ParsedRequest_isToken(const char *s);
+
 /* Destroy the parsing object. */
 void ParsedRequest_destroy(struct ParsedRequest *pr);
 
@@ -87,6 +188,21 @@ int ParsedRequest_unparse(struct ParsedRequest *pr, char *buf,
 int ParsedRequest_unparse_headers(struct ParsedRequest *pr, char *buf, 
 				  size_t buflen);
 
+/* 
+   Describe the request as buffers for writev(), with the request line in
+   origin form (METHOD /path VERSION). The entries point into the request
+   buffer and the headers, so they are valid until the request is changed
+   or destroyed. iov must have room for ParsedRequest_iovCount() entries.
+   The path is always entry 1, so it can be swapped for an absolute URL
+   when the request goes to another proxy.
+
+   @return the number of entries used, or -1 for a request without a path
+           (e.g. CONNECT)
+ */
+int ParsedRequest_unparse_iov(struct ParsedRequest *pr, struct iovec *iov,
+			      int iovcnt);
+int ParsedRequest_iovCount(struct ParsedRequest *pr);
+
 /* Total length including request line, headers and the trailing \r\n*/
 size_t ParsedRequest_totalLen(struct ParsedRequest *pr);
 
@@ -95,14 +211,23 @@ size_t ParsedRequest_totalLen(struct ParsedRequest *pr);
  */
 size_t ParsedHeader_headersLen(struct ParsedRequest *pr);
 
-/* Set, get, and remove null-terminated header keys and values */
+/* Set, get, and remove null-terminated header keys and values. Keys are
+ * matched case-insensitively. get returns the first occurrence, set and
+ * remove act on every occurrence. */
 int ParsedHeader_set(struct ParsedRequest *pr, const char * key, 
 		      const char * value);
 struct ParsedHeader* ParsedHeader_get(struct ParsedRequest *pr, 
 				      const char * key);
 int ParsedHeader_remove (struct ParsedRequest *pr, const char * key);
 
-/* debug() prints out debugging info if DEBUG is set to 1 */
+/* Constant time lookup of a well-known header by id, NULL if absent */
+struct ParsedHeader* ParsedHeader_getId(struct ParsedRequest *pr, int id);
+
+/* Return the HDR_* id of the header name key of length len, or
+ * HDR_UNKNOWN */
+int ParsedHeader_id(const char *key, size_t len);
+
+/* debug() logs debugging info at LV_DEBUG if DEBUG is set to 1 */
 void debug(const char * format, ...);
 
 /* Example usage:
@@ -153,7 +278,7 @@ void debug(const char * format, ...);
    // Get a specific header (key) from the headers. A key is a header field 
    // such as "If-Modified-Since" which is followed by ":"
    struct ParsedHeader *r = ParsedHeader_get(req, "If-Modified-Since");
-   printf("Modified value: %s\n", r->value);
+   printf("Modified value: %.*s\n", (int)r->valuelen, r->value);
    
    // Remove a specific header by name. In this case remove
    // the "If-Modified-Since" header. 
@@ -174,7 +299,7 @@ void debug(const char * format, ...);
 
    // Check the modified Header key value pair
     r = ParsedHeader_get(req, "Last-Modified");
-    printf("Last-Modified value: %s\n", r->value);
+    printf("Last-Modified value: %.*s\n", (int)r->valuelen, r->value);
 
    // Call destroy on any ParsedRequests that you
    // create once you are done using them. This will
@@ -1,9 +1,27 @@
 #include "proxy_parse.h"
+#include "http_scan.h"
+#include "arena.h"
+#include "metrics.h"
+#include "log.h"
+#include "cache.h"
+#include "origin.h"
+#include "admin.h"
+#include "snapshot.h"
+#include "config.h"
+#include "upgrade.h"
+#include "ratelimit.h"
+#include "refresh.h"
+#include "parent.h"
+#include "net.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <limits.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <arpa/inet.h>
@@ -13,46 +31,131 @@
 #include <sys/wait.h>
 #include <errno.h>
 #include <pthread.h>
-#include <semaphore.h>
 #include <signal.h>
+#include <ifaddrs.h>
+#include <poll.h>
 
-#define MAX_BYTES 4096      // Max allowed size of request/response
-#define MAX_CLIENTS 400     // Max number of client requests served at a time
-#define MAX_SIZE 200*(1<<20)     // Size of the cache (200MB)
-#define MAX_ELEMENT_SIZE 10*(1<<20)     // Max size of an element in cache (10MB)
+#ifndef IOV_MAX
+#define IOV_MAX 1024        // Most buffers one writev() takes (POSIX minimum is 16, Linux has 1024)
+#endif
+#define MAX_SELF_NAMES 64   // Most names and addresses the proxy answers to as itself
+#define UPGRADE_DONE 0      // Sent on the signal pipe in place of a signal once an upgrade worked
 
-// Cache element structure to store response data
-typedef struct cache_element cache_element;
+// Framing of a request body that has to be streamed to the origin
+struct request_body {
+    const char *prefix;       // Body bytes already read along with the headers
+    int prefix_len;           // Number of bytes in prefix
+    long long content_length; // Content-Length, or -1 if absent
+    int chunked;              // Transfer-Encoding: chunked
+    int expect_continue;      // Client sent Expect: 100-continue
+};
+
+// Receive buffer for a client request head, grown on demand up to limit
+struct conn_buffer {
+    char *data;
+    size_t len;               // Bytes received
+    size_t cap;               // Bytes allocated
+    size_t limit;             // Largest head we accept
+    struct arena *arena;      // Where data comes from
+};
+
+// Accepted connection and when it was accepted
+struct queued_conn {
+    int fd;
+    struct sockaddr_in addr;  // Client address
+    uint64_t accepted;        // now_usec() at accept time
+    struct client *client;    // Rate limit slot of the client, may be NULL
+};
+
+// Accepted connections waiting for a worker thread
+struct conn_queue {
+    struct queued_conn *conns;
+    int capacity;             // queue_size; connections beyond it are shed
+    int head;                 // Index of the oldest queued connection
+    int count;                // Number of queued connections
+    int busy;                 // Connections taken by a worker and not done yet
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+};
+
+// Why handle_request() relayed no response
+enum req_error {
+    REQ_FAILED = -1,          // Connect or local failure
+    REQ_ORIGIN_DOWN = -2,     // Origin at its cap or its breaker open
+    REQ_TIMEOUT = -3,         // Origin silent for origin_timeout
+    REQ_ORIGIN_ERROR = -4,    // Origin answered 5xx or nothing, with a fallback
+    REQ_UNREACHABLE = -5      // No connect to the origin or a parent, now or a moment ago
+};
 
-struct cache_element {
-    char* data;               // Stores HTTP response
-    int len;                  // Length of data
-    char* url;                // URL of the request
-    time_t lru_time_track;    // Timestamp for LRU tracking
-    cache_element* next;      // Pointer to next element
+// Incremental tracker for the end of a chunked body
+struct chunk_tracker {
+    int state;
+    unsigned long long remaining;
 };
 
 // Function declarations
-cache_element* find(char* url);
-int add_cache_element(char* data, int size, char* url);
-void remove_cache_element();
-void cleanup_cache();
-void* thread_fn(void* socketNew);
-int handle_request(int clientSocket, struct ParsedRequest *request, char *tempReq);
-int connectRemoteServer(char* host_addr, int port_num);
+void* thread_fn(void* arg);
+void handle_client(int socket, const struct sockaddr_in *peer, struct arena *arena, struct request_timing *timing, int overloaded);
+int conn_queue_push(struct conn_queue *q, int fd, const struct sockaddr_in *addr, struct client *client);
+void conn_queue_pop(struct conn_queue *q, struct queued_conn *conn);
+void conn_queue_done(struct conn_queue *q);
+int conn_queue_active(struct conn_queue *q);
+int handle_request(int clientSocket, struct ParsedRequest *request, char *cacheKey, struct request_body *body, struct arena *arena, struct request_timing *timing, int fallback);
+void send_cached(int socket, const struct cache_entry *e, struct request_timing *timing);
+int store_response(const char *key, const char *data, size_t len, int status);
+int refresh_fetch(const char *key);
+int get_request_body(struct ParsedRequest *request, struct request_body *body);
+int forward_request_body(int clientSocket, int remoteSocket, struct request_body *body, char *buf, size_t buflen);
+int chunk_tracker_feed(struct chunk_tracker *ct, const char *data, int len);
+int is_unsafe_method(const char *method);
+void strip_hop_by_hop(struct ParsedRequest *request);
+int send_iov(int socket, struct iovec *iov, int iovcnt);
+char* build_cache_key(struct ParsedRequest *request, struct arena *arena);
+int conn_buffer_init(struct conn_buffer *in, size_t limit, struct arena *arena);
+int conn_buffer_grow(struct conn_buffer *in);
+int is_self_request(struct ParsedRequest *request);
+void add_self_names(const struct sockaddr_in *listen_addr);
+void send_metrics(int socket, struct arena *arena);
+int send_purge_result(int socket, int removed);
+void tunnel_connect(int socket, int remote_socket, const char *pending, int pending_len, struct arena *arena);
+int connectRemoteServer(char* host_addr, int port_num, struct request_timing *timing);
+int connect_upstream(char *host, int port, const char *key, struct request_timing *timing, struct parent **via);
+int parent_open_tunnel(int remote, const char *target);
+int probe_parent(struct parent *p);
 int sendErrorMessage(int socket, int status_code);
+void send_overloaded(int socket);
 int checkHTTPversion(char *msg);
 void signal_handler(int sig);
+void upgrade_done(int ok);
+void drain_and_exit(int sig);
+void* reload_thread(void* arg);
+void apply_config(const struct config *cfg);
+int open_listener(struct sockaddr_in *server_addr);
+void admit_client(int fd, const struct sockaddr_in *addr);
 
 // Global variables
-int port_number = 8080;               // Default Port
+struct config config;                 // Settings in effect
+const char *config_path;              // Config file given with -c, or NULL
+int cli_port;                         // Port given on the command line, 0 if none
+int port_number;                      // Port the proxy listens on
+int worker_count;                     // Number of worker threads
+// Set by apply_config(); workers read them for each connection
+size_t max_header_bytes = DEFAULT_MAX_HEADER;  // Largest request head accepted
+size_t io_buffer_bytes = DEFAULT_BUFFER_SIZE;  // Receive buffers for responses and tunnels
+int tunnel_timeout = DEFAULT_TUNNEL_TIMEOUT;   // Seconds a tunnel may sit idle
+int connect_timeout = DEFAULT_CONNECT_TIMEOUT; // Seconds a connect to an origin may take
+int origin_timeout = DEFAULT_ORIGIN_TIMEOUT;   // Seconds an origin may go silent
+int queue_timeout_ms;                 // Longest wait for a worker before shedding, 0 for no limit
+int shed_serve_hits = 1;              // Still serve cache hits to connections being shed
 int proxy_socketId;                   // Socket descriptor of proxy server
-pthread_t tid[MAX_CLIENTS];           // Array to store the thread ids of clients
-sem_t seamaphore;                     // Semaphore for limiting concurrent clients
-pthread_mutex_t lock;                 // Mutex for cache access
-
-cache_element* head = NULL;           // Pointer to the cache
-int cache_size = 0;                   // Current size of the cache
+pthread_t *tid;                       // Array to store the thread ids of the workers
+struct conn_queue pending;            // Connections accepted but not yet served
+struct cache cache;                   // Responses to GET requests
+struct cache negative;                // 301, 404 and 410 responses, short-lived
+char *self_names[MAX_SELF_NAMES];     // Hosts that mean the proxy itself
+int self_name_count;
+const char *snapshot_dir;             // Where the cache is saved, NULL if it is not
+int shutdown_pipe[2];                 // Written by the signal handler, read by the accept loop
 
 /**
  * Send an HTTP error message to the client.
@@ -71,121 +174,610 @@ int sendErrorMessage(int socket, int status_code) {
 
     switch(status_code) {
         case 400: snprintf(str, sizeof(str), "HTTP/1.1 400 Bad Request\r\nContent-Length: 95\r\nConnection: close\r\nContent-Type: text/html\r\nDate: %s\r\nServer: ProxyServer/1.0\r\n\r\n<HTML><HEAD><TITLE>400 Bad Request</TITLE></HEAD>\n<BODY><H1>400 Bad Request</H1>\n</BODY></HTML>", currentTime);
-                  printf("400 Bad Request\n");
                   send(socket, str, strlen(str), 0);
                   break;
 
         case 403: snprintf(str, sizeof(str), "HTTP/1.1 403 Forbidden\r\nContent-Length: 112\r\nContent-Type: text/html\r\nConnection: close\r\nDate: %s\r\nServer: ProxyServer/1.0\r\n\r\n<HTML><HEAD><TITLE>403 Forbidden</TITLE></HEAD>\n<BODY><H1>403 Forbidden</H1><br>Permission Denied\n</BODY></HTML>", currentTime);
-                  printf("403 Forbidden\n");
                   send(socket, str, strlen(str), 0);
                   break;
 
         case 404: snprintf(str, sizeof(str), "HTTP/1.1 404 Not Found\r\nContent-Length: 91\r\nContent-Type: text/html\r\nConnection: close\r\nDate: %s\r\nServer: ProxyServer/1.0\r\n\r\n<HTML><HEAD><TITLE>404 Not Found</TITLE></HEAD>\n<BODY><H1>404 Not Found</H1>\n</BODY></HTML>", currentTime);
-                  printf("404 Not Found\n");
+                  send(socket, str, strlen(str), 0);
+                  break;
+
+        case 417: snprintf(str, sizeof(str), "HTTP/1.1 417 Expectation Failed\r\nContent-Length: 109\r\nConnection: close\r\nContent-Type: text/html\r\nDate: %s\r\nServer: ProxyServer/1.0\r\n\r\n<HTML><HEAD><TITLE>417 Expectation Failed</TITLE></HEAD>\n<BODY><H1>417 Expectation Failed</H1>\n</BODY></HTML>", currentTime);
+                  send(socket, str, strlen(str), 0);
+                  break;
+
+        case 429: snprintf(str, sizeof(str), "HTTP/1.1 429 Too Many Requests\r\nContent-Length: 107\r\nConnection: close\r\nRetry-After: 1\r\nContent-Type: text/html\r\nDate: %s\r\nServer: ProxyServer/1.0\r\n\r\n<HTML><HEAD><TITLE>429 Too Many Requests</TITLE></HEAD>\n<BODY><H1>429 Too Many Requests</H1>\n</BODY></HTML>", currentTime);
+                  send(socket, str, strlen(str), MSG_DONTWAIT);
+                  break;
+
+        case 431: snprintf(str, sizeof(str), "HTTP/1.1 431 Request Header Fields Too Large\r\nContent-Length: 135\r\nConnection: close\r\nContent-Type: text/html\r\nDate: %s\r\nServer: ProxyServer/1.0\r\n\r\n<HTML><HEAD><TITLE>431 Request Header Fields Too Large</TITLE></HEAD>\n<BODY><H1>431 Request Header Fields Too Large</H1>\n</BODY></HTML>", currentTime);
                   send(socket, str, strlen(str), 0);
                   break;
 
         case 500: snprintf(str, sizeof(str), "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 115\r\nConnection: close\r\nContent-Type: text/html\r\nDate: %s\r\nServer: ProxyServer/1.0\r\n\r\n<HTML><HEAD><TITLE>500 Internal Server Error</TITLE></HEAD>\n<BODY><H1>500 Internal Server Error</H1>\n</BODY></HTML>", currentTime);
-                  printf("500 Internal Server Error\n");
                   send(socket, str, strlen(str), 0);
                   break;
 
         case 501: snprintf(str, sizeof(str), "HTTP/1.1 501 Not Implemented\r\nContent-Length: 103\r\nConnection: close\r\nContent-Type: text/html\r\nDate: %s\r\nServer: ProxyServer/1.0\r\n\r\n<HTML><HEAD><TITLE>501 Not Implemented</TITLE></HEAD>\n<BODY><H1>501 Not Implemented</H1>\n</BODY></HTML>", currentTime);
-                  printf("501 Not Implemented\n");
+                  send(socket, str, strlen(str), 0);
+                  break;
+
+        case 502: snprintf(str, sizeof(str), "HTTP/1.1 502 Bad Gateway\r\nContent-Length: 95\r\nConnection: close\r\nContent-Type: text/html\r\nDate: %s\r\nServer: ProxyServer/1.0\r\n\r\n<HTML><HEAD><TITLE>502 Bad Gateway</TITLE></HEAD>\n<BODY><H1>502 Bad Gateway</H1>\n</BODY></HTML>", currentTime);
+                  send(socket, str, strlen(str), 0);
+                  break;
+
+        case 503: snprintf(str, sizeof(str), "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 111\r\nConnection: close\r\nContent-Type: text/html\r\nDate: %s\r\nServer: ProxyServer/1.0\r\n\r\n<HTML><HEAD><TITLE>503 Service Unavailable</TITLE></HEAD>\n<BODY><H1>503 Service Unavailable</H1>\n</BODY></HTML>", currentTime);
+                  send(socket, str, strlen(str), 0);
+                  break;
+
+        case 504: snprintf(str, sizeof(str), "HTTP/1.1 504 Gateway Timeout\r\nContent-Length: 103\r\nConnection: close\r\nContent-Type: text/html\r\nDate: %s\r\nServer: ProxyServer/1.0\r\n\r\n<HTML><HEAD><TITLE>504 Gateway Timeout</TITLE></HEAD>\n<BODY><H1>504 Gateway Timeout</H1>\n</BODY></HTML>", currentTime);
                   send(socket, str, strlen(str), 0);
                   break;
 
         case 505: snprintf(str, sizeof(str), "HTTP/1.1 505 HTTP Version Not Supported\r\nContent-Length: 125\r\nConnection: close\r\nContent-Type: text/html\r\nDate: %s\r\nServer: ProxyServer/1.0\r\n\r\n<HTML><HEAD><TITLE>505 HTTP Version Not Supported</TITLE></HEAD>\n<BODY><H1>505 HTTP Version Not Supported</H1>\n</BODY></HTML>", currentTime);
-                  printf("505 HTTP Version Not Supported\n");
                   send(socket, str, strlen(str), 0);
                   break;
 
         default:  return -1;
     }
+    metric_add(M_CLIENT_BYTES_OUT, strlen(str));
     return 1;
 }
 
+// Answer to a connection shed under load, formatted once: no Date, since
+// it has to go out without any work
+static const char overloaded_response[] =
+    "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 111\r\nConnection: close\r\nRetry-After: 1\r\n"
+    "Content-Type: text/html\r\nServer: ProxyServer/1.0\r\n\r\n"
+    "<HTML><HEAD><TITLE>503 Service Unavailable</TITLE></HEAD>\n<BODY><H1>503 Service Unavailable</H1>\n</BODY></HTML>";
+
+/**
+ * Tell a client the proxy is overloaded and to come back in a second.
+ * Never blocks: the answer is sent only if it fits in the send buffer.
+ * 
+ * @param socket Client socket
+ */
+void send_overloaded(int socket) {
+    ssize_t n = send(socket, overloaded_response, sizeof(overloaded_response) - 1, MSG_DONTWAIT);
+    metric_add(M_CONNECTIONS_SHED, 1);
+    if (n > 0) {
+        metric_add(M_CLIENT_BYTES_OUT, n);
+    }
+}
+
 /**
  * Connect to a remote server.
  * 
  * @param host_addr Host address or domain name
  * @param port_num Port number
- * @return Socket descriptor on success, -1 on failure
+ * @param timing Gets the DNS and connect phases, may be NULL
+ * @return Socket descriptor on success, else a connect_error
  */
-int connectRemoteServer(char* host_addr, int port_num) {
-    // Creating Socket for remote server
-    int remoteSocket = socket(AF_INET, SOCK_STREAM, 0);
+int connectRemoteServer(char* host_addr, int port_num, struct request_timing *timing) {
+    char name[256];
+    char port[8];
+    size_t len = strlen(host_addr);
+
+    // IPv6 literals come bracketed in the Host header
+    if (len >= 2 && host_addr[0] == '[' && host_addr[len - 1] == ']') {
+        host_addr++;
+        len -= 2;
+    }
+    if (len >= sizeof(name)) {
+        log_warn("No such host exists: %s", host_addr);
+        metric_add(M_CONNECT_FAILURES, 1);
+        return CONNECT_NO_HOST;
+    }
+    memcpy(name, host_addr, len);
+    name[len] = '\0';
+    snprintf(port, sizeof(port), "%d", port_num);
+
+    // Resolve the name; getaddrinfo() is thread safe, unlike gethostbyname()
+    struct addrinfo hints, *res, *ai;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    timing_start(timing);
+    int err = getaddrinfo(name, port, &hints, &res);
+    timing_end(timing, PH_DNS);
+    if (err != 0) {
+        log_warn("No such host exists: %s (%s)", name, gai_strerror(err));
+        metric_add(M_CONNECT_FAILURES, 1);
+        return CONNECT_NO_HOST;
+    }
+
+    // Connect to the first address that accepts within connect_timeout,
+    // rather than the minutes the kernel would wait for an unreachable host
+    int remoteSocket = -1, refused = 1;
+    int timeout_ms = __atomic_load_n(&connect_timeout, __ATOMIC_RELAXED) * 1000;
+    for (ai = res; ai != NULL; ai = ai->ai_next) {
+        remoteSocket = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (remoteSocket < 0) {
+            continue;
+        }
+        fcntl(remoteSocket, F_SETFL, O_NONBLOCK);
+        int r = connect(remoteSocket, ai->ai_addr, ai->ai_addrlen);
+        int soerr = r < 0 ? errno : 0;
+        if (r < 0 && errno == EINPROGRESS) {
+            struct pollfd p = {remoteSocket, POLLOUT, 0};
+            socklen_t soerr_len = sizeof(soerr);
+            if (poll(&p, 1, timeout_ms) == 1 &&
+                getsockopt(remoteSocket, SOL_SOCKET, SO_ERROR, &soerr, &soerr_len) == 0 && soerr == 0) {
+                r = 0;
+            }
+        }
+        if (r == 0) {
+            fcntl(remoteSocket, F_SETFL, 0);
+            break;
+        }
+        // Only an origin that refused on every address counts as refusing
+        refused &= soerr == ECONNREFUSED;
+        close(remoteSocket);
+        remoteSocket = -1;
+    }
+    timing_end(timing, PH_CONNECT);
+    freeaddrinfo(res);
 
     if (remoteSocket < 0) {
-        printf("Error in Creating Socket.\n");
-        return -1;
+        log_warn("Error in connecting to %s:%d", name, port_num);
+        metric_add(M_CONNECT_FAILURES, 1);
+        return refused ? CONNECT_REFUSED : CONNECT_FAILED;
     }
+
+    // A response that does not start within origin_timeout is given up on
+    struct timeval tv = {__atomic_load_n(&origin_timeout, __ATOMIC_RELAXED), 0};
+    setsockopt(remoteSocket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
     
-    // Get host by the name or ip address provided
-    struct hostent *host = gethostbyname(host_addr);    
-    if (host == NULL) {
-        fprintf(stderr, "No such host exists: %s\n", host_addr);    
-        close(remoteSocket);
+    return remoteSocket;
+}
+
+/**
+ * Connect to where a request goes: its parents in ring order, moving on
+ * when one fails, else the origin itself.
+ * 
+ * @param host Origin host
+ * @param port Origin port
+ * @param key Cache key of the request, or host:port of a tunnel
+ * @param timing Gets the DNS and connect phases, may be NULL
+ * @param via Set to the parent connected to, NULL for the origin
+ * @return Socket descriptor on success, else a connect_error; only a
+ *         connect to the origin itself fails with more than CONNECT_FAILED
+ */
+int connect_upstream(char *host, int port, const char *key, struct request_timing *timing, struct parent **via) {
+    struct parent *order[MAX_PARENTS];
+    int n = parent_route(key, order, MAX_PARENTS);
+
+    *via = NULL;
+    for (int i = 0; i < n; i++) {
+        int remote = connectRemoteServer(order[i]->host, order[i]->port, timing);
+        parent_result(order[i], remote >= 0);
+        if (remote >= 0) {
+            *via = order[i];
+            return remote;
+        }
+    }
+    if (n > 0 && !parent_direct()) {
+        return CONNECT_FAILED;
+    }
+    return connectRemoteServer(host, port, timing);
+}
+
+/**
+ * Ask a parent proxy to open a tunnel. Its answer is read a byte at a
+ * time up to the end of the head, so no byte of the tunnel is taken.
+ * 
+ * @param remote Socket connected to the parent
+ * @param target host:port to tunnel to
+ * @return Status code of the parent's answer, -1 if there was none
+ */
+int parent_open_tunnel(int remote, const char *target) {
+    char head[1024];
+    int len = snprintf(head, sizeof(head), "CONNECT %s HTTP/1.1\r\nHost: %s\r\n\r\n", target, target);
+    if (len < 0 || (size_t)len >= sizeof(head) || send(remote, head, len, 0) != len) {
         return -1;
     }
+    metric_add(M_ORIGIN_BYTES_OUT, len);
+
+    len = 0;
+    while (len < 4 || memcmp(head + len - 4, "\r\n\r\n", 4) != 0) {
+        if ((size_t)len == sizeof(head) - 1 || recv(remote, head + len, 1, 0) != 1) {
+            return -1;
+        }
+        len++;
+    }
+    metric_add(M_ORIGIN_BYTES_IN, len);
+    head[len] = '\0';
+    return len > 12 && strncmp(head, "HTTP/", 5) == 0 ? atoi(head + 9) : -1;
+}
 
-    // Insert ip address and port number of host in struct `server_addr`
-    struct sockaddr_in server_addr;
+/**
+ * Check a parent proxy by connecting to it, on the parent check thread.
+ * 
+ * @param p Parent
+ * @return 0 if it accepted the connection, -1 if not
+ */
+int probe_parent(struct parent *p) {
+    int remote = connectRemoteServer(p->host, p->port, NULL);
+    if (remote < 0) {
+        return -1;
+    }
+    close(remote);
+    return 0;
+}
 
-    bzero((char*)&server_addr, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port_num);
+/**
+ * Check whether a method may change state on the origin (RFC 9110 9.2.1).
+ * Successful responses to these invalidate the cached copy of the target.
+ * 
+ * @param method Request method
+ * @return 1 if the method is unsafe, 0 otherwise
+ */
+int is_unsafe_method(const char *method) {
+    return strcmp(method, "POST") == 0 || strcmp(method, "PUT") == 0 ||
+           strcmp(method, "PATCH") == 0 || strcmp(method, "DELETE") == 0;
+}
 
-    bcopy((char *)host->h_addr, (char *)&server_addr.sin_addr.s_addr, host->h_length);
+/**
+ * Remove the hop-by-hop headers of a request (RFC 9110 7.6.1): the ones
+ * that are always connection specific and any the client named in
+ * Connection. Connection itself is replaced by the caller.
+ * 
+ * @param request Parsed HTTP request
+ */
+void strip_hop_by_hop(struct ParsedRequest *request) {
+    static const char *always[] = {
+        "Proxy-Connection", "Keep-Alive", "TE", "Trailer", "Upgrade", "Proxy-Authorization"
+    };
 
-    // Connect to Remote server
-    if (connect(remoteSocket, (struct sockaddr*)&server_addr, (socklen_t)sizeof(server_addr)) < 0) {
-        fprintf(stderr, "Error in connecting to %s:%d\n", host_addr, port_num); 
-        close(remoteSocket);
-        return -1;
+    for (size_t h = 0; h < request->headersused; h++) {
+        struct ParsedHeader *conn = request->headers + h;
+        if (conn->key == NULL || conn->id != HDR_CONNECTION) {
+            continue;
+        }
+        // Each comma separated option names a header to drop
+        size_t i = 0;
+        while (i < conn->valuelen) {
+            while (i < conn->valuelen && (conn->value[i] == ',' || conn->value[i] == ' ' ||
+                                          conn->value[i] == '\t')) {
+                i++;
+            }
+            size_t start = i;
+            while (i < conn->valuelen && conn->value[i] != ',' && conn->value[i] != ' ' &&
+                   conn->value[i] != '\t') {
+                i++;
+            }
+            char name[64];
+            if (i == start || i - start >= sizeof(name)) {
+                continue;
+            }
+            memcpy(name, conn->value + start, i - start);
+            name[i - start] = '\0';
+            // Never let a client drop the headers that frame the message
+            int id = ParsedHeader_id(name, i - start);
+            if (id == HDR_CONNECTION || id == HDR_HOST || id == HDR_CONTENT_LENGTH ||
+                id == HDR_TRANSFER_ENCODING) {
+                continue;
+            }
+            ParsedHeader_remove(request, name);
+        }
+    }
+
+    for (size_t i = 0; i < sizeof(always) / sizeof(always[0]); i++) {
+        ParsedHeader_remove(request, always[i]);
     }
-    
-    return remoteSocket;
 }
 
 /**
- * Handle an HTTP request.
+ * Send a list of buffers, calling writev() again after a partial write.
+ * 
+ * @param socket Socket to send on
+ * @param iov Buffers; modified to track progress
+ * @param iovcnt Number of buffers
+ * @return 0 on success, -1 on failure
+ */
+int send_iov(int socket, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t n = writev(socket, iov, iovcnt < IOV_MAX ? iovcnt : IOV_MAX);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Build the cache key (the absolute URL) of a parsed request.
+ * 
+ * @param request Parsed HTTP request
+ * @param arena Arena of the connection
+ * @return Key allocated from arena, NULL on failure
+ */
+char* build_cache_key(struct ParsedRequest *request, struct arena *arena) {
+    size_t keylen = strlen(request->host) + strlen(request->path) + 16 +
+                    (request->port ? strlen(request->port) : 0);
+    char *key = (char*)arena_alloc(arena, keylen);
+    if (key == NULL) {
+        return NULL;
+    }
+    if (request->port != NULL) {
+        snprintf(key, keylen, "http://%s:%s%s", request->host, request->port, request->path);
+    } else {
+        snprintf(key, keylen, "http://%s%s", request->host, request->path);
+    }
+    return key;
+}
+
+/**
+ * Work out how the request body is framed (RFC 9112 6.3).
  * 
- * @param clientSocket Client socket
  * @param request Parsed HTTP request
- * @param tempReq Original HTTP request string
+ * @param body Body description to fill in (prefix fields are left alone)
+ * @return 0 on success, -1 if the framing is invalid
+ */
+int get_request_body(struct ParsedRequest *request, struct request_body *body) {
+    struct ParsedHeader *te = ParsedHeader_getId(request, HDR_TRANSFER_ENCODING);
+    struct ParsedHeader *cl = ParsedHeader_getId(request, HDR_CONTENT_LENGTH);
+
+    body->content_length = -1;
+    body->chunked = 0;
+
+    if (te != NULL) {
+        // A request carrying both is a smuggling vector, refuse it
+        if (cl != NULL) {
+            return -1;
+        }
+        // chunked must be the final coding, anything else has no known length
+        size_t end = te->valuelen;
+        while (end > 0 && te->value[end - 1] != ',') {
+            end--;
+        }
+        const char *last = te->value + end;
+        size_t lastlen = te->valuelen - end;
+        while (lastlen > 0 && (*last == ' ' || *last == '\t')) {
+            last++;
+            lastlen--;
+        }
+        if (lastlen != 7 || strncasecmp(last, "chunked", 7) != 0) {
+            return -1;
+        }
+        body->chunked = 1;
+    } else if (cl != NULL) {
+        char digits[24];
+        char *end;
+        if (cl->valuelen == 0 || cl->valuelen >= sizeof(digits)) {
+            return -1;
+        }
+        memcpy(digits, cl->value, cl->valuelen);
+        digits[cl->valuelen] = '\0';
+        errno = 0;
+        long long n = strtoll(digits, &end, 10);
+        if (errno != 0 || *end != '\0' || n < 0) {
+            return -1;
+        }
+        body->content_length = n;
+    }
+    return 0;
+}
+
+enum {
+    CHUNK_SIZE, CHUNK_EXT, CHUNK_SIZE_LF, CHUNK_DATA, CHUNK_DATA_CR, CHUNK_DATA_LF,
+    CHUNK_TRAILER_START, CHUNK_TRAILER, CHUNK_FINAL_LF, CHUNK_DONE, CHUNK_ERROR
+};
+
+/**
+ * Feed bytes of a chunked body to the tracker. The bytes are not modified,
+ * the tracker only follows the framing so we know where the body ends.
+ * 
+ * @param ct Tracker state, zero initialised before the first call
+ * @param data Body bytes
+ * @param len Number of bytes in data
+ * @return Number of bytes that belong to the body, -1 on a framing error
+ */
+int chunk_tracker_feed(struct chunk_tracker *ct, const char *data, int len) {
+    int i = 0;
+
+    while (i < len && ct->state != CHUNK_DONE) {
+        char c = data[i];
+        switch (ct->state) {
+            case CHUNK_SIZE:
+                if (isxdigit((unsigned char)c)) {
+                    if (ct->remaining >> 56) {
+                        ct->state = CHUNK_ERROR;
+                        return -1;
+                    }
+                    ct->remaining = ct->remaining * 16 +
+                        (isdigit((unsigned char)c) ? c - '0' : (tolower((unsigned char)c) - 'a' + 10));
+                } else if (c == ';' || c == ' ' || c == '\t') {
+                    ct->state = CHUNK_EXT;
+                } else if (c == '\r') {
+                    ct->state = CHUNK_SIZE_LF;
+                } else {
+                    ct->state = CHUNK_ERROR;
+                    return -1;
+                }
+                i++;
+                break;
+            case CHUNK_EXT:
+                if (c == '\r') {
+                    ct->state = CHUNK_SIZE_LF;
+                }
+                i++;
+                break;
+            case CHUNK_SIZE_LF:
+                if (c != '\n') {
+                    ct->state = CHUNK_ERROR;
+                    return -1;
+                }
+                ct->state = ct->remaining == 0 ? CHUNK_TRAILER_START : CHUNK_DATA;
+                i++;
+                break;
+            case CHUNK_DATA: {
+                unsigned long long avail = (unsigned long long)(len - i);
+                unsigned long long take = avail < ct->remaining ? avail : ct->remaining;
+                i += (int)take;
+                ct->remaining -= take;
+                if (ct->remaining == 0) {
+                    ct->state = CHUNK_DATA_CR;
+                }
+                break;
+            }
+            case CHUNK_DATA_CR:
+            case CHUNK_DATA_LF:
+                if (c != (ct->state == CHUNK_DATA_CR ? '\r' : '\n')) {
+                    ct->state = CHUNK_ERROR;
+                    return -1;
+                }
+                ct->state = ct->state == CHUNK_DATA_CR ? CHUNK_DATA_LF : CHUNK_SIZE;
+                i++;
+                break;
+            case CHUNK_TRAILER_START:
+                ct->state = (c == '\r') ? CHUNK_FINAL_LF : CHUNK_TRAILER;
+                i++;
+                break;
+            case CHUNK_TRAILER:
+                if (c == '\n') {
+                    ct->state = CHUNK_TRAILER_START;
+                }
+                i++;
+                break;
+            case CHUNK_FINAL_LF:
+                if (c != '\n') {
+                    ct->state = CHUNK_ERROR;
+                    return -1;
+                }
+                ct->state = CHUNK_DONE;
+                i++;
+                break;
+            default:
+                return -1;
+        }
+    }
+    return i;
+}
+
+/**
+ * Stream the request body from the client to the origin. Only one buffer
+ * of the body is held in memory at any time.
+ * 
+ * @param clientSocket Client socket
+ * @param remoteSocket Origin socket
+ * @param body Body framing and the bytes already read with the headers
+ * @param buf Receive buffer
+ * @param buflen Size of buf
  * @return 0 on success, -1 on failure
  */
-int handle_request(int clientSocket, struct ParsedRequest *request, char *tempReq) {
-    char *buf = (char*)malloc(sizeof(char) * MAX_BYTES);
-    if (buf == NULL) {
-        fprintf(stderr, "Memory allocation failed\n");
-        return -1;
+int forward_request_body(int clientSocket, int remoteSocket, struct request_body *body, char *buf, size_t buflen) {
+    struct chunk_tracker ct = {CHUNK_SIZE, 0};
+    long long remaining = body->content_length;
+    const char *data = body->prefix;
+    int len = body->prefix_len;
+
+    if (!body->chunked && remaining <= 0) {
+        return 0;
     }
-    
-    // Build the HTTP request to forward to the server
-    strcpy(buf, "GET ");
-    strcat(buf, request->path);
-    strcat(buf, " ");
-    strcat(buf, request->version);
-    strcat(buf, "\r\n");
 
-    size_t len = strlen(buf);
+    while (1) {
+        int take;
+        if (body->chunked) {
+            take = chunk_tracker_feed(&ct, data, len);
+            if (take < 0) {
+                log_debug("Malformed chunked request body");
+                return -1;
+            }
+        } else {
+            take = (len < remaining) ? len : (int)remaining;
+            remaining -= take;
+        }
+
+        if (take > 0 && send_all(remoteSocket, data, take) < (size_t)take) {
+            log_warn("Error in sending request body to remote server");
+            return -1;
+        }
+        metric_add(M_ORIGIN_BYTES_OUT, take);
+
+        if ((body->chunked && ct.state == CHUNK_DONE) || (!body->chunked && remaining == 0)) {
+            return 0;
+        }
+
+        len = recv(clientSocket, buf, buflen, 0);
+        if (len <= 0) {
+            log_debug("Client closed connection before sending the full body");
+            return -1;
+        }
+        metric_add(M_CLIENT_BYTES_IN, len);
+        data = buf;
+    }
+}
+
+/**
+ * Handle an HTTP request.
+ * 
+ * @param clientSocket Client socket
+ * @param request Parsed HTTP request
+ * @param cacheKey Cache key (absolute URL) of the request
+ * @param body Framing of the request body
+ * @param arena Arena of the connection, for the request and response buffers
+ * @param timing Gets the phases of the origin exchange
+ * @param fallback Nonzero if the caller holds a stale copy to answer with
+ *        when the origin fails; a 5xx response is then not relayed either
+ * @return 0 once a response was relayed, else a req_error and nothing has
+ *         been sent to the client
+ */
+int handle_request(int clientSocket, struct ParsedRequest *request, char *cacheKey, struct request_body *body, struct arena *arena, struct request_timing *timing, int fallback) {
+    timing->cls = RC_MISS;
 
-    // Set headers
+    // Rewrite only what the proxy has to; every other header line is sent
+    // straight from the client's bytes
+    strip_hop_by_hop(request);
     if (ParsedHeader_set(request, "Connection", "close") < 0) {
-        printf("Failed to set Connection header\n");
+        log_error("Failed to set Connection header");
     }
 
-    if (ParsedHeader_get(request, "Host") == NULL) {
-        if (ParsedHeader_set(request, "Host", request->host) < 0) {
-            printf("Failed to set Host header\n");
+    if (ParsedHeader_getId(request, HDR_HOST) == NULL) {
+        size_t hostlen = strlen(request->host) + (request->port ? strlen(request->port) : 0) + 2;
+        char *host = (char*)arena_alloc(arena, hostlen);
+        if (host != NULL) {
+            snprintf(host, hostlen, request->port ? "%s:%s" : "%s", request->host, request->port);
+        }
+        if (host == NULL || ParsedHeader_set(request, "Host", host) < 0) {
+            log_error("Failed to set Host header");
         }
     }
 
-    // Add headers to the request
-    if (ParsedRequest_unparse_headers(request, buf + len, (size_t)MAX_BYTES - len) < 0) {
-        printf("Header unparsing failed\n");
+    // We answer the expectation ourselves once the origin is reachable
+    if (body->expect_continue) {
+        ParsedHeader_remove(request, "Expect");
+    }
+
+    // Describe the request head as buffers for a single writev()
+    int iovcnt = ParsedRequest_iovCount(request);
+    size_t bufsize = __atomic_load_n(&io_buffer_bytes, __ATOMIC_RELAXED);
+    struct iovec *iov = (struct iovec*)arena_alloc(arena, iovcnt * sizeof(struct iovec));
+    char *buf = (char*)arena_alloc(arena, bufsize);
+    if (iov == NULL || buf == NULL) {
+        log_error("Memory allocation failed");
+        return REQ_FAILED;
+    }
+    iovcnt = ParsedRequest_unparse_iov(request, iov, iovcnt);
+    if (iovcnt < 0) {
+        log_error("Header unparsing failed");
+        return REQ_FAILED;
     }
 
     // Determine server port
@@ -194,843 +786,1573 @@ int handle_request(int clientSocket, struct ParsedRequest *request, char *tempRe
         server_port = atoi(request->port);
     }
 
-    // Connect to the remote server
-    int remoteSocketID = connectRemoteServer(request->host, server_port);
+    // Connect to the remote server, if it has room and is not known to be down
+    struct origin *origin = origin_get(request->host, server_port);
+    enum origin_verdict verdict = origin_acquire(origin);
+    if (verdict != ORIGIN_OK) {
+        log_debug("Origin %s:%d is busy or down, not connecting", request->host, server_port);
+        return verdict == ORIGIN_UNREACHABLE ? REQ_UNREACHABLE : REQ_ORIGIN_DOWN;
+    }
+    struct parent *via;
+    uint64_t connect_start = now_usec();
+    int remoteSocketID = connect_upstream(request->host, server_port, cacheKey, timing, &via);
+    origin_connected(origin, now_usec() - connect_start, remoteSocketID);
 
     if (remoteSocketID < 0) {
-        free(buf);
-        return -1;
+        origin_release(origin, 0);
+        return REQ_UNREACHABLE;
+    }
+
+    // A parent proxy takes the request line in absolute form
+    if (via != NULL) {
+        iov[1].iov_base = cacheKey;
+        iov[1].iov_len = strlen(cacheKey);
+    }
+    size_t reqlen = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        reqlen += iov[i].iov_len;
     }
 
     // Send request to remote server
-    int bytes_send = send(remoteSocketID, buf, strlen(buf), 0);
-    if (bytes_send < 0) {
-        printf("Failed to send request to remote server\n");
+    int bytes_send;
+    if (send_iov(remoteSocketID, iov, iovcnt) < 0) {
+        log_warn("Failed to send request to remote server");
         close(remoteSocketID);
-        free(buf);
-        return -1;
+        origin_release(origin, 1);
+        return REQ_FAILED;
+    }
+    metric_add(M_ORIGIN_BYTES_OUT, reqlen);
+
+    // HTTP/1.0 clients do not understand interim responses
+    if (body->expect_continue && strcmp(request->version, "HTTP/1.1") == 0) {
+        const char *cont = "HTTP/1.1 100 Continue\r\n\r\n";
+        send(clientSocket, cont, strlen(cont), 0);
+    }
+
+    if (forward_request_body(clientSocket, remoteSocketID, body, buf, bufsize) < 0) {
+        close(remoteSocketID);
+        origin_release(origin, 1);
+        return REQ_FAILED;
     }
+    timing_start(timing);
 
-    bzero(buf, MAX_BYTES);
+    // Only GET responses are stored, everything else is streamed through
+    int cacheable = strcmp(request->method, "GET") == 0;
+    int status = 0;
+
+    bzero(buf, bufsize);
     
     // Receive response from remote server and forward to client
-    bytes_send = recv(remoteSocketID, buf, MAX_BYTES-1, 0);
+    bytes_send = recv(remoteSocketID, buf, bufsize-1, 0);
+    timing_end(timing, PH_TTFB);
+    // No answer within origin_timeout counts against the origin's breaker
+    int answered = bytes_send >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+    if (!answered) {
+        log_warn("No response from %s:%d in %d s", request->host, server_port,
+                 __atomic_load_n(&origin_timeout, __ATOMIC_RELAXED));
+        close(remoteSocketID);
+        origin_release(origin, 0);
+        return REQ_TIMEOUT;
+    }
+    if (bytes_send > 0) {
+        metric_add(M_ORIGIN_BYTES_IN, bytes_send);
+        origin_ttfb(origin, timing->usec[PH_TTFB]);
+    }
+    if (bytes_send > 12 && strncmp(buf, "HTTP/", 5) == 0) {
+        status = atoi(buf + 9);
+    }
+    if (fallback && (bytes_send <= 0 || status >= 500)) {
+        log_debug("Origin answered %d for %s, keeping the stale copy", status, cacheKey);
+        close(remoteSocketID);
+        origin_release(origin, 1);
+        return REQ_ORIGIN_ERROR;
+    }
+    timing->status = status;
     
     // Allocate temp buffer to store the entire response
-    char *temp_buffer = (char*)malloc(sizeof(char) * MAX_BYTES);
+    char *temp_buffer = (char*)arena_alloc(arena, bufsize);
     if (temp_buffer == NULL) {
-        fprintf(stderr, "Memory allocation failed\n");
+        log_error("Memory allocation failed");
         close(remoteSocketID);
-        free(buf);
-        return -1;
+        origin_release(origin, 1);
+        return REQ_FAILED;
     }
     
-    int temp_buffer_size = MAX_BYTES;
-    int temp_buffer_index = 0;
+    size_t temp_buffer_size = bufsize;
+    size_t temp_buffer_index = 0;
+    size_t max_entry = __atomic_load_n(&cache.max_entry, __ATOMIC_RELAXED);
+    int complete = 0;       // The origin closed after the whole response
+    int timed_out = 0;      // It went quiet for longer than the timeout
 
     // Continue receiving data and forwarding to client
     while (bytes_send > 0) {
-        // Forward data to client
-        if (send(clientSocket, buf, bytes_send, 0) < 0) {
-            fprintf(stderr, "Error in sending data to client\n");
+        // Forward data to client; a failed send leaves the response cut short
+        if (send_all(clientSocket, buf, bytes_send) < (size_t)bytes_send) {
+            log_debug("Error in sending data to client");
             break;
         }
+        metric_add(M_CLIENT_BYTES_OUT, bytes_send);
         
-        // Store data in temp buffer for caching
-        if (temp_buffer_index + bytes_send >= temp_buffer_size) {
-            temp_buffer_size += MAX_BYTES;
-            char *new_buffer = (char*)realloc(temp_buffer, temp_buffer_size);
-            if (new_buffer == NULL) {
-                fprintf(stderr, "Memory reallocation failed\n");
-                break;
+        // Store data in temp buffer for caching, until it is too large
+        // for the cache to take anyway
+        if (cacheable && temp_buffer_index + bytes_send > max_entry) {
+            log_debug("Response for %s exceeds %zu bytes, not caching it", cacheKey, max_entry);
+            cacheable = 0;
+        }
+        if (cacheable) {
+            if (temp_buffer_index + bytes_send >= temp_buffer_size) {
+                // Doubling keeps the arena at most twice the response size
+                char *new_buffer = (char*)arena_realloc(arena, temp_buffer, temp_buffer_size,
+                                                        temp_buffer_size * 2);
+                if (new_buffer == NULL) {
+                    // Only the copy for the cache is lost, the client still
+                    // gets the whole response
+                    log_error("Memory reallocation failed, not caching %s", cacheKey);
+                    cacheable = 0;
+                } else {
+                    temp_buffer = new_buffer;
+                    temp_buffer_size *= 2;
+                }
+            }
+            if (cacheable) {
+                memcpy(temp_buffer + temp_buffer_index, buf, bytes_send);
+                temp_buffer_index += bytes_send;
             }
-            temp_buffer = new_buffer;
         }
         
-        memcpy(temp_buffer + temp_buffer_index, buf, bytes_send);
-        temp_buffer_index += bytes_send;
-        
-        bzero(buf, MAX_BYTES);
-        bytes_send = recv(remoteSocketID, buf, MAX_BYTES-1, 0);
+        bzero(buf, bufsize);
+        bytes_send = recv(remoteSocketID, buf, bufsize-1, 0);
+        if (bytes_send > 0) {
+            metric_add(M_ORIGIN_BYTES_IN, bytes_send);
+        } else if (bytes_send == 0) {
+            complete = 1;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            timed_out = 1;
+        }
     }
+    timing_end(timing, PH_TRANSFER);
 
-    // Null terminate the response
-    if (temp_buffer_index < temp_buffer_size) {
-        temp_buffer[temp_buffer_index] = '\0';
-    } else {
-        temp_buffer = (char*)realloc(temp_buffer, temp_buffer_size + 1);
+    // Only a response read to its end may be cached; one cut short by the
+    // origin or by the client going away would be served truncated
+    if (cacheable && !complete) {
+        log_debug("Response for %s cut short, not caching it", cacheKey);
+    } else if (cacheable) {
+        // Null terminate the response (the loop always leaves a spare byte)
         temp_buffer[temp_buffer_index] = '\0';
-    }
 
-    // Add the response to the cache
-    add_cache_element(temp_buffer, temp_buffer_index, tempReq);
-    
-    printf("Request handled successfully\n");
+        // Add the response to the cache, which keeps its own copy
+        int evicted = store_response(cacheKey, temp_buffer, temp_buffer_index, status);
+        if (evicted < 0) {
+            log_debug("Response not cached: status %d, %zu bytes", status, temp_buffer_index);
+        } else {
+            log_debug("Added to cache: %zu bytes, evicted %d", temp_buffer_index, evicted);
+        }
+    } else if (is_unsafe_method(request->method) && status >= 200 && status < 400) {
+        // RFC 9111 4.4: a successful unsafe request invalidates the target URI,
+        // and a PUT may just have created what was not found
+        int removed = cache_remove(&cache, cacheKey) == 0;
+        removed |= cache_remove(&negative, cacheKey) == 0;
+        if (removed) {
+            log_debug("Invalidated cached copy of %s", cacheKey);
+        }
+    }
     
-    free(buf);
-    free(temp_buffer);
     close(remoteSocketID);
+    origin_release(origin, !timed_out);
     return 0;
 }
 
 /**
- * Check HTTP version.
+ * Store the response to a GET. 301, 404 and 410 answers go to the
+ * negative cache, which has a budget of its own, and replace any copy in
+ * the main cache; other errors are not stored.
  * 
- * @param msg HTTP version string
- * @return 1 if valid version, -1 otherwise
+ * @param key Cache key
+ * @param data Response, NUL terminated
+ * @param len Length of the response
+ * @param status Its status code, 0 if it has none
+ * @return Entries evicted to make room, -1 if it was not stored
  */
-int checkHTTPversion(char *msg) {
-    if (strncmp(msg, "HTTP/1.1", 8) == 0) {
-        return 1;
-    } else if (strncmp(msg, "HTTP/1.0", 8) == 0) {            
-        return 1;    // Handling this similar to version 1.1
+int store_response(const char *key, const char *data, size_t len, int status) {
+    int evicted;
+
+    if (refresh_negative(status)) {
+        if (cache_remove(&cache, key) == 0) {
+            log_debug("Dropped the cached copy of %s, now %d", key, status);
+        }
+        evicted = cache_put(&negative, key, data, len);
+    } else if (status < 400) {
+        evicted = cache_put(&cache, key, data, len);
     } else {
         return -1;
     }
-}
-
-/**
- * Find a cache element by URL.
- * 
- * @param url URL to find
- * @return Cache element if found, NULL otherwise
- */
-cache_element* find(char* url) {
-    pthread_mutex_lock(&lock);
-    
-    cache_element* temp = head;
-    while (temp != NULL) {
-        if (strcmp(temp->url, url) == 0) {
-            // Update LRU timestamp
-            temp->lru_time_track = time(NULL);
-            pthread_mutex_unlock(&lock);
-            return temp;
-        }
-        temp = temp->next;
+    if (evicted > 0) {
+        metric_add(M_CACHE_EVICTIONS, evicted);
     }
-    
-    pthread_mutex_unlock(&lock);
-    return NULL;
+    return evicted;
 }
 
 /**
- * Add an element to the cache with LRU eviction policy.
+ * Fetch a URL again and store the response, on a refresh thread. The
+ * request is a plain GET of the cache key. The stale copy stays if the
+ * origin fails, answers 5xx or sends more than the cache takes.
  * 
- * @param data Response data
- * @param size Size of the data
- * @param url Request URL
- * @return 0 on success, -1 on failure
+ * @param key Cache key, an absolute http:// URL
+ * @return 0 if a new copy was stored, -1 otherwise
  */
-int add_cache_element(char* data, int size, char* url) {
-    if (size > MAX_ELEMENT_SIZE) {
-        printf("Response too large to cache\n");
+int refresh_fetch(const char *key) {
+    struct arena *arena = arena_get();
+    if (arena == NULL) {
         return -1;
     }
-    
-    pthread_mutex_lock(&lock);
-    
-    // Check if the URL already exists in cache
-    cache_element* existing = head;
-    while (existing != NULL) {
-        if (strcmp(existing->url, url) == 0) {
-            // URL exists, update the data
-            cache_size -= existing->len;
-            
-            // Allocate new memory for data
-            char* new_data = (char*)malloc(size + 1);
-            if (new_data == NULL) {
-                pthread_mutex_unlock(&lock);
-                return -1;
-            }
-            
-            // Copy new data
-            memcpy(new_data, data, size);
-            new_data[size] = '\0';
-            
-            // Free old data and update
-            free(existing->data);
-            existing->data = new_data;
-            existing->len = size;
-            existing->lru_time_track = time(NULL);
-            
-            cache_size += size;
-            pthread_mutex_unlock(&lock);
-            return 0;
+    struct origin *origin = NULL;
+    int remote = -1, err = -1;
+    size_t headcap = strlen(key) + 32;
+    char *head = (char*)arena_alloc(arena, headcap);
+    struct ParsedRequest *request = ParsedRequest_createIn(arena);
+    if (head == NULL || request == NULL) {
+        goto out;
+    }
+    int headlen = snprintf(head, headcap, "GET %s HTTP/1.1\r\n\r\n", key);
+    if (ParsedRequest_parse(request, head, headlen) < 0) {
+        goto out;
+    }
+    size_t hostlen = strlen(request->host) + (request->port ? strlen(request->port) : 0) + 2;
+    char *host = (char*)arena_alloc(arena, hostlen);
+    if (host == NULL) {
+        goto out;
+    }
+    snprintf(host, hostlen, request->port ? "%s:%s" : "%s", request->host, request->port);
+    if (ParsedHeader_set(request, "Host", host) < 0 ||
+        ParsedHeader_set(request, "Connection", "close") < 0) {
+        goto out;
+    }
+
+    int port = request->port ? atoi(request->port) : 80;
+    origin = origin_get(request->host, port);
+    if (origin_acquire(origin) != ORIGIN_OK) {
+        origin = NULL;
+        goto out;
+    }
+    int iovcnt = ParsedRequest_iovCount(request);
+    struct iovec *iov = (struct iovec*)arena_alloc(arena, iovcnt * sizeof(struct iovec));
+    if (iov == NULL || (iovcnt = ParsedRequest_unparse_iov(request, iov, iovcnt)) < 0) {
+        origin_release(origin, 1);
+        origin = NULL;
+        goto out;
+    }
+    struct parent *via;
+    uint64_t connect_start = now_usec();
+    remote = connect_upstream(request->host, port, key, NULL, &via);
+    origin_connected(origin, now_usec() - connect_start, remote);
+    if (via != NULL) {
+        iov[1].iov_base = (char*)key;
+        iov[1].iov_len = strlen(key);
+    }
+    if (remote < 0 || send_iov(remote, iov, iovcnt) < 0) {
+        origin_release(origin, remote >= 0);
+        origin = NULL;
+        goto out;
+    }
+
+    // Read the whole response; the origin closes the connection at its end
+    size_t cap = __atomic_load_n(&io_buffer_bytes, __ATOMIC_RELAXED), len = 0;
+    size_t limit = __atomic_load_n(&cache.max_entry, __ATOMIC_RELAXED);
+    char *data = (char*)arena_alloc(arena, cap);
+    ssize_t n = 0;
+    while (data != NULL && (n = recv(remote, data + len, cap - len - 1, 0)) > 0) {
+        len += n;
+        if (len > limit) {
+            break;
+        }
+        if (len + 1 == cap) {
+            data = (char*)arena_realloc(arena, data, cap, cap * 2);
+            cap *= 2;
         }
-        existing = existing->next;
     }
-    
-    // Free up space if needed
-    while (cache_size + size > MAX_SIZE && head != NULL) {
-        remove_cache_element();
+    metric_add(M_ORIGIN_BYTES_IN, len);
+    origin_release(origin, n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK));
+    origin = NULL;
+
+    int status = data != NULL && len > 12 && strncmp(data, "HTTP/", 5) == 0 ? atoi(data + 9) : 0;
+    if (n == 0 && status > 0 && status < 500) {
+        data[len] = '\0';
+        if (store_response(key, data, len, status) >= 0) {
+            metric_add(M_CACHE_REFRESHES, 1);
+            err = 0;
+        }
     }
-    
-    // Create new cache element
-    cache_element* new_element = (cache_element*)malloc(sizeof(cache_element));
-    if (new_element == NULL) {
-        pthread_mutex_unlock(&lock);
+
+out:
+    if (remote >= 0) {
+        close(remote);
+    }
+    ParsedRequest_destroy(request);
+    arena_put(arena);
+    return err;
+}
+
+/**
+ * Check HTTP version.
+ * 
+ * @param msg HTTP version string
+ * @return 1 if valid version, -1 otherwise
+ */
+int checkHTTPversion(char *msg) {
+    if (strncmp(msg, "HTTP/1.1", 8) == 0) {
+        return 1;
+    } else if (strncmp(msg, "HTTP/1.0", 8) == 0) {            
+        return 1;    // Handling this similar to version 1.1
+    } else {
         return -1;
     }
-    
-    // Allocate and copy data
-    new_element->data = (char*)malloc(size + 1);
-    if (new_element->data == NULL) {
-        free(new_element);
-        pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Set up a connection input buffer.
+ * 
+ * @param in Buffer to initialise
+ * @param limit Size the buffer may grow to
+ * @param arena Arena of the connection
+ * @return 0 on success, -1 on failure
+ */
+int conn_buffer_init(struct conn_buffer *in, size_t limit, struct arena *arena) {
+    size_t first = __atomic_load_n(&io_buffer_bytes, __ATOMIC_RELAXED);
+    in->cap = first < limit ? first : limit;
+    in->len = 0;
+    in->limit = limit;
+    in->arena = arena;
+    in->data = (char*)arena_alloc(arena, in->cap);
+    return in->data ? 0 : -1;
+}
+
+/**
+ * Double the capacity of a connection input buffer, up to its limit.
+ * 
+ * @param in Buffer to grow
+ * @return 0 on success, -1 if the limit is reached or memory ran out
+ */
+int conn_buffer_grow(struct conn_buffer *in) {
+    if (in->cap >= in->limit) {
         return -1;
     }
-    memcpy(new_element->data, data, size);
-    new_element->data[size] = '\0';
-    
-    // Allocate and copy URL
-    new_element->url = (char*)malloc(strlen(url) + 1);
-    if (new_element->url == NULL) {
-        free(new_element->data);
-        free(new_element);
-        pthread_mutex_unlock(&lock);
+    size_t cap = in->cap * 2 < in->limit ? in->cap * 2 : in->limit;
+    char *data = (char*)arena_realloc(in->arena, in->data, in->cap, cap);
+    if (data == NULL) {
         return -1;
     }
-    strcpy(new_element->url, url);
-    
-    // Set other fields
-    new_element->len = size;
-    new_element->lru_time_track = time(NULL);
-    
-    // Add to front of the list
-    new_element->next = head;
-    head = new_element;
-    cache_size += size;
-    
-    printf("Added to cache: %d bytes, total cache size: %d\n", size, cache_size);
-    
-    pthread_mutex_unlock(&lock);
+    in->data = data;
+    in->cap = cap;
     return 0;
 }
 
 /**
- * Remove the least recently used element from the cache.
+ * Remember a host name that addresses the proxy itself.
+ * 
+ * @param name Host name or address, IPv6 addresses bracketed
+ */
+static void add_self_name(const char *name) {
+    for (int i = 0; i < self_name_count; i++) {
+        if (strcasecmp(self_names[i], name) == 0) {
+            return;
+        }
+    }
+    if (self_name_count < MAX_SELF_NAMES) {
+        char *copy = strdup(name);
+        if (copy != NULL) {
+            self_names[self_name_count++] = copy;
+        }
+    }
+}
+
+/**
+ * Work out which hosts reach the proxy from the address it listens on: that
+ * address, or every local interface address when bound to the wildcard,
+ * plus localhost, the machine's host name and the self_host names of the
+ * config.
+ * 
+ * @param listen_addr Address the proxy socket is bound to
  */
-void remove_cache_element() {
-    if (head == NULL) {
+void add_self_names(const struct sockaddr_in *listen_addr) {
+    char name[256];
+
+    // Names from the config file first, so they are never crowded out
+    for (const char *p = config.self_hosts; *p != '\0'; ) {
+        size_t n = strcspn(p, ", \t");
+        if (n > 0 && n < sizeof(name)) {
+            memcpy(name, p, n);
+            name[n] = '\0';
+            add_self_name(name);
+        }
+        p += n;
+        p += strspn(p, ", \t");
+    }
+    add_self_name("localhost");
+    if (gethostname(name, sizeof(name)) == 0) {
+        name[sizeof(name) - 1] = '\0';
+        add_self_name(name);
+    }
+    if (listen_addr->sin_addr.s_addr != htonl(INADDR_ANY)) {
+        inet_ntop(AF_INET, &listen_addr->sin_addr, name, sizeof(name));
+        add_self_name(name);
         return;
     }
-    
-    // Find the LRU element
-    cache_element* current = head;
-    cache_element* prev = NULL;
-    cache_element* lru = head;
-    cache_element* lru_prev = NULL;
-    
-    while (current != NULL) {
-        if (current->lru_time_track < lru->lru_time_track) {
-            lru = current;
-            lru_prev = prev;
+
+    struct ifaddrs *ifs, *ifa;
+    if (getifaddrs(&ifs) < 0) {
+        log_warn("getifaddrs failed: %s", strerror(errno));
+        add_self_name("127.0.0.1");
+        return;
+    }
+    for (ifa = ifs; ifa != NULL; ifa = ifa->ifa_next) {
+        if (ifa->ifa_addr == NULL) {
+            continue;
+        }
+        if (ifa->ifa_addr->sa_family == AF_INET) {
+            inet_ntop(AF_INET, &((struct sockaddr_in*)ifa->ifa_addr)->sin_addr, name, sizeof(name));
+            add_self_name(name);
+        } else if (ifa->ifa_addr->sa_family == AF_INET6) {
+            // Host headers carry IPv6 literals in brackets
+            name[0] = '[';
+            inet_ntop(AF_INET6, &((struct sockaddr_in6*)ifa->ifa_addr)->sin6_addr, name + 1, sizeof(name) - 2);
+            strcat(name, "]");
+            add_self_name(name);
         }
-        prev = current;
-        current = current->next;
     }
-    
-    // Remove the LRU element
-    if (lru_prev == NULL) {
-        // LRU is the head
-        head = lru->next;
-    } else {
-        lru_prev->next = lru->next;
+    freeifaddrs(ifs);
+}
+
+/**
+ * Check if a request is addressed to the proxy itself: the host is one of
+ * the proxy's names or addresses and the port the one it listens on.
+ * 
+ * @param request Parsed HTTP request
+ * @return 1 if it is, 0 otherwise
+ */
+int is_self_request(struct ParsedRequest *request) {
+    int port = request->port != NULL ? atoi(request->port) : 80;
+    if (port != port_number) {
+        return 0;
     }
-    
-    // Update cache size
-    cache_size -= lru->len;
-    
-    printf("Removed from cache: %d bytes, total cache size: %d\n", lru->len, cache_size);
-    
-    // Free memory
-    free(lru->data);
-    free(lru->url);
-    free(lru);
+    for (int i = 0; i < self_name_count; i++) {
+        if (strcasecmp(request->host, self_names[i]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
 }
 
 /**
- * Clean up the entire cache.
+ * Answer a scrape of /metrics on the proxy itself: the counters plus a few
+ * gauges read from shared state, in the Prometheus text format.
+ * 
+ * @param socket Client socket
+ * @param arena Arena of the connection
  */
-void cleanup_cache() {
-    pthread_mutex_lock(&lock);
-    
-    cache_element* current = head;
-    cache_element* next;
-    
-    while (current != NULL) {
-        next = current->next;
-        free(current->data);
-        free(current->url);
-        free(current);
-        current = next;
+void send_metrics(int socket, struct arena *arena) {
+    size_t cap = 16 * 1024;
+    char *body = (char*)arena_alloc(arena, cap);
+    char head[256];
+    if (body == NULL) {
+        sendErrorMessage(socket, 500);
+        return;
     }
-    
-    head = NULL;
-    cache_size = 0;
-    
-    pthread_mutex_unlock(&lock);
+
+    size_t len = metrics_render(body, cap);
+
+    long long bytes = cache_bytes(&cache);
+    pthread_mutex_lock(&pending.lock);
+    int queued = pending.count;
+    pthread_mutex_unlock(&pending.lock);
+
+    len += snprintf(body + len, cap - len,
+                    "# HELP proxy_cache_bytes Bytes of responses in the cache\n"
+                    "# TYPE proxy_cache_bytes gauge\nproxy_cache_bytes %lld\n"
+                    "# HELP proxy_queue_length Accepted connections waiting for a worker\n"
+                    "# TYPE proxy_queue_length gauge\nproxy_queue_length %d\n"
+                    "# HELP proxy_workers Worker threads\n"
+                    "# TYPE proxy_workers gauge\nproxy_workers %d\n"
+                    "# HELP proxy_connections_active Client connections being served\n"
+                    "# TYPE proxy_connections_active gauge\nproxy_connections_active %lld\n"
+                    "# HELP proxy_tunnels_active Open CONNECT tunnels\n"
+                    "# TYPE proxy_tunnels_active gauge\nproxy_tunnels_active %lld\n",
+                    bytes, queued, worker_count,
+                    (long long)(metric_total(M_CONNECTIONS_OPENED) - metric_total(M_CONNECTIONS_CLOSED)),
+                    (long long)(metric_total(M_TUNNELS_OPENED) - metric_total(M_TUNNELS_CLOSED)));
+    if (len >= cap) {
+        len = cap - 1;
+    }
+
+    int headlen = snprintf(head, sizeof(head),
+                           "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                           "Content-Length: %zu\r\nConnection: close\r\n\r\n", len);
+    send(socket, head, headlen, 0);
+    send(socket, body, len, 0);
+    metric_add(M_CLIENT_BYTES_OUT, headlen + len);
 }
 
 /**
- * Thread function to handle client connections.
+ * Answer a PURGE request.
  * 
- * @param socketNew Client socket pointer
- * @return NULL
+ * @param socket Client socket
+ * @param removed Nonzero if a cached entry was dropped
+ * @return Status sent, 200 or 404
  */
-void* thread_fn(void* socketNew) {
-    // Wait for semaphore to control concurrent clients
-    sem_wait(&seamaphore);
-    
-    int p;
-    sem_getvalue(&seamaphore, &p);
-    printf("Semaphore value: %d\n", p);
-    
-    int* t = (int*)(socketNew);
-    int socket = *t;           // Socket descriptor of the connected Client
-    free(t);                   // Free the memory allocated for socket
-    
-    int bytes_send_client, len;    // Bytes Transferred
+int send_purge_result(int socket, int removed) {
+    const char *response = removed ?
+        "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: 7\r\nConnection: close\r\n\r\nPurged\n" :
+        "HTTP/1.1 404 Not Found\r\nContent-Type: text/plain\r\nContent-Length: 11\r\nConnection: close\r\n\r\nNot cached\n";
+    send(socket, response, strlen(response), 0);
+    metric_add(M_CLIENT_BYTES_OUT, strlen(response));
+    return removed ? 200 : 404;
+}
 
-    // Create buffer for client request
-    char *buffer = (char*)calloc(MAX_BYTES, sizeof(char));
-    if (buffer == NULL) {
-        fprintf(stderr, "Memory allocation failed\n");
-        close(socket);
-        sem_post(&seamaphore);
-        return NULL;
+/**
+ * Relay bytes between the client and the origin of a CONNECT request
+ * until either side closes or the tunnel is idle for tunnel_timeout seconds.
+ * 
+ * @param socket Client socket
+ * @param remote_socket Origin socket
+ * @param pending Bytes the client sent after the CONNECT head
+ * @param pending_len Number of bytes in pending
+ * @param arena Arena of the connection, for the relay buffer
+ */
+void tunnel_connect(int socket, int remote_socket, const char *pending, int pending_len, struct arena *arena) {
+    // Send 200 Connection established
+    char response[] = "HTTP/1.1 200 Connection Established\r\nProxy-agent: ProxyServer/1.0\r\n\r\n";
+    if (send_all(socket, response, strlen(response)) < strlen(response)) {
+        log_debug("Client gone before the tunnel opened");
+        return;
+    }
+    metric_add(M_TUNNELS_OPENED, 1);
+
+    if (pending_len > 0) {
+        if (send_all(remote_socket, pending, pending_len) < (size_t)pending_len) {
+            log_debug("Error in sending to the tunnel's origin");
+            metric_add(M_TUNNELS_CLOSED, 1);
+            return;
+        }
+        metric_add(M_ORIGIN_BYTES_OUT, pending_len);
     }
     
-    // Receive request from client
-    bytes_send_client = recv(socket, buffer, MAX_BYTES, 0);
+    // Set up for tunneling data between client and server
+    fd_set read_fds;
+    int max_fd = (socket > remote_socket) ? socket : remote_socket;
+    size_t tunnel_buffer_size = __atomic_load_n(&io_buffer_bytes, __ATOMIC_RELAXED);
+    char *tunnel_buffer = (char*)arena_alloc(arena, tunnel_buffer_size);
+    if (tunnel_buffer == NULL) {
+        log_error("Memory allocation failed");
+        metric_add(M_TUNNELS_CLOSED, 1);
+        return;
+    }
+    
+    // Continue tunneling until one side closes the connection
+    struct timeval timeout;
+    int activity;
     
-    // Print the first few bytes for debugging
-    if (bytes_send_client > 0) {
-        char debug_buffer[128] = {0};
-        int debug_len = bytes_send_client > 100 ? 100 : bytes_send_client;
-        memcpy(debug_buffer, buffer, debug_len);
-        debug_buffer[debug_len] = '\0';
-        printf("Request start: %s\n", debug_buffer);
+    while (1) {
+        // Clear the socket set
+        FD_ZERO(&read_fds);
+        FD_SET(socket, &read_fds);
+        FD_SET(remote_socket, &read_fds);
+        
+        // Set timeout for select
+        timeout.tv_sec = __atomic_load_n(&tunnel_timeout, __ATOMIC_RELAXED);
+        timeout.tv_usec = 0;
+        
+        // Wait for activity on either socket
+        activity = select(max_fd + 1, &read_fds, NULL, NULL, &timeout);
+        
+        if (activity < 0) {
+            log_warn("Select error in CONNECT tunnel: %s", strerror(errno));
+            break;
+        }
+        
+        if (activity == 0) {
+            // Timeout occurred
+            log_debug("Timeout in CONNECT tunnel");
+            break;
+        }
         
-        // Special handling for the CONNECT method
-        if (strncmp(buffer, "CONNECT ", 8) == 0) {
-            printf("Detected CONNECT method, processing directly\n");
+        // Check client socket activity
+        if (FD_ISSET(socket, &read_fds)) {
+            int bytes_read = recv(socket, tunnel_buffer, tunnel_buffer_size, 0);
+            if (bytes_read <= 0) {
+                log_debug("Client closed connection");
+                break;
+            }
             
-            // Find host and port
-            char *host_port = buffer + 8;
-            char *space = strchr(host_port, ' ');
-            if (space) {
-                *space = '\0'; // Temporarily terminate string for easier extraction
-                
-                char host[256];
-                int port = 443; // Default HTTPS port
-                
-                char *colon = strchr(host_port, ':');
-                if (colon) {
-                    // We have a port specification
-                    int host_len = colon - host_port;
-                    strncpy(host, host_port, host_len);
-                    host[host_len] = '\0';
-                    port = atoi(colon + 1);
-                } else {
-                    // No port, use the whole host_port string
-                    strcpy(host, host_port);
-                }
-                
-                *space = ' '; // Restore the original string
-                
-                printf("CONNECT: Connecting to %s:%d\n", host, port);
-                
-                // Connect to remote server
-                int remote_socket = connectRemoteServer(host, port);
-                if (remote_socket < 0) {
-                    sendErrorMessage(socket, 502); // Bad Gateway
-                    printf("Failed to connect to remote server\n");
-                    free(buffer);
-                    close(socket);
-                    sem_post(&seamaphore);
-                    return NULL;
-                }
-                
-                // Send 200 Connection established
-                char response[] = "HTTP/1.1 200 Connection Established\r\nProxy-agent: ProxyServer/1.0\r\n\r\n";
-                send(socket, response, strlen(response), 0);
-                
-                // Set up for tunneling data between client and server
-                fd_set read_fds;
-                int max_fd = (socket > remote_socket) ? socket : remote_socket;
-                char tunnel_buffer[MAX_BYTES];
-                
-                // Continue tunneling until one side closes the connection
-                struct timeval timeout;
-                int activity;
-                
-                while (1) {
-                    // Clear the socket set
-                    FD_ZERO(&read_fds);
-                    FD_SET(socket, &read_fds);
-                    FD_SET(remote_socket, &read_fds);
-                    
-                    // Set timeout for select
-                    timeout.tv_sec = 30;
-                    timeout.tv_usec = 0;
-                    
-                    // Wait for activity on either socket
-                    activity = select(max_fd + 1, &read_fds, NULL, NULL, &timeout);
-                    
-                    if (activity < 0) {
-                        printf("Select error\n");
-                        break;
-                    }
-                    
-                    if (activity == 0) {
-                        // Timeout occurred
-                        printf("Timeout in CONNECT tunnel\n");
-                        break;
-                    }
-                    
-                    // Check client socket activity
-                    if (FD_ISSET(socket, &read_fds)) {
-                        int bytes_read = recv(socket, tunnel_buffer, sizeof(tunnel_buffer), 0);
-                        if (bytes_read <= 0) {
-                            printf("Client closed connection\n");
-                            break;
-                        }
-                        
-                        // Forward to remote server
-                        send(remote_socket, tunnel_buffer, bytes_read, 0);
-                    }
-                    
-                    // Check remote socket activity
-                    if (FD_ISSET(remote_socket, &read_fds)) {
-                        int bytes_read = recv(remote_socket, tunnel_buffer, sizeof(tunnel_buffer), 0);
-                        if (bytes_read <= 0) {
-                            printf("Server closed connection\n");
-                            break;
-                        }
-                        
-                        // Forward to client
-                        send(socket, tunnel_buffer, bytes_read, 0);
-                    }
-                }
-                
-                // Close sockets and cleanup
-                close(remote_socket);
-                free(buffer);
-                close(socket);
-                sem_post(&seamaphore);
-                return NULL;
+            // Forward to remote server
+            metric_add(M_CLIENT_BYTES_IN, bytes_read);
+            if (send_all(remote_socket, tunnel_buffer, bytes_read) < (size_t)bytes_read) {
+                log_debug("Error in sending to the tunnel's origin");
+                break;
             }
+            metric_add(M_ORIGIN_BYTES_OUT, bytes_read);
+        }
+        
+        // Check remote socket activity
+        if (FD_ISSET(remote_socket, &read_fds)) {
+            int bytes_read = recv(remote_socket, tunnel_buffer, tunnel_buffer_size, 0);
+            if (bytes_read <= 0) {
+                log_debug("Server closed connection");
+                break;
+            }
+            
+            // Forward to client
+            metric_add(M_ORIGIN_BYTES_IN, bytes_read);
+            if (send_all(socket, tunnel_buffer, bytes_read) < (size_t)bytes_read) {
+                log_debug("Error in sending to the tunnel's client");
+                break;
+            }
+            metric_add(M_CLIENT_BYTES_OUT, bytes_read);
         }
     }
-    
-    // Continue receiving until we get the full request (ending with "\r\n\r\n")
-    while (bytes_send_client > 0) {
-        len = strlen(buffer);
-        if (strstr(buffer, "\r\n\r\n") == NULL) {    
-            bytes_send_client = recv(socket, buffer + len, MAX_BYTES - len, 0);
-        } else {
-            break;
+    metric_add(M_TUNNELS_CLOSED, 1);
+}
+
+/**
+ * Queue an accepted connection for the workers. Never waits: a full queue
+ * means the workers are behind, and the caller sheds the connection.
+ * 
+ * @param q Connection queue
+ * @param fd Client socket
+ * @param addr Client address
+ * @param client Rate limit slot of the client, may be NULL
+ * @return 0 if queued, -1 if the queue is full
+ */
+int conn_queue_push(struct conn_queue *q, int fd, const struct sockaddr_in *addr, struct client *client) {
+    pthread_mutex_lock(&q->lock);
+    if (q->count == q->capacity) {
+        pthread_mutex_unlock(&q->lock);
+        return -1;
+    }
+    struct queued_conn *c = &q->conns[(q->head + q->count) % q->capacity];
+    c->fd = fd;
+    c->addr = *addr;
+    c->accepted = now_usec();
+    c->client = client;
+    q->count++;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+    return 0;
+}
+
+/**
+ * Take the oldest queued connection, waiting until there is one.
+ * 
+ * @param q Connection queue
+ * @param conn Set to the connection
+ */
+void conn_queue_pop(struct conn_queue *q, struct queued_conn *conn) {
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0) {
+        pthread_cond_wait(&q->not_empty, &q->lock);
+    }
+    *conn = q->conns[q->head];
+    q->head = (q->head + 1) % q->capacity;
+    q->count--;
+    q->busy++;
+    pthread_mutex_unlock(&q->lock);
+}
+
+/**
+ * Mark a connection taken with conn_queue_pop() as finished.
+ * 
+ * @param q Connection queue
+ */
+void conn_queue_done(struct conn_queue *q) {
+    pthread_mutex_lock(&q->lock);
+    q->busy--;
+    pthread_mutex_unlock(&q->lock);
+}
+
+/**
+ * Count the connections not finished yet, queued or being served.
+ * 
+ * @param q Connection queue
+ * @return Number of connections
+ */
+int conn_queue_active(struct conn_queue *q) {
+    pthread_mutex_lock(&q->lock);
+    int n = q->count + q->busy;
+    pthread_mutex_unlock(&q->lock);
+    return n;
+}
+
+/**
+ * Worker thread: serve queued connections one at a time. Each connection
+ * gets an arena from the worker's free list and gives it back when done,
+ * so a warmed up worker serves requests without touching malloc().
+ * 
+ * @param arg Index of the worker, which is also its metrics and status slot
+ * @return NULL
+ */
+void* thread_fn(void* arg) {
+    metrics_bind((int)(intptr_t)arg);
+    admin_bind((int)(intptr_t)arg);
+
+    while (1) {
+        struct queued_conn conn;
+        conn_queue_pop(&pending, &conn);
+        struct arena *arena = arena_get();
+        if (arena == NULL) {
+            log_error("Memory allocation failed");
+            close(conn.fd);
+            conn_queue_done(&pending);
+            continue;
         }
+
+        // Time spent queued is the first phase of the request
+        struct request_timing timing = {.cls = -1, .set = 1u << PH_QUEUE};
+        timing.usec[PH_QUEUE] = now_usec() - conn.accepted;
+
+        // A connection that waited too long is shed, unless it may still
+        // be a cache hit, which costs far less than going to the origin
+        int limit = __atomic_load_n(&queue_timeout_ms, __ATOMIC_RELAXED);
+        int overloaded = limit > 0 && timing.usec[PH_QUEUE] > (uint64_t)limit * 1000;
+        if (overloaded && !__atomic_load_n(&shed_serve_hits, __ATOMIC_RELAXED)) {
+            send_overloaded(conn.fd);
+            close(conn.fd);
+            ratelimit_done(conn.client, 0);
+            arena_put(arena);
+            conn_queue_done(&pending);
+            continue;
+        }
+
+        metric_add(M_CONNECTIONS_OPENED, 1);
+        unsigned long long moved = metrics_local->v[M_CLIENT_BYTES_IN] + metrics_local->v[M_CLIENT_BYTES_OUT];
+        handle_client(conn.fd, &conn.addr, arena, &timing, overloaded);
+        moved = metrics_local->v[M_CLIENT_BYTES_IN] + metrics_local->v[M_CLIENT_BYTES_OUT] - moved;
+        ratelimit_done(conn.client, moved);
+        metrics_record(&timing);
+        arena_put(arena);
+        metric_add(M_CONNECTIONS_CLOSED, 1);
+        conn_queue_done(&pending);
     }
+    return NULL;
+}
+
+/**
+ * Send a cached response to the client.
+ * 
+ * @param socket Client socket
+ * @param e Cached entry, with a reference held by the caller
+ * @param timing Gets the class, status and transfer phase
+ */
+void send_cached(int socket, const struct cache_entry *e, struct request_timing *timing) {
+    log_debug("Cache hit! Sending cached response");
+    timing->cls = RC_HIT;
+    if (e->len > 12 && strncmp(e->data, "HTTP/", 5) == 0) {
+        timing->status = atoi(e->data + 9);
+    }
+    timing_start(timing);
+    
+    // Send the cached response in chunks
+    int total_sent = 0;
+    int remaining = (int)e->len;
+    int chunk_size = (int)__atomic_load_n(&io_buffer_bytes, __ATOMIC_RELAXED);
     
-    // Handle the case of direct browser requests that don't have an absolute URL
-    if (bytes_send_client > 0 && strncmp(buffer, "GET /", 5) == 0) {
-        printf("Direct browser request detected, converting to proxy format\n");
+    while (remaining > 0) {
+        int to_send = (remaining < chunk_size) ? remaining : chunk_size;
+        int sent = send(socket, e->data + total_sent, to_send, 0);
         
-        // Extract the Host header
-        char *host_header = strstr(buffer, "Host: ");
-        if (host_header) {
-            char host[256] = {0};
-            char *host_end = strstr(host_header, "\r\n");
-            if (host_end) {
-                int host_len = host_end - (host_header + 6);
-                strncpy(host, host_header + 6, host_len);
-                host[host_len] = '\0';
-                
-                // Extract the path
-                char *path_start = buffer + 4;  // Skip "GET "
-                char *path_end = strstr(path_start, " HTTP");
-                if (path_end) {
-                    char path[1024] = {0};
-                    int path_len = path_end - path_start;
-                    strncpy(path, path_start, path_len);
-                    path[path_len] = '\0';
-                    
-                    // Extract HTTP version
-                    char version[16] = {0};
-                    if (strncmp(path_end + 1, "HTTP/1.1", 8) == 0) {
-                        strcpy(version, "HTTP/1.1");
-                    } else {
-                        strcpy(version, "HTTP/1.0");
-                    }
-                    
-                    // Check if this is a direct request to the proxy itself 
-                    if (strcmp(host, "localhost:5000") == 0 || 
-                        strcmp(host, "127.0.0.1:5000") == 0 ||
-                        strcmp(host, "localhost:8080") == 0 ||
-                        strcmp(host, "127.0.0.1:8080") == 0) {
-                        // Send a simple response for direct requests to the proxy
-                        char *proxy_response = "HTTP/1.1 200 OK\r\nContent-Type: text/html\r\nConnection: close\r\n\r\n"
-                                           "<html><body><h1>Proxy Server</h1>"
-                                           "<p>This is a HTTP/HTTPS proxy server. Configure your browser to use this as a proxy.</p>"
-                                           "<p>Do not access this URL directly.</p></body></html>";
-                        
-                        send(socket, proxy_response, strlen(proxy_response), 0);
-                        
-                        printf("Sent direct proxy access response\n");
-                        free(buffer);
-                        close(socket);
-                        sem_post(&seamaphore);
-                        
-                        int p;
-                        sem_getvalue(&seamaphore, &p);
-                        printf("Semaphore post value: %d\n", p);
-                        
-                        return NULL;
-                    }
-                    
-                    // Create a new buffer with absolute URL for other hosts
-                    char *new_buffer = (char *)malloc(MAX_BYTES);
-                    if (new_buffer) {
-                        snprintf(new_buffer, MAX_BYTES, 
-                                "GET http://%s%s %s\r\n%s", 
-                                host, path, version, host_header);
-                        
-                        // Copy the rest of the headers
-                        char *headers_start = strstr(buffer, "\r\n") + 2;
-                        int headers_len = buffer + strlen(buffer) - headers_start;
-                        strncat(new_buffer, headers_start, headers_len);
-                        
-                        // Replace the original buffer with the new one
-                        strcpy(buffer, new_buffer);
-                        free(new_buffer);
-                        
-                        printf("Converted request: %s\n", buffer);
-                    }
-                }
-            }
+        if (sent <= 0) {
+            log_debug("Error sending cached response");
+            break;
         }
+        
+        total_sent += sent;
+        remaining -= sent;
     }
+    metric_add(M_CLIENT_BYTES_OUT, total_sent);
+    timing_end(timing, PH_TRANSFER);
     
-    // Create a copy of the request for cache lookup
-    char *tempReq = NULL;
-    if (bytes_send_client > 0) {
-        tempReq = (char*)malloc(strlen(buffer) * sizeof(char) + 1);
-        if (tempReq == NULL) {
-            fprintf(stderr, "Memory allocation failed\n");
-            free(buffer);
-            close(socket);
-            sem_post(&seamaphore);
-            return NULL;
-        }
-        strcpy(tempReq, buffer);
+    log_debug("Sent %d bytes from cache", total_sent);
+}
+
+/**
+ * Serve one client connection.
+ * 
+ * @param socket Client socket, closed on return unless handed to the admin thread
+ * @param peer Client address, for the access log
+ * @param arena Arena for everything the connection allocates
+ * @param timing Phases of the request, recorded by the caller
+ * @param overloaded Nonzero if the connection waited too long for a
+ *        worker: only cache hits and requests to the proxy itself are
+ *        served, the rest get a 503
+ */
+void handle_client(int socket, const struct sockaddr_in *peer, struct arena *arena, struct request_timing *timing, int overloaded) {
+    int bytes_send_client = 0;    // Bytes Transferred
+    int head_len = 0;             // Length of the request head, once complete
+    char *cacheKey = NULL;        // Absolute URL, for requests served here
+    uint64_t begin = now_usec();
+    unsigned long long sent_before = metrics_local->v[M_CLIENT_BYTES_OUT];
+
+    // Create buffer and parser for the client request
+    struct conn_buffer in;
+    struct ParsedRequest* request = ParsedRequest_createIn(arena);
+    if (request == NULL ||
+        conn_buffer_init(&in, __atomic_load_n(&max_header_bytes, __ATOMIC_RELAXED), arena) < 0) {
+        log_error("Memory allocation failed");
+        close(socket);
+        return;
+    }
+    
+    // Receive until the request head is complete. The parser resumes where
+    // it stopped, so every byte is looked at once however the head arrives.
+    while (head_len == 0) {
+        if (in.len == in.cap && conn_buffer_grow(&in) < 0) {
+            break;
+        }
+        bytes_send_client = recv(socket, in.data + in.len, in.cap - in.len, 0);
+        if (bytes_send_client <= 0) {
+            break;
+        }
+        metric_add(M_CLIENT_BYTES_IN, bytes_send_client);
+        in.len += bytes_send_client;
+        head_len = ParsedRequest_feed(request, in.data, in.len);
     }
     
-    // Check if request is in cache
-    struct cache_element* temp = NULL;
-    if (tempReq != NULL) {
-        temp = find(tempReq);
+    if (head_len > 0) {
+        metric_add(M_REQUESTS, 1);
+
+        // Print the first few bytes for debugging
+        log_debug("Request start: %.*s", (int)(in.len < 100 ? in.len : 100), in.data);
+
+        int connect = !strcmp(request->method, "CONNECT");
+        char target[256];
+        snprintf(target, sizeof(target), "%s%s%s%s", request->host, request->port ? ":" : "",
+                 request->port ? request->port : "", connect ? "" : request->path);
+        admin_busy(peer, request->method, target, connect);
     }
 
-    if (temp != NULL) {
-        // Request found in cache, send response to client
-        printf("Cache hit! Sending cached response\n");
-        
-        // Send the cached response in chunks
-        int total_sent = 0;
-        int remaining = temp->len;
-        int chunk_size = MAX_BYTES;
+    // Anything after the head is the start of the request body
+    const char *body_prefix = in.data + (head_len > 0 ? head_len : 0);
+    int body_prefix_len = head_len > 0 ? (int)in.len - head_len : 0;
+    
+    if (head_len == 0 && in.len == in.limit) {
+        log_debug("Request head exceeds %zu bytes", in.limit);
+        timing->status = 431;
+        sendErrorMessage(socket, 431);  // Request Header Fields Too Large
+    }
+    else if (head_len < 0) {
+        log_debug("Parsing failed");
+        timing->status = 400;
+        sendErrorMessage(socket, 400);  // Bad Request
+    }
+    else if (head_len > 0 && overloaded && !strcmp(request->method, "CONNECT")) {
+        timing->status = 503;
+        send_overloaded(socket);
+    }
+    else if (head_len > 0 && !strcmp(request->method, "CONNECT")) {
+        // Handle CONNECT method (used by browsers for HTTPS)
+        log_debug("CONNECT: Connecting to %s:%s", request->host, request->port);
         
-        while (remaining > 0) {
-            int to_send = (remaining < chunk_size) ? remaining : chunk_size;
-            int sent = send(socket, temp->data + total_sent, to_send, 0);
-            
-            if (sent <= 0) {
-                fprintf(stderr, "Error sending cached response\n");
-                break;
+        timing->cls = RC_TUNNEL;
+        struct origin *origin = origin_get(request->host, atoi(request->port));
+        enum origin_verdict verdict = origin_acquire(origin);
+        if (verdict == ORIGIN_UNREACHABLE) {
+            timing->status = 502;
+            sendErrorMessage(socket, 502);  // Bad Gateway, as when it failed
+        } else if (verdict != ORIGIN_OK) {
+            timing->status = 503;
+            sendErrorMessage(socket, 503);  // Service Unavailable
+        } else {
+            // Tunnels are spread over the parents by their target
+            size_t targetlen = strlen(request->host) + strlen(request->port) + 2;
+            char *target = (char*)arena_alloc(arena, targetlen);
+            struct parent *via = NULL;
+            int remote_socket = CONNECT_FAILED;
+            uint64_t connect_start = now_usec();
+            if (target != NULL) {
+                snprintf(target, targetlen, "%s:%s", request->host, request->port);
+                remote_socket = connect_upstream(request->host, atoi(request->port), target, timing, &via);
             }
-            
-            total_sent += sent;
-            remaining -= sent;
+            origin_connected(origin, now_usec() - connect_start, remote_socket);
+
+            // Through a parent, the tunnel is only there once it says so
+            int ok = remote_socket >= 0;
+            int parent_status;
+            if (ok && via != NULL && (parent_status = parent_open_tunnel(remote_socket, target)) != 200) {
+                log_warn("Parent %s answered %d to CONNECT %s", via->name, parent_status, target);
+                close(remote_socket);
+                remote_socket = -1;
+                ok = parent_status > 0;     // It answered, the failure is further up
+            }
+            if (remote_socket < 0) {
+                timing->status = 502;
+                sendErrorMessage(socket, 502);  // Bad Gateway
+            } else {
+                timing->status = 200;
+                tunnel_connect(socket, remote_socket, body_prefix, body_prefix_len, arena);
+                timing_end(timing, PH_TRANSFER);
+                close(remote_socket);
+            }
+            origin_release(origin, ok);
         }
-        
-        printf("Sent %d bytes from cache\n", total_sent);
     }
-    else if (bytes_send_client > 0) {
-        // Request not in cache, parse the request and handle it
-        len = strlen(buffer);
-        struct ParsedRequest* request = ParsedRequest_create();
+    else if (head_len > 0 && is_self_request(request) && strcmp(request->path, "/metrics") == 0) {
+        timing->status = 200;
+        send_metrics(socket, arena);
+    }
+    else if (head_len > 0 && is_self_request(request)) {
+        // The admin thread renders the status page and closes the socket,
+        // so a slow page never holds up this worker. It reads the rest of
+        // a purge form itself.
+        struct request_body form = {body_prefix, body_prefix_len, -1, 0, 0};
+        admin_idle();
+        if (get_request_body(request, &form) < 0 || form.chunked) {
+            timing->status = 400;
+            sendErrorMessage(socket, 400);  // Bad Request
+        } else if (admin_submit(socket, peer, request->method, request->path, form.prefix, form.prefix_len,
+                                form.content_length, begin - timing->usec[PH_QUEUE]) == 0) {
+            ParsedRequest_destroy(request);
+            return;
+        } else {
+            timing->status = 503;
+            sendErrorMessage(socket, 503);  // Service Unavailable
+        }
+    }
+    else if (head_len > 0) {
+        // Serve the request from the cache or the origin
+        struct request_body body = {body_prefix, body_prefix_len, -1, 0, 0};
+        struct ParsedHeader *expect;
         
-        if (ParsedRequest_parse(request, buffer, len) < 0) {
-            printf("Parsing failed\n");
+        if (checkHTTPversion(request->version) != 1 ||
+            (cacheKey = build_cache_key(request, arena)) == NULL ||
+            get_request_body(request, &body) < 0) {
+            timing->status = 400;
             sendErrorMessage(socket, 400);  // Bad Request
         }
-        else {    
-            bzero(buffer, MAX_BYTES);
-            
-            // Support for GET and CONNECT methods
+        else if ((expect = ParsedHeader_getId(request, HDR_EXPECT)) != NULL &&
+                 (expect->valuelen != 12 || strncasecmp(expect->value, "100-continue", 12) != 0)) {
+            timing->status = 417;
+            sendErrorMessage(socket, 417);  // Expectation Failed
+        }
+        else if (!strcmp(request->method, "PURGE") && !admin_may_purge(peer)) {
+            log_info("Refused PURGE of %s from %s", cacheKey, inet_ntoa(peer->sin_addr));
+            timing->status = 403;
+            sendErrorMessage(socket, 403);  // Forbidden
+        }
+        else if (!strcmp(request->method, "PURGE")) {
+            // Drop the cached copy of the target; nothing goes to the origin
+            int removed = cache_remove(&cache, cacheKey) == 0;
+            removed |= cache_remove(&negative, cacheKey) == 0;
+            if (removed) {
+                metric_add(M_CACHE_PURGED, 1);
+                log_info("Purged %s", cacheKey);
+            }
+            timing->status = send_purge_result(socket, removed);
+        }
+        else if (strcmp(request->method, "GET") && strcmp(request->method, "HEAD") &&
+                 strcmp(request->method, "POST") && strcmp(request->method, "PUT") &&
+                 strcmp(request->method, "PATCH") && strcmp(request->method, "DELETE") &&
+                 strcmp(request->method, "OPTIONS")) {
+            log_debug("Method not supported: %s", request->method);
+            timing->status = 501;
+            sendErrorMessage(socket, 501);  // Not Implemented
+        }
+        else {
+            body.expect_continue = expect != NULL;
+
+            // Check if request is in cache, and whether the copy may be used
+            struct cache_entry* temp = NULL;
+            enum staleness state = ENTRY_FRESH;
             if (!strcmp(request->method, "GET")) {
-                if (request->host && request->path && (checkHTTPversion(request->version) == 1)) {
-                    // Handle GET request
-                    if (handle_request(socket, request, tempReq) == -1) {    
-                        sendErrorMessage(socket, 500);  // Internal Server Error
-                    }
+                // A URL known not to exist is answered without a round trip
+                int negative_hit = 0;
+                temp = cache_get(&cache, cacheKey);
+                if (temp == NULL && (temp = cache_get(&negative, cacheKey)) != NULL) {
+                    negative_hit = 1;
+                }
+                if (temp != NULL && (state = refresh_check(temp, time(NULL))) == ENTRY_EXPIRED) {
+                    cache_release(temp);
+                    temp = NULL;
                 }
-                else {
-                    sendErrorMessage(socket, 400);  // Bad Request
+                metric_add(temp != NULL && state != ENTRY_IF_ERROR ? M_CACHE_HITS : M_CACHE_MISSES, 1);
+                if (temp != NULL && state != ENTRY_IF_ERROR && negative_hit) {
+                    metric_add(M_NEGATIVE_HITS, 1);
                 }
             }
-            else if (!strcmp(request->method, "CONNECT")) {
-                // Handle CONNECT method (used by browsers for HTTPS)
-                printf("CONNECT method detected for: %s\n", request->host);
-                
-                // Extract host and port from the request
-                char host[256];
-                int port = 443; // Default HTTPS port
-                
-                if (request->port != NULL) {
-                    port = atoi(request->port);
+
+            // Under load a copy kept for origin errors beats a 503
+            if (temp != NULL && (state != ENTRY_IF_ERROR || overloaded)) {
+                if (state == ENTRY_REVALIDATE) {
+                    // The next client gets the copy fetched in the background
+                    refresh_submit(cacheKey, origin_get(request->host, request->port ? atoi(request->port) : 80));
                 }
-                
-                strcpy(host, request->host);
-                printf("Connecting to %s:%d\n", host, port);
-                
-                // Connect to remote server
-                int remote_socket = connectRemoteServer(host, port);
-                if (remote_socket < 0) {
-                    sendErrorMessage(socket, 502);  // Bad Gateway
-                    printf("Failed to connect to remote server\n");
-                } else {
-                    // Send 200 Connection established
-                    char response[] = "HTTP/1.1 200 Connection Established\r\nProxy-agent: ProxyServer/1.0\r\n\r\n";
-                    send(socket, response, strlen(response), 0);
-                    
-                    // Set up for tunneling data between client and server
-                    fd_set read_fds;
-                    int max_fd = (socket > remote_socket) ? socket : remote_socket;
-                    char buffer[MAX_BYTES];
-                    
-                    // Tunnel data for a limited time or until connection closes
-                    struct timeval timeout;
-                    int activity;
-                    
-                    // Continue tunneling until one side closes the connection
-                    while (1) {
-                        // Clear the socket set
-                        FD_ZERO(&read_fds);
-                        FD_SET(socket, &read_fds);
-                        FD_SET(remote_socket, &read_fds);
-                        
-                        // Set timeout for select
-                        timeout.tv_sec = 30;
-                        timeout.tv_usec = 0;
-                        
-                        // Wait for activity on either socket
-                        activity = select(max_fd + 1, &read_fds, NULL, NULL, &timeout);
-                        
-                        if (activity < 0) {
-                            printf("Select error\n");
-                            break;
-                        }
-                        
-                        if (activity == 0) {
-                            // Timeout occurred
-                            printf("Timeout in CONNECT tunnel\n");
-                            break;
-                        }
-                        
-                        // Check client socket activity
-                        if (FD_ISSET(socket, &read_fds)) {
-                            int bytes_read = recv(socket, buffer, sizeof(buffer), 0);
-                            if (bytes_read <= 0) {
-                                printf("Client closed connection\n");
-                                break;
-                            }
-                            
-                            // Forward to remote server
-                            send(remote_socket, buffer, bytes_read, 0);
-                        }
-                        
-                        // Check remote socket activity
-                        if (FD_ISSET(remote_socket, &read_fds)) {
-                            int bytes_read = recv(remote_socket, buffer, sizeof(buffer), 0);
-                            if (bytes_read <= 0) {
-                                printf("Server closed connection\n");
-                                break;
-                            }
-                            
-                            // Forward to client
-                            send(socket, buffer, bytes_read, 0);
-                        }
-                    }
-                    
-                    // Close the remote socket
-                    close(remote_socket);
+                if (state != ENTRY_FRESH) {
+                    metric_add(M_CACHE_STALE, 1);
                 }
+                send_cached(socket, temp, timing);
+                cache_release(temp);
+            }
+            else if (overloaded) {
+                timing->status = 503;
+                send_overloaded(socket);
             }
             else {
-                printf("Method not supported: %s\n", request->method);
-                sendErrorMessage(socket, 501);  // Not Implemented
+                int r = handle_request(socket, request, cacheKey, &body, arena, timing, temp != NULL);
+                if (r < 0 && temp != NULL) {
+                    // stale-if-error: nothing was sent, answer with the old copy
+                    log_info("Origin failed, serving the stale copy of %s", cacheKey);
+                    metric_add(M_CACHE_STALE, 1);
+                    send_cached(socket, temp, timing);
+                } else if (r == REQ_ORIGIN_DOWN) {
+                    timing->status = 503;
+                    sendErrorMessage(socket, 503);  // Service Unavailable
+                } else if (r == REQ_UNREACHABLE) {
+                    timing->status = 502;
+                    sendErrorMessage(socket, 502);  // Bad Gateway
+                } else if (r == REQ_TIMEOUT) {
+                    timing->status = 504;
+                    sendErrorMessage(socket, 504);  // Gateway Timeout
+                } else if (r < 0) {
+                    timing->status = 500;
+                    sendErrorMessage(socket, 500);  // Internal Server Error
+                }
+                if (temp != NULL) {
+                    cache_release(temp);
+                }
             }
         }
-        
-        // Free parsed request
-        ParsedRequest_destroy(request);
     }
     else if (bytes_send_client < 0) {
-        perror("Error in receiving from client");
+        log_debug("Error in receiving from client: %s", strerror(errno));
     }
     else {
-        printf("Client disconnected\n");
+        log_debug("Client disconnected");
     }
 
-    // Clean up
-    free(buffer);
-    if (tempReq != NULL) {
-        free(tempReq);
+    if (head_len > 0) {
+        char client[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &peer->sin_addr, client, sizeof(client));
+        uint64_t usec = timing->usec[PH_QUEUE] + (now_usec() - begin);
+        int connect = !strcmp(request->method, "CONNECT");
+        // The URL goes last, so that a long one cut off with the line
+        // takes none of the other fields with it
+        log_access("client=%s method=%s status=%d bytes=%llu class=%s ms=%.3f url=%s%s%s",
+                   client, request->method,
+                   timing->status, metrics_local->v[M_CLIENT_BYTES_OUT] - sent_before,
+                   timing->cls >= 0 ? request_class_names[timing->cls] : "-", usec / 1000.0,
+                   cacheKey != NULL ? cacheKey : connect ? request->host : request->path,
+                   connect ? ":" : "", connect ? request->port : "");
     }
+
+    // The request and buffers go away with the arena
+    ParsedRequest_destroy(request);
+    admin_idle();
     
-    // Close socket and release semaphore
     shutdown(socket, SHUT_RDWR);
     close(socket);
-    sem_post(&seamaphore);    
-    
-    sem_getvalue(&seamaphore, &p);
-    printf("Semaphore post value: %d\n", p);
-    
-    return NULL;
 }
 
 /**
- * Signal handler for clean shutdown.
+ * Signal handler for SIGINT, SIGTERM and SIGUSR2. Only async-signal-safe
+ * calls are allowed here, so it just passes the signal to the accept loop,
+ * which shuts down or upgrades. A second signal cuts the drain short.
  * 
  * @param sig Signal number
  */
 void signal_handler(int sig) {
-    printf("\nCleaning up and shutting down proxy server...\n");
-    
-    // Close server socket
-    if (proxy_socketId > 0) {
-        close(proxy_socketId);
+    int saved = errno;
+    unsigned char c = (unsigned char)sig;
+
+    if (write(shutdown_pipe[1], &c, 1) < 0) {
+        // The pipe is full, a shutdown is already on its way
+    }
+    errno = saved;
+}
+
+/**
+ * Called on the upgrade thread when an upgrade ends. Once the new process
+ * is serving, the accept loop is told to drain through the signal pipe,
+ * with UPGRADE_DONE in place of a signal number.
+ * 
+ * @param ok Nonzero if the new process is serving
+ */
+void upgrade_done(int ok) {
+    unsigned char c = UPGRADE_DONE;
+
+    if (ok && write(shutdown_pipe[1], &c, 1) < 0) {
+        // The pipe is full, a shutdown is already on its way
+    }
+}
+
+/**
+ * Stop taking connections, let the ones in flight finish for up to
+ * drain_timeout seconds, then save and free the cache and exit.
+ * 
+ * @param sig Signal that asked for the shutdown; SIGUSR2 after a new
+ *            process has taken over the listener and the cache
+ */
+void drain_and_exit(int sig) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int upgraded = sig == SIGUSR2;
+    unsigned char c;
+    int fd;
+
+    // Connections the kernel has completed are taken too: closing the
+    // listener would reset them. After an upgrade the new process has
+    // the listener and takes them itself.
+    while (!upgraded && (fd = accept(proxy_socketId, (struct sockaddr*)&addr, &len)) >= 0) {
+        admit_client(fd, &addr);
+        len = sizeof(addr);
+    }
+    close(proxy_socketId);
+
+    int timeout = __atomic_load_n(&config.drain_timeout, __ATOMIC_RELAXED);
+    uint64_t deadline = now_usec() + (uint64_t)timeout * 1000000;
+    int active = conn_queue_active(&pending);
+    log_info("Shutting down on signal %d, draining %d connections for up to %d s", sig, active, timeout);
+
+    struct pollfd again = {shutdown_pipe[0], POLLIN, 0};
+    while (active > 0 && now_usec() < deadline) {
+        if (poll(&again, 1, 100) > 0 && read(shutdown_pipe[0], &c, 1) == 1) {
+            log_warn("Signal %d during the drain, not waiting any longer", c);
+            break;
+        }
+        active = conn_queue_active(&pending);
+    }
+
+    // Save the cache for the next start, unless a new process has it. The
+    // caches are left to exit(): the refresh, admin and snapshot threads may
+    // still be using them, and a shared cache has no lock around its unmap.
+    if (snapshot_dir != NULL && !upgraded) {
+        snapshot_save(&cache, snapshot_dir);
+    }
+    if (active == 0) {
+        log_info("All connections finished, exiting");
+    } else {
+        log_warn("Closing %d connections still open", active);
     }
-    
-    // Clean up the cache
-    cleanup_cache();
-    
-    // Destroy mutex and semaphore
-    pthread_mutex_destroy(&lock);
-    sem_destroy(&seamaphore);
-    
     exit(0);
 }
 
 /**
- * Main function.
+ * Make the settings of a config that can change at run time take effect:
+ * cache limits and policy, buffer and header sizes, timeouts, load
+ * shedding, client and origin limits and log level.
+ *
+ * Runs on the reload thread while the other threads keep serving. Each
+ * setting is a single word stored with a relaxed atomic, here and in the
+ * modules' configure functions, and read the same way. A reader sees the
+ * old value or the new one, and no two settings need to change together,
+ * so there is no lock.
+ * 
+ * @param cfg New configuration
  */
-int main(int argc, char * argv[]) {
-    int client_socketId, client_len; 
-    struct sockaddr_in server_addr, client_addr; 
-    
-    // Set up signal handler for clean shutdown
-    signal(SIGINT, signal_handler);
-    
-    // Initialize semaphore and mutex
-    sem_init(&seamaphore, 0, MAX_CLIENTS);
-    pthread_mutex_init(&lock, NULL);
-    
-    // Parse command line arguments
-    if (argc == 2) {
-        port_number = atoi(argv[1]);
-    } else if (argc > 2) {
-        printf("Usage: %s [port_number]\n", argv[0]);
-        exit(1);
+void apply_config(const struct config *cfg) {
+    int evicted = cache_resize(&cache, cfg->cache_size, cfg->cache_max_entry);
+    evicted += cache_resize(&negative, cfg->negative_cache_size, cfg->cache_max_entry);
+    if (evicted > 0) {
+        metric_add(M_CACHE_EVICTIONS, evicted);
+        log_info("Evicted %d cache entries to fit the new limits", evicted);
     }
-    
-    printf("Setting Proxy Server Port: %d\n", port_number);
+    cache_set_policy(&cache, cfg->cache_policy);
+    __atomic_store_n(&io_buffer_bytes, cfg->buffer_size, __ATOMIC_RELAXED);
+    __atomic_store_n(&max_header_bytes, cfg->max_header, __ATOMIC_RELAXED);
+    __atomic_store_n(&tunnel_timeout, cfg->tunnel_timeout, __ATOMIC_RELAXED);
+    __atomic_store_n(&connect_timeout, cfg->connect_timeout, __ATOMIC_RELAXED);
+    __atomic_store_n(&origin_timeout, cfg->origin_timeout, __ATOMIC_RELAXED);
+    origin_configure(cfg->origin_max_conns, cfg->origin_wait_ms, cfg->breaker_failures,
+                     cfg->breaker_cooldown, cfg->refresh_rate);
+    refresh_configure(cfg->cache_ttl, cfg->stale_while_revalidate, cfg->stale_if_error,
+                      cfg->negative_status_ttl);
+    origin_configure_negative(cfg->negative_dns_ttl, cfg->negative_refused_ttl);
+    parent_configure(cfg->parent_check_interval, cfg->parent_direct);
+    __atomic_store_n(&log_level, cfg->log_level, __ATOMIC_RELAXED);
+    __atomic_store_n(&config.drain_timeout, cfg->drain_timeout, __ATOMIC_RELAXED);
+    __atomic_store_n(&queue_timeout_ms, cfg->queue_timeout_ms, __ATOMIC_RELAXED);
+    __atomic_store_n(&shed_serve_hits, cfg->shed_serve_hits, __ATOMIC_RELAXED);
+    ratelimit_configure(cfg->client_max_conns, cfg->client_rate, cfg->client_burst, cfg->client_byte_rate);
+
+    config.cache_size = cfg->cache_size;
+    config.cache_max_entry = cfg->cache_max_entry;
+    config.cache_policy = cfg->cache_policy;
+    config.cache_ttl = cfg->cache_ttl;
+    config.stale_while_revalidate = cfg->stale_while_revalidate;
+    config.stale_if_error = cfg->stale_if_error;
+    config.refresh_rate = cfg->refresh_rate;
+    config.negative_cache_size = cfg->negative_cache_size;
+    config.negative_status_ttl = cfg->negative_status_ttl;
+    config.negative_dns_ttl = cfg->negative_dns_ttl;
+    config.negative_refused_ttl = cfg->negative_refused_ttl;
+    config.parent_check_interval = cfg->parent_check_interval;
+    config.parent_direct = cfg->parent_direct;
+    config.buffer_size = cfg->buffer_size;
+    config.max_header = cfg->max_header;
+    config.tunnel_timeout = cfg->tunnel_timeout;
+    config.connect_timeout = cfg->connect_timeout;
+    config.origin_timeout = cfg->origin_timeout;
+    config.origin_max_conns = cfg->origin_max_conns;
+    config.origin_wait_ms = cfg->origin_wait_ms;
+    config.breaker_failures = cfg->breaker_failures;
+    config.breaker_cooldown = cfg->breaker_cooldown;
+    config.queue_timeout_ms = cfg->queue_timeout_ms;
+    config.shed_serve_hits = cfg->shed_serve_hits;
+    config.log_level = cfg->log_level;
+    config.client_max_conns = cfg->client_max_conns;
+    config.client_rate = cfg->client_rate;
+    config.client_burst = cfg->client_burst;
+    config.client_byte_rate = cfg->client_byte_rate;
+}
+
+/**
+ * Thread that rereads the config file on every SIGHUP. A file with errors
+ * is ignored as a whole and the running settings stay.
+ * 
+ * @param arg Unused
+ * @return Never returns
+ */
+void* reload_thread(void* arg) {
+    sigset_t hup;
+    int sig;
+    (void)arg;
+
+    sigemptyset(&hup);
+    sigaddset(&hup, SIGHUP);
+    while (1) {
+        if (sigwait(&hup, &sig) != 0) {
+            continue;
+        }
+        if (config_path == NULL) {
+            log_info("SIGHUP without a config file, nothing to reload");
+            continue;
+        }
+        struct config next;
+        config_defaults(&next);
+        if (config_load(&next, config_path) < 0) {
+            log_warn("Keeping the running configuration, %s has errors", config_path);
+            continue;
+        }
+        if (strcmp(next.listen, config.listen) != 0 || (cli_port == 0 && next.port != config.port) ||
+            next.workers != config.workers || next.queue_size != config.queue_size || strcmp(next.shared_cache, config.shared_cache) != 0 ||
+            (cache.shared == NULL && strcmp(next.snapshot_dir, config.snapshot_dir) != 0) ||
+            next.snapshot_interval != config.snapshot_interval ||
+            strcmp(next.self_hosts, config.self_hosts) != 0 || strcmp(next.parents, config.parents) != 0 ||
+            strcmp(next.purge_allow, config.purge_allow) != 0) {
+            log_warn("Listener, worker, queue size, shared cache, snapshot, self_host, parent and "
+                     "purge_allow changes take effect on restart");
+        }
+        apply_config(&next);
+        log_info("Reloaded %s", config_path);
+    }
+    return NULL;
+}
+
+/**
+ * Create the listening socket on the configured address and port, exiting
+ * if that fails.
+ * 
+ * @param server_addr Set to the address bound
+ * @return Listening socket
+ */
+int open_listener(struct sockaddr_in *server_addr) {
+    log_info("Setting Proxy Server Port: %d", port_number);
     
     // Create proxy socket
-    proxy_socketId = socket(AF_INET, SOCK_STREAM, 0);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
     
-    if (proxy_socketId < 0) {
-        perror("Failed to create socket");
+    if (fd < 0) {
+        log_error("Failed to create socket: %s", strerror(errno));
         exit(1);
     }
     
     // Set socket options to reuse address
     int reuse = 1;
-    if (setsockopt(proxy_socketId, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse)) < 0) {
-        perror("setsockopt(SO_REUSEADDR) failed");
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse)) < 0) {
+        log_warn("setsockopt(SO_REUSEADDR) failed: %s", strerror(errno));
     }
     
     // Set up server address
-    bzero((char*)&server_addr, sizeof(server_addr));  
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port_number);
-    server_addr.sin_addr.s_addr = INADDR_ANY;
+    bzero((char*)server_addr, sizeof(*server_addr));  
+    server_addr->sin_family = AF_INET;
+    server_addr->sin_port = htons(port_number);
+    inet_pton(AF_INET, config.listen, &server_addr->sin_addr);
     
     // Bind the socket
-    if (bind(proxy_socketId, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Binding failed");
+    if (bind(fd, (struct sockaddr*)server_addr, sizeof(*server_addr)) < 0) {
+        log_error("Binding failed: %s", strerror(errno));
         exit(1);
     }
     
-    printf("Binding on port: %d\n", port_number);
+    log_info("Binding on port: %d", port_number);
     
     // Listen for connections
-    if (listen(proxy_socketId, MAX_CLIENTS) < 0) {
-        perror("Failed to listen");
+    if (listen(fd, worker_count) < 0) {
+        log_error("Failed to listen: %s", strerror(errno));
         exit(1);
     }
     
-    printf("Proxy server listening on port %d...\n", port_number);
+    log_info("Proxy server listening on port %d...", port_number);
+    return fd;
+}
+
+/**
+ * Queue an accepted connection for the workers, or turn it away: with a
+ * 429 if its client is over a limit, with a 503 if the queue is full. A
+ * refused connection never reaches a worker: the answer fits in the empty
+ * send buffer of a new socket, so the accept loop does not wait on it.
+ * 
+ * @param fd Client socket
+ * @param addr Client address
+ */
+void admit_client(int fd, const struct sockaddr_in *addr) {
+    struct client *client;
+    char discard[1024];
+
+    if (ratelimit_admit(addr->sin_addr.s_addr, &client) != RL_OK) {
+        metric_add(M_CLIENTS_REJECTED, 1);
+        log_debug("Refused %s, over its limits", inet_ntoa(addr->sin_addr));
+        sendErrorMessage(fd, 429);  // Too Many Requests
+    } else if (conn_queue_push(&pending, fd, addr, client) == 0) {
+        return;
+    } else {
+        log_debug("Queue full, shedding %s", inet_ntoa(addr->sin_addr));
+        ratelimit_done(client, 0);
+        send_overloaded(fd);    // Service Unavailable
+    }
+    // Closing with the request unread would reset the connection, and the
+    // client might never see the answer
+    recv(fd, discard, sizeof(discard), MSG_DONTWAIT);
+    close(fd);
+}
+
+/**
+ * Main function.
+ */
+int main(int argc, char * argv[]) {
+    int client_socketId, client_len, opt; 
+    struct sockaddr_in server_addr, client_addr; 
+    struct sigaction sa;
+    pthread_t reloader;
+    sigset_t hup;
+    
+    // Shutdown signals are passed to the accept loop through a pipe
+    if (pipe(shutdown_pipe) < 0) {
+        perror("pipe");
+        exit(1);
+    }
+    fcntl(shutdown_pipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(shutdown_pipe[1], F_SETFD, FD_CLOEXEC);
+    fcntl(shutdown_pipe[1], F_SETFL, O_NONBLOCK);
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = signal_handler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGUSR2, &sa, NULL);
+    upgrade_init(argv);
+
+    // A client hanging up mid-response is an error return from send(),
+    // not a reason to stop the process
+    signal(SIGPIPE, SIG_IGN);
+
+    // SIGHUP is taken by the reload thread; every thread started from here
+    // on inherits the mask
+    sigemptyset(&hup);
+    sigaddset(&hup, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &hup, NULL);
+    
+    // Parse command line arguments
+    while ((opt = getopt(argc, argv, "c:")) != -1) {
+        if (opt == 'c') {
+            config_path = optarg;
+        } else {
+            printf("Usage: %s [-c config_file] [port_number]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (optind == argc - 1) {
+        cli_port = atoi(argv[optind]);
+    } else if (optind < argc - 1) {
+        printf("Usage: %s [-c config_file] [port_number]\n", argv[0]);
+        exit(1);
+    }
+
+    // Defaults, then the environment, then the config file
+    config_defaults(&config);
+    log_level = config.log_level;
+    if (log_init() < 0) {
+        perror("Log thread creation failed");
+        exit(1);
+    }
+    if (config_path != NULL && config_load(&config, config_path) < 0) {
+        log_error("Cannot start with the configuration in %s", config_path);
+        exit(1);
+    }
+    port_number = cli_port > 0 ? cli_port : config.port;
+    worker_count = config.workers;
+    log_level = config.log_level;
+    io_buffer_bytes = config.buffer_size;
+    max_header_bytes = config.max_header;
+    tunnel_timeout = config.tunnel_timeout;
+    connect_timeout = config.connect_timeout;
+    origin_timeout = config.origin_timeout;
+    origin_configure(config.origin_max_conns, config.origin_wait_ms, config.breaker_failures,
+                     config.breaker_cooldown, config.refresh_rate);
+    refresh_configure(config.cache_ttl, config.stale_while_revalidate, config.stale_if_error,
+                      config.negative_status_ttl);
+    origin_configure_negative(config.negative_dns_ttl, config.negative_refused_ttl);
+    parent_configure(config.parent_check_interval, config.parent_direct);
+    queue_timeout_ms = config.queue_timeout_ms;
+    shed_serve_hits = config.shed_serve_hits;
+    ratelimit_configure(config.client_max_conns, config.client_rate, config.client_burst, config.client_byte_rate);
+
+    // Initialize the connection queue, by default one slot per worker
+    pending.capacity = config.queue_size > 0 ? config.queue_size : worker_count;
+    pending.conns = malloc(pending.capacity * sizeof(*pending.conns));
+    tid = malloc(worker_count * sizeof(*tid));
+    if (pending.conns == NULL || tid == NULL) {
+        log_error("Memory allocation failed");
+        exit(1);
+    }
+    pthread_mutex_init(&pending.lock, NULL);
+    pthread_cond_init(&pending.not_empty, NULL);
+
+    if (cache_init(&cache, config.cache_size, config.cache_max_entry, config.cache_policy) < 0 ||
+        cache_init(&negative, config.negative_cache_size, config.cache_max_entry, CACHE_LRU) < 0) {
+        log_error("Memory allocation failed");
+        exit(1);
+    }
+
+    // Several processes can share one cache in a shared memory file; it
+    // outlives each of them, so there is nothing to snapshot
+    if (config.shared_cache[0] != '\0') {
+        if (cache_share(&cache, config.shared_cache) < 0) {
+            log_warn("Using a private cache");
+        } else if (config.snapshot_dir[0] != '\0') {
+            log_warn("Snapshots are off with a shared cache");
+            config.snapshot_dir[0] = '\0';
+        }
+    }
+
+    // Started by an older proxy: take over its listener and cache
+    int upgraded = upgrade_inherit(&proxy_socketId, &cache);
+    if (upgraded < 0) {
+        exit(1);
+    }
+
+    // Warm start: index the last snapshot, its responses are read in lazily
+    if (config.snapshot_dir[0] != '\0') {
+        snapshot_dir = config.snapshot_dir;
+        if (!upgraded && snapshot_load(&cache, snapshot_dir) < 0) {
+            log_warn("Starting with an empty cache");
+        }
+        if (config.snapshot_interval > 0 &&
+            snapshot_start(&cache, snapshot_dir, config.snapshot_interval) < 0) {
+            log_error("Snapshot thread creation failed");
+            exit(1);
+        }
+    }
     
-    client_len = sizeof(client_addr);
+    if (upgraded) {
+        // The inherited listener keeps the address the old process had
+        socklen_t addr_len = sizeof(server_addr);
+        getsockname(proxy_socketId, (struct sockaddr*)&server_addr, &addr_len);
+        port_number = ntohs(server_addr.sin_port);
+        log_info("Took over the listener on port %d", port_number);
+    } else {
+        proxy_socketId = open_listener(&server_addr);
+    }
+
+    // Requests for these hosts on our port are answered by the proxy itself
+    add_self_names(&server_addr);
+    log_debug("Answering as itself for %d host names", self_name_count);
     
-    int thread_idx = 0;
+    // Start the workers, each counting into its own metrics slot
+    if (metrics_init(worker_count) < 0) {
+        log_error("Memory allocation failed");
+        exit(1);
+    }
+    if (admin_purge_allow(config.purge_allow) < 0) {
+        log_error("Cannot use the purge allow-list");
+        exit(1);
+    }
+    if (admin_init(&cache, &negative, worker_count) < 0) {
+        log_error("Admin thread creation failed");
+        exit(1);
+    }
+    if (pthread_create(&reloader, NULL, reload_thread, NULL) != 0) {
+        log_error("Reload thread creation failed");
+        exit(1);
+    }
+    pthread_detach(reloader);
+    if (refresh_init(refresh_fetch) < 0) {
+        log_error("Refresh thread creation failed");
+        exit(1);
+    }
+    int parents = parent_init(config.parents, probe_parent);
+    if (parents < 0) {
+        log_error("Cannot use the parent proxies");
+        exit(1);
+    }
+    if (parents > 0) {
+        log_info("Sending misses and tunnels through %d parent proxies", parents);
+    }
+    for (int i = 0; i < worker_count; i++) {
+        if (pthread_create(&tid[i], NULL, thread_fn, (void*)(intptr_t)i) != 0) {
+            log_error("Thread creation failed");
+            exit(1);
+        }
+        pthread_detach(tid[i]);
+    }
     
-    // Main server loop
+    // Let the process this one replaces drain, if any
+    upgrade_ready();
+
+    // Main server loop, until a shutdown signal shows up on the pipe
+    struct pollfd fds[2] = {{proxy_socketId, POLLIN, 0}, {shutdown_pipe[0], POLLIN, 0}};
+    fcntl(proxy_socketId, F_SETFL, O_NONBLOCK);
     while (1) {
-        // Accept client connection
-        client_socketId = accept(proxy_socketId, (struct sockaddr*)&client_addr, (socklen_t*)&client_len);
-        
-        if (client_socketId < 0) {
-            perror("Accept failed");
+        if (poll(fds, 2, -1) < 0) {
+            if (errno != EINTR) {
+                log_warn("poll failed: %s", strerror(errno));
+            }
             continue;
         }
-        
-        printf("Client connected: %s:%d\n", 
-               inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
-        
-        // Allocate memory for socket descriptor to pass to thread
-        int *client_sock = malloc(sizeof(int));
-        if (client_sock == NULL) {
-            perror("Memory allocation failed");
-            close(client_socketId);
+        if (fds[1].revents & POLLIN) {
+            // SIGUSR2 starts an upgrade, which goes on while this loop
+            // keeps accepting; it sends UPGRADE_DONE once it has worked
+            unsigned char sig = 0;
+            if (read(shutdown_pipe[0], &sig, 1) == 1) {
+                if (sig == SIGUSR2) {
+                    upgrade_start(proxy_socketId, &cache, upgrade_done);
+                } else {
+                    drain_and_exit(sig == UPGRADE_DONE ? SIGUSR2 : sig);
+                }
+            }
+        }
+        if (!(fds[0].revents & POLLIN)) {
             continue;
         }
+
+        // Accept client connection
+        client_len = sizeof(client_addr);
+        client_socketId = accept(proxy_socketId, (struct sockaddr*)&client_addr, (socklen_t*)&client_len);
         
-        *client_sock = client_socketId;
-        
-        // Create thread to handle client
-        if (pthread_create(&tid[thread_idx], NULL, thread_fn, (void*)client_sock) != 0) {
-            perror("Thread creation failed");
-            free(client_sock);
-            close(client_socketId);
+        if (client_socketId < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED) {
+                log_warn("Accept failed: %s", strerror(errno));
+            }
             continue;
         }
         
-        // Detach thread to automatically clean up when it exits
-        pthread_detach(tid[thread_idx]);
+        log_debug("Client connected: %s:%d",
+                  inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
         
-        thread_idx = (thread_idx + 1) % MAX_CLIENTS;
+        // Hand the connection to a worker, unless its client is over a limit
+        admit_client(client_socketId, &client_addr);
     }
     
     // Clean up (this part will not be reached in normal operation)
     close(proxy_socketId);
-    cleanup_cache();
-    pthread_mutex_destroy(&lock);
-    sem_destroy(&seamaphore);
+    cache_destroy(&cache);
+    cache_destroy(&negative);
     
     return 0;
 }
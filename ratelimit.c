@@ -0,0 +1,144 @@
+/*
+ * ratelimit.c -- per-client connection caps and token buckets.
+ *
+ * Buckets are refilled lazily: each slot remembers when it was last
+ * topped up and gets rate * elapsed tokens the next time it is looked at.
+ */
+
+#include "ratelimit.h"
+
+#include <pthread.h>
+
+#include "metrics.h"
+
+struct client {
+    uint32_t addr;            // 0 while the slot is free
+    int conns;                // Connections open
+    uint64_t refilled;        // now_usec() of the last refill
+    double requests;          // Request tokens
+    double bytes;             // Byte tokens, negative while in debt
+};
+
+struct client_set {
+    pthread_mutex_t lock;
+    struct client ways[CLIENT_WAYS];
+} __attribute__((aligned(64)));
+
+static struct client_set sets[CLIENT_SETS];
+static pthread_once_t sets_once = PTHREAD_ONCE_INIT;
+
+// Set by ratelimit_configure(); the accept loop reads them to admit a
+// connection, and workers read byte_rate when one is done
+static int max_conns;
+static int request_rate;
+static int request_burst;
+static long long byte_rate;
+
+static void sets_init(void) {
+    for (int i = 0; i < CLIENT_SETS; i++) {
+        pthread_mutex_init(&sets[i].lock, NULL);
+    }
+}
+
+static struct client_set *set_of(uint32_t addr) {
+    // Fibonacci hashing spreads the last octet, which varies most
+    return &sets[((uint32_t)(addr * 2654435769u) >> 16) % CLIENT_SETS];
+}
+
+void ratelimit_configure(int conns, int rate, int burst, long long bytes) {
+    pthread_once(&sets_once, sets_init);
+    __atomic_store_n(&max_conns, conns, __ATOMIC_RELAXED);
+    __atomic_store_n(&request_rate, rate, __ATOMIC_RELAXED);
+    __atomic_store_n(&request_burst, burst > 0 ? burst : (rate > 0 ? rate : 1), __ATOMIC_RELAXED);
+    __atomic_store_n(&byte_rate, bytes, __ATOMIC_RELAXED);
+}
+
+// Top up both buckets for the time since the last refill
+static void refill(struct client *c, uint64_t now) {
+    double elapsed = (now - c->refilled) / 1e6;
+    int rate = __atomic_load_n(&request_rate, __ATOMIC_RELAXED);
+    int burst = __atomic_load_n(&request_burst, __ATOMIC_RELAXED);
+    long long brate = __atomic_load_n(&byte_rate, __ATOMIC_RELAXED);
+
+    c->requests += elapsed * rate;
+    if (c->requests > burst) {
+        c->requests = burst;
+    }
+    c->bytes += elapsed * brate;
+    if (c->bytes > brate) {
+        c->bytes = brate;
+    }
+    c->refilled = now;
+}
+
+enum ratelimit_verdict ratelimit_admit(uint32_t addr, struct client **client) {
+    int conns = __atomic_load_n(&max_conns, __ATOMIC_RELAXED);
+    int rate = __atomic_load_n(&request_rate, __ATOMIC_RELAXED);
+    long long brate = __atomic_load_n(&byte_rate, __ATOMIC_RELAXED);
+
+    *client = NULL;
+    if (conns == 0 && rate == 0 && brate == 0) {
+        return RL_OK;
+    }
+    addr = addr ? addr : 1;     // 0.0.0.0 would read as a free slot
+    struct client_set *set = set_of(addr);
+    uint64_t now = now_usec();
+    enum ratelimit_verdict v = RL_OK;
+
+    pthread_mutex_lock(&set->lock);
+    struct client *c = NULL, *victim = NULL;
+    for (int i = 0; i < CLIENT_WAYS; i++) {
+        struct client *w = &set->ways[i];
+        if (w->addr == addr) {
+            c = w;
+            break;
+        }
+        // Prefer a free slot, then the one idle the longest
+        if (w->conns == 0 && (victim == NULL ||
+            (victim->addr != 0 && (w->addr == 0 || w->refilled < victim->refilled)))) {
+            victim = w;
+        }
+    }
+    if (c == NULL && victim != NULL) {
+        c = victim;
+        c->addr = addr;
+        c->conns = 0;
+        c->refilled = now;
+        c->requests = __atomic_load_n(&request_burst, __ATOMIC_RELAXED);
+        c->bytes = brate;
+    }
+    if (c != NULL) {
+        refill(c, now);
+        if (conns > 0 && c->conns >= conns) {
+            v = RL_CONNECTIONS;
+        } else if (rate > 0 && c->requests < 1) {
+            v = RL_REQUESTS;
+        } else if (brate > 0 && c->bytes < 0) {
+            v = RL_BYTES;
+        } else {
+            if (rate > 0) {
+                c->requests -= 1;
+            }
+            c->conns++;
+            *client = c;
+        }
+    }
+    pthread_mutex_unlock(&set->lock);
+    return v;
+}
+
+void ratelimit_done(struct client *c, unsigned long long bytes) {
+    if (c == NULL) {
+        return;
+    }
+    // The slot keeps its address while it has a connection open
+    struct client_set *set = set_of(c->addr);
+
+    pthread_mutex_lock(&set->lock);
+    c->conns--;
+    if (__atomic_load_n(&byte_rate, __ATOMIC_RELAXED) > 0) {
+        refill(c, now_usec());
+        c->bytes -= (double)bytes;
+    }
+    pthread_mutex_unlock(&set->lock);
+}
@@ -0,0 +1,68 @@
+/*
+ * ratelimit.h -- per-client connection caps and token buckets.
+ *
+ * Every client address gets a slot in a fixed table when it connects. The
+ * slot counts its open connections and holds two token buckets, one of
+ * requests and one of bytes. The accept loop asks for a connection to be
+ * admitted before it is queued for a worker, so a client over its limits
+ * costs a table lookup and a short 429, never a worker.
+ *
+ * The request bucket is charged one token per connection at admission,
+ * since a connection carries one request. The byte bucket is charged with
+ * the bytes the connection moved once it is done, which may leave it in
+ * debt; the client is refused until it has refilled.
+ *
+ * The table is split into sets by address hash, each with a mutex and a
+ * few slots. A slot is only given to another address while it has no
+ * connections open, and a client whose set is full of open connections is
+ * let through untracked.
+ */
+
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdint.h>
+
+#define CLIENT_SETS 512           // Sets in the client table
+#define CLIENT_WAYS 8             // Slots per set
+
+enum ratelimit_verdict {
+    RL_OK,
+    RL_CONNECTIONS,               // Too many connections open
+    RL_REQUESTS,                  // Request bucket empty
+    RL_BYTES                      // Byte bucket in debt
+};
+
+struct client;
+
+/**
+ * Set the limits. 0 turns a limit off. Safe to call while clients are
+ * being admitted.
+ *
+ * @param max_conns Connections a client may have open
+ * @param rate Requests per second
+ * @param burst Requests a client may make at once; 0 means rate
+ * @param byte_rate Bytes per second in both directions, also the depth
+ *        of the bucket
+ */
+void ratelimit_configure(int max_conns, int rate, int burst, long long byte_rate);
+
+/**
+ * Check a new connection against the limits of its client.
+ *
+ * @param addr Client IPv4 address, network order
+ * @param client Set to the slot to pass to ratelimit_done(), or NULL if
+ *        the client is not tracked
+ * @return RL_OK to serve the connection, else the limit it is over
+ */
+enum ratelimit_verdict ratelimit_admit(uint32_t addr, struct client **client);
+
+/**
+ * Account for a finished connection.
+ *
+ * @param c Slot from ratelimit_admit(), may be NULL
+ * @param bytes Bytes received from and sent to the client
+ */
+void ratelimit_done(struct client *c, unsigned long long bytes);
+
+#endif
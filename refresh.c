@@ -0,0 +1,248 @@
+/*
+ * refresh.c -- freshness of cached responses and their background refresh.
+ */
+
+#include "refresh.h"
+
+#include <ctype.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "http_scan.h"
+#include "log.h"
+
+// Set by refresh_configure(); workers read them on each cache hit and
+// when they store a response
+static int default_ttl;
+static int default_swr;
+static int default_sie;
+static int negative_ttl;
+
+// What the Cache-Control of a response allows, in seconds; -1 if not given
+struct freshness {
+    long max_age;
+    long s_maxage;
+    long swr;
+    long sie;
+    int no_cache;
+    int must_revalidate;
+};
+
+struct refresh_job {
+    char *key;
+    uint64_t hash;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    struct refresh_job jobs[REFRESH_QUEUE];
+    int head;
+    int count;
+    struct refresh_job busy[REFRESH_THREADS];     // Being fetched, key NULL if idle
+} queue = {.lock = PTHREAD_MUTEX_INITIALIZER, .ready = PTHREAD_COND_INITIALIZER};
+
+static int (*fetch_key)(const char *key);
+
+void refresh_configure(int ttl, int swr, int sie, int negative) {
+    __atomic_store_n(&default_ttl, ttl, __ATOMIC_RELAXED);
+    __atomic_store_n(&default_swr, swr, __ATOMIC_RELAXED);
+    __atomic_store_n(&default_sie, sie, __ATOMIC_RELAXED);
+    __atomic_store_n(&negative_ttl, negative, __ATOMIC_RELAXED);
+}
+
+static int negative_status(int status) {
+    return status == 301 || status == 404 || status == 410;
+}
+
+int refresh_negative(int status) {
+    return negative_status(status) && __atomic_load_n(&negative_ttl, __ATOMIC_RELAXED) > 0;
+}
+
+// Value of "name=N" in a directive, or -1 if d is not that directive
+static long directive_seconds(const char *d, size_t len, const char *name) {
+    size_t n = strlen(name);
+    if (len <= n || strncasecmp(d, name, n) != 0 || d[n] != '=') {
+        return -1;
+    }
+    d += n + 1;
+    len -= n + 1;
+    if (len > 0 && *d == '"') {
+        d++;
+        len--;
+    }
+    long v = 0;
+    size_t i = 0;
+    for (; i < len && isdigit((unsigned char)d[i]); i++) {
+        v = v < 100000000 ? v * 10 + (d[i] - '0') : v;
+    }
+    return i > 0 ? v : -1;
+}
+
+// Add the directives of one Cache-Control value to f
+static void parse_cache_control(const char *v, size_t len, struct freshness *f) {
+    const char *end = v + len;
+
+    while (v < end) {
+        while (v < end && (*v == ' ' || *v == '\t' || *v == ',')) {
+            v++;
+        }
+        const char *d = v;
+        while (v < end && *v != ',') {
+            v++;
+        }
+        size_t dlen = v - d;
+        while (dlen > 0 && (d[dlen - 1] == ' ' || d[dlen - 1] == '\t')) {
+            dlen--;
+        }
+        long s;
+        if ((s = directive_seconds(d, dlen, "max-age")) >= 0) {
+            f->max_age = s;
+        } else if ((s = directive_seconds(d, dlen, "s-maxage")) >= 0) {
+            f->s_maxage = s;
+        } else if ((s = directive_seconds(d, dlen, "stale-while-revalidate")) >= 0) {
+            f->swr = s;
+        } else if ((s = directive_seconds(d, dlen, "stale-if-error")) >= 0) {
+            f->sie = s;
+        } else if (dlen == 8 && strncasecmp(d, "no-cache", 8) == 0) {
+            f->no_cache = 1;
+        } else if ((dlen == 15 && strncasecmp(d, "must-revalidate", 15) == 0) ||
+                   (dlen == 16 && strncasecmp(d, "proxy-revalidate", 16) == 0)) {
+            f->must_revalidate = 1;
+        }
+    }
+}
+
+enum staleness refresh_check(const struct cache_entry *e, time_t now) {
+    struct freshness f = {-1, -1, -1, -1, 0, 0};
+    size_t head = http_scan_head_end(e->data, e->len);
+    const char *p = memchr(e->data, '\n', head);
+
+    // Every Cache-Control line of the response head counts
+    while (p != NULL && (size_t)(++p - e->data) < head) {
+        size_t left = head - (p - e->data);
+        const char *eol = memchr(p, '\n', left);
+        size_t linelen = eol != NULL ? (size_t)(eol - p) : left;
+        if (linelen > 14 && strncasecmp(p, "cache-control:", 14) == 0) {
+            size_t vlen = linelen - 14;
+            if (vlen > 0 && p[13 + vlen] == '\r') {
+                vlen--;
+            }
+            parse_cache_control(p + 14, vlen, &f);
+        }
+        p = eol;
+    }
+
+    // Errors and redirects get the negative defaults, and no stale windows
+    // unless they ask for them
+    int negative = e->len > 12 && strncmp(e->data, "HTTP/", 5) == 0 && negative_status(atoi(e->data + 9));
+    long lifetime = f.s_maxage >= 0 ? f.s_maxage : f.max_age >= 0 ? f.max_age :
+                    negative ? __atomic_load_n(&negative_ttl, __ATOMIC_RELAXED) :
+                    __atomic_load_n(&default_ttl, __ATOMIC_RELAXED);
+    if (f.no_cache) {
+        lifetime = 0;
+    } else if (f.s_maxage < 0 && f.max_age < 0 && lifetime == 0 && !negative) {
+        return ENTRY_FRESH;     // No lifetime given and no default: keep it
+    }
+    long age = now - e->stored;
+    if (age < lifetime) {
+        return ENTRY_FRESH;
+    }
+    if (f.no_cache || f.must_revalidate) {
+        return ENTRY_EXPIRED;
+    }
+    long swr = f.swr >= 0 ? f.swr : negative ? 0 : __atomic_load_n(&default_swr, __ATOMIC_RELAXED);
+    long sie = f.sie >= 0 ? f.sie : negative ? 0 : __atomic_load_n(&default_sie, __ATOMIC_RELAXED);
+    if (age < lifetime + swr) {
+        return ENTRY_REVALIDATE;
+    }
+    return age < lifetime + sie ? ENTRY_IF_ERROR : ENTRY_EXPIRED;
+}
+
+static uint64_t hash_key(const char *key) {
+    uint64_t h = 1469598103934665603ULL;
+    for (; *key; key++) {
+        h = (h ^ (unsigned char)*key) * 1099511628211ULL;
+    }
+    return h;
+}
+
+static int same_key(const struct refresh_job *j, const char *key, uint64_t hash) {
+    return j->key != NULL && j->hash == hash && strcmp(j->key, key) == 0;
+}
+
+static void *refresh_thread(void *arg) {
+    int slot = (int)(intptr_t)arg;
+
+    while (1) {
+        pthread_mutex_lock(&queue.lock);
+        while (queue.count == 0) {
+            pthread_cond_wait(&queue.ready, &queue.lock);
+        }
+        queue.busy[slot] = queue.jobs[queue.head];
+        queue.head = (queue.head + 1) % REFRESH_QUEUE;
+        queue.count--;
+        pthread_mutex_unlock(&queue.lock);
+
+        char *key = queue.busy[slot].key;
+        if (fetch_key(key) == 0) {
+            log_debug("Refreshed %s", key);
+        }
+
+        pthread_mutex_lock(&queue.lock);
+        queue.busy[slot].key = NULL;
+        pthread_mutex_unlock(&queue.lock);
+        free(key);
+    }
+    return NULL;
+}
+
+int refresh_init(int (*fetch)(const char *key)) {
+    fetch_key = fetch;
+    for (int i = 0; i < REFRESH_THREADS; i++) {
+        pthread_t t;
+        if (pthread_create(&t, NULL, refresh_thread, (void*)(intptr_t)i) != 0) {
+            return -1;
+        }
+        pthread_detach(t);
+    }
+    return 0;
+}
+
+int refresh_submit(const char *key, struct origin *o) {
+    uint64_t hash = hash_key(key);
+    int err = -1;
+
+    pthread_mutex_lock(&queue.lock);
+    for (int i = 0; i < REFRESH_THREADS; i++) {
+        if (same_key(&queue.busy[i], key, hash)) {
+            goto out;
+        }
+    }
+    for (int i = 0; i < queue.count; i++) {
+        if (same_key(&queue.jobs[(queue.head + i) % REFRESH_QUEUE], key, hash)) {
+            goto out;
+        }
+    }
+    // Only a key that would really be fetched uses up the origin's rate
+    if (queue.count == REFRESH_QUEUE || !origin_refresh_permit(o)) {
+        goto out;
+    }
+    char *copy = strdup(key);
+    if (copy == NULL) {
+        goto out;
+    }
+    struct refresh_job *j = &queue.jobs[(queue.head + queue.count) % REFRESH_QUEUE];
+    j->key = copy;
+    j->hash = hash;
+    queue.count++;
+    pthread_cond_signal(&queue.ready);
+    err = 0;
+
+out:
+    pthread_mutex_unlock(&queue.lock);
+    return err;
+}
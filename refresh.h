@@ -0,0 +1,94 @@
+/*
+ * refresh.h -- freshness of cached responses and their background refresh.
+ *
+ * A cached response is fresh for its lifetime: s-maxage or max-age from its
+ * Cache-Control, else the configured default. After that, RFC 5861 gives
+ * two more windows in which the stale copy may still be used:
+ *
+ *   stale-while-revalidate=N  serve it at once and fetch a new copy in the
+ *                             background, for N seconds past the lifetime
+ *   stale-if-error=N          fetch in the foreground, but fall back to it
+ *                             if the origin fails, for N seconds past the
+ *                             lifetime
+ *
+ * Responses without these directives get the configured defaults.
+ * no-cache and must-revalidate (or proxy-revalidate) turn both windows off.
+ *
+ * 301, 404 and 410 answers are kept in a separate negative cache. Without
+ * a lifetime of their own they get the negative TTL, and they are only
+ * used stale if their headers say so.
+ * The headers are read from the stored response at lookup time, so nothing
+ * about freshness is kept in the cache, its snapshots or a shared region.
+ *
+ * Background refreshes go through a small queue served by REFRESH_THREADS
+ * threads. A key already queued or being fetched is not queued again, and
+ * each origin is held to a rate of refreshes per second.
+ */
+
+#ifndef REFRESH_H
+#define REFRESH_H
+
+#include <time.h>
+
+#include "cache.h"
+#include "origin.h"
+
+#define REFRESH_THREADS 2         // Threads fetching in the background
+#define REFRESH_QUEUE 256         // Keys waiting to be fetched; more are dropped
+
+enum staleness {
+    ENTRY_FRESH,                  // Serve it
+    ENTRY_REVALIDATE,             // Serve it and refresh it in the background
+    ENTRY_IF_ERROR,               // Fetch a new copy, serve this one if that fails
+    ENTRY_EXPIRED                 // Do not use it
+};
+
+/**
+ * Set the defaults for responses that do not say. Safe to call while
+ * entries are being checked.
+ *
+ * @param ttl Lifetime in seconds, 0 for responses that never go stale
+ * @param swr stale-while-revalidate in seconds
+ * @param sie stale-if-error in seconds
+ * @param negative_ttl Lifetime of 301, 404 and 410 answers, 0 to not
+ *        keep them at all
+ */
+void refresh_configure(int ttl, int swr, int sie, int negative_ttl);
+
+/**
+ * Check whether a response belongs in the negative cache.
+ *
+ * @param status Status code of the response
+ * @return 1 for 301, 404 and 410 while negative caching is on, else 0
+ */
+int refresh_negative(int status);
+
+/**
+ * Work out how a cached response may be used.
+ *
+ * @param e Entry
+ * @param now Current time (wall clock, like e->stored)
+ * @return How to use the entry
+ */
+enum staleness refresh_check(const struct cache_entry *e, time_t now);
+
+/**
+ * Start the refresh threads.
+ *
+ * @param fetch Fetches a key and stores the response in the cache; called
+ *        on a refresh thread, returns 0 if a new copy was stored
+ * @return 0 on success, -1 if a thread could not be started
+ */
+int refresh_init(int (*fetch)(const char *key));
+
+/**
+ * Queue a key for a background fetch, unless it is queued or being fetched
+ * already, the queue is full or its origin is over its refresh rate.
+ *
+ * @param key Cache key
+ * @param o Origin of the key, for the rate limit; may be NULL
+ * @return 0 if queued, -1 if not
+ */
+int refresh_submit(const char *key, struct origin *o);
+
+#endif
@@ -0,0 +1,477 @@
+/*
+ * shmcache.c -- response cache in a shared memory file.
+ */
+
+#include "shmcache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+
+#define SHM_MAGIC "PXSHM01"   // Changes with the layout
+#define SHM_HEADER 4096       // Header page, shard headers follow
+
+enum {
+    REC_LIVE = 0x4c495645,    // Indexed
+    REC_DEAD = 0x44454144,    // Removed, waiting for the tail to pass
+    REC_PAD = 0x50414444      // Filler up to the end of the ring
+};
+
+struct shm_header {
+    char magic[8];            // Written last, once the region is formatted
+    uint64_t size;            // Of the whole region
+    uint64_t nshards;
+};
+
+struct shm_slot {
+    uint64_t hash;
+    uint64_t off;             // Of the record from the start of the region, 0 if free
+};
+
+struct shm_shard {
+    pthread_mutex_t lock;     // Process shared and robust
+    uint64_t slots_off;       // Index, nslots slots
+    uint64_t nslots;          // Power of two
+    uint64_t ring_off;
+    uint64_t ring_size;
+    uint64_t head;            // Where the next record goes, from ring_off
+    uint64_t tail;            // Oldest record
+    uint64_t used;            // Ring bytes between tail and head, dead records and padding included
+    uint64_t count;           // Live records
+    uint64_t bytes;           // Response bytes of live records
+} __attribute__((aligned(64)));
+
+// Followed by the key and its NUL, then the response and a NUL, padded to 8
+struct shm_record {
+    uint32_t magic;
+    uint32_t keylen;
+    uint64_t size;            // Whole record
+    uint64_t hash;
+    uint64_t len;
+    int64_t stored;
+    uint64_t hits;
+};
+
+struct shm_cache {
+    char *base;
+    size_t size;
+    struct shm_shard *shards;
+};
+
+static struct shm_shard *shard_of(struct shm_cache *s, uint64_t hash) {
+    // The index probes with the low bits, so pick the shard with the high ones
+    return &s->shards[(hash >> 56) % SHM_SHARDS];
+}
+
+static struct shm_slot *slots_of(struct shm_cache *s, struct shm_shard *sh) {
+    return (struct shm_slot *)(s->base + sh->slots_off);
+}
+
+static struct shm_record *record_at(struct shm_cache *s, struct shm_shard *sh, uint64_t pos) {
+    return (struct shm_record *)(s->base + sh->ring_off + pos);
+}
+
+static const char *record_key(const struct shm_record *r) {
+    return (const char *)(r + 1);
+}
+
+static void shard_reset(struct shm_cache *s, struct shm_shard *sh) {
+    memset(slots_of(s, sh), 0, sh->nslots * sizeof(struct shm_slot));
+    sh->head = sh->tail = sh->used = 0;
+    sh->count = sh->bytes = 0;
+}
+
+static void shard_lock(struct shm_cache *s, struct shm_shard *sh) {
+    if (pthread_mutex_lock(&sh->lock) == EOWNERDEAD) {
+        log_warn("A process died while updating shared cache shard %d, emptying it",
+                 (int)(sh - s->shards));
+        shard_reset(s, sh);
+        pthread_mutex_consistent(&sh->lock);
+    }
+}
+
+static uint64_t slot_find(struct shm_cache *s, struct shm_shard *sh, const char *key, uint64_t hash) {
+    struct shm_slot *slots = slots_of(s, sh);
+    uint64_t mask = sh->nslots - 1;
+
+    for (uint64_t i = hash & mask; slots[i].off != 0; i = (i + 1) & mask) {
+        if (slots[i].hash == hash &&
+            strcmp(record_key((struct shm_record *)(s->base + slots[i].off)), key) == 0) {
+            return i;
+        }
+    }
+    return sh->nslots;
+}
+
+// Free a slot, moving later slots of the probe sequence up so that no
+// lookup stops early at the hole
+static void slot_clear(struct shm_cache *s, struct shm_shard *sh, uint64_t i) {
+    struct shm_slot *slots = slots_of(s, sh);
+    uint64_t mask = sh->nslots - 1;
+
+    for (uint64_t j = (i + 1) & mask; slots[j].off != 0; j = (j + 1) & mask) {
+        uint64_t home = slots[j].hash & mask;
+        // Move slot j to i unless its home lies cyclically in (i, j]
+        if (i <= j ? (home <= i || home > j) : (home <= i && home > j)) {
+            slots[i] = slots[j];
+            i = j;
+        }
+    }
+    slots[i].off = 0;
+}
+
+static void record_drop(struct shm_cache *s, struct shm_shard *sh, struct shm_record *r) {
+    struct shm_slot *slots = slots_of(s, sh);
+    uint64_t mask = sh->nslots - 1, off = (char *)r - s->base;
+
+    for (uint64_t i = r->hash & mask; slots[i].off != 0; i = (i + 1) & mask) {
+        if (slots[i].off == off) {
+            slot_clear(s, sh, i);
+            break;
+        }
+    }
+    r->magic = REC_DEAD;
+    sh->count--;
+    sh->bytes -= r->len;
+}
+
+// Record at pos, or NULL if pos is too close to the end of the ring for
+// one, in which case the ring goes on at 0
+static struct shm_record *ring_record(struct shm_cache *s, struct shm_shard *sh, uint64_t pos) {
+    return sh->ring_size - pos < sizeof(struct shm_record) ? NULL : record_at(s, sh, pos);
+}
+
+// Advance the tail past the oldest record; returns 1 if it was live
+static int shard_evict(struct shm_cache *s, struct shm_shard *sh) {
+    struct shm_record *r = ring_record(s, sh, sh->tail);
+    if (r == NULL) {
+        sh->used -= sh->ring_size - sh->tail;
+        sh->tail = 0;
+        return 0;
+    }
+    if (r->size == 0 || r->size > sh->ring_size - sh->tail || r->size > sh->used) {
+        log_warn("Shared cache shard %d is damaged, emptying it", (int)(sh - s->shards));
+        shard_reset(s, sh);
+        return 0;
+    }
+    int live = r->magic == REC_LIVE;
+    if (live) {
+        record_drop(s, sh, r);
+    }
+    sh->used -= r->size;
+    sh->tail += r->size;
+    if (sh->tail == sh->ring_size) {
+        sh->tail = 0;
+    }
+    return live;
+}
+
+// Make room for size bytes at the head, evicting from the tail; returns
+// the number of live records evicted
+static int shard_reserve(struct shm_cache *s, struct shm_shard *sh, uint64_t size) {
+    int evicted = 0;
+
+    while (1) {
+        if (sh->used == 0) {
+            sh->head = sh->tail = 0;
+        }
+        if (sh->used == 0 || sh->head > sh->tail) {
+            // Free space runs from the head to the end, then from 0 to the tail
+            uint64_t room = sh->ring_size - sh->head;
+            if (room >= size) {
+                return evicted;
+            }
+            struct shm_record *pad = ring_record(s, sh, sh->head);
+            if (pad != NULL) {
+                pad->magic = REC_PAD;
+                pad->size = room;
+            }
+            sh->used += room;
+            sh->head = 0;
+        } else if (sh->head < sh->tail && sh->tail - sh->head >= size) {
+            return evicted;
+        } else {
+            evicted += shard_evict(s, sh);
+        }
+    }
+}
+
+size_t shm_cache_capacity(struct shm_cache *s) {
+    return s->shards[0].ring_size * SHM_SHARDS;
+}
+
+struct cache_entry *shm_cache_get(struct shm_cache *s, const char *key, uint64_t hash) {
+    struct shm_shard *sh = shard_of(s, hash);
+    struct cache_entry *e = NULL;
+
+    shard_lock(s, sh);
+    uint64_t i = slot_find(s, sh, key, hash);
+    if (i < sh->nslots) {
+        struct shm_record *r = (struct shm_record *)(s->base + slots_of(s, sh)[i].off);
+        e = malloc(sizeof(*e) + r->keylen + 1 + r->len + 1);
+        if (e != NULL) {
+            memset(e, 0, sizeof(*e));
+            e->key = (char *)(e + 1);
+            memcpy(e->key, record_key(r), r->keylen + 1);
+            e->data = e->key + r->keylen + 1;
+            memcpy(e->data, record_key(r) + r->keylen + 1, r->len + 1);
+            e->len = r->len;
+            e->hash = hash;
+            e->stored = r->stored;
+            e->hits = ++r->hits;
+            e->refs = 1;
+        }
+    }
+    pthread_mutex_unlock(&sh->lock);
+    return e;
+}
+
+int shm_cache_put(struct shm_cache *s, const char *key, uint64_t hash, const char *data, size_t len) {
+    struct shm_shard *sh = shard_of(s, hash);
+    size_t keylen = strlen(key);
+    uint64_t size = (sizeof(struct shm_record) + keylen + 1 + len + 1 + 7) & ~(uint64_t)7;
+    int evicted = 0;
+
+    if (size > sh->ring_size) {
+        return -1;
+    }
+    shard_lock(s, sh);
+    uint64_t i = slot_find(s, sh, key, hash);
+    if (i < sh->nslots) {
+        record_drop(s, sh, (struct shm_record *)(s->base + slots_of(s, sh)[i].off));
+    }
+    // Keep the index at most three quarters full
+    while (sh->count >= sh->nslots / 4 * 3 && sh->used > 0) {
+        evicted += shard_evict(s, sh);
+    }
+    evicted += shard_reserve(s, sh, size);
+
+    struct shm_record *r = record_at(s, sh, sh->head);
+    r->magic = REC_LIVE;
+    r->keylen = keylen;
+    r->size = size;
+    r->hash = hash;
+    r->len = len;
+    r->stored = time(NULL);
+    r->hits = 0;
+    char *p = (char *)(r + 1);
+    memcpy(p, key, keylen + 1);
+    memcpy(p + keylen + 1, data, len);
+    p[keylen + 1 + len] = '\0';
+
+    struct shm_slot *slots = slots_of(s, sh);
+    uint64_t mask = sh->nslots - 1;
+    for (i = hash & mask; slots[i].off != 0; i = (i + 1) & mask) {
+    }
+    slots[i].hash = hash;
+    slots[i].off = (char *)r - s->base;
+    sh->head += size;
+    sh->used += size;
+    sh->count++;
+    sh->bytes += len;
+    pthread_mutex_unlock(&sh->lock);
+    return evicted;
+}
+
+int shm_cache_remove(struct shm_cache *s, const char *key, uint64_t hash,
+                     int (*match)(const char *key, const void *arg), const void *arg) {
+    int removed = 0;
+
+    if (match == NULL) {
+        struct shm_shard *sh = shard_of(s, hash);
+        shard_lock(s, sh);
+        uint64_t i = slot_find(s, sh, key, hash);
+        if (i < sh->nslots) {
+            record_drop(s, sh, (struct shm_record *)(s->base + slots_of(s, sh)[i].off));
+            removed = 1;
+        }
+        pthread_mutex_unlock(&sh->lock);
+        return removed;
+    }
+
+    for (int n = 0; n < SHM_SHARDS; n++) {
+        struct shm_shard *sh = &s->shards[n];
+        shard_lock(s, sh);
+        uint64_t pos = sh->tail, left = sh->used;
+        while (left > 0) {
+            struct shm_record *r = ring_record(s, sh, pos);
+            uint64_t step = r != NULL ? r->size : sh->ring_size - pos;
+            if (step == 0 || step > left) {
+                break;
+            }
+            if (r != NULL && r->magic == REC_LIVE && match(record_key(r), arg)) {
+                record_drop(s, sh, r);
+                removed++;
+            }
+            left -= step;
+            pos = pos + step == sh->ring_size ? 0 : pos + step;
+        }
+        pthread_mutex_unlock(&sh->lock);
+    }
+    return removed;
+}
+
+size_t shm_cache_bytes(struct shm_cache *s) {
+    size_t bytes = 0;
+    for (int n = 0; n < SHM_SHARDS; n++) {
+        bytes += __atomic_load_n(&s->shards[n].bytes, __ATOMIC_RELAXED);
+    }
+    return bytes;
+}
+
+void shm_cache_walk(struct shm_cache *s, int (*fn)(void *arg, const struct cache_entry *e), void *arg) {
+    struct cache_entry view;
+
+    for (int n = 0; n < SHM_SHARDS; n++) {
+        struct shm_shard *sh = &s->shards[n];
+        int stop = 0;
+        shard_lock(s, sh);
+        uint64_t pos = sh->tail, left = sh->used;
+        while (left > 0 && !stop) {
+            struct shm_record *r = ring_record(s, sh, pos);
+            uint64_t step = r != NULL ? r->size : sh->ring_size - pos;
+            if (step == 0 || step > left) {
+                break;
+            }
+            if (r != NULL && r->magic == REC_LIVE) {
+                memset(&view, 0, sizeof(view));
+                view.key = (char *)record_key(r);
+                view.data = view.key + r->keylen + 1;
+                view.len = r->len;
+                view.hash = r->hash;
+                view.stored = r->stored;
+                view.hits = r->hits;
+                stop = fn(arg, &view);
+            }
+            left -= step;
+            pos = pos + step == sh->ring_size ? 0 : pos + step;
+        }
+        pthread_mutex_unlock(&sh->lock);
+        if (stop) {
+            return;
+        }
+    }
+}
+
+// Lay out the header, the shard headers, then each shard's index and ring
+static int region_format(char *base, size_t size) {
+    struct shm_header *h = (struct shm_header *)base;
+    struct shm_shard *shards = (struct shm_shard *)(base + SHM_HEADER);
+    uint64_t off = SHM_HEADER + SHM_SHARDS * sizeof(struct shm_shard);
+    uint64_t per_shard = ((size - off) / SHM_SHARDS) & ~(uint64_t)63;
+    pthread_mutexattr_t attr;
+
+    // About one slot per 2KB of ring, so the index is under 1% of it
+    uint64_t nslots = 64;
+    while (nslots * 2048 < per_shard) {
+        nslots *= 2;
+    }
+    if (nslots * sizeof(struct shm_slot) >= per_shard / 2) {
+        return -1;
+    }
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    for (int n = 0; n < SHM_SHARDS; n++) {
+        struct shm_shard *sh = &shards[n];
+        memset(sh, 0, sizeof(*sh));
+        pthread_mutex_init(&sh->lock, &attr);
+        sh->slots_off = off;
+        sh->nslots = nslots;
+        sh->ring_off = off + nslots * sizeof(struct shm_slot);
+        sh->ring_size = (per_shard - nslots * sizeof(struct shm_slot)) & ~(uint64_t)7;
+        off += per_shard;
+    }
+    pthread_mutexattr_destroy(&attr);
+    h->size = size;
+    h->nshards = SHM_SHARDS;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(h->magic, SHM_MAGIC, sizeof(h->magic));
+    return 0;
+}
+
+struct shm_cache *shm_cache_open(const char *path, size_t bytes) {
+    struct shm_header h = {{0}, 0, 0};
+    struct stat st;
+    char *base = MAP_FAILED;
+    size_t size = bytes;
+
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        log_error("Cannot open shared cache %s: %s", path, strerror(errno));
+        return NULL;
+    }
+    // One process formats a new region; the others wait here for it
+    if (flock(fd, LOCK_EX) < 0 || fstat(fd, &st) < 0) {
+        log_error("Cannot lock shared cache %s: %s", path, strerror(errno));
+        goto fail;
+    }
+    if (st.st_size >= (off_t)sizeof(h) && pread(fd, &h, sizeof(h), 0) != sizeof(h)) {
+        log_error("Cannot read shared cache %s: %s", path, strerror(errno));
+        goto fail;
+    }
+    int formatted = memcmp(h.magic, SHM_MAGIC, sizeof(h.magic)) == 0;
+    if (formatted) {
+        if (h.size != (uint64_t)st.st_size || h.nshards != SHM_SHARDS) {
+            log_error("Shared cache %s is damaged", path);
+            goto fail;
+        }
+        size = h.size;
+    } else if (h.magic[0] != '\0') {
+        log_error("Shared cache %s has another layout, leaving it alone", path);
+        goto fail;
+    } else if (size < SHM_MIN_SIZE) {
+        log_error("Shared cache needs at least %d bytes", SHM_MIN_SIZE);
+        goto fail;
+    } else if (ftruncate(fd, 0) < 0 || ftruncate(fd, size) < 0) {
+        // Emptied first: a process that died formatting it left junk
+        log_error("Cannot size shared cache %s: %s", path, strerror(errno));
+        goto fail;
+    }
+
+    base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        log_error("Cannot map shared cache %s: %s", path, strerror(errno));
+        goto fail;
+    }
+    if (!formatted && region_format(base, size) < 0) {
+        log_error("Shared cache %s is too small to format", path);
+        goto fail;
+    }
+    struct shm_cache *s = malloc(sizeof(*s));
+    if (s == NULL) {
+        goto fail;
+    }
+    s->base = base;
+    s->size = size;
+    s->shards = (struct shm_shard *)(base + SHM_HEADER);
+    flock(fd, LOCK_UN);
+    close(fd);
+    if (formatted) {
+        log_info("Attached to shared cache %s (%zu bytes, %zu cached)", path, size, shm_cache_bytes(s));
+    } else {
+        log_info("Created shared cache %s (%zu bytes)", path, size);
+    }
+    return s;
+
+fail:
+    if (base != MAP_FAILED) {
+        munmap(base, size);
+    }
+    close(fd);
+    return NULL;
+}
+
+void shm_cache_close(struct shm_cache *s) {
+    munmap(s->base, s->size);
+    free(s);
+}
@@ -0,0 +1,115 @@
+/*
+ * shmcache.h -- response cache in a shared memory file.
+ *
+ * Several proxy processes on one machine can map the same file (normally
+ * under /dev/shm) and share one cache. The region holds no pointers, only
+ * offsets from its start, since every process maps it at its own address.
+ *
+ * The region is split into SHM_SHARDS shards by key hash. Each shard has a
+ * process-shared robust mutex, an open addressing index of (hash, offset)
+ * slots and a ring that records are appended to: allocating moves the head
+ * and eviction is FIFO from the tail. A removed record stays in the ring,
+ * unindexed, until the tail passes it.
+ *
+ * No process holds references into the region; a hit is copied out under
+ * the shard lock. So a process may die at any point: if it held a shard
+ * lock, the next process to take it gets EOWNERDEAD, empties that shard
+ * (it may be half updated) and the rest of the cache carries on.
+ *
+ * All processes sharing a region must run the same build; a region with
+ * another layout is left alone.
+ */
+
+#ifndef SHMCACHE_H
+#define SHMCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cache.h"
+
+#define SHM_SHARDS 16
+#define SHM_MIN_SIZE (1 << 20)
+
+struct shm_cache;
+
+/**
+ * Map a shared cache, creating and formatting the file if it is new.
+ *
+ * @param path File, normally under /dev/shm
+ * @param bytes Size of the region if it is created; an existing region
+ *        keeps its size
+ * @return Handle, or NULL if the file cannot be used
+ */
+struct shm_cache *shm_cache_open(const char *path, size_t bytes);
+
+/**
+ * Unmap a shared cache. The region and its entries stay for the other
+ * processes.
+ *
+ * @param s Shared cache
+ */
+void shm_cache_close(struct shm_cache *s);
+
+/**
+ * @param s Shared cache
+ * @return Bytes available for records
+ */
+size_t shm_cache_capacity(struct shm_cache *s);
+
+/**
+ * Look a key up and copy the entry out.
+ *
+ * @param s Shared cache
+ * @param key Key
+ * @param hash Hash of the key
+ * @return A private copy with one reference, to be given back with
+ *         cache_release(), or NULL on a miss
+ */
+struct cache_entry *shm_cache_get(struct shm_cache *s, const char *key, uint64_t hash);
+
+/**
+ * Store a response, replacing any entry for the key.
+ *
+ * @param s Shared cache
+ * @param key Key
+ * @param hash Hash of the key
+ * @param data Response
+ * @param len Length of data
+ * @return Number of entries evicted, or -1 if the response does not fit
+ *         in a shard
+ */
+int shm_cache_put(struct shm_cache *s, const char *key, uint64_t hash, const char *data, size_t len);
+
+/**
+ * Drop every entry for which match returns nonzero; pass a NULL match to
+ * drop the one entry for key.
+ *
+ * @param s Shared cache
+ * @param key Key, when match is NULL
+ * @param hash Hash of the key, when match is NULL
+ * @param match Called with each key under its shard lock
+ * @param arg Passed to match
+ * @return Number of entries removed
+ */
+int shm_cache_remove(struct shm_cache *s, const char *key, uint64_t hash,
+                     int (*match)(const char *key, const void *arg), const void *arg);
+
+/**
+ * @param s Shared cache
+ * @return Bytes held by indexed entries
+ */
+size_t shm_cache_bytes(struct shm_cache *s);
+
+/**
+ * Call fn for every indexed entry, shard by shard and oldest first within
+ * a shard, each under its shard lock. The entry passed only lives for the
+ * call. fn returns nonzero to stop the walk.
+ *
+ * @param s Shared cache
+ * @param fn Callback
+ * @param arg Passed to fn
+ */
+void shm_cache_walk(struct shm_cache *s, int (*fn)(void *arg, const struct cache_entry *e), void *arg);
+
+#endif
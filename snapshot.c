@@ -0,0 +1,344 @@
+/*
+ * snapshot.c -- cache snapshots for warm restarts.
+ *
+ * Files are in native byte order; a snapshot is meant for the next run of
+ * the proxy on the same machine, not for moving around.
+ */
+
+#include "snapshot.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+
+#define SNAP_VERSION 1
+
+struct snap_header {
+    char magic[8];            // "PXSNAPI\0" for the index, "PXSNAPL\0" for the log
+    uint32_t version;
+    uint32_t count;           // Records in the index
+    uint64_t stamp;           // Same in both files of a snapshot
+    uint64_t log_bytes;       // Size of the log, header included
+};
+
+struct snap_record {
+    uint64_t offset;          // Of the key in the log; the response follows its NUL
+    uint64_t len;             // Response bytes, followed by a NUL
+    int64_t stored;           // When the response was stored (time_t)
+    uint32_t keylen;
+    uint32_t hits;
+    uint8_t referenced;       // CLOCK bit
+    uint8_t pad[7];
+};
+
+static const char idx_magic[8] = "PXSNAPI";
+static const char log_magic[8] = "PXSNAPL";
+
+// One save at a time, from the timer thread or at shutdown
+static pthread_mutex_t save_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct saver {
+    struct cache *c;
+    char dir[PATH_MAX];
+    int interval;
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// fflush, fsync and fclose; -1 if any of them or an earlier write failed
+static int finish_file(FILE *f) {
+    int err = ferror(f) || fflush(f) != 0 || fsync(fileno(f)) < 0;
+    return fclose(f) != 0 || err ? -1 : 0;
+}
+
+// Write the entries to the two streams and close them
+static int write_files(struct cache_entry **v, long n, FILE *idx, FILE *log) {
+    struct snap_header h = {{0}, SNAP_VERSION, (uint32_t)n, now_ns(), sizeof(h)};
+    for (long i = 0; i < n; i++) {
+        h.log_bytes += strlen(v[i]->key) + 1 + v[i]->len + 1;
+    }
+
+    if (idx == NULL || log == NULL) {
+        log_warn("Cannot write snapshot: %s", strerror(errno));
+        if (idx != NULL) fclose(idx);
+        if (log != NULL) fclose(log);
+        return -1;
+    }
+    setvbuf(log, NULL, _IOFBF, 1 << 20);
+
+    memcpy(h.magic, idx_magic, sizeof(h.magic));
+    fwrite(&h, sizeof(h), 1, idx);
+    memcpy(h.magic, log_magic, sizeof(h.magic));
+    fwrite(&h, sizeof(h), 1, log);
+
+    uint64_t offset = sizeof(h);
+    for (long i = 0; i < n && !ferror(log) && !ferror(idx); i++) {
+        struct cache_entry *e = v[i];
+        struct snap_record r = {0};
+        r.offset = offset;
+        r.len = e->len;
+        r.stored = e->stored;
+        r.keylen = strlen(e->key);
+        r.hits = __atomic_load_n(&e->hits, __ATOMIC_RELAXED);
+        r.referenced = __atomic_load_n(&e->referenced, __ATOMIC_RELAXED);
+        fwrite(&r, sizeof(r), 1, idx);
+        fwrite(e->key, 1, r.keylen + 1, log);
+        fwrite(e->data, 1, e->len, log);
+        fputc('\0', log);
+        offset += r.keylen + 1 + e->len + 1;
+    }
+
+    int ok_log = finish_file(log);
+    int ok_idx = finish_file(idx);
+    if (ok_log < 0 || ok_idx < 0) {
+        log_warn("Cannot write snapshot: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+long snapshot_save(struct cache *c, const char *dir) {
+    char idx_path[PATH_MAX], log_path[PATH_MAX], idx_tmp[PATH_MAX], log_tmp[PATH_MAX];
+    struct cache_entry **v;
+
+    snprintf(idx_path, sizeof(idx_path), "%s/cache.idx", dir);
+    snprintf(log_path, sizeof(log_path), "%s/cache.log", dir);
+    // Named after the process, an old one still draining after an upgrade
+    // may save at the same time as its successor
+    snprintf(idx_tmp, sizeof(idx_tmp), "%s/cache.idx.%d.tmp", dir, (int)getpid());
+    snprintf(log_tmp, sizeof(log_tmp), "%s/cache.log.%d.tmp", dir, (int)getpid());
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        log_warn("Cannot create snapshot directory %s: %s", dir, strerror(errno));
+        return -1;
+    }
+
+    pthread_mutex_lock(&save_lock);
+    uint64_t start = now_ns();
+    long n = cache_collect(c, &v);
+    if (n < 0) {
+        pthread_mutex_unlock(&save_lock);
+        return -1;
+    }
+
+    int err = write_files(v, n, fopen(idx_tmp, "w"), fopen(log_tmp, "w"));
+    for (long i = 0; i < n; i++) {
+        cache_release(v[i]);
+    }
+    free(v);
+
+    // The log goes first; a crash between the two leaves stamps that differ
+    if (err == 0 && (rename(log_tmp, log_path) < 0 || rename(idx_tmp, idx_path) < 0)) {
+        log_warn("Cannot replace snapshot: %s", strerror(errno));
+        err = -1;
+    }
+    if (err < 0) {
+        unlink(idx_tmp);
+        unlink(log_tmp);
+    } else {
+        int dfd = open(dir, O_RDONLY | O_DIRECTORY);
+        if (dfd >= 0) {
+            fsync(dfd);
+            close(dfd);
+        }
+        log_info("Saved %ld cache entries to %s in %.1f ms", n, dir, (now_ns() - start) / 1e6);
+    }
+    pthread_mutex_unlock(&save_lock);
+    return err < 0 ? -1 : n;
+}
+
+long snapshot_write(struct cache *c, int idx_fd, int log_fd) {
+    struct cache_entry **v;
+    long n = cache_collect(c, &v);
+    if (n < 0) {
+        return -1;
+    }
+
+    // The streams close duplicates, the descriptors stay the caller's
+    int idx_dup = dup(idx_fd), log_dup = dup(log_fd);
+    FILE *idx = idx_dup >= 0 ? fdopen(idx_dup, "w") : NULL;
+    FILE *log = log_dup >= 0 ? fdopen(log_dup, "w") : NULL;
+    if (idx == NULL && idx_dup >= 0) close(idx_dup);
+    if (log == NULL && log_dup >= 0) close(log_dup);
+    int err = write_files(v, n, idx, log);
+    for (long i = 0; i < n; i++) {
+        cache_release(v[i]);
+    }
+    free(v);
+    return err < 0 ? -1 : n;
+}
+
+// Read a whole small file; the index is a few dozen bytes per entry
+static void *read_file(int fd, size_t *len) {
+    struct stat st;
+    char *buf = NULL;
+
+    if (fstat(fd, &st) == 0 && (buf = malloc(st.st_size ? st.st_size : 1)) != NULL) {
+        size_t got = 0;
+        while (got < (size_t)st.st_size) {
+            ssize_t r = pread(fd, buf + got, st.st_size - got, got);
+            if (r <= 0) {
+                break;
+            }
+            got += r;
+        }
+        *len = got;
+    }
+    return buf;
+}
+
+long snapshot_load(struct cache *c, const char *dir) {
+    char idx_path[PATH_MAX], log_path[PATH_MAX];
+
+    snprintf(idx_path, sizeof(idx_path), "%s/cache.idx", dir);
+    snprintf(log_path, sizeof(log_path), "%s/cache.log", dir);
+
+    int idx_fd = open(idx_path, O_RDONLY);
+    if (idx_fd < 0) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    int log_fd = open(log_path, O_RDONLY);
+    long loaded = snapshot_read(c, idx_fd, log_fd, dir);
+    close(idx_fd);
+    if (log_fd >= 0) {
+        close(log_fd);
+    }
+    return loaded;
+}
+
+long snapshot_read(struct cache *c, int idx_fd, int log_fd, const char *name) {
+    size_t idx_len = 0;
+    long loaded = 0, skipped = 0;
+
+    char *idx = read_file(idx_fd, &idx_len);
+    if (idx == NULL) {
+        return -1;
+    }
+    struct snap_header h;
+    if (idx_len < sizeof(h) || (memcpy(&h, idx, sizeof(h)), memcmp(h.magic, idx_magic, 8) != 0) ||
+        h.version != SNAP_VERSION || idx_len != sizeof(h) + (size_t)h.count * sizeof(struct snap_record)) {
+        log_warn("Snapshot index in %s is damaged", name);
+        free(idx);
+        return -1;
+    }
+
+    struct stat st;
+    if (log_fd < 0 || fstat(log_fd, &st) < 0 || (uint64_t)st.st_size != h.log_bytes ||
+        h.log_bytes < sizeof(h)) {
+        log_warn("Snapshot log in %s is missing or does not match its index", name);
+        free(idx);
+        return -1;
+    }
+    char *base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, log_fd, 0);
+    struct cache_map *map = malloc(sizeof(*map));
+    if (base == MAP_FAILED || map == NULL) {
+        log_warn("Cannot map snapshot log in %s: %s", name, strerror(errno));
+        if (base != MAP_FAILED) munmap(base, st.st_size);
+        free(map);
+        free(idx);
+        return -1;
+    }
+    map->base = base;
+    map->len = st.st_size;
+    map->refs = 1;          // Ours until the loop is done
+    struct snap_header lh;
+    memcpy(&lh, base, sizeof(lh));
+    if (memcmp(lh.magic, log_magic, 8) != 0 || lh.stamp != h.stamp) {
+        log_warn("Snapshot log in %s does not match its index", name);
+        loaded = -1;
+    }
+
+    for (uint32_t i = 0; loaded >= 0 && i < h.count; i++) {
+        struct snap_record r;
+        memcpy(&r, idx + sizeof(h) + (size_t)i * sizeof(r), sizeof(r));
+
+        // Everything the record points at has to be inside the log
+        uint64_t avail = r.offset < map->len ? map->len - r.offset : 0;
+        if (r.offset < sizeof(h) || avail < 2 || r.keylen > avail - 2 || r.len > avail - 2 - r.keylen ||
+            memchr(base + r.offset, '\0', r.keylen + 1) != base + r.offset + r.keylen ||
+            base[r.offset + r.keylen + 1 + r.len] != '\0') {
+            log_warn("Snapshot record %u is damaged, stopping there", i);
+            break;
+        }
+        struct cache_entry *e = malloc(sizeof(*e) + r.keylen + 1);
+        if (e == NULL) {
+            break;
+        }
+        memset(e, 0, sizeof(*e));
+        e->key = (char *)(e + 1);
+        memcpy(e->key, base + r.offset, r.keylen + 1);
+        e->data = base + r.offset + r.keylen + 1;
+        e->len = r.len;
+        e->stored = r.stored;
+        e->hits = r.hits;
+        e->referenced = r.referenced;
+        e->map = map;
+        if (cache_insert_oldest(c, e) < 0) {
+            free(e);
+            skipped++;
+            continue;
+        }
+        __atomic_add_fetch(&map->refs, 1, __ATOMIC_RELAXED);
+        loaded++;
+    }
+    free(idx);
+
+    if (loaded > 0) {
+        // Start reading the responses in now rather than on the first hits
+        madvise(base, map->len, MADV_WILLNEED);
+    }
+    if (__atomic_sub_fetch(&map->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        munmap(base, map->len);
+        free(map);
+    }
+    if (loaded >= 0) {
+        log_info("Loaded %ld cache entries from %s (%ld skipped)", loaded, name, skipped);
+    }
+    return loaded;
+}
+
+static void *saver_thread(void *arg) {
+    struct saver *s = arg;
+    sigset_t all;
+
+    // Signals are for the main thread
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+    while (1) {
+        sleep(s->interval);
+        snapshot_save(s->c, s->dir);
+    }
+    return NULL;
+}
+
+int snapshot_start(struct cache *c, const char *dir, int interval) {
+    struct saver *s = malloc(sizeof(*s));
+    pthread_t tid;
+
+    if (s == NULL) {
+        return -1;
+    }
+    s->c = c;
+    snprintf(s->dir, sizeof(s->dir), "%s", dir);
+    s->interval = interval;
+    if (pthread_create(&tid, NULL, saver_thread, s) != 0) {
+        free(s);
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
@@ -0,0 +1,76 @@
+/*
+ * snapshot.h -- cache snapshots for warm restarts.
+ *
+ * A snapshot is two files in one directory: cache.log holds the keys and
+ * responses back to back, cache.idx a header and one fixed size record per
+ * entry (offset into the log, length, when it was stored, hits), newest
+ * first. Both carry the same stamp, so a pair from different saves is
+ * never loaded together. Each save writes new files and renames them over
+ * the old ones.
+ *
+ * Loading reads only the index. The log is mapped into memory and the
+ * entries point into the mapping, so the proxy can serve right away while
+ * the kernel reads the responses in as they are hit (and reads ahead in
+ * the background).
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "cache.h"
+
+/**
+ * Write the cache to a snapshot. References are taken under the cache's
+ * read lock and the files are written without it, so requests carry on.
+ *
+ * @param c Cache
+ * @param dir Directory of the snapshot
+ * @return Number of entries written, or -1 on failure
+ */
+long snapshot_save(struct cache *c, const char *dir);
+
+/**
+ * Index the entries of a snapshot into a cache, newest first, as long as
+ * they fit.
+ *
+ * @param c Cache, normally empty
+ * @param dir Directory of the snapshot
+ * @return Number of entries loaded, 0 if there is no snapshot, -1 if it
+ *         is unreadable or damaged
+ */
+long snapshot_load(struct cache *c, const char *dir);
+
+/**
+ * Write the cache in the snapshot format to two open files, such as the
+ * memory files handed to a new process on an upgrade.
+ *
+ * @param c Cache
+ * @param idx_fd Index file, written from its current offset
+ * @param log_fd Log file, written from its current offset
+ * @return Number of entries written, or -1 on failure
+ */
+long snapshot_write(struct cache *c, int idx_fd, int log_fd);
+
+/**
+ * Index the entries of a snapshot given as two open files; the log is
+ * mapped, so it may be closed afterwards.
+ *
+ * @param c Cache, normally empty
+ * @param idx_fd Index file
+ * @param log_fd Log file
+ * @param name Where the snapshot came from, for the log
+ * @return Number of entries loaded, -1 if the snapshot is damaged
+ */
+long snapshot_read(struct cache *c, int idx_fd, int log_fd, const char *name);
+
+/**
+ * Start a thread that saves a snapshot every interval seconds.
+ *
+ * @param c Cache
+ * @param dir Directory of the snapshot
+ * @param interval Seconds between saves
+ * @return 0 on success, -1 if the thread could not be started
+ */
+int snapshot_start(struct cache *c, const char *dir, int interval);
+
+#endif
@@ -0,0 +1,329 @@
+/*
+ * cache_test.c -- tests of the cache, its snapshots and the shared region.
+ *
+ * Purges by host and by prefix through the path trie, saves and loads a
+ * snapshot (and loads damaged ones), and stores, looks up and evicts
+ * entries in a shared memory region.
+ *
+ * Usage: ./cache_test (run by make test); exits nonzero on a failure.
+ */
+
+#include "cache.h"
+#include "log.h"
+#include "shmcache.h"
+#include "snapshot.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static int failures;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+// Whether key is cached with data as its response
+static int cached(struct cache *c, const char *key, const char *data) {
+    struct cache_entry *e = cache_get(c, key);
+    int found = e != NULL && e->len == strlen(data) && memcmp(e->data, data, e->len) == 0;
+    if (e != NULL) {
+        cache_release(e);
+    }
+    return found;
+}
+
+static int put(struct cache *c, const char *key) {
+    return cache_put(c, key, key, strlen(key));
+}
+
+static void test_purge(void) {
+    static const char *const keys[] = {
+        "http://a.com/",
+        "http://a.com/static/x.css",
+        "http://a.com/static/y.js",
+        "http://a.com/stat",
+        "http://a.com/static",
+        "https://a.com/static/x.css",
+        "http://a.com:8080/static/x.css",
+        "http://b.com/static/x.css",
+        "http://b.com/",
+    };
+    size_t n = sizeof(keys) / sizeof(keys[0]);
+    struct cache c;
+
+    CHECK(cache_init(&c, 1 << 20, 1 << 16, CACHE_LRU) == 0);
+    for (size_t i = 0; i < n; i++) {
+        CHECK(put(&c, keys[i]) == 0);
+    }
+
+    // Everything under the prefix, and nothing that only shares its start
+    CHECK(cache_purge_prefix(&c, "http://a.com/static/") == 2);
+    CHECK(!cached(&c, "http://a.com/static/x.css", "http://a.com/static/x.css"));
+    CHECK(!cached(&c, "http://a.com/static/y.js", "http://a.com/static/y.js"));
+    CHECK(cached(&c, "http://a.com/static", "http://a.com/static"));
+    CHECK(cached(&c, "http://a.com/stat", "http://a.com/stat"));
+    CHECK(cached(&c, "https://a.com/static/x.css", "https://a.com/static/x.css"));
+    CHECK(cached(&c, "http://a.com:8080/static/x.css", "http://a.com:8080/static/x.css"));
+    CHECK(cached(&c, "http://b.com/static/x.css", "http://b.com/static/x.css"));
+
+    // The origin is matched whatever its case, the path is not
+    CHECK(cache_purge_prefix(&c, "http://a.com/STAT") == 0);
+    CHECK(cache_purge_prefix(&c, "HTTP://A.COM/stat") == 2);
+    CHECK(!cached(&c, "http://a.com/stat", "http://a.com/stat"));
+    CHECK(cached(&c, "http://a.com/", "http://a.com/"));
+    CHECK(cache_purge_prefix(&c, "http://c.com/") == 0);
+
+    // The trie still takes new paths after nodes were merged away
+    CHECK(put(&c, "http://a.com/static/z.png") == 0);
+    CHECK(put(&c, "http://a.com/sta") == 0);
+    CHECK(cached(&c, "http://a.com/static/z.png", "http://a.com/static/z.png"));
+
+    // A host with a port is another origin; both schemes go
+    CHECK(cache_purge_host(&c, "A.com") == 4);
+    CHECK(!cached(&c, "http://a.com/", "http://a.com/"));
+    CHECK(!cached(&c, "https://a.com/static/x.css", "https://a.com/static/x.css"));
+    CHECK(cached(&c, "http://a.com:8080/static/x.css", "http://a.com:8080/static/x.css"));
+    CHECK(cache_purge_host(&c, "a.com:8080") == 1);
+    CHECK(cache_purge_host(&c, "a.com") == 0);
+    CHECK(cached(&c, "http://b.com/", "http://b.com/"));
+    CHECK(cached(&c, "http://b.com/static/x.css", "http://b.com/static/x.css"));
+    CHECK(c.count == 2);
+
+    // Removing one key leaves the rest of its origin
+    CHECK(cache_remove(&c, "http://b.com/") == 0);
+    CHECK(cache_purge_prefix(&c, "http://b.com/") == 1);
+    CHECK(c.count == 0 && cache_bytes(&c) == 0);
+    cache_destroy(&c);
+}
+
+static void path_in(char *out, size_t size, const char *dir, const char *name) {
+    snprintf(out, size, "%s/%s", dir, name);
+}
+
+static void truncate_by_one(const char *dir, const char *name) {
+    char path[512];
+    struct stat st;
+
+    path_in(path, sizeof(path), dir, name);
+    CHECK(stat(path, &st) == 0 && truncate(path, st.st_size - 1) == 0);
+}
+
+// Overwrite the log offset of index record i
+static void corrupt_record(const char *dir, unsigned i) {
+    // As in snapshot.c: a 32 byte header, then 40 byte records starting
+    // with the offset
+    char path[512];
+    uint64_t bad = (uint64_t)1 << 40;
+
+    path_in(path, sizeof(path), dir, "cache.idx");
+    int fd = open(path, O_WRONLY);
+    CHECK(fd >= 0 && pwrite(fd, &bad, sizeof(bad), 32 + 40 * i) == sizeof(bad));
+    close(fd);
+}
+
+static void test_snapshot(void) {
+    static const char *const keys[] = {
+        "http://a.com/1",
+        "http://a.com/2",
+        "http://b.com/3",
+    };
+    char dir[] = "/tmp/cache_test.XXXXXX";
+    char other[] = "/tmp/cache_test.XXXXXX";
+    struct cache c, loaded;
+
+    CHECK(mkdtemp(dir) != NULL && mkdtemp(other) != NULL);
+    CHECK(cache_init(&c, 1 << 20, 1 << 16, CACHE_LRU) == 0);
+    CHECK(snapshot_load(&c, dir) == 0);
+    for (size_t i = 0; i < 3; i++) {
+        CHECK(put(&c, keys[i]) == 0);
+    }
+    CHECK(cached(&c, keys[0], keys[0]));
+    CHECK(snapshot_save(&c, dir) == 3);
+
+    // Same entries, same order, same hits
+    CHECK(cache_init(&loaded, 1 << 20, 1 << 16, CACHE_LRU) == 0);
+    CHECK(snapshot_load(&loaded, dir) == 3);
+    struct cache_entry **a, **b;
+    long na = cache_collect(&c, &a), nb = cache_collect(&loaded, &b);
+    CHECK(na == 3 && nb == 3);
+    for (long i = 0; i < na && i < nb; i++) {
+        CHECK(strcmp(a[i]->key, b[i]->key) == 0);
+        CHECK(a[i]->len == b[i]->len && memcmp(a[i]->data, b[i]->data, a[i]->len) == 0);
+        CHECK(a[i]->hits == b[i]->hits);
+        CHECK(b[i]->data[b[i]->len] == '\0');
+    }
+    for (long i = 0; i < na; i++) {
+        cache_release(a[i]);
+    }
+    for (long i = 0; i < nb; i++) {
+        cache_release(b[i]);
+    }
+    free(a);
+    free(b);
+    // Loaded entries are purged like any other
+    CHECK(cache_purge_host(&loaded, "a.com") == 2);
+    cache_destroy(&loaded);
+
+    // Only what fits is loaded, newest first; the lookup above made keys[0]
+    // the newest
+    CHECK(cache_init(&loaded, strlen(keys[0]) + strlen(keys[2]), 1 << 16, CACHE_LRU) == 0);
+    CHECK(snapshot_load(&loaded, dir) == 2);
+    CHECK(cached(&loaded, keys[0], keys[0]) && cached(&loaded, keys[2], keys[2]));
+    CHECK(!cached(&loaded, keys[1], keys[1]));
+    cache_destroy(&loaded);
+
+    // A truncated log or index is refused as a whole
+    truncate_by_one(dir, "cache.log");
+    CHECK(cache_init(&loaded, 1 << 20, 1 << 16, CACHE_LRU) == 0);
+    CHECK(snapshot_load(&loaded, dir) == -1 && loaded.count == 0);
+    cache_destroy(&loaded);
+    CHECK(snapshot_save(&c, dir) == 3);
+    truncate_by_one(dir, "cache.idx");
+    CHECK(cache_init(&loaded, 1 << 20, 1 << 16, CACHE_LRU) == 0);
+    CHECK(snapshot_load(&loaded, dir) == -1 && loaded.count == 0);
+    cache_destroy(&loaded);
+
+    // So is a log from another save
+    char from[512], to[512];
+    CHECK(snapshot_save(&c, dir) == 3);
+    CHECK(put(&c, "http://c.com/4") == 0);
+    CHECK(snapshot_save(&c, other) == 4);
+    path_in(from, sizeof(from), other, "cache.log");
+    path_in(to, sizeof(to), dir, "cache.log");
+    CHECK(rename(from, to) == 0);
+    CHECK(cache_init(&loaded, 1 << 20, 1 << 16, CACHE_LRU) == 0);
+    CHECK(snapshot_load(&loaded, dir) == -1 && loaded.count == 0);
+    cache_destroy(&loaded);
+
+    // A damaged record ends the load, keeping the records before it
+    CHECK(snapshot_save(&c, dir) == 4);
+    corrupt_record(dir, 2);
+    CHECK(cache_init(&loaded, 1 << 20, 1 << 16, CACHE_LRU) == 0);
+    CHECK(snapshot_load(&loaded, dir) == 2 && loaded.count == 2);
+    cache_destroy(&loaded);
+
+    cache_destroy(&c);
+    const char *const names[] = {"cache.idx", "cache.log"};
+    for (size_t i = 0; i < 2; i++) {
+        path_in(from, sizeof(from), dir, names[i]);
+        unlink(from);
+        path_in(from, sizeof(from), other, names[i]);
+        unlink(from);
+    }
+    rmdir(dir);
+    rmdir(other);
+}
+
+static void test_shared(void) {
+    char path[64];
+    char data[4096];
+    char key[64];
+
+    snprintf(path, sizeof(path), "/tmp/cache_test.%d.shm", (int)getpid());
+    unlink(path);
+    struct shm_cache *s = shm_cache_open(path, SHM_MIN_SIZE);
+    CHECK(s != NULL);
+    if (s == NULL) {
+        return;
+    }
+    size_t shard = shm_cache_capacity(s) / SHM_SHARDS;
+    memset(data, 'x', sizeof(data));
+
+    // Another process attaching sees what this one stored
+    CHECK(shm_cache_put(s, "http://a.com/1", 1, "one", 3) == 0);
+    struct shm_cache *other = shm_cache_open(path, 0);
+    CHECK(other != NULL);
+    struct cache_entry *e = other != NULL ? shm_cache_get(other, "http://a.com/1", 1) : NULL;
+    CHECK(e != NULL && e->len == 3 && strcmp(e->data, "one") == 0 && e->hits == 1);
+    if (e != NULL) {
+        cache_release(e);
+    }
+
+    // Same hash, different key: a miss
+    CHECK(shm_cache_get(s, "http://a.com/2", 1) == NULL);
+
+    // Replacing a key keeps one entry
+    CHECK(shm_cache_put(s, "http://a.com/1", 1, "uno", 3) == 0);
+    e = shm_cache_get(s, "http://a.com/1", 1);
+    CHECK(e != NULL && strcmp(e->data, "uno") == 0);
+    if (e != NULL) {
+        cache_release(e);
+    }
+    CHECK(shm_cache_bytes(s) == 3);
+    CHECK(shm_cache_remove(s, "http://a.com/1", 1, NULL, NULL) == 1);
+    CHECK(shm_cache_get(s, "http://a.com/1", 1) == NULL);
+    CHECK(shm_cache_remove(s, "http://a.com/1", 1, NULL, NULL) == 0);
+
+    // Filling one shard evicts its oldest entries first; the top byte of
+    // the hash picks the shard
+    int evicted = 0;
+    unsigned stored = 0;
+    while ((size_t)stored * sizeof(data) < 2 * shard) {
+        snprintf(key, sizeof(key), "http://b.com/%u", stored);
+        int ret = shm_cache_put(s, key, stored + 1, data, sizeof(data));
+        CHECK(ret >= 0);
+        evicted += ret > 0 ? ret : 0;
+        stored++;
+    }
+    CHECK(evicted > 0);
+    CHECK(shm_cache_bytes(s) <= shard);
+    e = shm_cache_get(s, "http://b.com/0", 1);
+    CHECK(e == NULL);
+    snprintf(key, sizeof(key), "http://b.com/%u", stored - 1);
+    e = shm_cache_get(s, key, stored);
+    CHECK(e != NULL && e->len == sizeof(data) && memcmp(e->data, data, sizeof(data)) == 0);
+    if (e != NULL) {
+        cache_release(e);
+    }
+
+    // Other shards are left alone
+    CHECK(shm_cache_put(s, "http://c.com/1", (uint64_t)1 << 56, "c", 1) == 0);
+    e = shm_cache_get(s, "http://c.com/1", (uint64_t)1 << 56);
+    CHECK(e != NULL);
+    if (e != NULL) {
+        cache_release(e);
+    }
+
+    // Too large for a shard
+    char *big = calloc(1, shard + 1);
+    CHECK(big != NULL && shm_cache_put(s, "http://d.com/", 2, big, shard + 1) == -1);
+    free(big);
+
+    if (other != NULL) {
+        shm_cache_close(other);
+    }
+    shm_cache_close(s);
+
+    // The same through the cache, which purges the region by matching keys
+    struct cache c;
+    CHECK(cache_init(&c, SHM_MIN_SIZE, 1 << 16, CACHE_LRU) == 0);
+    CHECK(cache_share(&c, path) == 0);
+    CHECK(put(&c, "http://e.com/a") == 0 && put(&c, "http://e.com/b") == 0 && put(&c, "http://f.com/a") == 0);
+    CHECK(cached(&c, "http://e.com/a", "http://e.com/a"));
+    CHECK(cache_purge_prefix(&c, "http://e.com/a") == 1);
+    CHECK(cache_purge_host(&c, "e.com") == 1);
+    CHECK(!cached(&c, "http://e.com/b", "http://e.com/b"));
+    CHECK(cached(&c, "http://f.com/a", "http://f.com/a"));
+    cache_destroy(&c);
+    unlink(path);
+}
+
+int main(void) {
+    log_level = LV_ERROR;
+    test_purge();
+    test_snapshot();
+    test_shared();
+    if (failures > 0) {
+        fprintf(stderr, "cache_test: %d checks failed\n", failures);
+        return 1;
+    }
+    printf("cache_test: ok\n");
+    return 0;
+}
@@ -0,0 +1,205 @@
+/*
+ * parse_test.c -- tests of the request parser.
+ *
+ * Feeds request heads to ParsedRequest_feed() in every possible split,
+ * checks that malformed heads are rejected however they arrive, and checks
+ * the lookup of headers by name and by id.
+ *
+ * Usage: ./parse_test (run by make test); exits nonzero on a failure.
+ */
+
+#include "proxy_parse.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int failures;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+static const char *const good[] = {
+    "GET http://example.com/index.html HTTP/1.1\r\n"
+    "Host: example.com\r\n"
+    "User-Agent: test\r\n"
+    "Accept: */*\r\n"
+    "\r\n",
+
+    "GET http://example.com:8080/a/b?c=d HTTP/1.0\r\n"
+    "\r\n",
+
+    "POST http://example.com/form HTTP/1.1\r\n"
+    "Host: example.com\r\n"
+    "Content-Length: 4\r\n"
+    "X-Empty:\r\n"
+    "X-Spaces:   padded value   \r\n"
+    "\r\n"
+    "body",
+
+    "CONNECT example.com:443 HTTP/1.1\r\n"
+    "Host: example.com:443\r\n"
+    "\r\n",
+};
+
+static const char *const bad[] = {
+    "GET http://example.com/ HTTP/1.1\r\nNo colon here\r\n\r\n",
+    "GET http://example.com/ HTTP/1.1\r\nHost : example.com\r\n\r\n",
+    "GET http://example.com/ HTTP/1.1\r\n: no name\r\n\r\n",
+    "GET http://example.com/ HTTP/1.1\r\nBad\x01Name: x\r\n\r\n",
+    "GET http://example.com/ HTTP/1.1\r\n folded: x\r\n\r\n",
+    "GET http://example.com/\r\n\r\n",
+    "G(T http://example.com/ HTTP/1.1\r\n\r\n",
+    "GET http://example.com/ FTP/1.1\r\n\r\n",
+    "\r\n",
+};
+
+/* Feed text in two calls, the first with its first split bytes, growing the
+ * buffer in between as a receive loop does; return what the last call
+ * returned */
+static int feed_split(struct ParsedRequest *pr, const char *text, size_t len, size_t split) {
+    char *buf = malloc(split ? split : 1);
+    memcpy(buf, text, split);
+    int ret = ParsedRequest_feed(pr, buf, split);
+    if (ret == 0) {
+        buf = realloc(buf, len);
+        memcpy(buf + split, text + split, len - split);
+        ret = ParsedRequest_feed(pr, buf, len);
+    }
+    // The request line fields are copies, the headers point into buf
+    free(buf);
+    return ret;
+}
+
+/* Head length of a request: up to and including the empty line */
+static size_t head_len(const char *text) {
+    return strstr(text, "\r\n\r\n") + 4 - text;
+}
+
+static void test_split_everywhere(void) {
+    for (size_t i = 0; i < sizeof(good) / sizeof(good[0]); i++) {
+        const char *text = good[i];
+        size_t len = strlen(text);
+        int expect = (int)head_len(text);
+
+        struct ParsedRequest *whole = ParsedRequest_create();
+        CHECK(ParsedRequest_feed(whole, text, len) == expect);
+
+        for (size_t split = 0; split <= len; split++) {
+            struct ParsedRequest *pr = ParsedRequest_create();
+            int ret = feed_split(pr, text, len, split);
+            CHECK(ret == expect);
+            if (ret == expect) {
+                CHECK(strcmp(pr->method, whole->method) == 0);
+                CHECK(pr->headersused == whole->headersused);
+                CHECK((pr->host == NULL) == (whole->host == NULL));
+                if (pr->host != NULL && whole->host != NULL) {
+                    CHECK(strcmp(pr->host, whole->host) == 0);
+                }
+                CHECK((pr->path == NULL) == (whole->path == NULL));
+                if (pr->path != NULL && whole->path != NULL) {
+                    CHECK(strcmp(pr->path, whole->path) == 0);
+                }
+            }
+            ParsedRequest_destroy(pr);
+        }
+
+        // One byte at a time, as a slow client sends it
+        struct ParsedRequest *pr = ParsedRequest_create();
+        int ret = 0;
+        size_t n;
+        for (n = 1; n <= len && ret == 0; n++) {
+            ret = ParsedRequest_feed(pr, text, n);
+        }
+        CHECK(ret == expect);
+        CHECK(n - 1 == (size_t)expect);
+        ParsedRequest_destroy(pr);
+        ParsedRequest_destroy(whole);
+    }
+}
+
+static void test_malformed(void) {
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        const char *text = bad[i];
+        size_t len = strlen(text);
+
+        for (size_t split = 0; split <= len; split++) {
+            struct ParsedRequest *pr = ParsedRequest_create();
+            int ret = feed_split(pr, text, len, split);
+            if (ret != -1) {
+                fprintf(stderr, "bad head %zu split at %zu: got %d\n", i, split, ret);
+            }
+            CHECK(ret == -1);
+            ParsedRequest_destroy(pr);
+        }
+    }
+
+    // An incomplete head is neither accepted nor rejected
+    const char *text = good[0];
+    struct ParsedRequest *pr = ParsedRequest_create();
+    CHECK(ParsedRequest_feed(pr, text, head_len(text) - 1) == 0);
+    ParsedRequest_destroy(pr);
+}
+
+static void test_header_lookup(void) {
+    const char *text =
+        "GET http://example.com/ HTTP/1.1\r\n"
+        "hOsT: example.com\r\n"
+        "CONTENT-LENGTH: 12\r\n"
+        "Cache-Control: no-cache\r\n"
+        "X-Custom: one\r\n"
+        "cache-control: max-age=0\r\n"
+        "\r\n";
+    struct ParsedRequest *pr = ParsedRequest_create();
+    CHECK(ParsedRequest_feed(pr, text, strlen(text)) == (int)strlen(text));
+
+    CHECK(ParsedHeader_id("host", 4) == HDR_HOST);
+    CHECK(ParsedHeader_id("HOST", 4) == HDR_HOST);
+    CHECK(ParsedHeader_id("Content-Length", 14) == HDR_CONTENT_LENGTH);
+    CHECK(ParsedHeader_id("x-forwarded-for", 15) == HDR_X_FORWARDED_FOR);
+    CHECK(ParsedHeader_id("Hostx", 5) == HDR_UNKNOWN);
+    CHECK(ParsedHeader_id("Hos", 3) == HDR_UNKNOWN);
+    CHECK(ParsedHeader_id("X-Custom", 8) == HDR_UNKNOWN);
+
+    struct ParsedHeader *h = ParsedHeader_getId(pr, HDR_HOST);
+    CHECK(h != NULL && h->valuelen == 11 && memcmp(h->value, "example.com", 11) == 0);
+    h = ParsedHeader_getId(pr, HDR_CONTENT_LENGTH);
+    CHECK(h != NULL && h->valuelen == 2 && memcmp(h->value, "12", 2) == 0);
+    // The first of repeated headers
+    h = ParsedHeader_getId(pr, HDR_CACHE_CONTROL);
+    CHECK(h != NULL && h->valuelen == 8 && memcmp(h->value, "no-cache", 8) == 0);
+    CHECK(ParsedHeader_getId(pr, HDR_COOKIE) == NULL);
+
+    // Lookup by name finds the same headers whatever the case
+    CHECK(ParsedHeader_get(pr, "Host") == ParsedHeader_getId(pr, HDR_HOST));
+    CHECK(ParsedHeader_get(pr, "content-length") == ParsedHeader_getId(pr, HDR_CONTENT_LENGTH));
+    h = ParsedHeader_get(pr, "x-CUSTOM");
+    CHECK(h != NULL && h->valuelen == 3 && memcmp(h->value, "one", 3) == 0);
+    CHECK(ParsedHeader_get(pr, "X-Missing") == NULL);
+
+    // Removing takes every occurrence, setting keeps the id slots current
+    CHECK(ParsedHeader_remove(pr, "CACHE-CONTROL") == 0);
+    CHECK(ParsedHeader_getId(pr, HDR_CACHE_CONTROL) == NULL);
+    CHECK(ParsedHeader_get(pr, "Cache-Control") == NULL);
+    CHECK(ParsedHeader_set(pr, "Cookie", "a=b") == 0);
+    h = ParsedHeader_getId(pr, HDR_COOKIE);
+    CHECK(h != NULL && h->valuelen == 3 && memcmp(h->value, "a=b", 3) == 0);
+    CHECK(ParsedHeader_get(pr, "cookie") == h);
+    ParsedRequest_destroy(pr);
+}
+
+int main(void) {
+    test_split_everywhere();
+    test_malformed();
+    test_header_lookup();
+    if (failures > 0) {
+        fprintf(stderr, "parse_test: %d checks failed\n", failures);
+        return 1;
+    }
+    printf("parse_test: ok\n");
+    return 0;
+}
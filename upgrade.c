@@ -0,0 +1,276 @@
+/*
+ * upgrade.c -- replacing the running binary without closing the listener.
+ */
+
+#define _GNU_SOURCE
+#include "upgrade.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "snapshot.h"
+
+#define UPGRADE_FD 3          // Where the new process finds its end of the socket pair
+#define UPGRADE_FDS 3         // Listener, cache index, cache log
+
+extern char **environ;
+
+static char exe_path[PATH_MAX];
+static char **saved_argv;
+static int parent_fd = -1;    // Socket to the old process until upgrade_ready()
+
+// What the upgrade thread works on
+static struct {
+    int listen_fd;
+    struct cache *cache;
+    void (*done)(int ok);
+} job;
+static int running;           // An upgrade thread is at work
+
+static uint64_t monotonic_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+void upgrade_init(char **argv) {
+    // Read now: once a new build is renamed over the file, the link of a
+    // running process points at the deleted one
+    ssize_t n = readlink("/proc/self/exe", exe_path, sizeof(exe_path) - 1);
+    exe_path[n > 0 ? n : 0] = '\0';
+    saved_argv = argv;
+}
+
+// The environment of this process with UPGRADE_ENV set for the new one
+static char **upgrade_env(void) {
+    static char var[] = UPGRADE_ENV "=3";
+    size_t n = 0;
+
+    while (environ[n] != NULL) {
+        n++;
+    }
+    char **env = malloc((n + 2) * sizeof(*env));
+    if (env == NULL) {
+        return NULL;
+    }
+    size_t k = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (strncmp(environ[i], UPGRADE_ENV "=", sizeof(UPGRADE_ENV)) != 0) {
+            env[k++] = environ[i];
+        }
+    }
+    env[k++] = var;
+    env[k] = NULL;
+    return env;
+}
+
+static int send_fds(int sock, const int *fds, int n) {
+    char byte = 'U';
+    struct iovec iov = {&byte, 1};
+    union {
+        char buf[CMSG_SPACE(UPGRADE_FDS * sizeof(int))];
+        struct cmsghdr align;
+    } u;
+    struct msghdr msg = {0};
+
+    memset(&u, 0, sizeof(u));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = u.buf;
+    msg.msg_controllen = CMSG_SPACE(n * sizeof(int));
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(n * sizeof(int));
+    memcpy(CMSG_DATA(cm), fds, n * sizeof(int));
+    return sendmsg(sock, &msg, 0) == 1 ? 0 : -1;
+}
+
+static int recv_fds(int sock, int *fds, int n) {
+    char byte;
+    struct iovec iov = {&byte, 1};
+    union {
+        char buf[CMSG_SPACE(UPGRADE_FDS * sizeof(int))];
+        struct cmsghdr align;
+    } u;
+    struct msghdr msg = {0};
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = u.buf;
+    msg.msg_controllen = sizeof(u.buf);
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != 1) {
+        return -1;
+    }
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    if (cm == NULL || cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS ||
+        cm->cmsg_len != CMSG_LEN(n * sizeof(int))) {
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cm), n * sizeof(int));
+    return 0;
+}
+
+static int handover(int listen_fd, struct cache *c) {
+    int sv[2] = {-1, -1}, err = -1;
+    pid_t pid = -1;
+
+    if (exe_path[0] == '\0') {
+        log_error("Cannot upgrade, the path of the executable is unknown");
+        return -1;
+    }
+    int idx = memfd_create("proxy-cache-idx", MFD_CLOEXEC);
+    int lg = memfd_create("proxy-cache-log", MFD_CLOEXEC);
+    char **env = upgrade_env();
+    if (idx < 0 || lg < 0 || env == NULL || socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+        log_error("Cannot upgrade: %s", strerror(errno));
+        goto out;
+    }
+    long n = snapshot_write(c, idx, lg);
+    if (n < 0) {
+        goto out;
+    }
+
+    pid = fork();
+    if (pid == 0) {
+        // Only async-signal-safe calls from here to exec
+        sigset_t none;
+        if (sv[1] == UPGRADE_FD) {
+            fcntl(UPGRADE_FD, F_SETFD, 0);
+        } else {
+            dup2(sv[1], UPGRADE_FD);
+        }
+        // Client sockets of the workers must not live on in the new process
+        if (close_range(UPGRADE_FD + 1, ~0U, 0) < 0) {
+            for (int fd = UPGRADE_FD + 1; fd < 1024; fd++) {
+                close(fd);
+            }
+        }
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        execve(exe_path, saved_argv, env);
+        _exit(127);
+    }
+    if (pid < 0) {
+        log_error("Cannot upgrade, fork failed: %s", strerror(errno));
+        goto out;
+    }
+    close(sv[1]);
+    sv[1] = -1;
+
+    int fds[UPGRADE_FDS] = {listen_fd, idx, lg};
+    if (send_fds(sv[0], fds, UPGRADE_FDS) < 0) {
+        log_error("Cannot pass the listener to process %d: %s", (int)pid, strerror(errno));
+        goto out;
+    }
+    log_info("Started %s as process %d with %ld cache entries", exe_path, (int)pid, n);
+
+    // The new process closes its end if it gives up, which reads as EOF
+    struct pollfd p = {sv[0], POLLIN, 0};
+    uint64_t deadline = monotonic_sec() + UPGRADE_TIMEOUT;
+    char byte;
+    int r;
+    do {
+        r = poll(&p, 1, 1000);
+    } while ((r == 0 || (r < 0 && errno == EINTR)) && monotonic_sec() < deadline);
+    if (r > 0 && read(sv[0], &byte, 1) == 1) {
+        log_info("Process %d is serving, draining this one", (int)pid);
+        err = 0;
+    } else {
+        log_error("Process %d did not start, carrying on", (int)pid);
+    }
+
+out:
+    if (err < 0 && pid > 0) {
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+    }
+    free(env);
+    if (idx >= 0) close(idx);
+    if (lg >= 0) close(lg);
+    if (sv[0] >= 0) close(sv[0]);
+    if (sv[1] >= 0) close(sv[1]);
+    return err;
+}
+
+static void *upgrade_thread(void *arg) {
+    (void)arg;
+    int ok = handover(job.listen_fd, job.cache) == 0;
+    // A failed upgrade may be tried again; a successful one ends this process
+    if (!ok) {
+        __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+    }
+    job.done(ok);
+    return NULL;
+}
+
+int upgrade_start(int listen_fd, struct cache *c, void (*done)(int ok)) {
+    pthread_t t;
+
+    if (__atomic_exchange_n(&running, 1, __ATOMIC_ACQUIRE)) {
+        log_warn("An upgrade is already in progress");
+        return -1;
+    }
+    job.listen_fd = listen_fd;
+    job.cache = c;
+    job.done = done;
+    if (pthread_create(&t, NULL, upgrade_thread, NULL) != 0) {
+        log_error("Cannot start the upgrade thread");
+        __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+        return -1;
+    }
+    pthread_detach(t);
+    return 0;
+}
+
+int upgrade_inherit(int *listen_fd, struct cache *c) {
+    const char *env = getenv(UPGRADE_ENV);
+    int fds[UPGRADE_FDS];
+
+    if (env == NULL) {
+        return 0;
+    }
+    parent_fd = atoi(env);
+    unsetenv(UPGRADE_ENV);
+    fcntl(parent_fd, F_SETFD, FD_CLOEXEC);
+    if (recv_fds(parent_fd, fds, UPGRADE_FDS) < 0) {
+        log_error("Did not get the listener from the old process");
+        close(parent_fd);
+        parent_fd = -1;
+        return -1;
+    }
+    *listen_fd = fds[0];
+    if (snapshot_read(c, fds[1], fds[2], "the old process") < 0) {
+        log_warn("Starting with an empty cache");
+    }
+    close(fds[1]);
+    close(fds[2]);
+    return 1;
+}
+
+void upgrade_ready(void) {
+    char byte = 'R';
+
+    if (parent_fd < 0) {
+        return;
+    }
+    if (write(parent_fd, &byte, 1) != 1) {
+        log_warn("Cannot tell the old process to drain: %s", strerror(errno));
+    }
+    close(parent_fd);
+    parent_fd = -1;
+}
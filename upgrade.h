@@ -0,0 +1,68 @@
+/*
+ * upgrade.h -- replacing the running binary without closing the listener.
+ *
+ * On SIGUSR2 the running proxy writes its cache into two memory files
+ * (memfd_create) in the snapshot format and starts its own executable
+ * again, which by then may be a new build. The new process is given one
+ * end of a Unix socket pair; the listening socket and the two memory files
+ * are passed over it with SCM_RIGHTS. The new process maps the cache log
+ * like a snapshot log, so the responses are shared rather than copied,
+ * starts its workers and writes one byte back. Only then does the old
+ * process stop accepting and drain its connections. The handover runs on
+ * a thread of its own, so the old process keeps accepting while it writes
+ * the cache out and waits for the new one, and the listening socket stays
+ * open throughout.
+ *
+ * If the new process fails to start or does not report in time, it is
+ * killed and the old one carries on as before.
+ */
+
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+#include "cache.h"
+
+#define UPGRADE_TIMEOUT 10    // Seconds the new process has to start up
+#define UPGRADE_ENV "PROXY_UPGRADE_FD"
+
+/**
+ * Remember how this process was started, to start the new binary the same
+ * way. Call before anything changes the working directory.
+ *
+ * @param argv Command line of the proxy
+ */
+void upgrade_init(char **argv);
+
+/**
+ * Start handing the listener and the cache to a new process running the
+ * current executable. A thread writes the cache out, starts the process
+ * and waits until it is serving, then calls done. Only one upgrade runs
+ * at a time.
+ *
+ * @param listen_fd Listening socket
+ * @param c Cache
+ * @param done Called on the upgrade thread with 1 once the new process
+ *        is serving, 0 if the upgrade failed; must not block
+ * @return 0 if the upgrade started, -1 if one is already running or the
+ *         thread could not be started
+ */
+int upgrade_start(int listen_fd, struct cache *c, void (*done)(int ok));
+
+/**
+ * In a process started by upgrade_start(), take over the listening socket
+ * and load the cache of the old process.
+ *
+ * @param listen_fd Set to the listening socket
+ * @param c Cache, initialised and empty
+ * @return 1 if this is an upgrade and the handover worked, 0 if this is
+ *         a normal start, -1 if the handover failed
+ */
+int upgrade_inherit(int *listen_fd, struct cache *c);
+
+/**
+ * Tell the old process that this one is serving, so it can drain and
+ * exit. Does nothing on a normal start.
+ */
+void upgrade_ready(void);
+
+#endif